@@ -644,7 +644,9 @@ void DkBaseViewPort::draw(QPainter *painter, float opacity) {
 	float oldOp = (float)painter->opacity();
 	painter->setOpacity(opacity);
 
-	if (!movie || !movie->isValid())
+	if ((!movie || !movie->isValid()) && imgStorage.isTiled())
+		drawTiles(painter);
+	else if (!movie || !movie->isValid())
 		painter->drawImage(imgViewRect, imgQt, imgQt.rect());
 	else
 		painter->drawPixmap(imgViewRect, movie->currentPixmap(), movie->frameRect());
@@ -653,6 +655,23 @@ void DkBaseViewPort::draw(QPainter *painter, float opacity) {
 	//qDebug() << "view rect: " << imgStorage.getImage().size()*imgMatrix.m11()*worldMatrix.m11() << " img rect: " << imgQt.size();
 }
 
+/**
+ * Draws the visible tiles of very large images.
+ * Only the visible part is drawn using the pyramid level of the current zoom.
+ * @param painter the painter (with the world matrix set).
+ **/ 
+void DkBaseViewPort::drawTiles(QPainter *painter) {
+
+	// visible part in image coordinates
+	QTransform imgToView = imgMatrix*worldMatrix;
+	QRect visibleRect = imgToView.inverted().mapRect(QRectF(QPointF(), size())).toAlignedRect();
+
+	QVector<DkImageTile> tiles = imgStorage.getTiles(visibleRect, (float)(imgMatrix.m11()*worldMatrix.m11()));
+
+	for (int idx = 0; idx < tiles.size(); idx++)
+		painter->drawImage(imgMatrix.mapRect(QRectF(tiles[idx].rect)), tiles[idx].img, tiles[idx].srcRect);
+}
+
 bool DkBaseViewPort::imageInside() {
 
 	return worldMatrix.m11() <= 1.0f || viewportRect.contains(worldMatrix.mapRect(imgViewRect));
@@ -228,6 +228,7 @@ protected:
 
 	// functions
 	virtual void draw(QPainter *painter, float opacity = 1.0f);
+	void drawTiles(QPainter *painter);
 	virtual void updateImageMatrix();
 	virtual QTransform getScaledImageMatrix();
 	virtual void controlImagePosition(float lb = -1, float ub = -1);
@@ -43,8 +43,13 @@
 #include <QNetworkReply>
 #include <QBuffer>
 #include <QNetworkProxyFactory>
+#include <QVector>
+#include <QtConcurrentMap>
+#include <QTime>
+#include <QDateTime>
 
 #include <qmath.h>
+#include <climits>
 
 // quazip
 #ifdef WITH_QUAZIP
@@ -106,6 +111,8 @@ DkBasicLoader::DkBasicLoader(int mode) {
 	numPages = 1;
 	pageIdx = 1;
 	loader = no_loader;
+	preview = false;
+	rawPreviewMode = false;
 
 	this->metaData = QSharedPointer<DkMetaDataT>(new DkMetaDataT());
 }
@@ -128,8 +135,6 @@ bool DkBasicLoader::loadGeneral(const QFileInfo& fileInfo, QSharedPointer<QByteA
 	else
 		file = fileInfo;
 	
-	QString newSuffix = file.suffix();
-
 	QImage oldImg = qImg;
 #ifdef WITH_OPENCV
 	cv::Mat oldMat = cvImg;
@@ -139,10 +144,6 @@ bool DkBasicLoader::loadGeneral(const QFileInfo& fileInfo, QSharedPointer<QByteA
 	if (pageIdxDirty)
 		imgLoaded = loadPage();
 
-	// identify raw images:
-	//newSuffix.contains(QRegExp("(nef|crw|cr2|arw|rw2|mrw|dng)", Qt::CaseInsensitive)))
-
-	QList<QByteArray> qtFormats = QImageReader::supportedImageFormats();
 	QString suf = file.suffix().toLower();
 
 	if (!imgLoaded && !file.exists() && ba && !ba->isEmpty()) {
@@ -152,69 +153,40 @@ bool DkBasicLoader::loadGeneral(const QFileInfo& fileInfo, QSharedPointer<QByteA
 			loader = qt_loader;
 	}
 
-	// default Qt loader
-	// here we just try those formats that are officially supported
-	if (!imgLoaded && qtFormats.contains(suf.toStdString().c_str())) {
+	// identify the format by its magic bytes - so we just need a single decoder
+	// (tiff pages are loaded already - so we do not need to read the header)
+	DkFormatRegistry& registry = DkFormatRegistry::instance();
+	DkFormatRegistry::Format format;
+	format.loader = no_loader;
 
-		// if image has Indexed8 + alpha channel -> we crash... sorry for that
-		if (!ba || ba->isEmpty())
-			imgLoaded = qImg.load(file.absoluteFilePath());
-		else
-			imgLoaded = qImg.loadFromData(*ba.data());
+	if (!imgLoaded)
+		format = registry.sniff(DkFormatRegistry::readHeader(file, ba), suf);
 
-		if (imgLoaded) loader = qt_loader;
-	}
+	QTime dt;
+	dt.start();
 
-	// PSD loader
-	if (!imgLoaded) {
+	if (!imgLoaded && format.loader != no_loader) {
 
-		imgLoaded = loadPSDFile(file, ba);
-		if (imgLoaded) loader = psd_loader;
-	}
-	// WEBP loader
-	if (!imgLoaded) {
+		// JPEGs are decoded with the resolution needed (e.g. screen resolution)
+		if (previewSize.isValid() && format.name == "jpeg")
+			imgLoaded = loadJpegScaled(file, ba, previewSize);
+		
+		if (imgLoaded)
+			loader = qt_loader;
+		else
+			imgLoaded = loadWithLoader(format.loader, format.name, ba, fast);
 
-		imgLoaded = loadWebPFile(file, ba);
-		if (imgLoaded) loader = webp_loader;
+		registry.addDecodeTime(format.name, dt.elapsed(), imgLoaded);
 	}
 
-	// RAW loader
-	if (!imgLoaded && !qtFormats.contains(suf.toStdString().c_str())) {
+	// unknown formats (or wrong magic bytes) are passed to the remaining loaders
+	if (!imgLoaded) {
 		
-		// TODO: sometimes (e.g. _DSC6289.tif) strange opencv errors are thrown - catch them!
-		// load raw files
-		imgLoaded = loadRawFile(file, ba, fast);
-		if (imgLoaded) loader = raw_loader;
+		dt.restart();
+		imgLoaded = loadUnknown(format.loader, ba, fast);
+		registry.addDecodeTime("unknown", dt.elapsed(), imgLoaded);
 	}
 
-	// default Qt loader
-	if (!imgLoaded && !newSuffix.contains(QRegExp("(roh)", Qt::CaseInsensitive))) {
-
-		// if we first load files to buffers, we can additionally load images with wrong extensions (rainer bugfix : )
-		// TODO: add warning here
-		QByteArray ba;
-		loadFileToBuffer(file, ba);
-		imgLoaded = qImg.loadFromData(ba);
-		
-		if (imgLoaded) loader = qt_loader;
-	}  
-
-	// this loader is a bit buggy -> be carefull
-	if (!imgLoaded && newSuffix.contains(QRegExp("(roh)", Qt::CaseInsensitive))) {
-		
-		imgLoaded = loadRohFile(file, ba);
-		if (imgLoaded) loader = roh_loader;
-
-	} 
-
-	// this loader is for OpenCV cascade training files
-	if (!imgLoaded && newSuffix.contains(QRegExp("(vec)", Qt::CaseInsensitive))) {
-
-		imgLoaded = loadOpenCVVecFile(file, ba);
-		if (imgLoaded) loader = roh_loader;
-
-	} 
-
 	//if (!imgLoaded && (training || file.suffix().contains(QRegExp("(hdr)", Qt::CaseInsensitive)))) {
 
 	//	// load hdr here...
@@ -257,6 +229,153 @@ bool DkBasicLoader::loadGeneral(const QFileInfo& fileInfo, QSharedPointer<QByteA
 	return imgLoaded;
 }
 
+/**
+ * Decodes the current file with the loader specified.
+ * @param loaderId the loader (see DkBasicLoader::loaderID).
+ * @param qtFormat the Qt format (e.g. jpeg) if the qt_loader is used.
+ * If it is empty, Qt detects the format.
+ * @param ba the file buffer (can be empty).
+ * @param fast if true, RAW files are loaded fast (preview).
+ * @return bool true if the image could be loaded.
+ **/ 
+bool DkBasicLoader::loadWithLoader(int loaderId, const QByteArray& qtFormat, QSharedPointer<QByteArray> ba, bool fast) {
+
+	bool imgLoaded = false;
+	const char* qtFormatStr = qtFormat.isEmpty() ? 0 : qtFormat.constData();
+
+	switch (loaderId) {
+
+	case qt_loader:
+		// if image has Indexed8 + alpha channel -> we crash... sorry for that
+		if (!ba || ba->isEmpty())
+			imgLoaded = qImg.load(file.absoluteFilePath(), qtFormatStr);
+		else
+			imgLoaded = qImg.loadFromData(*ba.data(), qtFormatStr);
+		break;
+
+	case psd_loader:
+		imgLoaded = loadPSDFile(file, ba);
+		break;
+
+	case webp_loader:
+		imgLoaded = loadWebPFile(file, ba);
+		break;
+
+	case raw_loader:
+		// TODO: sometimes (e.g. _DSC6289.tif) strange opencv errors are thrown - catch them!
+		imgLoaded = loadRawFile(file, ba, fast);
+		break;
+
+	case roh_loader:
+		// this loader is a bit buggy -> be carefull
+		imgLoaded = loadRohFile(file, ba);
+		break;
+
+	case vec_loader:
+		// this loader is for OpenCV cascade training files
+		imgLoaded = loadOpenCVVecFile(file, ba);
+		break;
+	}
+
+	if (imgLoaded)
+		loader = loaderId;
+
+	return imgLoaded;
+}
+
+/**
+ * Tries all loaders that could load the current file.
+ * This is the fallback if the format could not be identified
+ * by its magic bytes (e.g. TGA) or if the identified loader failed.
+ * @param triedLoader the loader that failed already (or no_loader).
+ * @param ba the file buffer (can be empty).
+ * @param fast if true, RAW files are loaded fast (preview).
+ * @return bool true if the image could be loaded.
+ **/ 
+bool DkBasicLoader::loadUnknown(int triedLoader, QSharedPointer<QByteArray> ba, bool fast) {
+
+	QByteArray suf = file.suffix().toLower().toLatin1();
+	bool qtSuffix = DkFormatRegistry::instance().isQtFormat(suf);
+
+	// we do not need to try loaders twice
+	if (triedLoader == qt_loader || triedLoader == roh_loader || triedLoader == vec_loader)
+		return false;
+
+	// default Qt loader
+	// here we just try those formats that are officially supported
+	if (qtSuffix && loadWithLoader(qt_loader, QByteArray(), ba, fast))
+		return true;
+
+	// PSD and WebP files are always identified by their magic bytes
+	if (triedLoader == no_loader) {
+		
+		if (loadWithLoader(psd_loader, QByteArray(), ba, fast))
+			return true;
+		if (loadWithLoader(webp_loader, QByteArray(), ba, fast))
+			return true;
+	}
+
+	// RAW loader
+	if (triedLoader != raw_loader && !qtSuffix && loadWithLoader(raw_loader, QByteArray(), ba, fast))
+		return true;
+
+	// if we first load files to buffers, we can additionally load images with wrong extensions (rainer bugfix : )
+	if (!ba || ba->isEmpty())
+		ba = loadFileToBuffer(file);
+
+	return loadWithLoader(qt_loader, QByteArray(), ba, fast);
+}
+
+/**
+ * Decodes a JPEG with 1/2, 1/4 or 1/8 of its resolution.
+ * libjpeg scales in the DCT domain, so this is considerably faster than
+ * decoding the full image (and needs less memory). The smallest size
+ * that still covers previewSize is decoded (see DkImage::jpegScaledSize).
+ * @param fileInfo the JPEG file.
+ * @param ba the file buffer (can be empty).
+ * @param previewSize the size the image is displayed with.
+ * @return bool false if the file is no JPEG or should be decoded completely.
+ **/ 
+bool DkBasicLoader::loadJpegScaled(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba, const QSize& previewSize) {
+
+	DkTimer dt;
+	QBuffer buffer;
+	QImageReader reader;
+
+	if (!ba || ba->isEmpty())
+		reader.setFileName(fileInfo.absoluteFilePath());
+	else {
+		buffer.setData(*ba);
+		buffer.open(QIODevice::ReadOnly);
+		reader.setDevice(&buffer);
+	}
+
+	if (reader.format() != "jpeg")
+		return false;
+
+	// the image might be rotated (EXIF) - so the preview must cover both orientations
+	int maxSide = qMax(previewSize.width(), previewSize.height());
+	QSize jpgSize = reader.size();
+	QSize scaledSize = DkImage::jpegScaledSize(jpgSize, QSize(maxSide, maxSide));
+
+	if (scaledSize == jpgSize)
+		return false;
+
+	reader.setScaledSize(scaledSize);
+	QImage img = reader.read();
+
+	if (img.isNull())
+		return false;
+
+	qImg = img;
+	preview = true;
+	fullSize = jpgSize;
+
+	qDebug() << "[DkBasicLoader]" << fileInfo.fileName() << "decoded with" << qImg.size() << "instead of" << jpgSize << "in" << dt.getTotal();
+
+	return true;
+}
+
 /**
  * Loads special RAW files that are generated by the Hamamatsu camera.
  * @param fileName the filename of the file to be loaded.
@@ -320,6 +439,117 @@ bool DkBasicLoader::loadRohFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 	return imgLoaded;
 }
 
+#ifdef WITH_LIBRAW
+// RAW development --------------------------------------------------------------------
+/**
+ * Look-up tables and the color matrix of a RAW image.
+ * They are shared by all tiles so that the per-pixel work is integer only.
+ **/ 
+struct DkRawParams {
+	LibRaw* processor;
+	int cols;
+	QVector<unsigned short> normLut;	// black point & dynamic range
+	QVector<int> wbLut[3];				// white balance
+	qint64 colorMat[3][3];				// color correction (16.16 fixed-point)
+	QVector<uchar> gammaLut;			// gamma & conversion to 8 bit
+};
+
+/**
+ * A block of rows which is processed by one thread.
+ **/ 
+struct DkRawTile {
+	int firstRow;
+	int lastRow;
+	const DkRawParams* params;
+	const cv::Mat* src;
+	cv::Mat* dst;
+};
+
+static QVector<DkRawTile> rawTiles(int rows, const DkRawParams* params, const cv::Mat* src, cv::Mat* dst) {
+
+	const int tileRows = 64;
+	QVector<DkRawTile> tiles;
+
+	for (int row = 0; row < rows; row += tileRows) {
+
+		DkRawTile tile;
+		tile.firstRow = row;
+		tile.lastRow = qMin(row+tileRows, rows);
+		tile.params = params;
+		tile.src = src;
+		tile.dst = dst;
+		tiles.append(tile);
+	}
+
+	return tiles;
+}
+
+/**
+ * Copies the raw values to dst and normalizes them.
+ * dst is either a CV_16UC1 bayer image or a CV_16UC3 RGB image.
+ **/ 
+static void normalizeRawTile(DkRawTile& tile) {
+
+	const DkRawParams* p = tile.params;
+	const unsigned short* normLut = p->normLut.constData();
+	unsigned short (*rawData)[4] = p->processor->imgdata.image;
+
+	for (int row = tile.firstRow; row < tile.lastRow; row++) {
+
+		unsigned short* ptrDst = tile.dst->ptr<unsigned short>(row);
+		const unsigned short (*ptrRaw)[4] = rawData + p->cols*row;
+
+		if (tile.dst->channels() == 1) {
+
+			for (int col = 0; col < p->cols; col++)
+				ptrDst[col] = normLut[ptrRaw[col][p->processor->COLOR(row, col)]];
+		}
+		else {
+			for (int col = 0; col < p->cols; col++, ptrDst += 3) {
+				ptrDst[0] = normLut[ptrRaw[col][0]];
+				ptrDst[1] = normLut[ptrRaw[col][1]];
+				ptrDst[2] = normLut[ptrRaw[col][2]];
+			}
+		}
+	}
+}
+
+/**
+ * Applies white balance, color correction and gamma to a demosaiced CV_16UC3 image.
+ * The result is written to a CV_8UC3 image.
+ **/ 
+static void developRawTile(DkRawTile& tile) {
+
+	const DkRawParams* p = tile.params;
+	const int* wbR = p->wbLut[0].constData();
+	const int* wbG = p->wbLut[1].constData();
+	const int* wbB = p->wbLut[2].constData();
+	const uchar* gammaLut = p->gammaLut.constData();
+	const qint64 (*m)[3] = p->colorMat;
+
+	for (int row = tile.firstRow; row < tile.lastRow; row++) {
+
+		const unsigned short* ptrSrc = tile.src->ptr<unsigned short>(row);
+		uchar* ptrDst = tile.dst->ptr<uchar>(row);
+
+		for (int col = 0; col < p->cols; col++, ptrSrc += 3, ptrDst += 3) {
+
+			qint64 r = wbR[ptrSrc[0]];
+			qint64 g = wbG[ptrSrc[1]];
+			qint64 b = wbB[ptrSrc[2]];
+
+			qint64 corrR = (m[0][0]*r + m[0][1]*g + m[0][2]*b + 32768) >> 16;
+			qint64 corrG = (m[1][0]*r + m[1][1]*g + m[1][2]*b + 32768) >> 16;
+			qint64 corrB = (m[2][0]*r + m[2][1]*g + m[2][2]*b + 32768) >> 16;
+
+			ptrDst[0] = gammaLut[corrR > 65535 ? 65535 : corrR < 0 ? 0 : corrR];
+			ptrDst[1] = gammaLut[corrG > 65535 ? 65535 : corrG < 0 ? 0 : corrG];
+			ptrDst[2] = gammaLut[corrB > 65535 ? 65535 : corrB < 0 ? 0 : corrB];
+		}
+	}
+}
+#endif
+
 /**
  * Loads the RAW file specified.
  * Note: nomacs needs to be compiled with OpenCV and LibRaw in
@@ -330,6 +560,7 @@ bool DkBasicLoader::loadRohFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 bool DkBasicLoader::loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba, bool fast) {
 	
 	bool imgLoaded = false;
+	preview = false;
 
 	try {
 
@@ -361,6 +592,12 @@ bool DkBasicLoader::loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 
 		int error = LIBRAW_DATA_ERROR;
 
+		// if the embedded preview is too small (or missing) we decode a half-size preview
+		// libraw bins 2x2 pixels instead of demosaicing - this is ~4x faster
+		// the full resolution is loaded if the user zooms in (see DkViewPort::zoom)
+		bool halfSize = rawPreviewMode && (fast || DkSettings::resources.loadRawThumb != DkSettings::raw_thumb_never);
+		iProcessor.imgdata.params.half_size = halfSize ? 1 : 0;
+
 		//use iprocessor from libraw to read the data
 		if (!ba || ba->isEmpty()) {
 			error = iProcessor.open_file(fileInfo.absoluteFilePath().toStdString().c_str());
@@ -419,7 +656,7 @@ bool DkBasicLoader::loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 				qDebug() << "error unpacking the thumb...";
 		}
 
-		qDebug() << "[RAW] loading full raw file";
+		qDebug() << "[RAW] loading " << (halfSize ? "half-size" : "full") << " raw file";
 
 
 		//unpack the data
@@ -436,6 +673,12 @@ bool DkBasicLoader::loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 		unsigned short cols = iProcessor.imgdata.sizes.width,//.raw_width,
 			rows = iProcessor.imgdata.sizes.height;//.raw_height;
 
+		// binned images have their own size
+		if (halfSize) {
+			cols = iProcessor.imgdata.sizes.iwidth;
+			rows = iProcessor.imgdata.sizes.iheight;
+		}
+
 		cv::Mat rawMat, rgbImg;
 
 		// modifications sequence for changing from raw to rgb:
@@ -475,34 +718,38 @@ bool DkBasicLoader::loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 
 		if (strcmp(iProcessor.imgdata.idata.cdesc, "RGBG")) throw DkException("Wrong Bayer Pattern (not RGBG)\n", __LINE__, __FILE__);
 
+		DkTimer dtRaw;
+
 		// 1. read raw image and normalize it according to dynamic range and black point
 		
 		//dynamic range is defined by maximum - black
 		float dynamicRange = (float)(iProcessor.imgdata.color.maximum-iProcessor.imgdata.color.black);	// iProcessor.imgdata.color.channel_maximum[0]-iProcessor.imgdata.color.black;	// dynamic range
 
-		if (iProcessor.imgdata.idata.filters) {
-
-			rawMat = cv::Mat(rows, cols, CV_32FC1);
-
-			for (uint row = 0; row < rows; row++) {
-				float *ptrRaw = rawMat.ptr<float>(row);
-
-				for (uint col = 0; col < cols; col++) {
+		DkRawParams rawParams;
+		rawParams.processor = &iProcessor;
+		rawParams.cols = cols;
+
+		// the raw values are 16 bit - so we normalize with a look-up table
+		// (the float ops & rounding are the same as in the per-pixel version)
+		rawParams.normLut.resize(65536);
+		for (int idx = 0; idx < 65536; idx++) {
+			float val = (float)idx;
+			val -= iProcessor.imgdata.color.black;
+			val /= dynamicRange;
+			val *= 65535;	// for conversion to 16U
+			rawParams.normLut[idx] = cv::saturate_cast<unsigned short>(val);
+		}
 
-					int colorIdx = iProcessor.COLOR(row, col);
-					ptrRaw[col] = (float)(iProcessor.imgdata.image[cols*(row) + col][colorIdx]);
+		// binned pixels already hold all colors - so no demosaicing is needed
+		if (iProcessor.imgdata.idata.filters && !halfSize) {
 
-					//correct the image values according the black point defined by the camera
-					ptrRaw[col] -= iProcessor.imgdata.color.black;
-					//normalize according the dynamic range
-					ptrRaw[col] /= dynamicRange;
-					ptrRaw[col] *= 65535;  // for conversion to 16U
-				}
-			}
+			rawMat = cv::Mat(rows, cols, CV_16UC1);
+			QVector<DkRawTile> tiles = rawTiles(rows, &rawParams, 0, &rawMat);
+			QtConcurrent::blockingMap(tiles, normalizeRawTile);
 			
-			// 2. demosaic raw image
-			rawMat.convertTo(rawMat, CV_16U);
+			qDebug() << "[RAW] normalized in: " << dtRaw.getIvl();
 
+			// 2. demosaic raw image
 			//cvtColor(rawMat, rgbImg, CV_BayerBG2RGB);
 			unsigned long type = (unsigned long)iProcessor.imgdata.idata.filters;
 			type = type & 255;
@@ -514,41 +761,16 @@ bool DkBasicLoader::loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 			else if (type == 225) cvtColor(rawMat, rgbImg, CV_BayerGB2RGB);		//bitmask  11 10 00 01
 			else if (type == 75) cvtColor(rawMat, rgbImg, CV_BayerGR2RGB);		//bitmask  01 00 10 11
 			else throw DkException("Wrong Bayer Pattern (not BG, RG, GB, GR)\n", __LINE__, __FILE__);
+
+			qDebug() << "[RAW] demosaiced in: " << dtRaw.getIvl();
 		}
 		else {
 
-			rawMat = cv::Mat(rows, cols, CV_32FC3);
-			rawMat.setTo(0);
-			std::vector<cv::Mat> rawCh;
-			split(rawMat, rawCh);
-
-			for (unsigned int row = 0; row < rows; row++) {
-				float *ptrR = rawCh[0].ptr<float>(row);
-				float *ptrG = rawCh[1].ptr<float>(row);
-				float *ptrB = rawCh[2].ptr<float>(row);
-				//float *ptrE = rawCh[3].ptr<float>(row);
-
-				for (unsigned int col = 0; col < cols; col++) {
+			rgbImg = cv::Mat(rows, cols, CV_16UC3);
+			QVector<DkRawTile> tiles = rawTiles(rows, &rawParams, 0, &rgbImg);
+			QtConcurrent::blockingMap(tiles, normalizeRawTile);
 
-					ptrR[col] = (float)(iProcessor.imgdata.image[cols*(row) + col][0]);
-					ptrR[col] -= iProcessor.imgdata.color.black;
-					ptrR[col] /= dynamicRange;
-					ptrR[col] *= 65535;  // for conversion to 16U
-
-					ptrG[col] = (float)(iProcessor.imgdata.image[cols*(row) + col][1]);
-					ptrG[col] -= iProcessor.imgdata.color.black;
-					ptrG[col] /= dynamicRange;
-					ptrG[col] *= 65535;  // for conversion to 16U
-
-					ptrB[col] = (float)(iProcessor.imgdata.image[cols*(row) + col][2]);
-					ptrB[col] -= iProcessor.imgdata.color.black;
-					ptrB[col] /= dynamicRange;
-					ptrB[col] *= 65535;  // for conversion to 16U
-
-				}
-			}
-			merge(rawCh, rgbImg);
-			rgbImg.convertTo(rgbImg, CV_16U);
+			qDebug() << "[RAW] normalized in: " << dtRaw.getIvl();
 		}
 
 		rawMat.release();
@@ -568,9 +790,14 @@ bool DkBasicLoader::loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 
 		//read gamma value and create gamma table
 		float gamma = (float)iProcessor.imgdata.params.gamm[0];///(float)iProcessor.imgdata.params.gamm[1];
-		float gammaTable[65536];
+
+		// the gamma table directly maps the corrected 16 bit values to 8 bit
+		rawParams.gammaLut.resize(65536);
 		for (int i = 0; i < 65536; i++) {
-			gammaTable[i] = (float)(1.099f*pow((float)i/65535.0f, gamma)-0.099f);
+
+			unsigned short val = i <= 0.018f * 65535.0f ? (unsigned short)(i*(float)iProcessor.imgdata.params.gamm[1]/257.0f) :
+				(unsigned short)((float)(1.099f*pow((float)i/65535.0f, gamma)-0.099f) * 255);
+			rawParams.gammaLut[i] = cv::saturate_cast<uchar>(val);
 		}
 
 		// normalize white balance multipliers
@@ -595,51 +822,29 @@ bool DkBasicLoader::loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 		if (mulWhite[3] == 0)
 			mulWhite[3] = mulWhite[1];
 
-		//apply corrections
-		std::vector<cv::Mat> corrCh;
-		split(rgbImg, corrCh);
-
-		for (uint row = 0; row < rows; row++)
-		{
-			unsigned short *ptrR = corrCh[0].ptr<unsigned short>(row);
-			unsigned short *ptrG = corrCh[1].ptr<unsigned short>(row);
-			unsigned short *ptrB = corrCh[2].ptr<unsigned short>(row);
-
-			for (uint col = 0; col < cols; col++)
-			{
-				//apply white balance correction
-				int tempR = qRound(ptrR[col] * mulWhite[0]);
-				int tempG = qRound(ptrG[col] * mulWhite[1]);
-				int tempB = qRound(ptrB[col] * mulWhite[2]);
-
-				//apply color correction					
-				int corrR = qRound(colorCorrMat[0][0] * tempR + colorCorrMat[0][1] * tempG  + colorCorrMat[0][2] * tempB);
-				int corrG = qRound(colorCorrMat[1][0] * tempR + colorCorrMat[1][1] * tempG  + colorCorrMat[1][2] * tempB);
-				int corrB = qRound(colorCorrMat[2][0] * tempR + colorCorrMat[2][1] * tempG  + colorCorrMat[2][2] * tempB);
-				// without color correction: change above three lines to the bottom ones
-				//int corrR = tempR;
-				//int corrG = tempG;
-				//int corrB = tempB;
-
-				//clipping
-				ptrR[col] = (corrR > 65535) ? 65535 : (corrR < 0) ? 0 : (unsigned short)corrR;
-				ptrG[col] = (corrG > 65535) ? 65535 : (corrG < 0) ? 0 : (unsigned short)corrG;
-				ptrB[col] = (corrB > 65535) ? 65535 : (corrB < 0) ? 0 : (unsigned short)corrB;
-
-				//apply gamma correction
-				ptrR[col] = ptrR[col] <= 0.018f * 65535.0f ? (unsigned short)(ptrR[col]*(float)iProcessor.imgdata.params.gamm[1]/257.0f) :
-					(unsigned short)(gammaTable[ptrR[col]] * 255);
-				//									(1.099f*(float)(pow((float)ptrRaw[col], gamma))-0.099f);
-				ptrG[col] = ptrG[col] <= 0.018f * 65535.0f ? (unsigned short)(ptrG[col]*(float)iProcessor.imgdata.params.gamm[1]/257.0f) :
-					(unsigned short)(gammaTable[ptrG[col]] * 255);
-				ptrB[col] = ptrB[col] <= 0.018f * 65535.0f ? (unsigned short)(ptrB[col]*(float)iProcessor.imgdata.params.gamm[1]/257.0f) :
-					(unsigned short)(gammaTable[ptrB[col]] * 255);
-			}
+		// white balance look-up tables
+		for (int c = 0; c < 3; c++) {
+			
+			rawParams.wbLut[c].resize(65536);
+			for (int i = 0; i < 65536; i++)
+				rawParams.wbLut[c][i] = qRound(i * mulWhite[c]);
 		}
 
-		merge(corrCh, rgbImg);
-		rgbImg.convertTo(rgbImg, CV_8U);
-			
+		// color correction in 16.16 fixed-point
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				rawParams.colorMat[i][j] = qRound64(colorCorrMat[i][j] * 65536.0);
+
+		//apply corrections (all at once)
+		cv::Mat rgb8 = cv::Mat(rows, cols, CV_8UC3);
+		QVector<DkRawTile> tiles = rawTiles(rows, &rawParams, &rgbImg, &rgb8);
+		QtConcurrent::blockingMap(tiles, developRawTile);
+		rgbImg = rgb8;
+
+		qDebug() << "[RAW] color corrected in: " << dtRaw.getIvl() << " total: " << dtRaw.getTotal();
+
+		std::vector<cv::Mat> corrCh;
+
 		// filter color noise withe a median filter
 		if (DkSettings::resources.filterRawImages) {
 
@@ -705,6 +910,8 @@ bool DkBasicLoader::loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteA
 		//	img = img.transformed(rotationMatrix);
 		//}
 		imgLoaded = true;
+		preview = halfSize;
+		fullSize = halfSize ? qImg.size()*2 : qImg.size();
 
 		iProcessor.recycle();
 
@@ -975,6 +1182,11 @@ QSharedPointer<QByteArray> DkBasicLoader::loadFileToBuffer(const QFileInfo& file
 		return DkZipContainer::extractImage(DkZipContainer::decodeZipFile(file), DkZipContainer::decodeImageFile(file));
 #endif
 
+	if (DkSettings::resources.mapFileBuffers) {
+		QSharedPointer<QByteArray> ba = DkMappedBuffer::map(fileInfo);
+		if (ba) return ba;
+	}
+
 	QFile file(fileInfo.absoluteFilePath());
 	file.open(QIODevice::ReadOnly);
 
@@ -995,6 +1207,9 @@ bool DkBasicLoader::writeBufferToFile(const QFileInfo& fileInfo, const QSharedPo
 	file.close();
 	qDebug() << "[DkBasicLoader] buffer saved, bytes written: " << bytesWritten;
 
+	DkMetaDataCache::instance().remove(fileInfo);
+	DkTiffIndex::instance().remove(fileInfo);
+
 	if (!bytesWritten || bytesWritten == -1)
 		return false;
 
@@ -1006,6 +1221,7 @@ void DkBasicLoader::indexPages(const QFileInfo& fileInfo) {
 	// reset counters
 	numPages = 1;
 	pageIdx = 1;
+	tiffPages.clear();
 
 #ifdef WITH_LIBTIFF
 
@@ -1013,35 +1229,13 @@ void DkBasicLoader::indexPages(const QFileInfo& fileInfo) {
 	if (!fileInfo.suffix().contains(QRegExp("(tif|tiff)", Qt::CaseInsensitive)))
 		return;
 
-	// first turn off nasty warning/error dialogs - (we do the GUI : )
-	TIFFErrorHandler oldErrorHandler, oldWarningHandler;
-	oldWarningHandler = TIFFSetWarningHandler(NULL);
-	oldErrorHandler = TIFFSetErrorHandler(NULL); 
-
 	DkTimer dt;
-	TIFF* tiff = TIFFOpen(this->file.absoluteFilePath().toLatin1(), "r");
-
-	if (!tiff) 
-		return;
-
-	// libtiff example
-	int dircount = 0;
-
-	do {
-		dircount++;
-
-	} while (TIFFReadDirectory(tiff));
+	tiffPages = DkTiffIndex::instance().pages(this->file);
 
-	numPages = dircount;
+	if (!tiffPages.empty())
+		numPages = tiffPages.size();
 
-	if (numPages > 1)
-		pageIdx = 1;
-
-	qDebug() << dircount << " TIFF directories... " << dt.getTotal();
-	TIFFClose(tiff);
-
-	TIFFSetWarningHandler(oldWarningHandler);
-	TIFFSetWarningHandler(oldErrorHandler);
+	qDebug() << numPages << " TIFF directories... " << dt.getTotal();
 #endif
 
 }
@@ -1061,52 +1255,60 @@ bool DkBasicLoader::loadPage(int skipIdx) {
 
 bool DkBasicLoader::loadPageAt(int pageIdx) {
 
-	bool imgLoaded = false;
+	// the index is rebuilt if the file changed
+	tiffPages = DkTiffIndex::instance().pages(this->file);
 
-#ifdef WITH_LIBTIFF
+	if (pageIdx > tiffPages.size() || pageIdx < 1)
+		return false;
 
-	// <= 1 since first page is loaded using qt
-	if (pageIdx > numPages || pageIdx < 1)
-		return imgLoaded;
+	QImage img;
 
-	// first turn off nasty warning/error dialogs - (we do the GUI : )
-	TIFFErrorHandler oldErrorHandler, oldWarningHandler;
-	oldWarningHandler = TIFFSetWarningHandler(NULL);
-	oldErrorHandler = TIFFSetErrorHandler(NULL); 
+	if (!loadTiffPage(this->file, tiffPages.at(pageIdx-1), img))
+		return false;
 
-	DkTimer dt;
-	TIFF* tiff = TIFFOpen(this->file.absoluteFilePath().toLatin1(), "r");
+	qImg = img;
 
-	if (!tiff)
-		return imgLoaded;
+	return true;
+}
+
+/**
+ * Decodes a single TIFF page.
+ * The page's directory is opened directly, so this is independent of the
+ * page number. It is thread-safe (each call opens its own handle).
+ * @param file the TIFF file
+ * @param page the page (see DkTiffIndex)
+ * @param img the decoded page
+ * @return bool true if the page was decoded
+ **/ 
+bool DkBasicLoader::loadTiffPage(const QFileInfo& file, const DkTiffIndex::Page& page, QImage& img) {
 
-	uint32 width = 0;
-	uint32 height = 0;
-	TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
-	TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+	bool imgLoaded = false;
 
-	// go to current directory
-	for (int idx = 1; idx < pageIdx; idx++) {
+#ifdef WITH_LIBTIFF
 
-		if (!TIFFReadDirectory(tiff))
-			return false;
+	TIFF* tiff = TIFFOpen(file.absoluteFilePath().toLatin1(), "r");
+
+	if (!tiff)
+		return imgLoaded;
+
+	// go to the page's directory
+	if (!TIFFSetSubDirectory(tiff, page.offset)) {
+		TIFFClose(tiff);
+		return imgLoaded;
 	}
 
 	// init the qImage
-	qImg = QImage(width, height, QImage::Format_ARGB32);
+	img = QImage(page.width, page.height, QImage::Format_ARGB32);
 
 	const int stopOnError = 1;
-	imgLoaded = TIFFReadRGBAImageOriented(tiff, width, height, reinterpret_cast<uint32 *>(qImg.bits()), ORIENTATION_TOPLEFT, stopOnError) != 0;
+	imgLoaded = !img.isNull() && TIFFReadRGBAImageOriented(tiff, page.width, page.height, reinterpret_cast<uint32 *>(img.bits()), ORIENTATION_TOPLEFT, stopOnError) != 0;
 
 	if (imgLoaded) {
-		for (uint32 y=0; y<height; ++y)
-			convert32BitOrder(qImg.scanLine(y), width);
+		for (int y = 0; y < page.height; ++y)
+			convert32BitOrder(img.scanLine(y), page.width);
 	}
 
 	TIFFClose(tiff);
-
-	TIFFSetWarningHandler(oldWarningHandler);
-	TIFFSetWarningHandler(oldErrorHandler);
 #endif
 
 	return imgLoaded;
@@ -1203,8 +1405,9 @@ bool DkBasicLoader::saveToBuffer(const QFileInfo& fileInfo, const QImage& img, Q
 
 	if (saved && metaData) {
 		
+		// the buffer holds the new image - so the cached metadata of the file on disk must not be used
 		if (!metaData->isLoaded() || !metaData->hasMetaData())
-			metaData->readMetaData(fileInfo, ba);
+			metaData->readMetaData(fileInfo, ba, false);
 
 		if (metaData->isLoaded()) {
 			try {
@@ -1251,8 +1454,9 @@ void DkBasicLoader::saveMetaData(const QFileInfo& fileInfo, QSharedPointer<QByte
 	if (!ba)
 		ba = QSharedPointer<QByteArray>(new QByteArray());
 
+	// the buffer is written to the file - so we cannot map it
 	if (ba->isEmpty() && metaData->isDirty())
-		ba = loadFileToBuffer(fileInfo);
+		loadFileToBuffer(fileInfo, *ba);
 
 	bool saved = false;
 	try {
@@ -1351,6 +1555,7 @@ void DkBasicLoader::release(bool clear) {
 	saveMetaData(file);
 
 	qImg = QImage();
+	preview = false;
 	//metaData.clear();
 	
 	// TODO: where should we clear the metadata?
@@ -1374,18 +1579,18 @@ bool DkBasicLoader::loadWebPFile(const QFileInfo& fileInfo, QSharedPointer<QByte
 
 	// retrieve the image features (size, alpha etc.)
 	WebPBitstreamFeatures features;
-	int error = WebPGetFeatures((const uint8_t*)ba->data(), ba->size(), &features);
+	int error = WebPGetFeatures((const uint8_t*)ba->constData(), ba->size(), &features);
 	if (error) return false;
 
 	uint8_t* webData = 0;
 
 	if (features.has_alpha) {
-		webData = WebPDecodeBGRA((const uint8_t*) ba->data(), ba->size(), &features.width, &features.height);
+		webData = WebPDecodeBGRA((const uint8_t*) ba->constData(), ba->size(), &features.width, &features.height);
 		if (!webData) return false;
 		qImg = QImage(webData, (int)features.width, (int)features.height, QImage::Format_ARGB32);
 	}
 	else {
-		webData = WebPDecodeRGB((const uint8_t*) ba->data(), ba->size(), &features.width, &features.height);
+		webData = WebPDecodeRGB((const uint8_t*) ba->constData(), ba->size(), &features.width, &features.height);
 		if (!webData) return false;
 		qImg = QImage(webData, (int)features.width, (int)features.height, features.width*3, QImage::Format_RGB888);
 	}
@@ -1502,6 +1707,377 @@ bool DkBasicLoader::saveWebPFile(const QImage img, QSharedPointer<QByteArray>& b
 }
 #endif
 
+// DkFormatRegistry --------------------------------------------------------------------
+DkFormatRegistry& DkFormatRegistry::instance() {
+
+	static DkFormatRegistry inst;
+	return inst;
+}
+
+DkFormatRegistry::DkFormatRegistry() {
+
+	// supportedImageFormats() loads all plugins - so we just call it once
+	QList<QByteArray> formats = QImageReader::supportedImageFormats();
+
+	for (int idx = 0; idx < formats.size(); idx++)
+		qtFormats.insert(formats.at(idx).toLower());
+}
+
+DkFormatRegistry::~DkFormatRegistry() {
+
+	qDebug() << "[DkFormatRegistry]" << getStats();
+}
+
+/**
+ * Identifies the image format.
+ * @param header the first bytes of the file (see readHeader).
+ * @param suffix the lower case file suffix (used for formats without magic bytes).
+ * @return DkFormatRegistry::Format the loader that should decode the file
+ * (no_loader if the format is unknown).
+ **/ 
+DkFormatRegistry::Format DkFormatRegistry::sniff(const QByteArray& header, const QString& suffix) const {
+
+	Format format;
+	format.loader = DkBasicLoader::no_loader;
+
+	// these formats have no magic bytes
+	if (suffix == "roh") {
+		format.loader = DkBasicLoader::roh_loader;
+		format.name = "roh";
+		return format;
+	}
+	else if (suffix == "vec") {
+		format.loader = DkBasicLoader::vec_loader;
+		format.name = "vec";
+		return format;
+	}
+
+	QByteArray qtFormat;
+
+	if (header.startsWith("\xff\xd8\xff"))
+		qtFormat = "jpeg";
+	else if (header.startsWith("\x89PNG"))
+		qtFormat = "png";
+	else if (header.startsWith("GIF8"))
+		qtFormat = "gif";
+	else if (header.startsWith("BM"))
+		qtFormat = "bmp";
+	else if (header.startsWith(QByteArray("\0\0\1\0", 4)))
+		qtFormat = "ico";
+	else if (header.startsWith(QByteArray("\0\0\0\x0cjP  ", 8)) || header.startsWith("\xff\x4f\xff\x51"))
+		qtFormat = "jp2";
+	else if (header.startsWith("icns"))
+		qtFormat = "icns";
+	else if (header.startsWith("DDS "))
+		qtFormat = "dds";
+	else if (header.startsWith("/* XPM */"))
+		qtFormat = "xpm";
+	else if (header.size() > 2 && header[0] == 'P' && header[1] >= '1' && header[1] <= '6' && QChar(header[2]).isSpace()) {
+		const char* pnm[] = {"pbm", "pgm", "ppm"};
+		qtFormat = pnm[(header[1]-'1') % 3];
+	}
+	else if (header.startsWith("8BPS")) {
+		format.loader = DkBasicLoader::psd_loader;
+		format.name = "psd";
+	}
+	else if (header.startsWith("RIFF") && header.mid(8, 4) == "WEBP") {
+		format.loader = DkBasicLoader::webp_loader;
+		format.name = "webp";
+	}
+	// most RAW formats (e.g. CR2, NEF, DNG, ARW) are TIFF files
+	else if (header.startsWith("II*") || header.startsWith(QByteArray("MM\0*", 4))) {
+
+		if (suffix == "tif" || suffix == "tiff")
+			qtFormat = "tiff";
+		else {
+			format.loader = DkBasicLoader::raw_loader;
+			format.name = "raw";
+		}
+	}
+	// RAF, ORF, RW2, MRW, X3F, CRW, CR3
+	else if (header.startsWith("FUJIFILM") || header.startsWith("IIRO") || header.startsWith("IIRS") || header.startsWith("MMOR") ||
+		header.startsWith(QByteArray("IIU\0", 4)) || header.startsWith(QByteArray("\0MRM", 4)) || header.startsWith("FOVb") ||
+		header.startsWith(QByteArray("II\x1a\0\0\0HEAPCCDR", 14)) || header.mid(4, 8) == "ftypcrx ") {
+		format.loader = DkBasicLoader::raw_loader;
+		format.name = "raw";
+	}
+
+	// formats without plugin are passed to the fallback loaders
+	if (!qtFormat.isEmpty() && qtFormats.contains(qtFormat)) {
+		format.loader = DkBasicLoader::qt_loader;
+		format.name = qtFormat;
+	}
+
+	return format;
+}
+
+/**
+ * Returns true if Qt has a plugin for the format specified.
+ * @param format the format (e.g. jpeg) or a lower case suffix.
+ * @return bool true if Qt can read the format.
+ **/ 
+bool DkFormatRegistry::isQtFormat(const QByteArray& format) const {
+
+	return qtFormats.contains(format);
+}
+
+/**
+ * Returns the first bytes of a file.
+ * @param fileInfo the file.
+ * @param ba the file buffer - if it is empty, the header is read from the file.
+ * @return QByteArray the header (empty if the file cannot be read).
+ **/ 
+QByteArray DkFormatRegistry::readHeader(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba) {
+
+	if (ba && !ba->isEmpty())
+		return ba->left(header_size);
+
+	QFile file(fileInfo.absoluteFilePath());
+	if (!file.open(QIODevice::ReadOnly))
+		return QByteArray();
+
+	return file.read(header_size);
+}
+
+void DkFormatRegistry::addDecodeTime(const QByteArray& format, int ms, bool loaded) {
+
+	QMutexLocker locker(&mutex);
+
+	Timing& t = timings[format];
+
+	if (loaded) {
+		t.numLoaded++;
+		t.decodeTime += ms;
+	}
+	else
+		t.numFailed++;
+}
+
+/**
+ * Returns the decoding statistics.
+ * @return QString the mean decoding time and the number of failed attempts per format.
+ **/ 
+QString DkFormatRegistry::getStats() {
+
+	QMutexLocker locker(&mutex);
+	QStringList stats;
+
+	QHash<QByteArray, Timing>::const_iterator it = timings.constBegin();
+	for (; it != timings.constEnd(); ++it) {
+
+		QString s = QString("%1: %2 images").arg(QString::fromLatin1(it.key())).arg(it->numLoaded);
+
+		if (it->numLoaded)
+			s += QString(" (%1 ms/image)").arg(it->decodeTime/it->numLoaded, 0, 'f', 1);
+		if (it->numFailed)
+			s += QString(", %1 failed").arg(it->numFailed);
+
+		stats << s;
+	}
+
+	return stats.join(" | ");
+}
+
+// DkTiffIndex --------------------------------------------------------------------
+DkTiffIndex& DkTiffIndex::instance() {
+
+	static DkTiffIndex inst;
+	return inst;
+}
+
+DkTiffIndex::DkTiffIndex() {
+
+	accessClock = 0;
+
+#ifdef WITH_LIBTIFF
+	// turn off nasty warning/error dialogs - (we do the GUI : )
+	// this is done once since pages are decoded in parallel
+	TIFFSetWarningHandler(NULL);
+	TIFFSetErrorHandler(NULL);
+#endif
+}
+
+/**
+ * Returns the pages of a TIFF.
+ * The file is indexed if it is not cached or if it changed.
+ * @param file the TIFF file
+ * @return QVector<DkTiffIndex::Page> the pages or an empty vector if the file cannot be read.
+ **/ 
+QVector<DkTiffIndex::Page> DkTiffIndex::pages(const QFileInfo& file) {
+
+	// fresh stat: the file info passed might be outdated
+	QFileInfo cFile(file.absoluteFilePath());
+	qint64 modified = cFile.lastModified().toMSecsSinceEpoch();
+
+	{
+		QMutexLocker locker(&mutex);
+
+		QHash<QString, Entry>::iterator eIter = index.find(cFile.absoluteFilePath());
+
+		if (eIter != index.end() && eIter.value().modified == modified && eIter.value().fileSize == cFile.size()) {
+			eIter.value().lastAccess = ++accessClock;
+			return eIter.value().pages;
+		}
+	}
+
+	// index without locking - this walks the whole directory chain
+	Entry e;
+	e.pages = indexFile(cFile);
+	e.modified = modified;
+	e.fileSize = cFile.size();
+
+	if (e.pages.empty())
+		return e.pages;
+
+	QMutexLocker locker(&mutex);
+
+	// drop the least recently used file
+	if (index.size() >= max_files && !index.contains(cFile.absoluteFilePath())) {
+
+		QHash<QString, Entry>::iterator oIter = index.begin();
+
+		for (QHash<QString, Entry>::iterator eIter = index.begin(); eIter != index.end(); ++eIter) {
+			if (eIter.value().lastAccess < oIter.value().lastAccess)
+				oIter = eIter;
+		}
+		index.erase(oIter);
+	}
+
+	e.lastAccess = ++accessClock;
+	index.insert(cFile.absoluteFilePath(), e);
+
+	return e.pages;
+}
+
+void DkTiffIndex::remove(const QFileInfo& file) {
+
+	QMutexLocker locker(&mutex);
+	index.remove(file.absoluteFilePath());
+}
+
+void DkTiffIndex::clear() {
+
+	QMutexLocker locker(&mutex);
+	index.clear();
+}
+
+QVector<DkTiffIndex::Page> DkTiffIndex::indexFile(const QFileInfo& file) const {
+
+	QVector<Page> pages;
+
+#ifdef WITH_LIBTIFF
+
+	DkTimer dt;
+	TIFF* tiff = TIFFOpen(file.absoluteFilePath().toLatin1(), "r");
+
+	if (!tiff) 
+		return pages;
+
+	do {
+		uint32 width = 0;
+		uint32 height = 0;
+		TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+
+		Page page;
+		page.offset = TIFFCurrentDirOffset(tiff);
+		page.width = width;
+		page.height = height;
+		pages.append(page);
+
+	} while (TIFFReadDirectory(tiff));
+
+	TIFFClose(tiff);
+
+	qDebug() << "[DkTiffIndex]" << pages.size() << "pages of" << file.fileName() << "indexed in" << dt.getTotal();
+#endif
+
+	return pages;
+}
+
+// DkMappedBuffer --------------------------------------------------------------------
+QHash<QByteArray*, QFile*> DkMappedBuffer::files;
+QMutex DkMappedBuffer::mutex;
+
+/**
+ * Maps a file into memory.
+ * @param fileInfo the file.
+ * @param prefault if true, all pages are touched once so that
+ * the file is read now (e.g. if the file is prefetched).
+ * @return QSharedPointer<QByteArray> the buffer (NULL if the file could not be mapped).
+ **/ 
+QSharedPointer<QByteArray> DkMappedBuffer::map(const QFileInfo& fileInfo, bool prefault) {
+
+	QFile* file = new QFile(fileInfo.absoluteFilePath());
+	qint64 size = file->size();
+	uchar* data = 0;
+
+	// a QByteArray cannot be larger than 2 GB
+	if (size > 0 && size < INT_MAX && file->open(QIODevice::ReadOnly))
+		data = file->map(0, size);
+
+	if (!data) {
+		delete file;
+		return QSharedPointer<QByteArray>();
+	}
+
+	if (prefault) {
+		volatile uchar sum = 0;
+		for (qint64 idx = 0; idx < size; idx += 4096)
+			sum += data[idx];
+	}
+
+	QByteArray* ba = new QByteArray(QByteArray::fromRawData((const char*)data, (int)size));
+
+	QMutexLocker locker(&mutex);
+	files.insert(ba, file);
+
+	return QSharedPointer<QByteArray>(ba, &DkMappedBuffer::unmap);
+}
+
+/**
+ * Returns true if the buffer references a memory mapped file.
+ * @param ba the buffer.
+ * @return bool true if the buffer was created by DkMappedBuffer::map.
+ **/ 
+bool DkMappedBuffer::isMapped(const QSharedPointer<QByteArray>& ba) {
+
+	if (!ba)
+		return false;
+
+	QMutexLocker locker(&mutex);
+	return files.contains(ba.data());
+}
+
+/**
+ * Returns the size of all files that are currently mapped.
+ * @return qint64 the mapped bytes.
+ **/ 
+qint64 DkMappedBuffer::mappedBytes() {
+
+	QMutexLocker locker(&mutex);
+	qint64 bytes = 0;
+
+	QHash<QByteArray*, QFile*>::const_iterator it = files.constBegin();
+	for (; it != files.constEnd(); ++it)
+		bytes += it.value()->size();
+
+	return bytes;
+}
+
+void DkMappedBuffer::unmap(QByteArray* ba) {
+
+	QFile* file = 0;
+
+	mutex.lock();
+	file = files.take(ba);
+	mutex.unlock();
+
+	// the buffer must be deleted before its data is unmapped
+	delete ba;
+	delete file;	// unmaps & closes the file
+}
+
 // FileDownloader --------------------------------------------------------------------
 FileDownloader::FileDownloader(QUrl imageUrl, QObject *parent) : QObject(parent) {
 	QNetworkProxyQuery npq(QUrl("http://www.nomacs.org"));
@@ -33,6 +33,11 @@
 #include <QUrl>
 #include <QFileInfo>
 #include <QImage>
+#include <QSet>
+#include <QHash>
+#include <QMutex>
+#include <QFile>
+#include <QVector>
 #pragma warning(pop)
 
 //#include "DkImageStorage.h"
@@ -100,6 +105,51 @@ protected:
 };
 #endif
 
+/**
+ * Directory index of (multi-page) TIFFs.
+ * The directory chain of a file is walked once and the offset and size
+ * of each page is cached. Pages can then be opened directly instead of
+ * reading all directories in front of them.
+ * Entries are dropped if the file changes.
+ **/ 
+class DllExport DkTiffIndex {
+
+public:
+	static DkTiffIndex& instance();
+
+	struct Page {
+		quint64 offset;		// offset of the page's directory
+		int width;
+		int height;
+	};
+
+	QVector<Page> pages(const QFileInfo& file);
+	void remove(const QFileInfo& file);
+	void clear();
+
+protected:
+	DkTiffIndex();
+	DkTiffIndex(DkTiffIndex const&);		// hide
+	void operator=(DkTiffIndex const&);		// hide
+
+	QVector<Page> indexFile(const QFileInfo& file) const;
+
+	enum {
+		max_files = 32,
+	};
+
+	struct Entry {
+		QVector<Page> pages;
+		qint64 modified;
+		qint64 fileSize;
+		quint32 lastAccess;
+	};
+
+	QHash<QString, Entry> index;
+	quint32 accessClock;
+	QMutex mutex;
+};
+
 /**
  * This class provides image loading and editing capabilities.
  * It additionally stores the currently loaded image.
@@ -123,6 +173,7 @@ public:
 		raw_loader,
 		roh_loader,
 		hdr_loader,
+		vec_loader,
 	};
 
 	DkBasicLoader(int mode = mode_default);
@@ -160,6 +211,16 @@ public:
 		return pageIdx;
 	};
 
+	/**
+	 * Returns the TIFF pages of the current file.
+	 * @return QVector<DkTiffIndex::Page> the pages or an empty vector if the file is no TIFF.
+	 **/ 
+	QVector<DkTiffIndex::Page> getTiffPages() const {
+		return tiffPages;
+	};
+
+	static bool loadTiffPage(const QFileInfo& file, const DkTiffIndex::Page& page, QImage& img);
+
 	bool setPageIdx(int skipIdx);
 	void resetPageIdx();
 
@@ -215,6 +276,43 @@ public:
 		return pageIdxDirty;
 	};
 
+	/**
+	 * Returns true if the image is a preview.
+	 * Previews are half-size RAW images or JPEGs decoded with a
+	 * smaller resolution (see setPreviewSize).
+	 * @return bool true if the full resolution was not decoded.
+	 **/ 
+	bool isPreview() const {
+		return preview;
+	};
+
+	/**
+	 * Returns the size of the full resolution image.
+	 * @return QSize the image size if it is no preview.
+	 **/ 
+	QSize getFullSize() const {
+		return preview ? fullSize : qImg.size();
+	};
+
+	/**
+	 * If set, JPEGs are decoded with the smallest resolution
+	 * (1/2, 1/4 or 1/8) that covers size.
+	 * @param size the size the image is displayed with - an empty size loads the full resolution.
+	 **/ 
+	void setPreviewSize(const QSize& size) {
+		previewSize = size;
+	};
+
+	/**
+	 * If enabled, RAW files are decoded with half the resolution
+	 * if their embedded preview is too small. It is disabled by
+	 * default since saved or exported images need the full resolution.
+	 * @param preview if false, RAW files are always decoded with full resolution.
+	 **/ 
+	void setRawPreviewMode(bool preview) {
+		rawPreviewMode = preview;
+	};
+
 	/**
 	 * Returns the current image size.
 	 * @return QSize the image size.
@@ -272,8 +370,11 @@ public slots:
 protected:
 	bool loadRohFile(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba = QSharedPointer<QByteArray>());
 	bool loadRawFile(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba = QSharedPointer<QByteArray>(), bool fast = false);
+	bool loadJpegScaled(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba, const QSize& previewSize);
+	bool loadWithLoader(int loaderId, const QByteArray& qtFormat, QSharedPointer<QByteArray> ba, bool fast);
+	bool loadUnknown(int triedLoader, QSharedPointer<QByteArray> ba, bool fast);
 	void indexPages(const QFileInfo& fileInfo);
-	void convert32BitOrder(void *buffer, int width);
+	static void convert32BitOrder(void *buffer, int width);
 
 	int loader;
 	bool training;
@@ -283,6 +384,11 @@ protected:
 	int numPages;
 	int pageIdx;
 	bool pageIdxDirty;
+	QVector<DkTiffIndex::Page> tiffPages;
+	bool preview;
+	bool rawPreviewMode;
+	QSize previewSize;
+	QSize fullSize;
 	QSharedPointer<DkMetaDataT> metaData;
 
 #ifdef WITH_OPENCV
@@ -290,6 +396,75 @@ protected:
 #endif
 };
 
+/**
+ * Identifies image formats by their magic bytes.
+ * DkBasicLoader uses the registry to dispatch a file directly to
+ * the right decoder rather than trying all loaders one after another.
+ * The formats supported by Qt are cached and decoding times are
+ * recorded per format.
+ **/ 
+class DllExport DkFormatRegistry {
+
+public:
+	static DkFormatRegistry& instance();
+	~DkFormatRegistry();
+
+	struct Format {
+		int loader;			// DkBasicLoader::loaderID
+		QByteArray name;	// e.g. jpeg, raw, psd (Qt format name if loader is the qt_loader)
+	};
+
+	enum {
+		header_size = 32,
+	};
+
+	Format sniff(const QByteArray& header, const QString& suffix) const;
+	bool isQtFormat(const QByteArray& format) const;
+	static QByteArray readHeader(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba);
+
+	void addDecodeTime(const QByteArray& format, int ms, bool loaded);
+	QString getStats();
+
+protected:
+	DkFormatRegistry();
+	DkFormatRegistry(DkFormatRegistry const&);		// hide
+	void operator=(DkFormatRegistry const&);		// hide
+
+	struct Timing {
+		int numLoaded;
+		int numFailed;
+		double decodeTime;
+	};
+
+	QSet<QByteArray> qtFormats;
+	QHash<QByteArray, Timing> timings;
+	QMutex mutex;
+};
+
+/**
+ * Memory mapped file buffers.
+ * The buffer references the mapped file (QByteArray::fromRawData),
+ * so decoders that read it (constData) do not copy the file.
+ * Pages are loaded on demand and belong to the file system cache.
+ * The file is unmapped if the last reference to the buffer is released.
+ * Mapping is opt-in (mapFileBuffers): reading a mapped file that was
+ * truncated meanwhile (or lies on a share that dropped) crashes, and Windows
+ * does not allow for deleting or overwriting mapped files.
+ **/ 
+class DllExport DkMappedBuffer {
+
+public:
+	static QSharedPointer<QByteArray> map(const QFileInfo& fileInfo, bool prefault = false);
+	static bool isMapped(const QSharedPointer<QByteArray>& ba);
+	static qint64 mappedBytes();
+
+protected:
+	static void unmap(QByteArray* ba);
+
+	static QHash<QByteArray*, QFile*> files;
+	static QMutex mutex;
+};
+
 // file downloader from: http://qt-project.org/wiki/Download_Data_from_URL
 class FileDownloader : public QObject {
 	Q_OBJECT
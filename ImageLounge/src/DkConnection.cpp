@@ -35,6 +35,9 @@
 #include <QHostInfo>
 #include <QThread>
 #include <QDebug>
+#include <QtConcurrentRun>
+#include <QDateTime>
+#include <climits>
 #pragma warning(pop)		// no warnings from includes - end
 
 namespace nmc {
@@ -49,8 +52,14 @@ DkConnection::DkConnection(QObject* parent) : QTcpSocket(parent) {
 	isSynchronizeMessageSent = false;
 	connectionCreated = false;
 	this->synchronizedTimer = new QTimer(this);
+	receivePending = false;
+
+	syncTimer = new QTimer(this);
+	syncTimer->setSingleShot(true);
+	lastSync.start();
 
 	connect(synchronizedTimer, SIGNAL(timeout()), this, SLOT(synchronizedTimerTimeout()));
+	connect(syncTimer, SIGNAL(timeout()), this, SLOT(flushSyncMessages()));
 	connect(this, SIGNAL(readyRead()), this, SLOT(processReadyRead()));
 
 	this->setReadBufferSize(MaxBufferSize);
@@ -102,6 +111,92 @@ void DkConnection::sendNewTitleMessage(QString newtitle) {
 }
 
 void DkConnection::sendNewPositionMessage(QRect position, bool opacity, bool overlaid) {
+
+	if (sendQueue.hasPosition)
+		syncStats.coalesced++;
+
+	sendQueue.hasPosition = true;
+	sendQueue.position = position;
+	sendQueue.opacity = opacity;
+	sendQueue.overlaid = overlaid;
+	scheduleSyncMessages();
+}
+
+void DkConnection::sendNewTransformMessage(QTransform transform, QTransform imgTransform, QPointF canvasSize) {
+
+	if (sendQueue.hasTransform)
+		syncStats.coalesced++;
+
+	sendQueue.hasTransform = true;
+	sendQueue.transform = transform;
+	sendQueue.imgTransform = imgTransform;
+	sendQueue.canvasSize = canvasSize;
+	scheduleSyncMessages();
+}
+
+/**
+ * Queues a file message.
+ * Relative skips (e.g. next, previous) are summed up, absolute messages (a filename, first, last)
+ * replace pending ones.
+ * @param op the number of files to skip or SHRT_MIN, SHRT_MAX for the first and last file
+ * @param filename the file to load
+ **/
+void DkConnection::sendNewFileMessage(qint16 op , QString filename) {
+
+	bool relative = filename.isEmpty() && op != SHRT_MIN && op != SHRT_MAX;
+
+	if (sendQueue.hasFile) {
+
+		bool pendingRelative = sendQueue.filename.isEmpty() && sendQueue.fileOp != SHRT_MIN && sendQueue.fileOp != SHRT_MAX;
+
+		if (!relative) {
+			syncStats.coalesced++;
+		}
+		else if (pendingRelative) {
+			op = (qint16)qMax(SHRT_MIN+1, qMin(SHRT_MAX-1, sendQueue.fileOp + op));
+			syncStats.coalesced++;
+		}
+		else
+			flushSyncMessages();	// a skip relative to a file that was not sent yet
+	}
+
+	sendQueue.hasFile = true;
+	sendQueue.fileOp = op;
+	sendQueue.filename = filename;
+	scheduleSyncMessages();
+};
+
+/**
+ * Starts the sync timer.
+ * The first message is sent with the next event loop iteration,
+ * messages that follow within SyncInterval are coalesced.
+ **/
+void DkConnection::scheduleSyncMessages() {
+
+	if (syncTimer->isActive())
+		return;
+
+	int wait = qMax(0, qMin(SyncInterval, SyncInterval - lastSync.elapsed()));
+	syncTimer->start(wait);
+}
+
+void DkConnection::flushSyncMessages() {
+
+	syncTimer->stop();
+	lastSync.restart();
+
+	// the file first - transforms refer to the new image
+	if (sendQueue.hasFile)
+		writeNewFileMessage(sendQueue.fileOp, sendQueue.filename);
+	if (sendQueue.hasTransform)
+		writeNewTransformMessage(sendQueue.transform, sendQueue.imgTransform, sendQueue.canvasSize);
+	if (sendQueue.hasPosition)
+		writeNewPositionMessage(sendQueue.position, sendQueue.opacity, sendQueue.overlaid);
+
+	sendQueue = SyncMessages();
+}
+
+void DkConnection::writeNewPositionMessage(QRect position, bool opacity, bool overlaid) {
 	//qDebug() << "sending new Position to " << this->peerName() << ":" << this->peerPort();
 	QByteArray ba;
 	QDataStream ds(&ba, QIODevice::ReadWrite);
@@ -113,23 +208,26 @@ void DkConnection::sendNewPositionMessage(QRect position, bool opacity, bool ove
 	QByteArray data = "NEWPOSITION";
 	data.append(SeparatorToken).append(QByteArray::number(ba.size())).append(SeparatorToken).append(ba);
 	write(data);
+	syncStats.sent++;
 }
 
-void DkConnection::sendNewTransformMessage(QTransform transform, QTransform imgTransform, QPointF canvasSize) {
+void DkConnection::writeNewTransformMessage(QTransform transform, QTransform imgTransform, QPointF canvasSize) {
 	//qDebug() << "sending new Transform Message to " << this->peerName() << ":" << this->peerPort();
 	QByteArray ba;
 	QDataStream ds(&ba, QIODevice::ReadWrite);
 	ds << transform;
 	ds << imgTransform;
 	ds << canvasSize;
+	ds << QDateTime::currentMSecsSinceEpoch();	// for measuring the latency (older versions ignore it)
 
 	//QByteArray data = "NEWTRANSFORM" + SeparatorToken + QByteArray::number(ba.size()) + SeparatorToken + ba;
 	QByteArray data = "NEWTRANSFORM";
 	data.append(SeparatorToken).append(QByteArray::number(ba.size())).append(SeparatorToken).append(ba);
 	write(data);
+	syncStats.sent++;
 }
 
-void DkConnection::sendNewFileMessage(qint16 op , QString filename) {
+void DkConnection::writeNewFileMessage(qint16 op , QString filename) {
 	//qDebug() << "sending new File Message to " << this->peerName() << ":" << this->peerPort();
 	QByteArray ba;
 	QDataStream ds(&ba, QIODevice::ReadWrite);
@@ -138,6 +236,7 @@ void DkConnection::sendNewFileMessage(qint16 op , QString filename) {
 	QByteArray data = "NEWFILE";
 	data.append(SeparatorToken).append(QByteArray::number(ba.size())).append(SeparatorToken).append(ba);
 	write(data);
+	syncStats.sent++;
 };
 
 void DkConnection::sendNewGoodbyeMessage() {
@@ -398,27 +497,52 @@ void DkConnection::processData() {
 		emit connectionTitleHasChanged(this, QString::fromUtf8(buffer));
 		break;
 	case newPosition: {
+		// positions and transforms are emitted after all buffered messages are read - so just the latest is processed
 		if (state == Synchronized) {
-			QRect rect;
-			bool opacity;
-			bool overlaid;
+			if (receiveQueue.hasPosition)
+				syncStats.dropped++;
+
 			QDataStream ds(buffer);
-			ds >> rect;
-			ds >> opacity;
-			ds >> overlaid;
-			emit connectionNewPosition(this, rect, opacity, overlaid);
+			ds >> receiveQueue.position;
+			ds >> receiveQueue.opacity;
+			ds >> receiveQueue.overlaid;
+			receiveQueue.hasPosition = true;
+			syncStats.received++;
+
+			if (!receivePending) {
+				receivePending = true;
+				QTimer::singleShot(0, this, SLOT(emitReceivedSyncMessages()));
+			}
 		}
 		break;}
 	case newTransform: {
 		if (state == Synchronized) {
-			QTransform transform;
-			QTransform imgTransform;
-			QPointF canvasSize;
+			if (receiveQueue.hasTransform)
+				syncStats.dropped++;
+
 			QDataStream dsTransform(buffer);
-			dsTransform >> transform;
-			dsTransform >> imgTransform;
-			dsTransform >> canvasSize;
-			emit connectionNewTransform(this, transform, imgTransform, canvasSize);
+			dsTransform >> receiveQueue.transform;
+			dsTransform >> receiveQueue.imgTransform;
+			dsTransform >> receiveQueue.canvasSize;
+			receiveQueue.hasTransform = true;
+			syncStats.received++;
+
+			// older versions do not send the time
+			if (!dsTransform.atEnd()) {
+				qint64 sent;
+				dsTransform >> sent;
+				qint64 latency = QDateTime::currentMSecsSinceEpoch() - sent;
+				
+				if (latency >= 0 && latency < 60000) {	// the clocks of remote peers might differ
+					syncStats.latencySum += latency;
+					syncStats.latencyCount++;
+				}
+			}
+
+			if (!receivePending) {
+				receivePending = true;
+				QTimer::singleShot(0, this, SLOT(emitReceivedSyncMessages()));
+			}
 		}
 		break;}
 	case newFile: {
@@ -429,6 +553,10 @@ void DkConnection::processData() {
 			QDataStream dsTransform(buffer);
 			dsTransform >> op;
 			dsTransform >> filename;
+			syncStats.received++;
+
+			// keep the order: transforms that were received before belong to the old file
+			emitReceivedSyncMessages();
 			emit connectionNewFile(this, op, filename);
 		}
 		break;}
@@ -441,6 +569,40 @@ void DkConnection::processData() {
 	buffer.clear();
 }
 
+void DkConnection::emitReceivedSyncMessages() {
+
+	receivePending = false;
+
+	if (receiveQueue.hasTransform)
+		emit connectionNewTransform(this, receiveQueue.transform, receiveQueue.imgTransform, receiveQueue.canvasSize);
+	if (receiveQueue.hasPosition)
+		emit connectionNewPosition(this, receiveQueue.position, receiveQueue.opacity, receiveQueue.overlaid);
+
+	receiveQueue = SyncMessages();
+}
+
+/**
+ * Returns the message counts since the last call.
+ **/
+DkSyncStats DkConnection::takeSyncStats() {
+
+	DkSyncStats stats = syncStats;
+	syncStats = DkSyncStats();
+
+	return stats;
+}
+
+// DkSyncStats --------------------------------------------------------------------
+void DkSyncStats::add(const DkSyncStats& other) {
+
+	sent += other.sent;
+	coalesced += other.coalesced;
+	received += other.received;
+	dropped += other.dropped;
+	latencySum += other.latencySum;
+	latencyCount += other.latencyCount;
+}
+
 void DkConnection::synchronizedTimerTimeout() {
 	synchronizedTimer->stop();
 	emit connectionStopSynchronize(this);
@@ -545,6 +707,19 @@ DkLANConnection::DkLANConnection(QObject* parent /* = 0 */) : DkConnection(paren
 	iAmServer = true;
 	showInMenu = false;
 	currentLanDataType = Undefined;
+
+	peerImageProtocol = 0;
+	sendTransferId = 0;
+	fullTransferId = 0;
+	sendOffset = 0;
+	decodePending = false;
+	shownTransferId = 0;
+	shownFull = false;
+
+	connect(&proxyWatcher, SIGNAL(finished()), this, SLOT(proxyEncoded()));
+	connect(&fullWatcher, SIGNAL(finished()), this, SLOT(imageEncoded()));
+	connect(&decodeWatcher, SIGNAL(finished()), this, SLOT(imageDecoded()));
+	connect(this, SIGNAL(bytesWritten(qint64)), this, SLOT(sendNextImageChunk()));
 }
 
 void DkLANConnection::sendNewUpcomingImageMessage(QString image) {
@@ -564,6 +739,14 @@ void DkLANConnection::sendNewUpcomingImageMessage(QString image) {
 };
 
 
+/**
+ * Sends an image to the peer.
+ * The image is encoded in a background thread. Peers that support streaming
+ * first get a small proxy and then the full resolution image in chunks.
+ * A new image cancels the current transfer.
+ * @param image the image to be sent
+ * @param title the window title
+ **/
 void DkLANConnection::sendNewImageMessage(QImage image, QString title) {
 	if (!allowImage)
 		return;
@@ -571,25 +754,141 @@ void DkLANConnection::sendNewImageMessage(QImage image, QString title) {
 	if (title == "")
 		title = "nomacs - ImageLounge";
 
+	// cancel the current transfer - results of old encodings are dropped since their ids do not match
+	if (!sendTransfer.data.isEmpty()) {
+		sendImageCancelMessage(sendTransfer.id);
+		sendTransfer = ImageTransfer();
+	}
+	queuedTransfer = ImageTransfer();
+
+	sendTransferId++;
+
+	ImageTransfer transfer;
+	transfer.id = sendTransferId;
+	transfer.title = title;
+
+	if (peerImageProtocol > 0 && qMax(image.width(), image.height()) > ImageProxySize) {
+		transfer.isProxy = true;
+		proxyWatcher.setFuture(QtConcurrent::run(&nmc::DkLANConnection::encodeImage, image, transfer));
+	}
+
+	transfer.isProxy = false;
+	fullWatcher.setFuture(QtConcurrent::run(&nmc::DkLANConnection::encodeImage, image, transfer));
+};
+
+void DkLANConnection::proxyEncoded() {
+
+	ImageTransfer transfer = proxyWatcher.result();
+
+	// outdated or the full image was faster
+	if (transfer.id != sendTransferId || transfer.id == fullTransferId)
+		return;
+
+	if (sendTransfer.data.isEmpty())
+		startImageTransfer(transfer);
+}
+
+void DkLANConnection::imageEncoded() {
+
+	ImageTransfer transfer = fullWatcher.result();
+
+	if (transfer.id != sendTransferId)
+		return;
+
+	if (transfer.data.isEmpty()) {
+		QString msg = "sorry, I could not encode the image...";
+		qDebug() << msg;
+		emit connectionShowStatusMessage(this, msg);
+		return;
+	}
+
+	fullTransferId = transfer.id;
+
+	if (peerImageProtocol == 0)
+		sendLegacyImageMessage(transfer);
+	else if (!sendTransfer.data.isEmpty())
+		queuedTransfer = transfer;	// the proxy is currently sent
+	else
+		startImageTransfer(transfer);
+}
+
+void DkLANConnection::startImageTransfer(const ImageTransfer& transfer) {
+
+	sendTransfer = transfer;
+	sendOffset = 0;
+	sendTime.start();
+
 	QByteArray ba;
 	QDataStream ds(&ba, QIODevice::ReadWrite);
-	ds << title;
+	ds << transfer.id;
+	ds << transfer.isProxy;
+	ds << transfer.title;
+	ds << (qint32)transfer.data.size();
 
-	QByteArray imageBA;
-	QBuffer buffer(&imageBA);
-	buffer.open(QIODevice::WriteOnly);
-	
-	if (image.hasAlphaChannel())
-		image.save(&buffer, "TIF");
-	else
-		image.save(&buffer, "JPG", 100);	// fastest way
-	buffer.close();
+	QByteArray data = "IMAGEBEGIN";
+	data.append(SeparatorToken).append(QByteArray::number(ba.size())).append(SeparatorToken).append(ba);
+	write(data);
 
-	ds << imageBA;
+	sendNextImageChunk();
+}
+
+/**
+ * Writes the next chunks of the current image.
+ * Just a few chunks are buffered by the socket so that other messages
+ * (e.g. transforms) and cancels are not queued behind the whole image.
+ **/
+void DkLANConnection::sendNextImageChunk() {
+
+	while (!sendTransfer.data.isEmpty() && bytesToWrite() < 2*ImageChunkSize) {
+
+		int chunkSize = qMin(ImageChunkSize, sendTransfer.data.size() - sendOffset);
+
+		QByteArray ba;
+		QDataStream ds(&ba, QIODevice::ReadWrite);
+		ds << sendTransfer.id;
+		ba.append(sendTransfer.data.constData() + sendOffset, chunkSize);
+
+		QByteArray data = "IMAGECHUNK";
+		data.append(SeparatorToken).append(QByteArray::number(ba.size())).append(SeparatorToken).append(ba);
+		write(data);
+
+		sendOffset += chunkSize;
 
+		if (sendOffset == sendTransfer.data.size()) {
 
-	//qDebug() << "imag size: " << (float)buffer.size()/1000000.0f;
-	//qDebug() << "my stacksize is: " << (float)this->thread()->stackSize()/1000000.0f;
+			qDebug() << "[DkLANConnection]" << (sendTransfer.isProxy ? "proxy" : "image") << "of" << sendTransfer.data.size()/1024 << "KB queued in" << sendTime.elapsed() << "ms";
+
+			sendTransfer = ImageTransfer();
+
+			if (!queuedTransfer.data.isEmpty()) {
+				ImageTransfer transfer = queuedTransfer;
+				queuedTransfer = ImageTransfer();
+				startImageTransfer(transfer);
+			}
+		}
+	}
+}
+
+void DkLANConnection::sendImageCancelMessage(quint32 transferId) {
+
+	QByteArray ba;
+	QDataStream ds(&ba, QIODevice::ReadWrite);
+	ds << transferId;
+
+	QByteArray data = "IMAGECANCEL";
+	data.append(SeparatorToken).append(QByteArray::number(ba.size())).append(SeparatorToken).append(ba);
+	write(data);
+}
+
+/**
+ * Sends the image in a single message (for peers that do not support streaming).
+ **/
+void DkLANConnection::sendLegacyImageMessage(const ImageTransfer& transfer) {
+
+	QByteArray ba;
+	QDataStream ds(&ba, QIODevice::ReadWrite);
+	ds << transfer.title;
+	ds << transfer.data;
 
 	try {
 		QByteArray data = "NEWIMAGE";
@@ -598,12 +897,140 @@ void DkLANConnection::sendNewImageMessage(QImage image, QString title) {
 	} 
 	catch(...) {
 		QString imageSize;
-		imageSize.setNum(buffer.size() / 1000000);
+		imageSize.setNum(transfer.data.size() / 1000000);
 		QString msg = "sorry, I could not send the image\n " + imageSize + " MB is too much for me...";
 		qDebug() << msg;
 		emit connectionShowStatusMessage(this, msg);
 	}
-};
+}
+
+/**
+ * Encodes the image (called in a background thread).
+ * Proxies are downscaled and compressed, full images are sent as JPG (100)
+ * or TIF if they have an alpha channel.
+ **/
+DkLANConnection::ImageTransfer DkLANConnection::encodeImage(QImage image, ImageTransfer transfer) {
+
+	if (transfer.isProxy)
+		image = image.scaled(ImageProxySize, ImageProxySize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+	QBuffer buffer(&transfer.data);
+	buffer.open(QIODevice::WriteOnly);
+
+	if (transfer.isProxy)
+		image.save(&buffer, image.hasAlphaChannel() ? "PNG" : "JPG", 85);
+	else if (image.hasAlphaChannel())
+		image.save(&buffer, "TIF");
+	else
+		image.save(&buffer, "JPG", 100);	// fastest way
+	buffer.close();
+
+	transfer.size = transfer.data.size();
+
+	return transfer;
+}
+
+void DkLANConnection::readImageBegin() {
+
+	QDataStream ds(buffer);
+	ImageTransfer transfer;
+	qint32 size;
+	ds >> transfer.id;
+	ds >> transfer.isProxy;
+	ds >> transfer.title;
+	ds >> size;
+	transfer.size = size;
+
+	// the size is sent by the peer - do not trust it
+	if (transfer.size <= 0 || transfer.size > MaxImageTransferSize) {
+		qDebug() << "[DkLANConnection] rejecting image transfer of" << transfer.size << "bytes";
+		recvTransfer = ImageTransfer();
+		return;
+	}
+
+	// the buffer grows as chunks arrive - a transfer which is never sent does not allocate much
+	recvTransfer = transfer;
+	recvTransfer.data.reserve(qMin(transfer.size, 16*ImageChunkSize));
+	recvTime.start();
+}
+
+void DkLANConnection::readImageChunk() {
+
+	QDataStream ds(buffer);
+	quint32 transferId;
+	ds >> transferId;
+
+	// chunks of cancelled transfers
+	if (transferId != recvTransfer.id || recvTransfer.size <= 0)
+		return;
+
+	int headerSize = sizeof(quint32);
+	recvTransfer.data.append(buffer.constData() + headerSize, buffer.size() - headerSize);
+
+	if (recvTransfer.data.size() >= recvTransfer.size) {
+
+		int elapsed = qMax(recvTime.elapsed(), 1);
+		qDebug() << "[DkLANConnection]" << (recvTransfer.isProxy ? "proxy" : "image") << "of" << recvTransfer.size/1024 << "KB received in" << elapsed << "ms" 
+			<< "(" << recvTransfer.size/1024.0/1024.0/(elapsed/1000.0) << "MB/s )";
+
+		startImageDecoding(recvTransfer);
+		recvTransfer = ImageTransfer();
+	}
+}
+
+void DkLANConnection::readImageCancel() {
+
+	QDataStream ds(buffer);
+	quint32 transferId;
+	ds >> transferId;
+
+	if (transferId == recvTransfer.id)
+		recvTransfer = ImageTransfer();
+}
+
+void DkLANConnection::startImageDecoding(const ImageTransfer& transfer) {
+
+	// the latest image wins
+	if (decodeWatcher.isRunning()) {
+		pendingDecode = transfer;
+		decodePending = true;
+		return;
+	}
+
+	decodePending = false;
+	decodeWatcher.setFuture(QtConcurrent::run(&nmc::DkLANConnection::decodeImage, transfer));
+}
+
+void DkLANConnection::imageDecoded() {
+
+	ImageTransfer transfer = decodeWatcher.result();
+
+	// do not replace the full image by its proxy or a newer image by an old one
+	bool outdated = transfer.id < shownTransferId || (transfer.id == shownTransferId && shownFull);
+
+	if (!outdated && !transfer.image.isNull()) {
+		shownTransferId = transfer.id;
+		shownFull = !transfer.isProxy;
+		emit connectionNewImage(this, transfer.image, transfer.title);
+	}
+
+	if (decodePending) {
+		ImageTransfer next = pendingDecode;
+		pendingDecode = ImageTransfer();
+		startImageDecoding(next);
+	}
+}
+
+/**
+ * Decodes a received image (called in a background thread).
+ **/
+DkLANConnection::ImageTransfer DkLANConnection::decodeImage(ImageTransfer transfer) {
+
+	transfer.image.loadFromData(transfer.data);
+	transfer.data.clear();
+
+	return transfer;
+}
 
 void DkLANConnection::sendSwitchServerMessage(QHostAddress address, quint16 port) {
 	//qDebug() << "sending switch server message";
@@ -632,6 +1059,7 @@ void DkLANConnection::sendGreetingMessage(QString currentTitle) {
 		ds << currentTitle;
 	else
 		ds << " ";
+	ds << ImageProtocolVersion;	// older versions ignore it
 
 	//QByteArray data = "GREETING" + SeparatorToken + QByteArray::number(ba.size()) + SeparatorToken + ba;
 	QByteArray data = "GREETING";
@@ -646,9 +1074,10 @@ void DkLANConnection::sendGreetingMessage(QString currentTitle) {
 void DkLANConnection::readGreetingMessage() {
 	QString title;
 
+	QDataStream ds(buffer);
+
 	if (!iAmServer) { // server controls which actions are allowed 
 		
-		QDataStream ds(buffer);
 		ds >> clientName;
 		ds >> allowFile;
 		ds >> allowImage;
@@ -656,9 +1085,14 @@ void DkLANConnection::readGreetingMessage() {
 		ds >> allowTransformation;
 		ds >> title;		
 	} else {
-		QDataStream ds(buffer); // only read clientname
 		ds >> clientName;
 
+		// skip the actions and the title
+		bool dummy;
+		QString dummyTitle;
+		ds >> dummy >> dummy >> dummy >> dummy;
+		ds >> dummyTitle;
+
 		allowFile = DkSettings::sync.allowFile;
 		allowImage = DkSettings::sync.allowImage;
 		allowPosition = DkSettings::sync.allowPosition;
@@ -666,6 +1100,11 @@ void DkLANConnection::readGreetingMessage() {
 		title = "";
 	}
 
+	// older versions do not send the image protocol
+	peerImageProtocol = 0;
+	if (!ds.atEnd())
+		ds >> peerImageProtocol;
+
 	//qDebug() << "emitting readyForUse";
 	emit connectionReadyForUse(peerServerPort, title, this);
 }
@@ -675,6 +1114,9 @@ bool DkLANConnection::readProtocolHeader() {
 	QByteArray newImageBA = QByteArray("NEWIMAGE").append(SeparatorToken);
 	QByteArray upcomingImageBA = QByteArray("UPCOMINGIMAGE").append(SeparatorToken);
 	QByteArray switchServerBA = QByteArray("SWITCHSERVER").append(SeparatorToken);
+	QByteArray imageBeginBA = QByteArray("IMAGEBEGIN").append(SeparatorToken);
+	QByteArray imageChunkBA = QByteArray("IMAGECHUNK").append(SeparatorToken);
+	QByteArray imageCancelBA = QByteArray("IMAGECANCEL").append(SeparatorToken);
 
 	if (buffer == newImageBA) {
 		//qDebug() << "New Image received from:" << this->peerAddress() << ":" << this->peerPort();
@@ -685,6 +1127,12 @@ bool DkLANConnection::readProtocolHeader() {
 	} else if (buffer == switchServerBA) {
 		//qDebug() << "Switch Server received from:" << this->peerAddress() << ":" << this->peerPort();
 		currentLanDataType = switchServer;
+	} else if (buffer == imageBeginBA) {
+		currentLanDataType = imageBegin;
+	} else if (buffer == imageChunkBA) {
+		currentLanDataType = imageChunk;
+	} else if (buffer == imageCancelBA) {
+		currentLanDataType = imageCancel;
 	} else {
 		return DkConnection::readProtocolHeader();
 	}
@@ -696,7 +1144,7 @@ bool DkLANConnection::readProtocolHeader() {
 
 void DkLANConnection::processReadyRead() {
 
-	if (currentLanDataType == newImage) { // long message
+	if (currentLanDataType == newImage || currentLanDataType == imageChunk) { // long message
 		readWhileBytesAvailable();
 		return;
 	}
@@ -773,6 +1221,17 @@ void  DkLANConnection::processData() {
 			  //qDebug() << "switch server received: " << address << ":" << port;
 		  }
 		  break;
+	case imageBegin:
+		if (state == Synchronized)
+			readImageBegin();
+		break;
+	case imageChunk:
+		if (state == Synchronized)
+			readImageChunk();
+		break;
+	case imageCancel:
+		readImageCancel();
+		break;
 	case Undefined:
 	default: 
 		DkConnection::processData();
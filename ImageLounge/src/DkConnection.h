@@ -33,6 +33,8 @@
 #include <QTransform>
 #include <QHostAddress>
 #include <QImage>
+#include <QFutureWatcher>
+#include <QTime>
 #pragma warning(pop)		// no warnings from includes - end
 
 #ifdef QT_NO_DEBUG_OUTPUT
@@ -46,6 +48,29 @@ namespace nmc {
 
 static const int MaxBufferSize = 102400000;
 static const char SeparatorToken = '<';
+static const int SyncInterval = 16;	// transforms, positions and files are sent with max 60 Hz
+static const quint16 ImageProtocolVersion = 1;	// 0: images are sent in one message, 1: images are streamed
+static const int ImageChunkSize = 262144;	// images are streamed in chunks of 256 KB
+static const int MaxImageTransferSize = 268435456;	// larger transfers (256 MB) are rejected
+static const int ImageProxySize = 1280;		// max side length of the preview that is sent before the full image
+
+/**
+ * Counts the synchronization messages of a connection.
+ **/
+class DkSyncStats {
+
+	public:
+		DkSyncStats() : sent(0), coalesced(0), received(0), dropped(0), latencySum(0), latencyCount(0) {};
+
+		void add(const DkSyncStats& other);
+
+		int sent;			// messages written to the socket
+		int coalesced;		// messages replaced by a newer one before sending
+		int received;		// messages read from the socket
+		int dropped;		// received messages that were superseded before they were processed
+		qint64 latencySum;	// ms from sending a transform to processing it
+		int latencyCount;
+};
 
 class DkConnection : public QTcpSocket {
 	Q_OBJECT;
@@ -64,6 +89,7 @@ class DkConnection : public QTcpSocket {
 		quint16 getPeerId() {return peerId;};
 		void setPeerId(quint16 peerId) { this->peerId = peerId;};
 		void setTitle(QString newTitle);
+		DkSyncStats takeSyncStats();
 
 		bool connectionCreated;
 
@@ -88,6 +114,7 @@ class DkConnection : public QTcpSocket {
 		virtual void sendNewFileMessage(qint16 op , QString filename);
 		void sendNewGoodbyeMessage();
 		void synchronizedPeersListChanged(QList<quint16> newList);
+		void flushSyncMessages();
 
 
 	protected:
@@ -118,6 +145,32 @@ class DkConnection : public QTcpSocket {
 		bool hasEnoughData();
 		int dataLengthForCurrentDataType();
 		virtual bool allowedToSynchronize() {return true;};
+		void scheduleSyncMessages();
+		void writeNewTransformMessage(QTransform transform, QTransform imgTransform, QPointF canvasSize);
+		void writeNewPositionMessage(QRect position, bool opacity, bool overlaid);
+		void writeNewFileMessage(qint16 op, QString filename);
+
+		/**
+		 * The latest transform, position and file of a connection.
+		 * Newer messages replace older ones that were not yet sent (or processed).
+		 **/
+		struct SyncMessages {
+			SyncMessages() : hasTransform(false), hasPosition(false), opacity(false), overlaid(false), hasFile(false), fileOp(0) {};
+
+			bool hasTransform;
+			QTransform transform;
+			QTransform imgTransform;
+			QPointF canvasSize;
+
+			bool hasPosition;
+			QRect position;
+			bool opacity;
+			bool overlaid;
+
+			bool hasFile;
+			qint16 fileOp;
+			QString filename;
+		};
 
 		ConnectionState state; 
 		DataType currentDataType; 
@@ -134,10 +187,17 @@ class DkConnection : public QTcpSocket {
 
 	private slots:
 		void synchronizedTimerTimeout();
+		void emitReceivedSyncMessages();
 
 	private:
 
 		QTimer* synchronizedTimer;
+		QTimer* syncTimer;
+		QTime lastSync;
+		SyncMessages sendQueue;
+		SyncMessages receiveQueue;
+		bool receivePending;
+		DkSyncStats syncStats;
 		QList<quint16> synchronizedPeersServerPorts;
 		quint16 peerId;
 };
@@ -198,6 +258,10 @@ class DkLANConnection : public DkConnection {
 
 	protected slots:
 		void processReadyRead();
+		void proxyEncoded();
+		void imageEncoded();
+		void imageDecoded();
+		void sendNextImageChunk();
 
 	public slots:
 		void sendNewImageMessage(QImage image, QString title);
@@ -218,8 +282,33 @@ class DkLANConnection : public DkConnection {
 			upcomingImage = 9,
 			newImage,
 			switchServer,
+			imageBegin,
+			imageChunk,
+			imageCancel,
 			Undefined
 		};
+
+		struct ImageTransfer {
+			ImageTransfer() : id(0), isProxy(false), size(0) {};
+
+			quint32 id;
+			bool isProxy;
+			QString title;
+			int size;
+			QByteArray data;
+			QImage image;
+		};
+
+		void startImageTransfer(const ImageTransfer& transfer);
+		void sendLegacyImageMessage(const ImageTransfer& transfer);
+		void sendImageCancelMessage(quint32 transferId);
+		void readImageBegin();
+		void readImageChunk();
+		void readImageCancel();
+		void startImageDecoding(const ImageTransfer& transfer);
+		static ImageTransfer encodeImage(QImage image, ImageTransfer transfer);
+		static ImageTransfer decodeImage(ImageTransfer transfer);
+
 		LANDataType currentLanDataType;
 		bool allowTransformation;
 		bool allowPosition;
@@ -231,6 +320,26 @@ class DkLANConnection : public DkConnection {
 		QString clientName;
 		bool showInMenu;
 		bool iAmServer;
+
+		// sending images
+		quint16 peerImageProtocol;
+		quint32 sendTransferId;
+		quint32 fullTransferId;		// id of the last full resolution image that was streamed
+		int sendOffset;
+		ImageTransfer sendTransfer;
+		ImageTransfer queuedTransfer;
+		QFutureWatcher<ImageTransfer> proxyWatcher;
+		QFutureWatcher<ImageTransfer> fullWatcher;
+		QTime sendTime;
+
+		// receiving images
+		ImageTransfer recvTransfer;
+		ImageTransfer pendingDecode;
+		bool decodePending;
+		quint32 shownTransferId;
+		bool shownFull;
+		QFutureWatcher<ImageTransfer> decodeWatcher;
+		QTime recvTime;
 };
 
 
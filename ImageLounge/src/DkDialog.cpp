@@ -74,6 +74,7 @@
 #include <QProgressBar>
 #include <QFuture>
 #include <QtConcurrentRun>
+#include <QtConcurrentMap>
 #include <QMouseEvent>
 #include <QAction>
 #include <QMessageBox>
@@ -83,9 +84,17 @@
 #include <qmath.h>
 #include <QDesktopServices>
 #include <QSplashScreen>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QCoreApplication>
+#include <QThread>
+#include <QSet>
+#include <QScrollBar>
 
 #if QT_VERSION >= 0x050000
 #include <QKeySequenceEdit>
+#include <QStandardPaths>
 #endif
 
 // quazip
@@ -95,6 +104,8 @@
 
 #pragma warning(pop)		// no warnings from includes - end
 
+#include <algorithm>
+
 namespace nmc {
 
 // DkSplashScreen --------------------------------------------------------------------
@@ -2894,6 +2905,9 @@ DkExportTiffDialog::DkExportTiffDialog(QWidget* parent /* = 0 */, Qt::WindowFlag
 
 	connect(this, SIGNAL(updateImage(QImage)), viewport, SLOT(setImage(QImage)));
 	connect(&watcher, SIGNAL(finished()), this, SLOT(processingFinished()));
+	connect(&thumbWatcher, SIGNAL(resultReadyAt(int)), this, SLOT(thumbLoaded(int)));
+	connect(&thumbWatcher, SIGNAL(finished()), this, SLOT(loadVisibleThumbs()));
+	connect(pageStrip->horizontalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(loadVisibleThumbs()));
 	connect(this, SIGNAL(infoMessage(QString)), msgLabel, SLOT(setText(QString)));
 	connect(this, SIGNAL(updateProgress(int)), progress, SLOT(setValue(int)));
 	QMetaObject::connectSlotsByName(this);
@@ -3000,6 +3014,18 @@ void DkExportTiffDialog::createLayout() {
 	viewport->setForceFastRendering(true);
 	viewport->setPanControl(QPointF(0.0f, 0.0f));
 
+	// page strip (filled from the TIFF index)
+	pageStrip = new QListWidget(this);
+	pageStrip->setObjectName("pageStrip");
+	pageStrip->setViewMode(QListView::IconMode);
+	pageStrip->setFlow(QListView::LeftToRight);
+	pageStrip->setWrapping(false);
+	pageStrip->setMovement(QListView::Static);
+	pageStrip->setUniformItemSizes(true);
+	pageStrip->setIconSize(QSize(DkSettings::display.thumbSize, DkSettings::display.thumbSize));
+	pageStrip->setFixedHeight(DkSettings::display.thumbSize + 3*fontMetrics().height());
+	pageStrip->hide();
+
 	// buttons
 	buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, Qt::Horizontal, this);
 	buttons->button(QDialogButtonBox::Ok)->setText(tr("&Export"));
@@ -3009,6 +3035,7 @@ void DkExportTiffDialog::createLayout() {
 
 	QVBoxLayout* layout = new QVBoxLayout(this);
 	layout->addWidget(viewport);
+	layout->addWidget(pageStrip);
 	layout->addWidget(progress);
 	layout->addWidget(msgLabel);
 	layout->addWidget(controlWidget);
@@ -3103,13 +3130,12 @@ int DkExportTiffDialog::exportImages(QFileInfo file, QFileInfo saveFile, int fro
 
 	processing = true;
 
-	// Do your job
+	QVector<DkTiffIndex::Page> tiffPages = DkTiffIndex::instance().pages(file);
+	QVector<ExportJob> jobs;
+
 	for (int idx = from; idx <= to; idx++) {
 
 		QFileInfo sFile(saveFile.absolutePath(), saveFile.baseName() + QString::number(idx) + "." + saveFile.suffix());
-		qDebug() << "trying to save: " << sFile.absoluteFilePath();
-
-		emit updateProgress(idx-1);
 
 		// user wants to overwrite files
 		if (sFile.exists() && overwrite) {
@@ -3121,19 +3147,47 @@ int DkExportTiffDialog::exportImages(QFileInfo file, QFileInfo saveFile, int fro
 			continue;
 		}
 
-		if (!loader.loadPageAt(idx)) {	// load next
+		if (idx > tiffPages.size()) {
 			emit infoMessage(tr("Sorry, I could not load page: %1").arg(idx));
 			continue;
 		}
 
-		QFileInfo saveFile = loader.save(sFile, loader.image(), 90);		//TODO: ask user for compression?
-		saveFile.refresh();
+		ExportJob job;
+		job.tiffFile = file;
+		job.saveFile = sFile;
+		job.page = tiffPages.at(idx-1);
+		job.pageIdx = idx;
+		job.status = page_not_loaded;
+		jobs.append(job);
+	}
+
+	int numDone = (to-from+1) - jobs.size();
+	emit updateProgress(from-1+numDone);
+
+	// pages are decoded and encoded in parallel - a batch per round keeps the memory low
+	int batchSize = qMax(QThread::idealThreadCount(), 1);
+
+	for (int idx = 0; idx < jobs.size(); idx += batchSize) {
+
+		int lastIdx = qMin(idx + batchSize, jobs.size());
+		QtConcurrent::blockingMap(jobs.begin()+idx, jobs.begin()+lastIdx, &nmc::DkExportTiffDialog::exportPage);
+
+		for (int jIdx = idx; jIdx < lastIdx; jIdx++) {
+
+			if (jobs[jIdx].status == page_not_loaded)
+				emit infoMessage(tr("Sorry, I could not load page: %1").arg(jobs[jIdx].pageIdx));
+			else if (jobs[jIdx].status == page_not_saved)
+				emit infoMessage(tr("Sorry, I could not save: %1").arg(jobs[jIdx].saveFile.fileName()));
+		}
+
+		if (!jobs[lastIdx-1].img.isNull())
+			emit updateImage(jobs[lastIdx-1].img);
 
-		if (!saveFile.exists() || !saveFile.isFile())
-			emit infoMessage(tr("Sorry, I could not save: %1").arg(sFile.fileName()));
+		for (int jIdx = idx; jIdx < lastIdx; jIdx++)
+			jobs[jIdx].img = QImage();
 
-		emit updateImage(loader.image());
-		emit updateProgress(idx);
+		numDone += lastIdx-idx;
+		emit updateProgress(from-1+numDone);
 
 		// user canceled?
 		if (!processing)
@@ -3145,6 +3199,34 @@ int DkExportTiffDialog::exportImages(QFileInfo file, QFileInfo saveFile, int fro
 	return QDialog::Accepted;
 }
 
+/**
+ * Loads and saves a single page (called in parallel).
+ **/
+void DkExportTiffDialog::exportPage(ExportJob& job) {
+
+	qDebug() << "trying to save: " << job.saveFile.absoluteFilePath();
+
+	QImage img;
+
+	if (!DkBasicLoader::loadTiffPage(job.tiffFile, job.page, img)) {
+		job.status = page_not_loaded;
+		return;
+	}
+
+	DkBasicLoader pageLoader;
+
+	// the pages get the metadata of the TIFF
+	try {
+		pageLoader.getMetaData()->readMetaData(job.tiffFile);
+	} catch(...) {}	// ignore if we cannot read the metadata
+
+	QFileInfo savedFile = pageLoader.save(job.saveFile, img, 90);		//TODO: ask user for compression?
+	savedFile.refresh();
+
+	job.status = (savedFile.exists() && savedFile.isFile()) ? page_saved : page_not_saved;
+	job.img = img;
+}
+
 void DkExportTiffDialog::setFile(const QFileInfo& file) {
 	
 	if (!file.exists())
@@ -3166,12 +3248,103 @@ void DkExportTiffDialog::setFile(const QFileInfo& file) {
 
 	fromPage->setValue(1);
 	toPage->setValue(loader.getNumPages());
+
+	updatePageStrip();
+}
+
+/**
+ * Fills the page strip with the pages of the index.
+ * Thumbnails are just loaded for visible pages.
+ **/
+void DkExportTiffDialog::updatePageStrip() {
+
+	thumbWatcher.cancel();
+	thumbWatcher.waitForFinished();
+	thumbRows.clear();
+
+	pages = loader.getTiffPages();
+	thumbsRequested = QVector<bool>(pages.size(), false);
+
+	int thumbSize = pageStrip->iconSize().width();
+
+	pageStrip->clear();
+
+	for (int idx = 0; idx < pages.size(); idx++) {
+
+		QListWidgetItem* item = new QListWidgetItem(QString::number(idx+1), pageStrip);
+		item->setToolTip(tr("Page %1 (%2 x %3)").arg(idx+1).arg(pages[idx].width).arg(pages[idx].height));
+		item->setSizeHint(QSize(thumbSize+8, thumbSize+2*fontMetrics().height()));
+	}
+
+	pageStrip->setVisible(pages.size() > 1);
+
+	// wait for the layout
+	QTimer::singleShot(0, this, SLOT(loadVisibleThumbs()));
+}
+
+void DkExportTiffDialog::loadVisibleThumbs() {
+
+	// we are called again if the current thumbs are loaded
+	if (thumbWatcher.isRunning() || pageStrip->isHidden())
+		return;
+
+	QList<ThumbJob> jobs;
+	thumbRows.clear();
+
+	for (int idx = 0; idx < pageStrip->count() && idx < pages.size(); idx++) {
+
+		if (thumbsRequested[idx] || !pageStrip->visualItemRect(pageStrip->item(idx)).intersects(pageStrip->viewport()->rect()))
+			continue;
+
+		ThumbJob job;
+		job.tiffFile = cFile;
+		job.page = pages[idx];
+		job.thumbSize = pageStrip->iconSize().width();
+		jobs.append(job);
+
+		thumbsRequested[idx] = true;
+		thumbRows.append(idx);
+	}
+
+	if (!jobs.empty())
+		thumbWatcher.setFuture(QtConcurrent::mapped(jobs, &nmc::DkExportTiffDialog::loadThumb));
+}
+
+void DkExportTiffDialog::thumbLoaded(int idx) {
+
+	if (idx >= thumbRows.size() || thumbRows[idx] >= pageStrip->count())
+		return;
+
+	QImage thumb = thumbWatcher.resultAt(idx);
+
+	if (!thumb.isNull())
+		pageStrip->item(thumbRows[idx])->setIcon(QPixmap::fromImage(thumb));
+}
+
+QImage DkExportTiffDialog::loadThumb(const ThumbJob& job) {
+
+	QImage img;
+
+	if (!DkBasicLoader::loadTiffPage(job.tiffFile, job.page, img))
+		return QImage();
+
+	return img.scaled(job.thumbSize, job.thumbSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+}
+
+void DkExportTiffDialog::on_pageStrip_currentRowChanged(int row) {
+
+	if (row < 0 || processing)
+		return;
+
+	if (loader.loadPageAt(row+1))
+		viewport->setImage(loader.image());
 }
 
 void DkExportTiffDialog::enableAll(bool enable) {
 
 	enableTIFFSave(enable);
 	controlWidget->setEnabled(enable);
+	pageStrip->setEnabled(enable);
 }
 
 void DkExportTiffDialog::enableTIFFSave(bool enable) {
@@ -3366,6 +3539,371 @@ void DkUnsharpDialog::setFile(const QFileInfo& file) {
 	setImage(loader.image());
 }
 
+// DkMosaicDatabase --------------------------------------------------------------------
+DkMosaicDatabase::DkMosaicDatabase() {
+
+	dirty = false;
+}
+
+/**
+ * Loads the database of a folder.
+ * @param folder the tile folder
+ **/
+void DkMosaicDatabase::setFolder(const QDir& folder) {
+
+	if (this->folder == folder && !tiles.empty())
+		return;
+
+	this->folder = folder;
+	tiles.clear();
+	tileIdx.clear();
+	dirty = false;
+
+	QFile dbFile(dbFilePath());
+
+	if (!dbFile.open(QIODevice::ReadOnly))
+		return;
+
+	DkTimer dt;
+	QDataStream ds(&dbFile);
+	quint32 magic, version;
+	qint32 numTiles;
+	ds >> magic >> version;
+
+	// unknown format? -> start from scratch
+	if (magic != 0x6e6d4d64 || version != 1)
+		return;
+
+	ds >> numTiles;
+	tiles.reserve(numTiles);
+
+	for (int idx = 0; idx < numTiles && ds.status() == QDataStream::Ok; idx++) {
+
+		Tile tile;
+		ds >> tile.filePath >> tile.modified >> tile.fileSize >> tile.valid;
+		ds.readRawData((char*)tile.desc, desc_length);
+
+		tileIdx.insert(tile.filePath, tiles.size());
+		tiles.append(tile);
+	}
+
+	qDebug() << "[DkMosaicDatabase]" << tiles.size() << "tiles loaded in" << dt.getTotal();
+}
+
+/**
+ * Synchronizes the database with the files of the folder.
+ * Tiles of files that do not exist anymore are removed.
+ * @param files all image files of the folder
+ * @return the tiles that need to be computed (new or modified files)
+ **/
+QVector<DkMosaicDatabase::Tile> DkMosaicDatabase::update(const QFileInfoList& files) {
+
+	QVector<Tile> newTiles;
+	QVector<Tile> oldTiles = tiles;
+	QHash<QString, int> oldIdx = tileIdx;
+
+	tiles.clear();
+	tileIdx.clear();
+
+	for (int idx = 0; idx < files.size(); idx++) {
+
+		const QFileInfo& file = files.at(idx);
+		QString filePath = file.absoluteFilePath();
+		qint64 modified = file.lastModified().toMSecsSinceEpoch();
+
+		int oIdx = oldIdx.value(filePath, -1);
+
+		if (oIdx != -1 && oldTiles[oIdx].modified == modified && oldTiles[oIdx].fileSize == file.size()) {
+			tileIdx.insert(filePath, tiles.size());
+			tiles.append(oldTiles[oIdx]);
+			continue;
+		}
+
+		Tile tile;
+		tile.filePath = filePath;
+		tile.modified = modified;
+		tile.fileSize = file.size();
+		tile.valid = false;
+		memset(tile.desc, 0, desc_length);
+		newTiles.append(tile);
+	}
+
+	if (tiles.size() != oldTiles.size())
+		dirty = true;
+
+	return newTiles;
+}
+
+void DkMosaicDatabase::insert(const QVector<Tile>& newTiles) {
+
+	// invalid tiles are kept too - so that we do not try to load them again
+	for (int idx = 0; idx < newTiles.size(); idx++) {
+		tileIdx.insert(newTiles[idx].filePath, tiles.size());
+		tiles.append(newTiles[idx]);
+	}
+
+	if (!newTiles.empty())
+		dirty = true;
+}
+
+void DkMosaicDatabase::save() const {
+
+	if (!dirty)
+		return;
+
+	QDir dir = QFileInfo(dbFilePath()).absoluteDir();
+
+	if (!dir.exists() && !dir.mkpath(dir.absolutePath())) {
+		qDebug() << "[DkMosaicDatabase] could not create: " << dir.absolutePath();
+		return;
+	}
+
+	QFile dbFile(dbFilePath());
+
+	if (!dbFile.open(QIODevice::WriteOnly)) {
+		qDebug() << "[DkMosaicDatabase] could not write: " << dbFile.fileName();
+		return;
+	}
+
+	QDataStream ds(&dbFile);
+	ds << (quint32)0x6e6d4d64 << (quint32)1;
+	ds << (qint32)tiles.size();
+
+	for (int idx = 0; idx < tiles.size(); idx++) {
+		const Tile& tile = tiles[idx];
+		ds << tile.filePath << tile.modified << tile.fileSize << tile.valid;
+		ds.writeRawData((const char*)tile.desc, desc_length);
+	}
+
+	const_cast<DkMosaicDatabase*>(this)->dirty = false;
+}
+
+const QVector<DkMosaicDatabase::Tile>& DkMosaicDatabase::getTiles() const {
+
+	return tiles;
+}
+
+int DkMosaicDatabase::find(const QString& filePath) const {
+
+	return tileIdx.value(filePath, -1);
+}
+
+/**
+ * Returns the database file of the current folder.
+ * Portable versions keep it next to the executable.
+ **/
+QString DkMosaicDatabase::dbFilePath() const {
+
+	QString dbName = QCryptographicHash::hash(folder.absolutePath().toUtf8(), QCryptographicHash::Md5).toHex() + ".db";
+
+	if (DkSettings::isPortable())
+		return QCoreApplication::applicationDirPath() + "/mosaic/" + dbName;
+
+#if QT_VERSION >= 0x050000
+	return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/mosaic/" + dbName;
+#else
+	return QDesktopServices::storageLocation(QDesktopServices::CacheLocation) + "/mosaic/" + dbName;
+#endif
+}
+
+/**
+ * Computes the descriptor of a tile (called in parallel).
+ * The thumbnail is sufficient for the descriptor.
+ * @param tile the tile whose file is loaded
+ **/
+void DkMosaicDatabase::computeTile(Tile& tile) {
+
+	tile.valid = false;
+
+	try {
+		DkThumbNail thumb = DkThumbNail(QFileInfo(tile.filePath));
+		thumb.compute();
+
+		if (thumb.hasImage() != DkThumbNail::loaded)
+			return;
+
+		cv::Mat patch = createPatch(thumb.getImage(), desc_size);
+		computeDescriptor(patch, tile.desc);
+		tile.valid = true;
+	}
+	// catch cv exceptions e.g. out of memory
+	catch(...) {
+		tile.valid = false;
+	}
+}
+
+/**
+ * Computes the descriptor of a square luminance patch.
+ * @param imgL a square CV_8UC1 patch
+ * @param desc the descriptor (desc_length values)
+ **/
+void DkMosaicDatabase::computeDescriptor(const cv::Mat& imgL, unsigned char* desc) {
+
+	cv::Mat small = imgL;
+	
+	if (imgL.rows != desc_size || imgL.cols != desc_size)
+		cv::resize(imgL, small, cv::Size(desc_size, desc_size), 0.0, 0.0, CV_INTER_AREA);
+
+	for (int rIdx = 0; rIdx < desc_size; rIdx++) {
+		const unsigned char* sPtr = small.ptr<unsigned char>(rIdx);
+		for (int cIdx = 0; cIdx < desc_size; cIdx++)
+			desc[rIdx*desc_size+cIdx] = sPtr[cIdx];
+	}
+}
+
+/**
+ * Creates the luminance patch of an image.
+ * The center square of the image is resized to patchRes x patchRes.
+ * @param img the image
+ * @param patchRes the patch size
+ * @return the CV_8UC1 L channel (Lab) of the patch
+ **/
+cv::Mat DkMosaicDatabase::createPatch(const QImage& img, int patchRes) {
+
+	cv::Mat cvThumb = DkImage::qImage2Mat(img);
+	cv::cvtColor(cvThumb, cvThumb, CV_RGB2Lab);
+	std::vector<cv::Mat> channels;
+	cv::split(cvThumb, channels);
+	cvThumb = channels[0];
+	channels.clear();
+
+	// make square
+	if (cvThumb.rows != cvThumb.cols) {
+
+		if (cvThumb.rows > cvThumb.cols) {
+			float sh = (cvThumb.rows - cvThumb.cols)/2.0f;
+			cvThumb = cvThumb.rowRange(qFloor(sh), cvThumb.rows-qCeil(sh));
+		}
+		else {
+			float sh = (cvThumb.cols - cvThumb.rows)/2.0f;
+			cvThumb = cvThumb.colRange(qFloor(sh), cvThumb.cols-qCeil(sh));
+		}
+	}
+
+	if (cvThumb.rows < patchRes || cvThumb.cols < patchRes)
+		qDebug() << "enlarging thumbs!!";
+
+	cv::resize(cvThumb, cvThumb, cv::Size(patchRes, patchRes), 0.0, 0.0, CV_INTER_AREA);
+
+	return cvThumb;
+}
+
+// DkMosaicIndex --------------------------------------------------------------------
+/**
+ * Builds the k-d tree.
+ * @param tiles all tiles of the database
+ * @param tileIdxs the tiles that are indexed
+ **/
+DkMosaicIndex::DkMosaicIndex(const QVector<DkMosaicDatabase::Tile>& tiles, const QVector<int>& tileIdxs) : tiles(tiles) {
+
+	ids = tileIdxs;
+	nodes.reserve(ids.size());
+	root = build(0, ids.size());
+}
+
+int DkMosaicIndex::size() const {
+
+	return ids.size();
+}
+
+int DkMosaicIndex::build(int from, int to) {
+
+	if (from >= to)
+		return -1;
+
+	// split the dimension with the largest spread
+	int dim = 0;
+	int maxSpread = -1;
+
+	for (int d = 0; d < DkMosaicDatabase::desc_length; d++) {
+
+		int minV = 255, maxV = 0;
+		for (int idx = from; idx < to; idx++) {
+			int v = tiles[ids[idx]].desc[d];
+			minV = qMin(minV, v);
+			maxV = qMax(maxV, v);
+		}
+
+		if (maxV - minV > maxSpread) {
+			maxSpread = maxV - minV;
+			dim = d;
+		}
+	}
+
+	int mid = (from + to)/2;
+	std::nth_element(ids.begin()+from, ids.begin()+mid, ids.begin()+to, DescCompare(tiles, dim));
+
+	Node node;
+	node.tileIdx = ids[mid];
+	node.dim = dim;
+	nodes.append(node);
+	int nodeIdx = nodes.size()-1;
+
+	int left = build(from, mid);
+	int right = build(mid+1, to);
+	nodes[nodeIdx].left = left;
+	nodes[nodeIdx].right = right;
+
+	return nodeIdx;
+}
+
+/**
+ * Returns the k nearest tiles of a descriptor.
+ * @param desc the query descriptor
+ * @param k the number of neighbours
+ * @return the matches sorted by distance
+ **/
+QVector<DkMosaicIndex::Match> DkMosaicIndex::knn(const unsigned char* desc, int k) const {
+
+	QVector<Match> matches;
+	matches.reserve(k+1);
+
+	if (root != -1 && k > 0)
+		search(root, desc, k, matches);
+
+	return matches;
+}
+
+void DkMosaicIndex::search(int nodeIdx, const unsigned char* desc, int k, QVector<Match>& matches) const {
+
+	const Node& node = nodes[nodeIdx];
+
+	Match m;
+	m.tileIdx = node.tileIdx;
+	m.dist = distance(desc, node.tileIdx);
+
+	// keep the k best matches sorted
+	if (matches.size() < k || m.dist < matches.last().dist) {
+		matches.insert(std::upper_bound(matches.begin(), matches.end(), m), m);
+		if (matches.size() > k)
+			matches.pop_back();
+	}
+
+	int diff = (int)desc[node.dim] - (int)tiles[node.tileIdx].desc[node.dim];
+	int nearChild = (diff < 0) ? node.left : node.right;
+	int farChild = (diff < 0) ? node.right : node.left;
+
+	if (nearChild != -1)
+		search(nearChild, desc, k, matches);
+
+	// can the other side contain closer tiles?
+	if (farChild != -1 && (matches.size() < k || diff*diff < matches.last().dist))
+		search(farChild, desc, k, matches);
+}
+
+int DkMosaicIndex::distance(const unsigned char* desc, int tileIdx) const {
+
+	const unsigned char* tDesc = tiles[tileIdx].desc;
+	int dist = 0;
+
+	for (int idx = 0; idx < DkMosaicDatabase::desc_length; idx++) {
+		int d = (int)desc[idx] - (int)tDesc[idx];
+		dist += d*d;
+	}
+
+	return dist;
+}
+
 // DkMosaicDialog --------------------------------------------------------------------
 DkMosaicDialog::DkMosaicDialog(QWidget* parent /* = 0 */, Qt::WindowFlags f /* = 0 */) : QDialog(parent, f) {
 
@@ -3830,13 +4368,6 @@ int DkMosaicDialog::computeMosaic(QFileInfo file, QString filter, QString suffix
 	cv::split(mImgLab, channels);
 	cv::Mat imgL = channels[0];
 
-	// keeps track of the weights
-	cv::Mat cc(numPatches.height(), numPatches.width(), CV_32FC1);
-	cc.setTo(0);
-	cv::Mat ccD(numPatches.height(), numPatches.width(), CV_8UC1);	// tells us if we have already computed the real patch
-
-	filesUsed.resize(numPatches.height()*numPatches.width());
-
 	// destination image
 	cv::Mat dImg(patchResD*numPatches.height(), patchResD*numPatches.width(), CV_8UC1);
 	dImg = 255;
@@ -3851,172 +4382,105 @@ int DkMosaicDialog::computeMosaic(QFileInfo file, QString filter, QString suffix
 	qDebug() << "num patches: " << numPatches.width() << " x " << numPatches.height();
 	qDebug() << "mosaic data --------------------------------";
 
-	// progress bar
-	int pIdx = 0;
-	int maxP = numPatches.width()*numPatches.height();
+	// the database contains all images of the folder - filters are applied when the tiles are selected
+	QSet<QString> visited;
+	QFileInfoList files = scanFolder(saveDir, DkSettings::app.fileFilters, visited);
 
-	int iDidNothing = 0;
-	bool force = false;
-	bool useTwice = false;
-
-	//for (int idx = 0; idx < 10; idx++) {
-	while (iDidNothing < 10000) {
-
-		if (!processing)
-			return QDialog::Rejected;
+	if (!updateDatabase(files)) {
+		processing = false;
+		return QDialog::Rejected;
+	}
 
-		if (iDidNothing > 100) {
-			force = true;
+	qDebug() << "database updated in: " << dt.getIvl();
 
-			if (!useTwice)
-				emit infoMessage(tr("Filling empty areas..."));
-		}
+	QStringList ignoreList = (filter.isEmpty()) ? QStringList() : filter.split(";");
+	QVector<int> tileIdxs;
 
-		if (iDidNothing > 400 && !useTwice) {
-			emit infoMessage(tr("I need to use some images twice - maybe the database is too small?"));
-			iDidNothing = 0;
-			useTwice = true;
-		}
-		else if (iDidNothing > 400) {
-			emit infoMessage(tr("Sorry, it seems that i cannot create your mosaic with this database."));
-			return QDialog::Rejected;
-		}
+	for (int idx = 0; idx < files.size(); idx++) {
 
-		QString imgPath = getRandomImagePath(saveDir.absolutePath(), filter, suffix);
+		QString filePath = files.at(idx).absoluteFilePath();
 
-		if (!useTwice && filesUsed.contains(QFileInfo(imgPath))) {
-			iDidNothing++;
+		if (!suffix.isEmpty() && !QDir::match(suffix, files.at(idx).fileName()))
 			continue;
-		}
 
-		try {
-
-			DkThumbNail thumb = DkThumbNail(QFileInfo(imgPath));
-			thumb.setMinThumbSize(patchResO);
-			thumb.setRescale(false);
-			thumb.compute();
-
-			if (!thumb.hasImage()) {
-				iDidNothing++;
-				continue;
-			}
-
-			cv::Mat ccTmp(cc.size(), cc.depth());
-		
-			if (!force)
-				ccTmp.setTo(0);
-			else
-				ccTmp = cc.clone();
-
-			cv::Mat thumbPatch = createPatch(thumb, patchResO);
-		
-			if (thumbPatch.rows != patchResO || thumbPatch.cols != patchResO) {
-				iDidNothing++;
-				continue;
-			}
-		
-			matchPatch(imgL, thumbPatch, patchResO, ccTmp);
-
-			if (force) {
-				cv::Mat mask = (cc == 0);
-				mask.convertTo(mask, CV_32FC1, 1.0f/255.0f);
-				ccTmp = ccTmp.mul(mask);
+		bool ignore = false;
+		for (int iIdx = 0; iIdx < ignoreList.size(); iIdx++) {
+			if (filePath.contains(ignoreList.at(iIdx))) {
+				ignore = true;
+				break;
 			}
-				
-			double maxVal = 0;
-			cv::Point maxIdx;
-			cv::minMaxLoc(ccTmp, 0, &maxVal, 0, &maxIdx);
-			float* ccPtr = cc.ptr<float>(maxIdx.y);
+		}
 
-			if (maxVal > ccPtr[maxIdx.x]) {
+		int tIdx = database.find(filePath);
 
-				cv::Mat pPatch = pImg.rowRange(maxIdx.y*patchResO, maxIdx.y*patchResO+patchResO)
-					.colRange(maxIdx.x*patchResO, maxIdx.x*patchResO+patchResO);
-				thumbPatch.copyTo(pPatch);
-			
-				// visualize
-				if (pIdx % 10 == 0) {
-				
-					channels[0] = pImg;
-				
-					//debug
-					cv::Mat imgT3;
-					cv::merge(channels, imgT3);
-					cv::cvtColor(imgT3, imgT3, CV_Lab2BGR);
-					emit updateImage(DkImage::mat2QImage(imgT3));
-				}
-
-				if (ccPtr[maxIdx.x] == 0) {
-					pIdx++;
-					emit updateProgress(qRound((float)pIdx/maxP*100));
-				}
+		if (!ignore && tIdx != -1 && database.getTiles().at(tIdx).valid)
+			tileIdxs.append(tIdx);
+	}
 
-				// compute it now if we already have the full image loaded
-				if (thumb.getImage().width() > patchResD && thumb.getImage().height() > patchResD) {
-					thumbPatch = createPatch(thumb, patchResD);
+	if (tileIdxs.empty()) {
+		emit infoMessage(tr("Sorry, it seems that i cannot create your mosaic with this database."));
+		processing = false;
+		return QDialog::Rejected;
+	}
 
-					cv::Mat dPatch = dImg.rowRange(maxIdx.y*patchResD, maxIdx.y*patchResD+patchResD)
-						.colRange(maxIdx.x*patchResD, maxIdx.x*patchResD+patchResD);
-					thumbPatch.copyTo(dPatch);
-					ccD.ptr<unsigned char>(maxIdx.y)[maxIdx.x] = 1;
-				}
-				else
-					ccD.ptr<unsigned char>(maxIdx.y)[maxIdx.x] = 0;
+	// describe the patches of the image like the tiles
+	int numP = numPatches.width()*numPatches.height();
+	cv::Mat queryDescs(numP, DkMosaicDatabase::desc_length, CV_8UC1);
 
-				// update cc
-				ccPtr[maxIdx.x] = (float)maxVal;
+	for (int rIdx = 0; rIdx < numPatches.height(); rIdx++) {
+		for (int cIdx = 0; cIdx < numPatches.width(); cIdx++) {
 
-				filesUsed[maxIdx.y*numPatchesH+maxIdx.x] = thumb.getFile();	// replaces additionally the old file
-				iDidNothing = 0;
-			}
-			else
-				iDidNothing++;
-		} 
-		// catch cv exceptions e.g. out of memory
-		catch(...) {
-			iDidNothing++;
+			cv::Mat cPatch = imgL.rowRange(rIdx*patchResO, rIdx*patchResO+patchResO).colRange(cIdx*patchResO, cIdx*patchResO+patchResO);
+			DkMosaicDatabase::computeDescriptor(cPatch, queryDescs.ptr<unsigned char>(rIdx*numPatches.width()+cIdx));
 		}
+	}
 
-		// are we done yet?
-		double minVal = 0;
-		cv::minMaxLoc(cc, &minVal);
+	bool useTwice = false;
+	DkMosaicIndex index(database.getTiles(), tileIdxs);
+	QVector<int> assignment = assignTiles(index, queryDescs, useTwice);
 
-		if (minVal > 0)
-			break;
-		
-	}
+	if (useTwice)
+		emit infoMessage(tr("I need to use some images twice - maybe the database is too small?"));
 
-	pIdx = 0;
+	qDebug() << numP << "patches matched against" << index.size() << "tiles in: " << dt.getIvl();
 
-	// compute real resolution
-	for (int rIdx = 0; rIdx < ccD.rows; rIdx++) {
+	// just the chosen tiles are loaded
+	QVector<TileJob> jobs;
+	filesUsed.resize(numP);
 
-		const unsigned char* ccDPtr = ccD.ptr<unsigned char>(rIdx);
+	for (int pIdx = 0; pIdx < numP; pIdx++) {
 
-		for (int cIdx = 0; cIdx < ccD.cols; cIdx++) {
+		TileJob job;
+		job.filePath = database.getTiles().at(assignment[pIdx]).filePath;
+		job.row = pIdx / numPatches.width();
+		job.col = pIdx % numPatches.width();
+		job.patchResO = patchResO;
+		job.patchResD = patchResD;
+		job.pImg = &pImg;
+		job.dImg = &dImg;
+		jobs.append(job);
 
-			// is the patch already computed?
-			if (ccDPtr[cIdx])
-				continue;
+		filesUsed[pIdx] = QFileInfo(job.filePath);
+	}
 
-			QFileInfo cFile = filesUsed.at(rIdx*ccD.cols+cIdx);
+	int batchSize = qMax(QThread::idealThreadCount()*4, 16);
 
-			if (!cFile.exists()) {
-				emit infoMessage(tr("Something is seriously wrong, I could not load: %1").arg(cFile.absoluteFilePath()));
-				continue;
-			}
+	for (int idx = 0; idx < jobs.size(); idx += batchSize) {
 
-			cv::Mat thumbPatch = createPatch(DkThumbNail(cFile), patchResD);
+		if (!processing)
+			return QDialog::Rejected;
 
-			cv::Mat dPatch = dImg.rowRange(rIdx*patchResD, rIdx*patchResD+patchResD)
-				.colRange(cIdx*patchResD, cIdx*patchResD+patchResD);
-			thumbPatch.copyTo(dPatch);
-			emit updateProgress(qRound((float)pIdx/maxP*100));
-			pIdx++;
-		}
-	}
+		int lastIdx = qMin(idx + batchSize, jobs.size());
+		QtConcurrent::blockingMap(jobs.begin()+idx, jobs.begin()+lastIdx, &nmc::DkMosaicDialog::renderTile);
+		emit updateProgress(qRound((float)lastIdx/numP*100));
 
-	qDebug() << "I fully rendered: " << ccD.rows*ccD.cols-cv::sum(ccD)[0] << " images";
+		// visualize
+		channels[0] = pImg;
+		cv::Mat imgT3;
+		cv::merge(channels, imgT3);
+		cv::cvtColor(imgT3, imgT3, CV_Lab2BGR);
+		emit updateImage(DkImage::mat2QImage(imgT3));
+	}
 
 	// create final images
 	origImg = mImgLab;
@@ -4030,120 +4494,209 @@ int DkMosaicDialog::computeMosaic(QFileInfo file, QString filter, QString suffix
 	return QDialog::Accepted;
 }
 
-void DkMosaicDialog::matchPatch(const cv::Mat& img, const cv::Mat& thumb, int patchRes, cv::Mat& cc) {
+/**
+ * Returns all images of a folder and its sub folders.
+ * @param dir the folder
+ * @param fileFilters the image filters
+ * @param visited the canonical paths of all scanned folders - symlinks might point to a parent
+ * @return the image files
+ **/
+QFileInfoList DkMosaicDialog::scanFolder(const QDir& dir, const QStringList& fileFilters, QSet<QString>& visited) const {
 
-	for (int rIdx = 0; rIdx < cc.rows; rIdx++) {
+	QString canonicalPath = dir.canonicalPath();
 
-		float* ccPtr = cc.ptr<float>(rIdx);
-		const cv::Mat imgStrip = img.rowRange(rIdx*patchRes, rIdx*patchRes+patchRes);
+	if (canonicalPath.isEmpty() || visited.contains(canonicalPath))
+		return QFileInfoList();
 
-		for (int cIdx = 0; cIdx < cc.cols; cIdx++) {
+	visited.insert(canonicalPath);
 
-			// already computed?
-			if (ccPtr[cIdx] != 0)
-				continue;
+	QFileInfoList files = dir.entryInfoList(fileFilters, QDir::Files);
+	QFileInfoList dirs = dir.entryInfoList(QStringList(), QDir::AllDirs | QDir::NoDotAndDotDot);
 
-			const cv::Mat cPatch = imgStrip.colRange(cIdx*patchRes, cIdx*patchRes+patchRes);
-			
-			cv::Mat absDiff;
-			cv::absdiff(cPatch, thumb, absDiff);
-			ccPtr[cIdx] = 1.0f-((float)cv::sum(absDiff)[0]/(patchRes*patchRes*255));
-		}
-	}
+	for (int idx = 0; idx < dirs.size(); idx++)
+		files += scanFolder(QDir(dirs.at(idx).absoluteFilePath()), fileFilters, visited);
+
+	return files;
 }
 
-cv::Mat DkMosaicDialog::createPatch(const DkThumbNail& thumb, int patchRes) {
+/**
+ * Computes the descriptors of new or modified images in parallel.
+ * @param files all images of the folder
+ * @return false if the user canceled
+ **/
+bool DkMosaicDialog::updateDatabase(const QFileInfoList& files) {
 
-	QImage img;
+	database.setFolder(saveDir);
+	QVector<DkMosaicDatabase::Tile> newTiles = database.update(files);
 
-	// load full image if we have not enough resolution
-	if (qMin(thumb.getImage().width(), thumb.getImage().height()) < patchRes) {
-		DkBasicLoader loader;
-		loader.loadGeneral(thumb.getFile(), true, true);
-		img = loader.image();
-	}
-	else
-		img = thumb.getImage();
+	if (!newTiles.empty())
+		emit infoMessage(tr("Indexing %1 new images...").arg(newTiles.size()));
 
-	cv::Mat cvThumb = DkImage::qImage2Mat(img);
-	cv::cvtColor(cvThumb, cvThumb, CV_RGB2Lab);
-	std::vector<cv::Mat> channels;
-	cv::split(cvThumb, channels);
-	cvThumb = channels[0];
-	channels.clear();
+	int batchSize = 64;
 
-	// make square
-	if (cvThumb.rows != cvThumb.cols) {
+	for (int idx = 0; idx < newTiles.size(); idx += batchSize) {
 
-		if (cvThumb.rows > cvThumb.cols) {
-			float sh = (cvThumb.rows - cvThumb.cols)/2.0f;
-			cvThumb = cvThumb.rowRange(qFloor(sh), cvThumb.rows-qCeil(sh));
-		}
-		else {
-			float sh = (cvThumb.cols - cvThumb.rows)/2.0f;
-			cvThumb = cvThumb.colRange(qFloor(sh), cvThumb.cols-qCeil(sh));
+		// keep what we have computed so far
+		if (!processing) {
+			database.insert(newTiles.mid(0, idx));
+			database.save();
+			return false;
 		}
+
+		int lastIdx = qMin(idx + batchSize, newTiles.size());
+		QtConcurrent::blockingMap(newTiles.begin()+idx, newTiles.begin()+lastIdx, &nmc::DkMosaicDatabase::computeTile);
+		emit updateProgress(qRound((float)lastIdx/newTiles.size()*100));
 	}
 
-	if (cvThumb.rows < patchRes || cvThumb.cols < patchRes)
-		qDebug() << "enlarging thumbs!!";
+	database.insert(newTiles);
+	database.save();
 
-	cv::resize(cvThumb, cvThumb, cv::Size(patchRes, patchRes), 0.0, 0.0, CV_INTER_AREA);
+	if (!newTiles.empty()) {
+		emit infoMessage("");
+		emit updateProgress(0);
+	}
 
-	return cvThumb;
+	return true;
 }
 
-QString DkMosaicDialog::getRandomImagePath(const QString& cPath, const QString& ignore, const QString& suffix) {
+/**
+ * Assigns a tile to each patch.
+ * The nearest tiles of all patches are found in parallel. Then the closest
+ * patch/tile pairs are assigned first so that each tile is used once.
+ * @param index the tile index
+ * @param queryDescs the patch descriptors (one per row)
+ * @param useTwice is set to true if there are not enough tiles
+ * @return the tile per patch
+ **/
+QVector<int> DkMosaicDialog::assignTiles(const DkMosaicIndex& index, const cv::Mat& queryDescs, bool& useTwice) const {
+
+	int numP = queryDescs.rows;
+	QVector<QVector<DkMosaicIndex::Match> > matches(numP);
+	QVector<AssignBand> bands;
+
+	for (int idx = 0; idx < numP; idx += 64) {
+
+		AssignBand band;
+		band.index = &index;
+		band.queryDescs = &queryDescs;
+		band.firstPatch = idx;
+		band.lastPatch = qMin(idx + 64, numP);
+		band.k = qMin(index.size(), 16);
+		band.matches = &matches;
+		bands.append(band);
+	}
 
-	// TODO: remove hierarchy
+	QtConcurrent::blockingMap(bands, &nmc::DkMosaicDialog::computeAssignBand);
 
-	QStringList fileFilters = (suffix.isEmpty()) ? DkSettings::app.fileFilters : QStringList(suffix);
+	// candidate pairs sorted by distance
+	QVector<QPair<int, int> > pairs;	// distance, patch * k + match index
+	int k = qMin(index.size(), 16);
 
-	// get all dirs
-	QFileInfoList entries = QDir(cPath).entryInfoList(QStringList(), QDir::AllDirs | QDir::NoDotAndDotDot);
-	//qDebug() << entries;
-	// get all files
-	entries += QDir(cPath).entryInfoList(fileFilters);
-	//qDebug() << "current entries: " << e;
+	for (int pIdx = 0; pIdx < numP; pIdx++) {
+		for (int mIdx = 0; mIdx < matches[pIdx].size(); mIdx++)
+			pairs.append(qMakePair(matches[pIdx][mIdx].dist, pIdx*k+mIdx));
+	}
+	std::sort(pairs.begin(), pairs.end());
 
-	if (!ignore.isEmpty()) {
+	QVector<int> assignment(numP, -1);
+	QSet<int> used;
 
-		QStringList ignoreList = ignore.split(";");
-		QFileInfoList entriesTmp = entries;
-		entries.clear();
+	for (int idx = 0; idx < pairs.size(); idx++) {
 
-		for (int idx = 0; idx < entriesTmp.size(); idx++) {
-			
-			bool ignore = false;
-			QString p = entriesTmp.at(idx).absoluteFilePath();
+		int pIdx = pairs[idx].second / k;
+		int tIdx = matches[pIdx][pairs[idx].second % k].tileIdx;
 
-			for (int iIdx = 0; iIdx < ignoreList.size(); iIdx++) {
-				if (p.contains(ignoreList.at(iIdx))) {
-					ignore = true;
-					break;
+		if (assignment[pIdx] == -1 && !used.contains(tIdx)) {
+			assignment[pIdx] = tIdx;
+			used.insert(tIdx);
+		}
+	}
+
+	// patches whose nearest tiles are taken
+	for (int pIdx = 0; pIdx < numP; pIdx++) {
+
+		if (assignment[pIdx] != -1)
+			continue;
+
+		if (used.size() < index.size()) {
+
+			// widen the search until a free tile turns up - asking for used.size()+1 tiles at once is quadratic
+			for (int cK = qMin(2*k, index.size()); assignment[pIdx] == -1; cK = qMin(2*cK, index.size())) {
+
+				QVector<DkMosaicIndex::Match> m = index.knn(queryDescs.ptr<unsigned char>(pIdx), cK);
+
+				for (int mIdx = 0; mIdx < m.size(); mIdx++) {
+					if (!used.contains(m[mIdx].tileIdx)) {
+						assignment[pIdx] = m[mIdx].tileIdx;
+						used.insert(m[mIdx].tileIdx);
+						break;
+					}
 				}
-			}
 
-			if (!ignore)
-				entries.append(entriesTmp.at(idx));
+				// all tiles were checked
+				if (cK == index.size())
+					break;
+			}
+		}
+		else {
+			assignment[pIdx] = matches[pIdx][0].tileIdx;
+			useTwice = true;
 		}
 	}
-		
 
-	if (entries.isEmpty())
-		return QString();
+	return assignment;
+}
 
-	int rIdx = qRound((float)qrand()/RAND_MAX*(entries.size()-1));
+void DkMosaicDialog::computeAssignBand(AssignBand& band) {
 
-	//qDebug() << "rand index: " << rIdx;
+	for (int pIdx = band.firstPatch; pIdx < band.lastPatch; pIdx++)
+		(*band.matches)[pIdx] = band.index->knn(band.queryDescs->ptr<unsigned char>(pIdx), band.k);
+}
 
-	QFileInfo rPath = entries.at(rIdx);
-	//qDebug() << rPath.absoluteFilePath();
+/**
+ * Loads a tile and renders it to the preview and the mosaic (called in parallel).
+ * The full image is only loaded if the thumbnail is too small.
+ **/
+void DkMosaicDialog::renderTile(TileJob& job) {
 
-	if (rPath.isDir())
-		return getRandomImagePath(rPath.absoluteFilePath(), ignore, suffix);
-	else
-		return rPath.absoluteFilePath();
+	try {
+		DkThumbNail thumb = DkThumbNail(QFileInfo(job.filePath));
+		thumb.setMinThumbSize(job.patchResO);
+		thumb.setRescale(false);
+		thumb.compute();
+
+		QImage img = thumb.getImage();
+
+		// load full image if we have not enough resolution
+		if (qMin(img.width(), img.height()) < job.patchResD) {
+			DkBasicLoader loader;
+			loader.loadGeneral(QFileInfo(job.filePath), true, true);
+
+			if (!loader.image().isNull())
+				img = loader.image();
+		}
+
+		if (img.isNull())
+			return;
+
+		cv::Mat dPatch = DkMosaicDatabase::createPatch(img, job.patchResD);
+		cv::Mat pPatch;
+
+		if (job.patchResD >= job.patchResO)
+			cv::resize(dPatch, pPatch, cv::Size(job.patchResO, job.patchResO), 0.0, 0.0, CV_INTER_AREA);
+		else
+			pPatch = DkMosaicDatabase::createPatch(img, job.patchResO);
+
+		// the jobs write to disjoint regions
+		dPatch.copyTo(job.dImg->rowRange(job.row*job.patchResD, job.row*job.patchResD+job.patchResD)
+			.colRange(job.col*job.patchResD, job.col*job.patchResD+job.patchResD));
+		pPatch.copyTo(job.pImg->rowRange(job.row*job.patchResO, job.row*job.patchResO+job.patchResO)
+			.colRange(job.col*job.patchResO, job.col*job.patchResO+job.patchResO));
+	}
+	// catch cv exceptions e.g. out of memory
+	catch(...) {
+		qDebug() << "could not render: " << job.filePath;
+	}
 }
 
 void DkMosaicDialog::updatePostProcess() {
@@ -36,6 +36,8 @@
 #include <QDialog>
 #include <QDir>
 #include <QFutureWatcher>
+#include <QHash>
+#include <QSet>
 #pragma warning(pop)		// no warnings from includes - end
 
 #include "DkBasicLoader.h"
@@ -712,6 +714,9 @@ public slots:
 	void reject();
 	int exportImages(QFileInfo file, QFileInfo saveFile, int from, int to, bool overwrite);
 	void processingFinished();
+	void on_pageStrip_currentRowChanged(int row);
+	void loadVisibleThumbs();
+	void thumbLoaded(int idx);
 
 signals:
 	void updateImage(QImage img);
@@ -724,8 +729,28 @@ protected:
 	void enableAll(bool enable);
 	void dropEvent(QDropEvent *event);
 	void dragEnterEvent(QDragEnterEvent *event);
+	void updatePageStrip();
+
+	struct ExportJob {
+		QFileInfo tiffFile;
+		QFileInfo saveFile;
+		DkTiffIndex::Page page;
+		int pageIdx;
+		int status;
+		QImage img;
+	};
+
+	struct ThumbJob {
+		QFileInfo tiffFile;
+		DkTiffIndex::Page page;
+		int thumbSize;
+	};
+
+	static void exportPage(ExportJob& job);
+	static QImage loadThumb(const ThumbJob& job);
 
 	DkBaseViewPort* viewport;
+	QListWidget* pageStrip;
 	QLabel* tiffLabel;
 	QLabel* folderLabel;
 	QLineEdit* fileEdit;
@@ -742,6 +767,10 @@ protected:
 	QDir saveDir;
 	DkBasicLoader loader;
 	QFutureWatcher<int> watcher;
+	QFutureWatcher<QImage> thumbWatcher;
+	QVector<DkTiffIndex::Page> pages;
+	QVector<bool> thumbsRequested;
+	QVector<int> thumbRows;
 
 	bool processing;
 
@@ -751,6 +780,12 @@ protected:
 		error,
 
 	};
+
+	enum {
+		page_saved,
+		page_not_loaded,
+		page_not_saved,
+	};
 };
 #ifdef WITH_OPENCV
 class DkUnsharpDialog : public QDialog {
@@ -790,6 +825,96 @@ protected:
 	QImage img;
 };
 
+/**
+ * Persistent tile database for mosaics.
+ * Each image of a folder (including sub folders) is described by the
+ * luminance of its center square at desc_size x desc_size. The descriptors
+ * are stored per folder and only computed for new or modified files.
+ **/
+class DkMosaicDatabase {
+
+public:
+	enum {
+		desc_size = 4,
+		desc_length = desc_size*desc_size,
+	};
+
+	struct Tile {
+		QString filePath;
+		qint64 modified;
+		qint64 fileSize;
+		bool valid;
+		unsigned char desc[desc_length];
+	};
+
+	DkMosaicDatabase();
+
+	void setFolder(const QDir& folder);
+	QVector<Tile> update(const QFileInfoList& files);
+	void insert(const QVector<Tile>& newTiles);
+	void save() const;
+
+	const QVector<Tile>& getTiles() const;
+	int find(const QString& filePath) const;
+
+	static void computeTile(Tile& tile);
+	static void computeDescriptor(const cv::Mat& imgL, unsigned char* desc);
+	static cv::Mat createPatch(const QImage& img, int patchRes);
+
+protected:
+	QString dbFilePath() const;
+
+	QDir folder;
+	QVector<Tile> tiles;
+	QHash<QString, int> tileIdx;
+	bool dirty;
+};
+
+/**
+ * k-d tree over mosaic tile descriptors.
+ * Finds the exact k nearest tiles (squared L2 distance) of a patch descriptor.
+ **/
+class DkMosaicIndex {
+
+public:
+	struct Match {
+		int tileIdx;
+		int dist;
+
+		bool operator<(const Match& o) const { return dist < o.dist; };
+	};
+
+	DkMosaicIndex(const QVector<DkMosaicDatabase::Tile>& tiles, const QVector<int>& tileIdxs);
+
+	QVector<Match> knn(const unsigned char* desc, int k) const;
+	int size() const;
+
+protected:
+	struct Node {
+		int tileIdx;
+		int dim;
+		int left;
+		int right;
+	};
+
+	struct DescCompare {
+		DescCompare(const QVector<DkMosaicDatabase::Tile>& tiles, int dim) : tiles(tiles), dim(dim) {};
+		bool operator()(int a, int b) const { return tiles[a].desc[dim] < tiles[b].desc[dim]; };
+
+		const QVector<DkMosaicDatabase::Tile>& tiles;
+		int dim;
+	};
+
+	int build(int from, int to);
+	void search(int nodeIdx, const unsigned char* desc, int k, QVector<Match>& matches) const;
+	int distance(const unsigned char* desc, int tileIdx) const;
+
+	const QVector<DkMosaicDatabase::Tile>& tiles;
+	QVector<int> ids;
+	QVector<Node> nodes;
+	int root;
+};
+
 class DkMosaicDialog : public QDialog {
 	Q_OBJECT
 
@@ -830,9 +955,31 @@ protected:
 	void enableAll(bool enable);
 	void dropEvent(QDropEvent *event);
 	void dragEnterEvent(QDragEnterEvent *event);
-	QString getRandomImagePath(const QString& cPath, const QString& ignore, const QString& suffix);
-	void matchPatch(const cv::Mat& img, const cv::Mat& thumb, int patchRes, cv::Mat& cc);
-	cv::Mat createPatch(const DkThumbNail& thumb, int patchRes);
+	QFileInfoList scanFolder(const QDir& dir, const QStringList& fileFilters, QSet<QString>& visited) const;
+	bool updateDatabase(const QFileInfoList& files);
+	QVector<int> assignTiles(const DkMosaicIndex& index, const cv::Mat& queryDescs, bool& useTwice) const;
+
+	struct TileJob {
+		QString filePath;
+		int row;
+		int col;
+		int patchResO;
+		int patchResD;
+		cv::Mat* pImg;
+		cv::Mat* dImg;
+	};
+
+	struct AssignBand {
+		const DkMosaicIndex* index;
+		const cv::Mat* queryDescs;
+		int firstPatch;
+		int lastPatch;
+		int k;
+		QVector<QVector<DkMosaicIndex::Match> >* matches;
+	};
+
+	static void renderTile(TileJob& job);
+	static void computeAssignBand(AssignBand& band);
 	
 	DkBaseViewPort* viewport;
 	DkBaseViewPort* preview;
@@ -860,6 +1007,7 @@ protected:
 	QFileInfo cFile;
 	QDir saveDir;
 	DkBasicLoader loader;
+	DkMosaicDatabase database;
 	QFutureWatcher<int> mosaicWatcher;
 	QFutureWatcher<bool> postProcessWatcher;
 
@@ -61,6 +61,7 @@
 #include <QWriteLocker>
 #include <QReadWriteLock>
 #include <QTimer>
+#include <QSet>
 #include <QMovie>
 #include <QByteArray>
 #include <QCoreApplication>
@@ -70,6 +71,8 @@
 #include <QPainter>
 #include <qmath.h>
 #include <QtConcurrentRun>
+#include <QtConcurrentMap>
+#include <algorithm>
 
 // quazip
 #ifdef WITH_QUAZIP
@@ -103,6 +106,7 @@ namespace nmc {
 DkImageLoader::DkImageLoader(QFileInfo file) {
 
 	qRegisterMetaType<QFileInfo>("QFileInfo");
+	qRegisterMetaType<QFileInfoList>("QFileInfoList");
 
 	dirWatcher = new QFileSystemWatcher(this);
 	connect(dirWatcher, SIGNAL(directoryChanged(QString)), this, SLOT(directoryChanged(QString)));
@@ -111,8 +115,14 @@ DkImageLoader::DkImageLoader(QFileInfo file) {
 	sortingImages = false;
 	folderUpdated = false;
 	tmpFileIdx = 0;
+	indexing = false;
+	indexingNewDir = false;
+	loadFilePending = false;
+	pendingFileIdx = 0;
 
 	connect(&createImageWatcher, SIGNAL(finished()), this, SLOT(imagesSorted()));
+	connect(this, SIGNAL(filesIndexedSignal(QFileInfoList, int)), this, SLOT(filesIndexed(QFileInfoList, int)), Qt::QueuedConnection);
+	connect(this, SIGNAL(dirIndexedSignal(QFileInfoList, int)), this, SLOT(dirIndexed(QFileInfoList, int)), Qt::QueuedConnection);
 
 	delayedUpdateTimer.setSingleShot(true);
 	connect(&delayedUpdateTimer, SIGNAL(timeout()), this, SLOT(directoryChanged()));
@@ -134,6 +144,12 @@ DkImageLoader::~DkImageLoader() {
 	
 	if (createImageWatcher.isRunning())
 		createImageWatcher.blockSignals(true);
+
+	// the indexing threads access this object - stop them before we are gone
+	indexGeneration.fetchAndAddOrdered(1);
+
+	for (int idx = 0; idx < indexFutures.size(); idx++)
+		indexFutures[idx].waitForFinished();
 }
 
 /**
@@ -151,6 +167,12 @@ void DkImageLoader::clearPath() {
 		images.clear();
 	}
 
+	// cancel indexing
+	indexGeneration.fetchAndAddOrdered(1);
+	indexing = false;
+	loadFilePending = false;
+
+	cacher.clear(currentImage);
 	currentImage.clear();
 }
 
@@ -232,28 +254,14 @@ bool DkImageLoader::loadDir(QDir newDir, bool scanRecursive) {
 	if (folderUpdated && newDir.absolutePath() == dir.absolutePath()) {
 		
 		folderUpdated = false;
-		QFileInfoList files = getFilteredFileInfoList(dir, ignoreKeywords, keywords, folderKeywords);		// this line takes seconds if you have lots of files and slow loading (e.g. network)
-
-		// might get empty too (e.g. someone deletes all images)
- 		if (files.empty()) {
-			emit showInfoSignal(tr("%1 \n does not contain any image").arg(dir.absolutePath()), 4000);	// stop showing
-			images.clear();
-			emit updateDirSignal(images);
-			return false;
-		}
 
-		// disabled threaded sorting - people didn't like it (#484 and #460)
-		//if (files.size() > 2000) {
-		//	createImages(files, false);
-		//	sortImagesThreaded(images);
-		//}
-		//else
-			createImages(files, true);
+		// the old file list is kept until the folder is re-indexed (see dirIndexed)
+		indexDirThreaded(false);
 
 		qDebug() << "getting file list.....";
 	}
 	// new folder is loaded
-	else if ((newDir.absolutePath() != dir.absolutePath() || images.empty()) && newDir.exists()) {
+	else if ((newDir.absolutePath() != dir.absolutePath() || (images.empty() && !isIndexing())) && newDir.exists()) {
 
 		QFileInfoList files;
 
@@ -266,10 +274,20 @@ bool DkImageLoader::loadDir(QDir newDir, bool scanRecursive) {
 		folderKeywords.clear();	// delete key words -> otherwise user may be confused
 		emit folderFiltersChanged(folderKeywords);
 
-		if (scanRecursive && DkSettings::global.scanSubFolders)
-			files = updateSubFolders(dir);
-		else 
-			files = getFilteredFileInfoList(dir, ignoreKeywords, keywords, folderKeywords);		// this line takes seconds if you have lots of files and slow loading (e.g. network)
+		if (!scanRecursive || !DkSettings::global.scanSubFolders) {
+			
+			// listing a folder takes seconds if you have lots of files and slow loading (e.g. network)
+			// so we index it in the background - the current image is loaded meanwhile
+			images.clear();
+			indexDirThreaded(true);
+			return true;
+		}
+
+		// cancel indexing
+		indexGeneration.fetchAndAddOrdered(1);
+		indexing = false;
+
+		files = updateSubFolders(dir);
 
 		if (files.empty()) {
 			emit showInfoSignal(tr("%1 \n does not contain any image").arg(dir.absolutePath()), 4000);	// stop showing
@@ -342,19 +360,25 @@ void DkImageLoader::createImages(const QFileInfoList& files, bool sort) {
 	QVector<QSharedPointer<DkImageContainerT > > oldImages = images;
 	images.clear();
 
+	// findFileIdx is linear - which is too slow for folders with 100k files
+	QHash<QString, QSharedPointer<DkImageContainerT> > oldImagesHash;
+	oldImagesHash.reserve(oldImages.size());
+	for (int idx = 0; idx < oldImages.size(); idx++)
+		oldImagesHash.insert(oldImages.at(idx)->file().absoluteFilePath(), oldImages.at(idx));
+
 	for (int idx = 0; idx < files.size(); idx++) {
 
-		int oIdx = findFileIdx(files.at(idx), oldImages);
+		QSharedPointer<DkImageContainerT> oldImage = oldImagesHash.value(files.at(idx).absoluteFilePath());
 
-		if (oIdx != -1 && oldImages.at(oIdx)->file().lastModified() == files.at(idx).lastModified())
-			images.append(oldImages.at(oIdx));
+		if (oldImage && oldImage->file().lastModified() == files.at(idx).lastModified())
+			images.append(oldImage);
 		else
 			images.append(QSharedPointer<DkImageContainerT >(new DkImageContainerT(files.at(idx))));
 	}
 	qDebug() << "[DkImageLoader] " << images.size() << " containers created in " << dt.getTotal();
 
 	if (sort) {
-		qSort(images.begin(), images.end(), imageContainerLessThanPtr);
+		sortImagesIntern(images);
 		qDebug() << "[DkImageLoader] after sorting: " << dt.getTotal();
 
 		emit updateDirSignal(images);
@@ -370,11 +394,341 @@ void DkImageLoader::createImages(const QFileInfoList& files, bool sort) {
 
 QVector<QSharedPointer<DkImageContainerT > > DkImageLoader::sortImages(QVector<QSharedPointer<DkImageContainerT > > images) const {
 
-	qSort(images.begin(), images.end(), imageContainerLessThanPtr);
+	sortImagesIntern(images);
 
 	return images;
 }
 
+/**
+ * Sorts the images according to the current sort mode.
+ * Rather than comparing file names (or querying file dates) for every comparison,
+ * one sort key is computed per image. The keys are then sorted in parallel
+ * chunks which are merged afterwards. Name keys and file dates are cached in
+ * the containers, so re-sorting or changing the sort mode is cheap.
+ * The result is the same as sorting with imageContainerLessThanPtr.
+ * @param images the images to be sorted.
+ **/ 
+void DkImageLoader::sortImagesIntern(QVector<QSharedPointer<DkImageContainerT > >& images) {
+
+	DkTimer dt;
+	int sortMode = DkSettings::global.sortMode;
+
+	QVector<SortEntry> entries(images.size());
+	for (int idx = 0; idx < images.size(); idx++) {
+		
+		SortEntry& e = entries[idx];
+		e.image = images.at(idx).data();
+		e.name = images.at(idx)->getSortKeyName();
+		e.key = (sortMode == DkSettings::sort_random) ? qrand() : 0;
+		e.sortMode = sortMode;
+		e.idx = idx;
+	}
+
+	// reading file dates is the expensive part - so we read them in parallel
+	if (sortMode == DkSettings::sort_date_created || sortMode == DkSettings::sort_date_modified)
+		QtConcurrent::blockingMap(entries, computeSortKey);
+
+	// small folders are not worth the overhead
+	int numChunks = qBound(1, entries.size()/4096, QThread::idealThreadCount());
+	QVector<int> bounds;
+	for (int idx = 0; idx <= numChunks; idx++)
+		bounds.append((int)((qint64)entries.size()*idx/numChunks));
+
+	QVector<SortChunk> chunks;
+	for (int idx = 0; idx < numChunks; idx++) {
+		SortChunk c = {entries.data(), bounds[idx], bounds[idx], bounds[idx+1]};
+		chunks.append(c);
+	}
+	QtConcurrent::blockingMap(chunks, sortChunk);
+
+	// merge neighboring chunks until we have one sorted list
+	while (bounds.size() > 2) {
+
+		QVector<int> mergedBounds;
+		chunks.clear();
+
+		for (int idx = 0; idx+2 < bounds.size(); idx += 2) {
+			SortChunk c = {entries.data(), bounds[idx], bounds[idx+1], bounds[idx+2]};
+			chunks.append(c);
+			mergedBounds.append(bounds[idx]);
+		}
+
+		// an odd chunk is merged in the next round
+		if (bounds.size() % 2 == 0)
+			mergedBounds.append(bounds[bounds.size()-2]);
+		mergedBounds.append(bounds.last());
+		bounds = mergedBounds;
+
+		QtConcurrent::blockingMap(chunks, mergeChunk);
+	}
+
+	bool descending = DkSettings::global.sortDir == DkSettings::sort_descending && sortMode != DkSettings::sort_random;
+	QVector<QSharedPointer<DkImageContainerT > > sortedImages;
+	sortedImages.reserve(images.size());
+
+	for (int idx = 0; idx < entries.size(); idx++)
+		sortedImages.append(images.at(entries.at(descending ? entries.size()-idx-1 : idx).idx));
+
+	images = sortedImages;
+
+	qDebug() << "[DkImageLoader]" << images.size() << "images sorted in" << dt.getTotal();
+}
+
+void DkImageLoader::computeSortKey(SortEntry& entry) {
+
+	entry.key = entry.image->getSortKeyDate(entry.sortMode);
+}
+
+bool DkImageLoader::sortEntryLessThan(const SortEntry& l, const SortEntry& r) {
+
+	if (l.key != r.key)
+		return l.key < r.key;
+	
+	return l.name < r.name;
+}
+
+void DkImageLoader::sortChunk(SortChunk& chunk) {
+
+	std::sort(chunk.entries+chunk.first, chunk.entries+chunk.last, sortEntryLessThan);
+}
+
+void DkImageLoader::mergeChunk(SortChunk& chunk) {
+
+	std::inplace_merge(chunk.entries+chunk.first, chunk.entries+chunk.mid, chunk.entries+chunk.last, sortEntryLessThan);
+}
+
+bool DkImageLoader::isIndexing() const {
+
+	return indexing;
+}
+
+void DkImageLoader::indexDirThreaded(bool newDir) {
+
+	// cancel the old indexing thread - it checks the generation for every file
+	// we do not wait for it: a slow network share might block it for seconds
+	int generation = indexGeneration.fetchAndAddOrdered(1) + 1;
+
+	for (int idx = indexFutures.size()-1; idx >= 0; idx--) {
+		if (indexFutures.at(idx).isFinished())
+			indexFutures.remove(idx);
+	}
+
+	indexing = true;
+	indexingNewDir = newDir;
+	loadFilePending = false;
+
+	indexFutures.append(QtConcurrent::run(this, 
+		&nmc::DkImageLoader::indexDir, dir, ignoreKeywords, keywords, folderKeywords, generation));
+
+	qDebug() << "indexing" << dir.absolutePath() << "threaded...";
+}
+
+/**
+ * Lists all images of dir (runs in the indexing thread).
+ * The files are reported in batches via filesIndexedSignal and all filtered
+ * files via dirIndexedSignal. Files are only stat'ed if the sorting needs their dates.
+ * @param dir the directory to be indexed.
+ * @param generation the indexing is canceled if indexGeneration changes.
+ **/ 
+void DkImageLoader::indexDir(QDir dir, QStringList ignoreKeywords, QStringList keywords, QStringList folderKeywords, int generation) {
+
+	DkTimer dt;
+
+	bool statFiles = DkSettings::global.sortMode == DkSettings::sort_date_created || 
+		DkSettings::global.sortMode == DkSettings::sort_date_modified;
+
+	QStringList fileNames;
+	QStringList batch;
+	QFileInfoList files;
+	int batchSize = 64;		// the first batch is small - so that we can show something asap
+
+#ifdef WIN32
+
+	QString winPath = QDir::toNativeSeparators(dir.path()) + "\\*.*";
+	const wchar_t* fname = reinterpret_cast<const wchar_t *>(winPath.utf16());
+
+	WIN32_FIND_DATAW findFileData;
+	HANDLE MyHandle = FindFirstFileW(fname, &findFileData);
+	bool hasNext = MyHandle != INVALID_HANDLE_VALUE;
+
+	// remove the * in fileFilters
+	QStringList fileFiltersClean = DkSettings::app.browseFilters;
+	for (int idx = 0; idx < fileFiltersClean.size(); idx++)
+		fileFiltersClean[idx].replace("*", "");
+#else
+	QDirIterator dirIt(dir.absolutePath(), DkSettings::app.browseFilters, QDir::Files);
+	bool hasNext = dirIt.hasNext();
+#endif
+
+	while (hasNext && generation == indexGeneration.fetchAndAddRelaxed(0)) {
+
+#ifdef WIN32
+		QString fileName = DkUtils::stdWStringToQString(findFileData.cFileName);
+		hasNext = FindNextFileW(MyHandle, &findFileData) != 0;
+
+		for (int idx = 0; idx < fileFiltersClean.size(); idx++) {
+
+			if (fileName.contains(fileFiltersClean[idx], Qt::CaseInsensitive)) {
+				batch.append(fileName);
+				break;
+			}
+		}
+#else
+		dirIt.next();
+		batch.append(dirIt.fileName());
+		hasNext = dirIt.hasNext();
+#endif
+
+		if (batch.size() < batchSize && (hasNext || batch.empty()))
+			continue;
+
+		batch = filterKeywords(batch, ignoreKeywords, keywords);
+		
+		QFileInfoList batchFiles;
+		for (int idx = 0; idx < batch.size() && generation == indexGeneration.fetchAndAddRelaxed(0); idx++) {
+			
+			QFileInfo cFile(dir, batch.at(idx));
+			
+			// QFileInfo caches the stat - so sorting does not need to touch the disk again
+			if (statFiles)
+				cFile.lastModified();
+
+			batchFiles.append(cFile);
+		}
+
+		fileNames.append(batch);
+		files.append(batchFiles);
+		batch.clear();
+		batchSize = qMin(batchSize*2, 8192);
+
+		emit filesIndexedSignal(batchFiles, generation);
+	}
+
+#ifdef WIN32
+	if (MyHandle != INVALID_HANDLE_VALUE)
+		FindClose(MyHandle);
+#endif
+
+	if (generation != indexGeneration.fetchAndAddRelaxed(0))
+		return;
+
+	qDebug() << "[DkImageLoader] indexed" << files.size() << "files in" << dt.getTotal();
+
+	// these filters need the whole file list
+	QStringList filteredNames = filterDuplicates(filterFolderKeywords(fileNames, folderKeywords));
+
+	if (filteredNames.size() == fileNames.size()) {
+		emit dirIndexedSignal(files, generation);
+		return;
+	}
+
+	QSet<QString> filteredSet = QSet<QString>::fromList(filteredNames);
+	QFileInfoList filteredFiles;
+
+	for (int idx = 0; idx < files.size(); idx++) {
+
+		if (filteredSet.contains(fileNames.at(idx)))
+			filteredFiles.append(files.at(idx));
+	}
+
+	emit dirIndexedSignal(filteredFiles, generation);
+}
+
+/**
+ * Adds a batch of indexed files to the current folder.
+ * The batch is sorted and merged into the (sorted) images so that
+ * the file list is consistent while the folder is indexed.
+ * @param files the new files.
+ * @param generation indexing generation of the batch.
+ **/ 
+void DkImageLoader::filesIndexed(QFileInfoList files, int generation) {
+
+	// the old file list is kept until a folder update finished
+	if (!indexing || !indexingNewDir || generation != indexGeneration.fetchAndAddRelaxed(0))
+		return;
+
+	DkTimer dt;
+	int oldSize = images.size();
+	QString currentPath = currentImage ? currentImage->file().absoluteFilePath() : QString();
+
+	for (int idx = 0; idx < files.size(); idx++) {
+
+		// do not create a second container for the image that is already loaded
+		if (!currentPath.isEmpty() && files.at(idx).absoluteFilePath() == currentPath)
+			images.append(currentImage);
+		else
+			images.append(QSharedPointer<DkImageContainerT >(new DkImageContainerT(files.at(idx))));
+	}
+
+	QVector<QSharedPointer<DkImageContainerT > > batch = images.mid(oldSize);
+	sortImagesIntern(batch);
+	std::copy(batch.begin(), batch.end(), images.begin()+oldSize);
+	std::inplace_merge(images.begin(), images.begin()+oldSize, images.end(), imageContainerLessThanPtr);
+
+	qDebug() << "[DkImageLoader]" << files.size() << "files merged in" << dt.getTotal() << "-" << images.size() << "images indexed";
+
+	emit updateDirSignal(images);
+}
+
+/**
+ * Is called if the indexing thread listed all files.
+ * @param files all filtered files of the folder.
+ * @param generation indexing generation of the files - results of canceled runs are ignored.
+ **/ 
+void DkImageLoader::dirIndexed(QFileInfoList files, int generation) {
+
+	if (!indexing || generation != indexGeneration.fetchAndAddRelaxed(0))
+		return;
+
+	indexing = false;
+
+	// might get empty too (e.g. someone deletes all images)
+	if (files.empty()) {
+		emit showInfoSignal(tr("%1 \n does not contain any image").arg(dir.absolutePath()), 4000);	// stop showing
+		images.clear();
+		emit updateDirSignal(images);
+		loadFilePending = false;
+		return;
+	}
+
+	if (indexingNewDir) {
+
+		// images are sorted already - just remove files that are filtered using the whole list (e.g. duplicates)
+		if (files.size() != images.size()) {
+
+			QSet<QString> filePaths;
+			for (int idx = 0; idx < files.size(); idx++)
+				filePaths.insert(files.at(idx).absoluteFilePath());
+
+			QVector<QSharedPointer<DkImageContainerT > > filteredImages;
+			for (int idx = 0; idx < images.size(); idx++) {
+				if (filePaths.contains(images.at(idx)->file().absoluteFilePath()))
+					filteredImages.append(images.at(idx));
+			}
+			images = filteredImages;
+		}
+
+		emit updateDirSignal(images);
+
+		if (dirWatcher) {
+			if (!dirWatcher->directories().isEmpty())
+				dirWatcher->removePaths(dirWatcher->directories());
+			dirWatcher->addPath(dir.absolutePath());
+		}
+	}
+	else {
+		// disabled threaded sorting - people didn't like it (#484 and #460)
+		createImages(files, true);
+	}
+
+	qDebug() << "new folder path: " << dir.absolutePath() << " contains: " << images.size() << " images";
+
+	if (loadFilePending) {
+		loadFilePending = false;
+		loadFileAt(pendingFileIdx);
+	}
+}
+
 /**
  * Loads the ancesting or subsequent file.
  * @param skipIdx the number of files that should be skipped after/before the current file.
@@ -714,6 +1068,13 @@ void DkImageLoader::setImages(QVector<QSharedPointer<DkImageContainerT> > images
  **/ 
 void DkImageLoader::firstFile() {
 
+	// we do not know the first file before the folder is indexed
+	if (isIndexing() && indexingNewDir) {
+		pendingFileIdx = 0;
+		loadFilePending = true;
+		return;
+	}
+
 	loadFileAt(0);
 }
 
@@ -722,6 +1083,12 @@ void DkImageLoader::firstFile() {
  **/ 
 void DkImageLoader::lastFile() {
 	
+	if (isIndexing() && indexingNewDir) {
+		pendingFileIdx = -1;
+		loadFilePending = true;
+		return;
+	}
+
 	loadFileAt(-1);
 }
 
@@ -752,6 +1119,9 @@ bool DkImageLoader::unloadFile() {
 		}
 	}
 
+	// the file might be renamed or deleted now - so it must not be mapped anymore
+	currentImage->releaseFileBuffer();
+
 	return true;
 }
 
@@ -880,6 +1250,9 @@ void DkImageLoader::load(QSharedPointer<DkImageContainerT> image /* = QSharedPoi
 	if (!image)
 		return;
 
+	// the user wants to see this image - not the file requested while indexing
+	loadFilePending = false;
+
 #ifdef WITH_QUAZIP
 	bool isZipArchive = DkBasicLoader::isContainer(image->file());
 
@@ -891,6 +1264,7 @@ void DkImageLoader::load(QSharedPointer<DkImageContainerT> image /* = QSharedPoi
 #endif
 
 	setCurrentImage(image);
+	cacher.imageRequested(currentImage);
 
 	if (currentImage && currentImage->getLoadState() == DkImageContainerT::loading)
 		return;
@@ -920,7 +1294,8 @@ void DkImageLoader::imageLoaded(bool loaded /* = false */) {
 	emit imageUpdatedSignal(currentImage);
 
 	if (currentImage) {
-		emit updateFileSignal(currentImage->file());
+		// previews are smaller than the image - the title should show the real size
+		emit updateFileSignal(currentImage->file(), currentImage->getLoader()->getFullSize());
 
 		// this signal is needed by the folder scrollbar
 		int idx = findFileIdx(currentImage->file(), images);
@@ -1483,6 +1858,9 @@ bool DkImageLoader::deleteFile() {
 
 		QFile fileHandle(currentImage->file().absoluteFilePath());
 
+		// memory mapped files cannot be deleted on Windows
+		currentImage->releaseFileBuffer();
+
 		if (fileHandle.remove()) {
 			QSharedPointer<DkImageContainerT> imgC = getSkippedImage(1);
 			load(imgC);
@@ -1795,60 +2173,310 @@ void DkImageLoader::errorDialog(const QString& msg) const {
 
 void DkImageLoader::updateCacher(QSharedPointer<DkImageContainerT> imgC) {
 
-	if (!imgC || !DkSettings::resources.cacheMemory)
+	cacher.update(images, imgC);
+}
+
+// DkImageCacher --------------------------------------------------------------------
+DkImageCacher::DkImageCacher() {
+
+	lastIdx = -1;
+	lastNumImages = 0;
+	direction = 1;
+	velocity = 1.0f;
+	numHits = 0;
+	numMisses = 0;
+	numCanceled = 0;
+}
+
+/**
+ * Updates the cache if a new image is displayed.
+ * Stale loads are canceled, the most likely next images are prefetched
+ * and the least recently used images are released if we exceed the memory budget.
+ * @param images the images of the current folder.
+ * @param imgC the image which is currently displayed.
+ **/ 
+void DkImageCacher::update(const QVector<QSharedPointer<DkImageContainerT> >& images, QSharedPointer<DkImageContainerT> imgC) {
+
+	if (!imgC)
 		return;
 
-	DkTimer dt;
+	// no caching? delete all
+	if (!DkSettings::resources.cacheMemory) {
+		clear(imgC);
+		return;
+	}
 
-	//// no caching? delete all
-	//if (!DkSettings::resources.cacheMemory) {
-	//	for (int idx = 0; idx < images.size(); idx++) {
-	//		images.at(idx)->clear();
-	//	}
-	//	return;
-	//}
+	DkTimer dt;
 
-	int cIdx = findFileIdx(imgC->file(), images);
-	float mem = 0;
+	int window = qMax(DkSettings::resources.maxImagesCached, 1);
+	int cIdx = locate(images, imgC);
 
 	if (cIdx == -1) {
-		qDebug() << "WARNING: image not found for caching!";
+		qDebug() << "[DkImageCacher] WARNING: image not found for caching!";
 		return;
 	}
 
-	for (int idx = 0; idx < images.size(); idx++) {
+	updateMotion(cIdx, images.size(), window);
+	touch(imgC);
 
-		// clear images if they are edited
-		if (idx != cIdx && images.at(idx)->isEdited()) {
-			images.at(idx)->clear();
-			continue;
+	// clear images if they are edited
+	for (int idx = lru.size()-1; idx > 0; idx--) {
+		
+		if (lru.at(idx)->isEdited()) {
+			lru.at(idx)->clear();
+			lru.removeAt(idx);
 		}
+	}
 
-		if (idx >= cIdx-1 && idx <= cIdx+DkSettings::resources.maxImagesCached)
-			mem += images.at(idx)->getMemoryUsage();
-		else {
-			images.at(idx)->clear();
+	QVector<int> order = prefetchOrder(cIdx, images.size(), window);
+	QSet<DkImageContainerT*> wanted;
+	wanted.insert(imgC.data());
+
+	float mem = cachedMemory();
+
+	for (int rank = 0; rank < order.size(); rank++) {
+
+		QSharedPointer<DkImageContainerT> img = images.at(order.at(rank));
+		wanted.insert(img.data());
+
+		if (img->isEdited() || img->getLoadState() == DkImageContainerT::exists_not)
 			continue;
+
+		bool cached = img->hasImage() || img->getLoadState() == DkImageContainerT::loading || !img->getFileBuffer()->isEmpty();
+
+		if (!cached && mem < DkSettings::resources.cacheMemory) {
+
+			// fully load the most likely next image - just fetch the others
+			if (rank == 0) {
+				img->loadImageThreaded();
+				qDebug() << "[DkImageCacher] " << img->file().absoluteFilePath() << " fully cached...";
+			}
+			else {
+				img->fetchFile();
+				qDebug() << "[DkImageCacher] " << img->file().absoluteFilePath() << " file fetched...";
+			}
+
+			mem += img->getFileSize();	// we don't know the decoded size yet
+			cached = true;
 		}
 
-		// ignore the last and current one
-		if (idx == cIdx-1 || idx == cIdx) {
-			continue;
+		// keep the LRU in the order of the prefetch priority
+		if (cached)
+			touch(img, rank+1);
+	}
+
+	// cancel loads we don't need anymore (e.g. the user changed the direction)
+	for (int idx = lru.size()-1; idx > 0; idx--) {
+
+		QSharedPointer<DkImageContainerT> img = lru.at(idx);
+
+		if (img->getLoadState() == DkImageContainerT::loading && !wanted.contains(img.data())) {
+			img->cancel();
+			lru.removeAt(idx);
+			numCanceled++;
+		}
+	}
+
+	// release the least recently used images
+	for (int idx = lru.size()-1; idx > 0 && mem > DkSettings::resources.cacheMemory; idx--) {
+
+		QSharedPointer<DkImageContainerT> img = lru.at(idx);
+		mem -= img->getMemoryUsage();
+		img->clear();
+		lru.removeAt(idx);
+	}
+
+	qDebug() << "[DkImageCacher] cache with: " << mem << " MB (" << lru.size() << " images) updated in: " << dt.getTotal() << " - " << getStats();
+}
+
+/**
+ * Counts cache hits and misses.
+ * Call this before an image is loaded for display.
+ * @param imgC the image requested.
+ **/ 
+void DkImageCacher::imageRequested(QSharedPointer<DkImageContainerT> imgC) {
+
+	if (!imgC)
+		return;
+
+	// in-flight prefetches count as hits too
+	if (imgC->hasImage() || imgC->getLoadState() == DkImageContainerT::loading)
+		numHits++;
+	else
+		numMisses++;
+}
+
+/**
+ * Releases all cached images.
+ * @param keepImg this image is not released (e.g. the current image).
+ **/ 
+void DkImageCacher::clear(QSharedPointer<DkImageContainerT> keepImg) {
+
+	for (int idx = 0; idx < lru.size(); idx++) {
+
+		if (lru.at(idx) != keepImg)
+			lru.at(idx)->clear();
+	}
+
+	lru.clear();
+
+	if (keepImg)
+		lru.append(keepImg);
+
+	lastIdx = -1;
+}
+
+QString DkImageCacher::getStats() const {
+
+	int numRequests = numHits + numMisses;
+	float hitRate = numRequests ? (float)numHits/numRequests*100.0f : 0.0f;
+
+	return QString("hits: %1 misses: %2 (%3%) canceled: %4").arg(numHits).arg(numMisses).arg(hitRate, 0, 'f', 1).arg(numCanceled);
+}
+
+/**
+ * Returns the index of imgC.
+ * Since we mostly browse sequentially, the images around the last index
+ * are searched first.
+ * @param images the images of the current folder.
+ * @param imgC the image to be found.
+ * @return int the index or -1 if imgC is not in images.
+ **/ 
+int DkImageCacher::locate(const QVector<QSharedPointer<DkImageContainerT> >& images, QSharedPointer<DkImageContainerT> imgC) const {
+
+	QString filePath = imgC->file().absoluteFilePath();
+
+	if (lastIdx >= 0 && lastIdx < images.size()) {
+
+		int radius = qMax(DkSettings::resources.maxImagesCached, 1) + qMax(DkSettings::global.skipImgs, 1);
+
+		for (int d = 0; d <= radius; d++) {
+
+			if (lastIdx+d < images.size() && images.at(lastIdx+d)->file().absoluteFilePath() == filePath)
+				return lastIdx+d;
+			if (d && lastIdx-d >= 0 && images.at(lastIdx-d)->file().absoluteFilePath() == filePath)
+				return lastIdx-d;
+		}
+	}
+
+	// random jump
+	for (int idx = 0; idx < images.size(); idx++) {
+
+		if (images.at(idx)->file().absoluteFilePath() == filePath)
+			return idx;
+	}
+
+	return -1;
+}
+
+/**
+ * Updates the browsing direction and velocity.
+ * @param cIdx the current index.
+ * @param numImages the number of images in the current folder.
+ * @param window the maximal number of images cached.
+ **/ 
+void DkImageCacher::updateMotion(int cIdx, int numImages, int window) {
+
+	// new folder - we assume that the user browses forward
+	if (lastIdx == -1 || numImages != lastNumImages) {
+		direction = 1;
+		velocity = 1.0f;
+		lastIdx = cIdx;
+		lastNumImages = numImages;
+		return;
+	}
+
+	int step = cIdx - lastIdx;
+
+	// stepping over the folder's end
+	if (DkSettings::global.loop && qAbs(step) > numImages/2) 
+		step = step > 0 ? step - numImages : step + numImages;
+
+	if (step) {
+
+		// large jumps (e.g. random slideshow) tell us nothing about the next image
+		if (qAbs(step) > window + qMax(DkSettings::global.skipImgs, 1)) {
+			direction = 0;
+			velocity = 1.0f;
 		}
-		// fully load the next image
-		else if (idx == cIdx+1 && mem < DkSettings::resources.cacheMemory && images.at(idx)->getLoadState() == DkImageContainerT::not_loaded) {
-			images.at(idx)->loadImageThreaded();
-			qDebug() << "[Cacher] " << images.at(idx)->file().absoluteFilePath() << " fully cached...";
+		else {
+			direction = step > 0 ? 1 : -1;
+			velocity = 0.5f*velocity + 0.5f*qAbs(step);
 		}
-		else if (idx > cIdx && idx < cIdx+DkSettings::resources.maxImagesCached-2 && mem < DkSettings::resources.cacheMemory && images.at(idx)->getLoadState() == DkImageContainerT::not_loaded) {
-			//dt.getIvl();
-			images.at(idx)->fetchFile();		// TODO: crash detected here
-			qDebug() << "[Cacher] " << images.at(idx)->file().absoluteFilePath() << " file fetched...";
+	}
+
+	lastIdx = cIdx;
+}
+
+static bool prefetchWeightGreater(const QPair<float, int>& l, const QPair<float, int>& r) {
+	return l.first > r.first;
+}
+
+/**
+ * Returns the images that should be prefetched ordered by their priority.
+ * The images in browsing direction get higher weights than the ones behind.
+ * @param cIdx the current index.
+ * @param numImages the number of images in the current folder.
+ * @param window the maximal number of images cached.
+ * @return QVector<int> the image indexes (most likely next image first).
+ **/ 
+QVector<int> DkImageCacher::prefetchOrder(int cIdx, int numImages, int window) const {
+
+	QVector<QPair<float, int> > candidates;
+	int stride = qMax(qRound(velocity), 1);
+
+	if (direction) {
+
+		for (int k = 1; k <= window; k++)
+			candidates.append(qMakePair(1.0f/k, cIdx + direction*stride*k));
+		for (int k = 1; k <= qMax(window/3, 1); k++)
+			candidates.append(qMakePair(0.5f/k, cIdx - direction*k));
+	}
+	else {
+		for (int k = 1; k <= window/2+1; k++) {
+			candidates.append(qMakePair(1.0f/k, cIdx + k));
+			candidates.append(qMakePair(1.0f/k, cIdx - k));
 		}
 	}
 
-	qDebug() << "cache with: " << mem << " MB created in: " << dt.getTotal();
+	qStableSort(candidates.begin(), candidates.end(), prefetchWeightGreater);
+
+	QVector<int> order;
+	order.reserve(candidates.size());
+
+	for (int idx = 0; idx < candidates.size(); idx++) {
+
+		int cIdxN = candidates.at(idx).second;
+
+		if (DkSettings::global.loop && numImages)
+			cIdxN = (cIdxN % numImages + numImages) % numImages;
+
+		if (cIdxN >= 0 && cIdxN < numImages && cIdxN != cIdx && !order.contains(cIdxN))
+			order.append(cIdxN);
+	}
+
+	return order;
+}
+
+/**
+ * Moves imgC to a position in the LRU.
+ * @param imgC the image which was used.
+ * @param pos the position (0 is the most recently used).
+ **/ 
+void DkImageCacher::touch(QSharedPointer<DkImageContainerT> imgC, int pos) {
 
+	lru.removeOne(imgC);
+	lru.insert(qMin(pos, lru.size()), imgC);
+}
+
+float DkImageCacher::cachedMemory() const {
+
+	float mem = 0;
+
+	for (int idx = 0; idx < lru.size(); idx++)
+		mem += lru.at(idx)->getMemoryUsage();
+
+	return mem;
 }
 
 /**
@@ -1927,25 +2555,66 @@ QFileInfoList DkImageLoader::getFilteredFileInfoList(const QDir& dir, QStringLis
 	tmpDir.setSorting(QDir::LocaleAware);
 	QStringList fileList = tmpDir.entryList(DkSettings::app.browseFilters);
 	qDebug() << "Qt, sorted file list computed in: " << dt.getIvl();
-	qDebug() << fileList;
 
 #endif
 
-	for (int idx = 0; idx < ignoreKeywords.size(); idx++) {
-		QRegExp exp = QRegExp("^((?!" + ignoreKeywords[idx] + ").)*$");
-		exp.setCaseSensitivity(Qt::CaseInsensitive);
-		fileList = fileList.filter(exp);
-	}
+	fileList = filterKeywords(fileList, ignoreKeywords, keywords);
+	fileList = filterFolderKeywords(fileList, folderKeywords);
+	fileList = filterDuplicates(fileList);
 
-	for (int idx = 0; idx < keywords.size(); idx++) {
-		fileList = fileList.filter(keywords[idx], Qt::CaseInsensitive);
+	//fileList = sort(fileList, dir);
+
+	QFileInfoList fileInfoList;
+	
+	for (int idx = 0; idx < fileList.size(); idx++)
+		fileInfoList.append(QFileInfo(dir, fileList.at(idx)));
+
+	return fileInfoList;
+}
+
+QStringList DkImageLoader::filterKeywords(QStringList fileList, const QStringList& ignoreKeywords, const QStringList& keywords) {
+
+	if (ignoreKeywords.empty() && keywords.empty())
+		return fileList;
+
+	// compile the expressions once - not for every file
+	QVector<QRegExp> ignoreExps;
+	for (int idx = 0; idx < ignoreKeywords.size(); idx++)
+		ignoreExps.append(QRegExp(ignoreKeywords[idx], Qt::CaseInsensitive));
+
+	QStringList resultList;
+
+	for (int idx = 0; idx < fileList.size(); idx++) {
+
+		const QString& cName = fileList.at(idx);
+		bool keep = true;
+
+		for (int kIdx = 0; kIdx < ignoreExps.size() && keep; kIdx++)
+			keep = ignoreExps[kIdx].indexIn(cName) == -1;
+
+		for (int kIdx = 0; kIdx < keywords.size() && keep; kIdx++)
+			keep = cName.contains(keywords[kIdx], Qt::CaseInsensitive);
+
+		if (keep)
+			resultList.append(cName);
 	}
 
+	return resultList;
+}
+
+QStringList DkImageLoader::filterFolderKeywords(const QStringList& fileList, const QStringList& folderKeywords) {
+
 	if (!folderKeywords.empty()) {
 		
-		QStringList resultList = fileList;
-		for (int idx = 0; idx < folderKeywords.size(); idx++) {
-			resultList = resultList.filter(folderKeywords[idx], Qt::CaseInsensitive);
+		QStringList resultList;
+		for (int idx = 0; idx < fileList.size(); idx++) {
+
+			bool keep = true;
+			for (int kIdx = 0; kIdx < folderKeywords.size() && keep; kIdx++)
+				keep = fileList.at(idx).contains(folderKeywords[kIdx], Qt::CaseInsensitive);
+
+			if (keep)
+				resultList.append(fileList.at(idx));
 		}
 
 		// if string match returns nothing -> try a regexp
@@ -1954,58 +2623,66 @@ QFileInfoList DkImageLoader::getFilteredFileInfoList(const QDir& dir, QStringLis
 
 		qDebug() << "filtered file list (get)" << resultList;
 		qDebug() << "keywords: " << folderKeywords;
-		fileList = resultList;
+		return resultList;
 	}
 
+	return fileList;
+}
+
+QStringList DkImageLoader::filterDuplicates(const QStringList& fileList) {
+
 	if (DkSettings::resources.filterDuplicats) {
 
 		QString preferredExtension = DkSettings::resources.preferredExtension;
 		preferredExtension = preferredExtension.replace("*.", "");
 		qDebug() << "preferred extension: " << preferredExtension;
 
-		QStringList resultList = fileList;
-		fileList.clear();
+		// the file names have no path - so we don't need QFileInfo to get base names and suffixes
+		QStringList baseNames;
+		baseNames.reserve(fileList.size());
+		QHash<QString, int> preferredBaseNames;	// base name -> number of files with the preferred extension
+
+		for (int idx = 0; idx < fileList.size(); idx++) {
+			
+			const QString& cName = fileList.at(idx);
+			int dotIdx = cName.indexOf('.');
+			baseNames.append(dotIdx == -1 ? cName : cName.left(dotIdx));
+
+			if (cName.contains(preferredExtension, Qt::CaseInsensitive))
+				preferredBaseNames[baseNames.last()]++;
+		}
+
+		QStringList resultList;
 		
-		for (int idx = 0; idx < resultList.size(); idx++) {
+		for (int idx = 0; idx < fileList.size(); idx++) {
 			
-			QFileInfo cFName = QFileInfo(resultList.at(idx));
+			const QString& cName = fileList.at(idx);
+			int dotIdx = cName.lastIndexOf('.');
+			QString suffix = dotIdx == -1 ? QString() : cName.mid(dotIdx+1);
 
-			if (preferredExtension.compare(cFName.suffix(), Qt::CaseInsensitive) == 0) {
-				fileList.append(resultList.at(idx));
+			if (preferredExtension.compare(suffix, Qt::CaseInsensitive) == 0) {
+				resultList.append(cName);
 				continue;
 			}
 
-			QString cFBase = cFName.baseName();
-			bool remove = false;
-
-			for (int cIdx = 0; cIdx < resultList.size(); cIdx++) {
-
-				QString ccBase = QFileInfo(resultList.at(cIdx)).baseName();
-
-				if (cIdx != idx && ccBase == cFBase && resultList.at(cIdx).contains(preferredExtension, Qt::CaseInsensitive)) {
-					remove = true;
-					break;
-				}
-			}
+			// remove the file if another file with the same base name has the preferred extension
+			int numPreferred = preferredBaseNames.value(baseNames.at(idx));
+			if (cName.contains(preferredExtension, Qt::CaseInsensitive))
+				numPreferred--;
 			
-			if (!remove)
-				fileList.append(resultList.at(idx));
+			if (numPreferred <= 0)
+				resultList.append(cName);
 		}
-	}
 
-	//fileList = sort(fileList, dir);
-
-	QFileInfoList fileInfoList;
-	
-	for (int idx = 0; idx < fileList.size(); idx++)
-		fileInfoList.append(QFileInfo(dir, fileList.at(idx)));
+		return resultList;
+	}
 
-	return fileInfoList;
+	return fileList;
 }
 
 void DkImageLoader::sort() {
 	
-	qSort(images.begin(), images.end(), imageContainerLessThanPtr);
+	sortImagesIntern(images);
 	emit updateDirSignal(images);
 }
 
@@ -77,6 +77,40 @@ class QUrl;
 
 namespace nmc {
 
+/**
+ * Schedules which images of the current folder are kept in memory.
+ * It keeps a LRU list of all images that hold decoded data which is bounded
+ * by DkSettings::resources.cacheMemory. Images are prefetched in both directions
+ * where the direction (and speed) the user is browsing gets the highest priority.
+ * Each update only visits the images around the current one.
+ **/ 
+class DllExport DkImageCacher {
+
+public:
+	DkImageCacher();
+
+	void update(const QVector<QSharedPointer<DkImageContainerT> >& images, QSharedPointer<DkImageContainerT> imgC);
+	void imageRequested(QSharedPointer<DkImageContainerT> imgC);
+	void clear(QSharedPointer<DkImageContainerT> keepImg = QSharedPointer<DkImageContainerT>());
+	QString getStats() const;
+
+protected:
+	int locate(const QVector<QSharedPointer<DkImageContainerT> >& images, QSharedPointer<DkImageContainerT> imgC) const;
+	void updateMotion(int cIdx, int numImages, int window);
+	QVector<int> prefetchOrder(int cIdx, int numImages, int window) const;
+	void touch(QSharedPointer<DkImageContainerT> imgC, int pos = 0);
+	float cachedMemory() const;
+
+	QList<QSharedPointer<DkImageContainerT> > lru;	// most recently used first
+	int lastIdx;
+	int lastNumImages;
+	int direction;		// -1 backward, 1 forward, 0 unknown (e.g. random slideshow)
+	float velocity;		// images per step
+	int numHits;
+	int numMisses;
+	int numCanceled;
+};
+
 /**
  * This class is a basic image loader class.
  * It takes care of the file watches for the current folder,
@@ -123,6 +157,7 @@ public:
 	QString fileName();
 	QSharedPointer<DkImageContainerT> getSkippedImage(int skipIdx, bool searchFile = true, bool recursive = false);
 	void sort();
+	bool isIndexing() const;
 	QSharedPointer<DkImageContainerT> findOrCreateFile(const QFileInfo& file) const;
 	QSharedPointer<DkImageContainerT> findFile(const QFileInfo& file) const;
 	int findFileIdx(const QFileInfo& file, const QVector<QSharedPointer<DkImageContainerT> >& images) const;
@@ -158,6 +193,8 @@ signals:
 	void showInfoSignal(QString msg, int time = 3000, int position = 0);
 	void updateDirSignal(QVector<QSharedPointer<DkImageContainerT> > images);
 	void imageHasGPSSignal(bool hasGPS);
+	void filesIndexedSignal(QFileInfoList files, int generation);	// emitted by the indexing thread
+	void dirIndexedSignal(QFileInfoList files, int generation);		// emitted by the indexing thread
 
 public slots:
 	void changeFile(int skipIdx);
@@ -182,6 +219,8 @@ public slots:
 	void imageLoaded(bool loaded = false);
 	void imageSaved(QFileInfo file, bool saved = true);
 	void imagesSorted();
+	void filesIndexed(QFileInfoList files, int generation);
+	void dirIndexed(QFileInfoList files, int generation);
 	bool unloadFile();
 	void reloadImage();
 
@@ -201,6 +240,28 @@ protected:
 	bool sortingImages;
 	bool sortingIsDirty;
 	QFutureWatcher<QVector<QSharedPointer<DkImageContainerT > > > createImageWatcher;
+	QVector<QFuture<void> > indexFutures;	// stale runs are not waited for
+	QAtomicInt indexGeneration;
+	bool indexing;
+	bool indexingNewDir;
+	bool loadFilePending;
+	int pendingFileIdx;
+	DkImageCacher cacher;
+
+	struct SortEntry {
+		const DkImageContainer* image;
+		QString name;	// natural sort key
+		qint64 key;		// date or random key
+		int sortMode;
+		int idx;
+	};
+
+	struct SortChunk {
+		SortEntry* entries;
+		int first;
+		int mid;
+		int last;
+	};
 
 	// functions
 	void updateCacher(QSharedPointer<DkImageContainerT> imgC);
@@ -212,6 +273,16 @@ protected:
 	void sortImagesThreaded(QVector<QSharedPointer<DkImageContainerT > > images);
 	void createImages(const QFileInfoList& files, bool sort = true);
 	QVector<QSharedPointer<DkImageContainerT > > sortImages(QVector<QSharedPointer<DkImageContainerT > > images) const;
+	static void sortImagesIntern(QVector<QSharedPointer<DkImageContainerT > >& images);
+	void indexDirThreaded(bool newDir);
+	void indexDir(QDir dir, QStringList ignoreKeywords, QStringList keywords, QStringList folderKeywords, int generation);
+	static void computeSortKey(SortEntry& entry);
+	static bool sortEntryLessThan(const SortEntry& l, const SortEntry& r);
+	static void sortChunk(SortChunk& chunk);
+	static void mergeChunk(SortChunk& chunk);
+	static QStringList filterKeywords(QStringList fileList, const QStringList& ignoreKeywords, const QStringList& keywords);
+	static QStringList filterFolderKeywords(const QStringList& fileList, const QStringList& folderKeywords);
+	static QStringList filterDuplicates(const QStringList& fileList);
 };
 
 // deprecated
@@ -38,6 +38,9 @@
 #include <QObject>
 #include <QImage>
 #include <QtConcurrentRun>
+#include <QDateTime>
+#include <QApplication>
+#include <QDesktopWidget>
 
 // quazip
 #ifdef WITH_QUAZIP
@@ -62,6 +65,10 @@ QString DkZipContainer::mZipMarker = "dIrChAr";
  **/ 
 DkImageContainer::DkImageContainer(const QFileInfo& fileInfo) {
 	
+	sortKeyGeneration = 0;
+	sortKeyDateValid = false;
+	sortKeyCreated = 0;
+	sortKeyModified = 0;
 	setFileInfo(fileInfo);
 	loadState = not_loaded;
 	init();
@@ -117,8 +124,8 @@ void DkImageContainer::clear() {
 
 	if (loader)
 		loader->release();
-	if (fileBuffer)
-		fileBuffer->clear();
+	releaseFileBuffer();
+	histogram.clear();
 	init();
 }
 
@@ -173,6 +180,21 @@ QSharedPointer<DkMetaDataT> DkImageContainer::getMetaData() {
 	return getLoader()->getMetaData();
 }
 
+/**
+ * Returns the histogram of the current image.
+ * It is computed once and kept until the image changes.
+ * @return QSharedPointer<DkImageHistogram> the histogram
+ **/ 
+QSharedPointer<DkImageHistogram> DkImageContainer::getHistogram() {
+
+	QImage img = image();
+
+	if (!histogram || histogram->isSampled() || !histogram->isComputedFrom(img))
+		histogram = DkImageHistogram::compute(img);
+
+	return histogram;
+}
+
 QSharedPointer<DkThumbNailT> DkImageContainer::getThumb() {
 
 	if (!thumb) {
@@ -198,13 +220,24 @@ QSharedPointer<QByteArray> DkImageContainer::getFileBuffer() {
 	return fileBuffer;
 }
 
+/**
+ * Releases the file buffer.
+ * Memory mapped files are unmapped as soon as no one else uses the buffer.
+ * Hence, call this function before the file is written, renamed or deleted.
+ **/ 
+void DkImageContainer::releaseFileBuffer() {
+
+	fileBuffer = QSharedPointer<QByteArray>();
+}
+
 float DkImageContainer::getMemoryUsage() const {
 
-	if (!loader)
-		return 0;
+	// fetched files have a buffer but no loader yet
+	// mapped files belong to the file system cache - so just the decoded image is counted
+	float memSize = fileBuffer && !DkMappedBuffer::isMapped(fileBuffer) ? fileBuffer->size()/(1024.0f*1024.0f) : 0;
 
-	float memSize = fileBuffer ? fileBuffer->size()/(1024.0f*1024.0f) : 0;
-	memSize += DkImage::getBufferSizeFloat(loader->image().size(), loader->image().depth());
+	if (loader)
+		memSize += DkImage::getBufferSizeFloat(loader->image().size(), loader->image().depth());
 
 	return memSize;
 }
@@ -237,15 +270,14 @@ void DkImageContainer::setImage(const QImage& img, const QFileInfo& fileInfo) {
 
 void DkImageContainer::setFileInfo(const QFileInfo& fileInfo) {
 
-	this->fileInfo = fileInfo;
+	QString sortKey = DkUtils::naturalSortKey(fileInfo.fileName());
 
-#ifdef WIN32
-#if QT_VERSION < 0x050000
-	this->fileNameStr = fileInfo.fileName().toStdWString();
-#else
-	this->fileNameStr = DkUtils::qStringToStdWString(fileInfo.fileName());
-#endif
-#endif
+	// dates are read the next time they are needed
+	QMutexLocker locker(&sortKeyMutex);
+	this->fileInfo = fileInfo;
+	sortKeyName = sortKey;
+	sortKeyGeneration++;
+	sortKeyDateValid = false;
 }
 
 bool DkImageContainer::hasImage() const {
@@ -261,11 +293,23 @@ int DkImageContainer::getLoadState() const {
 	return loadState;
 }
 
-bool DkImageContainer::loadImage() {
+/**
+ * Reads the file into the file buffer if it is not loaded yet.
+ * Note: psd files are never buffered.
+ * @return bool true if the buffer holds data.
+ **/ 
+bool DkImageContainer::loadBuffer() {
 
 	if (getFileBuffer()->isEmpty())
 		fileBuffer = loadFileToBuffer(fileInfo);
 
+	return fileBuffer && !fileBuffer->isEmpty();
+}
+
+bool DkImageContainer::loadImage() {
+
+	loadBuffer();
+
 	loader = loadImageIntern(fileInfo, getLoader(), fileBuffer);
 
 	return loader->hasImage();
@@ -277,6 +321,10 @@ bool DkImageContainer::saveImage(const QFileInfo fileInfo, int compression /* =
 
 bool DkImageContainer::saveImage(const QFileInfo fileInfo, const QImage saveImg, int compression /* = -1 */) {
 
+	// unmap the file if we overwrite it
+	if (fileInfo.absoluteFilePath() == this->fileInfo.absoluteFilePath())
+		releaseFileBuffer();
+
 	QFileInfo saveFile = saveImageIntern(fileInfo, getLoader(), saveImg, compression);
 
 	saveFile.refresh();
@@ -294,6 +342,13 @@ QSharedPointer<QByteArray> DkImageContainer::loadFileToBuffer(const QFileInfo fi
 		return getZipData()->extractImage(getZipData()->getZipFileInfo(), getZipData()->getImageFileInfo());
 #endif
 
+	// mapped files are read on demand - so psd's can be mapped too
+	// the pages are touched here since this function is used to prefetch files
+	if (DkSettings::resources.mapFileBuffers) {
+		QSharedPointer<QByteArray> ba = DkMappedBuffer::map(fInfo, true);
+		if (ba) return ba;
+	}
+
 	if (fInfo.suffix().contains("psd")) {	// for now just psd's are not cached because their file might be way larger than the part we need to read
 		return QSharedPointer<QByteArray>(new QByteArray());
 	}
@@ -327,7 +382,11 @@ void DkImageContainer::saveMetaData() {
 	if (!loader)
 		return;
 
-	saveMetaDataIntern(fileInfo, loader, fileBuffer);
+	// mapped files cannot be written
+	if (DkMappedBuffer::isMapped(fileBuffer))
+		releaseFileBuffer();
+
+	saveMetaDataIntern(fileInfo, loader, getFileBuffer());
 }
 
 void DkImageContainer::saveMetaDataIntern(const QFileInfo fileInfo, QSharedPointer<DkBasicLoader> loader, QSharedPointer<QByteArray> fileBuffer) {
@@ -367,12 +426,53 @@ QSharedPointer<DkZipContainer> DkImageContainer::getZipData() {
 	return zipData;
 }
 #endif
-#ifdef WIN32
-std::wstring DkImageContainer::getFileNameWStr() const {
-	
-	return fileNameStr;
+/**
+ * Returns the natural sort key of the file name.
+ * This function is thread-safe.
+ * @return QString the sort key (see DkUtils::naturalSortKey).
+ **/ 
+QString DkImageContainer::getSortKeyName() const {
+
+	QMutexLocker locker(&sortKeyMutex);
+	return sortKeyName;
+}
+
+/**
+ * Returns the creation or modification date in ms since epoch.
+ * The dates are read once and cached so that re-sorting a folder
+ * does not query the file system again. This function is thread-safe.
+ * @param sortMode DkSettings::sort_date_created or DkSettings::sort_date_modified
+ * @return qint64 the date in ms since epoch.
+ **/ 
+qint64 DkImageContainer::getSortKeyDate(int sortMode) const {
+
+	sortKeyMutex.lock();
+
+	if (sortKeyDateValid) {
+		qint64 date = (sortMode == DkSettings::sort_date_created) ? sortKeyCreated : sortKeyModified;
+		sortKeyMutex.unlock();
+		return date;
+	}
+
+	// the copy keeps the stat cached by the indexing thread
+	QFileInfo fInfo = fileInfo;
+	int generation = sortKeyGeneration;
+	sortKeyMutex.unlock();
+
+	// stat without holding the lock (network drives)
+	qint64 created = fInfo.created().toMSecsSinceEpoch();
+	qint64 modified = fInfo.lastModified().toMSecsSinceEpoch();
+
+	// the dates are outdated if setFileInfo was called meanwhile
+	QMutexLocker locker(&sortKeyMutex);
+	if (generation == sortKeyGeneration) {
+		sortKeyCreated = created;
+		sortKeyModified = modified;
+		sortKeyDateValid = true;
+	}
+
+	return (sortMode == DkSettings::sort_date_created) ? created : modified;
 }
-#endif
 
 bool imageContainerLessThanPtr(const QSharedPointer<DkImageContainer> l, const QSharedPointer<DkImageContainer> r) {
 
@@ -384,53 +484,30 @@ bool imageContainerLessThanPtr(const QSharedPointer<DkImageContainer> l, const Q
 
 bool imageContainerLessThan(const DkImageContainer& l, const DkImageContainer& r) {
 
-	switch(DkSettings::global.sortMode) {
-
-	case DkSettings::sort_filename:
-#ifdef WIN32
-		// not beautiful if you take a look at the code, but:
-		// time on Win8 with compFilename:
-		//		WinAPI, indexed ( 73872 ) files in:  " 92 ms"
-		//		[DkImageLoader]  73872  containers created in  " 1.825 sec"
-		//		[DkImageLoader] after sorting:  " 52.246 sec"
-		// time on Win8 with direct wCompLogic:
-		//		WinAPI, indexed ( 73872 ) files in:  " 63 ms"
-		//		[DkImageLoader]  73872  containers created in  " 1.203 sec"
-		//		[DkImageLoader] after sorting:  " 14.407 sec"
-		if (DkSettings::global.sortDir == DkSettings::sort_ascending)
-			return DkUtils::wCompLogic(l.getFileNameWStr(), r.getFileNameWStr());
-		else
-			return !DkUtils::wCompLogic(l.getFileNameWStr(), r.getFileNameWStr());
-		break;
-#else
-		if (DkSettings::global.sortDir == DkSettings::sort_ascending)
-			return DkUtils::compFilename(l.file(), r.file());
-		else
-			return DkUtils::compFilenameInv(l.file(), r.file());
-		break;
-#endif
+	int sortMode = DkSettings::global.sortMode;
+	bool ascending = DkSettings::global.sortDir == DkSettings::sort_ascending;
 
-	case DkSettings::sort_date_created:
-		if (DkSettings::global.sortDir == DkSettings::sort_ascending)
-			return DkUtils::compDateCreated(l.file(), r.file());
-		else
-			return DkUtils::compDateCreatedInv(l.file(), r.file());
-		break;
+	switch(sortMode) {
 
-	case DkSettings::sort_date_modified:
-		if (DkSettings::global.sortDir == DkSettings::sort_ascending)
-			return DkUtils::compDateModified(l.file(), r.file());
-		else
-			return DkUtils::compDateModifiedInv(l.file(), r.file());
+	case DkSettings::sort_date_created:
+	case DkSettings::sort_date_modified: {
+		qint64 ld = l.getSortKeyDate(sortMode);
+		qint64 rd = r.getSortKeyDate(sortMode);
 
+		// files with the same date are sorted by their names
+		if (ld != rd)
+			return ascending ? ld < rd : rd < ld;
+		break;
+	}
 	case DkSettings::sort_random:
 		return DkUtils::compRandom(l.file(), r.file());
 
 	default:
-		// filename
-		return DkUtils::compFilename(l.file(), r.file());
+		break;
 	}
-	
+
+	// filename
+	return ascending ? l.getSortKeyName() < r.getSortKeyName() : r.getSortKeyName() < l.getSortKeyName();
 }
 
 // DkImageContainerT --------------------------------------------------------------------
@@ -455,6 +532,9 @@ DkImageContainerT::~DkImageContainerT() {
 	bufferWatcher.cancel();
 	imageWatcher.blockSignals(true);
 	imageWatcher.cancel();
+	fullResWatcher.blockSignals(true);
+	fullResWatcher.cancel();
+	histogramWatcher.blockSignals(true);
 
 	saveMetaData();
 
@@ -514,6 +594,7 @@ void DkImageContainerT::checkForFileUpdates() {
 	// it in nomacs
 	if (waitForUpdate && fileInfo.isReadable()) {
 		waitForUpdate = false;
+		DkThumbCache::instance().remove(fileInfo);
 		getThumb()->setImage(QImage());
 		loadImageThreaded(true);
 	}
@@ -623,6 +704,10 @@ void DkImageContainerT::fetchImage() {
 	qDebug() << "fetching: " << file().absoluteFilePath();
 	fetchingImage = true;
 
+	// JPEGs are decoded with screen resolution and RAWs with half size - the full resolution is loaded on demand (see loadFullResolution)
+	getLoader()->setRawPreviewMode(true);
+	getLoader()->setPreviewSize(DkSettings::resources.screenResolutionFirst ? QApplication::desktop()->screenGeometry().size() : QSize());
+
 	connect(&imageWatcher, SIGNAL(finished()), this, SLOT(imageLoaded()), Qt::UniqueConnection);
 
 	imageWatcher.setFuture(QtConcurrent::run(this, 
@@ -668,14 +753,73 @@ void DkImageContainerT::loadingFinished() {
 		getThumb()->setImage(getLoader()->image());
 	}
 
+	// the histogram panel is shown -> count the pixels while the image is displayed
+	if (DkSettings::app.showHistogram.testBit(DkSettings::app.currentAppMode))
+		computeHistogramThreaded();
+
 	// clear file buffer if it exceeds a certain size?! e.g. psd files
-	if (fileBuffer && fileBuffer->size()/(1024.0f*1024.0f) > DkSettings::resources.cacheMemory*0.5f)
-		fileBuffer->clear();
+	// mapped files are kept since they do not occupy memory
+	if (fileBuffer && !DkMappedBuffer::isMapped(fileBuffer) && fileBuffer->size()/(1024.0f*1024.0f) > DkSettings::resources.cacheMemory*0.5f)
+		releaseFileBuffer();
 	
 	loadState = loaded;
 	emit fileLoadedSignal(true);
 }
 
+/**
+ * Replaces a preview (RAW or JPEG) with the full resolution image.
+ * The image is decoded with a new loader, so the preview
+ * can be displayed until the full resolution is ready.
+ * @param threaded if false, this function returns after the full resolution is loaded.
+ * @return bool true if the full resolution is loaded.
+ **/ 
+bool DkImageContainerT::loadFullResolution(bool threaded) {
+
+	if (loadState != loaded || fetchingImage || fetchingBuffer || !getLoader()->isPreview())
+		return false;
+
+	if (!fullResWatcher.isRunning()) {
+
+		QSharedPointer<DkBasicLoader> fullLoader(new DkBasicLoader());
+		fullLoader->setRawPreviewMode(false);
+
+		qDebug() << "[DkImageContainerT] loading full resolution of: " << file().fileName();
+
+		connect(&fullResWatcher, SIGNAL(finished()), this, SLOT(fullResolutionLoaded()), Qt::UniqueConnection);
+		fullResWatcher.setFuture(QtConcurrent::run(this, 
+			&nmc::DkImageContainerT::loadImageIntern, file(), fullLoader, fileBuffer));
+	}
+	else if (threaded)
+		return false;
+
+	if (!threaded) {
+		fullResWatcher.waitForFinished();
+		fullResolutionLoaded();
+	}
+
+	return true;
+}
+
+void DkImageContainerT::fullResolutionLoaded() {
+
+	// the full resolution was delivered already (see loadFullResolution)
+	if (!getLoader()->isPreview())
+		return;
+
+	QSharedPointer<DkBasicLoader> fullLoader = fullResWatcher.result();
+
+	// keep the preview if the image was released or edited in the meantime
+	if (loadState != loaded || edited || !fullLoader || !fullLoader->hasImage())
+		return;
+
+	loader = fullLoader;
+
+	if (DkSettings::app.showHistogram.testBit(DkSettings::app.currentAppMode))
+		computeHistogramThreaded();
+
+	emit fileLoadedSignal(true);
+}
+
 void DkImageContainerT::downloadFile(const QUrl& url) {
 
 	if (!fileDownloader) {
@@ -745,6 +889,10 @@ void DkImageContainerT::saveMetaDataThreaded() {
 	if (!exists() || getLoader()->getMetaData() && !getLoader()->getMetaData()->isDirty())
 		return;
 
+	// mapped files cannot be written
+	if (DkMappedBuffer::isMapped(fileBuffer))
+		releaseFileBuffer();
+
 	fileUpdateTimer.stop();
 	QFuture<void> future = QtConcurrent::run(this, 
 		&nmc::DkImageContainerT::saveMetaDataIntern, file(), getLoader(), getFileBuffer());
@@ -779,6 +927,10 @@ bool DkImageContainerT::saveImageThreaded(const QFileInfo fileInfo, const QImage
 
 	qDebug() << "attempting to save: " << fileInfo.absoluteFilePath();
 
+	// unmap the file if we overwrite it
+	if (fileInfo.absoluteFilePath() == file().absoluteFilePath())
+		releaseFileBuffer();
+
 	fileUpdateTimer.stop();
 	connect(&saveImageWatcher, SIGNAL(finished()), this, SLOT(savingFinished()), Qt::UniqueConnection);
 
@@ -800,8 +952,7 @@ void DkImageContainerT::savingFinished() {
 		//// reset thumb - loadImageThreaded should do it anyway
 		//thumb = QSharedPointer<DkThumbNailT>(new DkThumbNailT(saveFile, loader->image()));
 
-		if (fileBuffer)
-			fileBuffer->clear();	// do a complete clear?
+		releaseFileBuffer();
 		setFileInfo(saveFile);
 		edited = false;
 		downloaded = false;
@@ -845,6 +996,51 @@ QSharedPointer<DkBasicLoader> DkImageContainerT::getLoader() {
 	return loader;
 }
 
+/**
+ * Returns the histogram of the current image without blocking.
+ * If it is not computed yet, a sampled histogram is returned
+ * and histogramLoadedSignal() is emitted once the full histogram is ready.
+ * @return QSharedPointer<DkImageHistogram> the (approximated) histogram
+ **/ 
+QSharedPointer<DkImageHistogram> DkImageContainerT::getHistogram() {
+
+	QImage img = getLoader()->image();
+
+	if (histogram && histogram->isComputedFrom(img) && !histogram->isSampled())
+		return histogram;
+
+	computeHistogramThreaded();
+
+	if (!histogram || !histogram->isComputedFrom(img))
+		histogram = DkImageHistogram::compute(img, 4);
+
+	return histogram;
+}
+
+void DkImageContainerT::computeHistogramThreaded() {
+
+	if (histogramWatcher.isRunning() || !getLoader()->hasImage())
+		return;
+
+	connect(&histogramWatcher, SIGNAL(finished()), this, SLOT(histogramLoaded()), Qt::UniqueConnection);
+	histogramWatcher.setFuture(QtConcurrent::run(&nmc::DkImageHistogram::compute, getLoader()->image(), 1));
+}
+
+void DkImageContainerT::histogramLoaded() {
+
+	QSharedPointer<DkImageHistogram> h = histogramWatcher.result();
+
+	// the image was changed in the meantime -> count again if the histogram was requested
+	if (!h->isComputedFrom(getLoader()->image())) {
+		if (histogram && histogram->isSampled())
+			computeHistogramThreaded();
+		return;
+	}
+
+	histogram = h;
+	emit histogramLoadedSignal();
+}
+
 QSharedPointer<DkThumbNailT> DkImageContainerT::getThumb() {
 
 	if (!thumb) {
@@ -32,6 +32,8 @@
 #include <QTimer>
 #include <QFileInfo>
 #include <QSharedPointer>
+#include <QAtomicInt>
+#include <QMutex>
 #pragma warning(pop)		// no warnings from includes - end
 
 #pragma warning(disable: 4251)	// TODO: remove
@@ -53,6 +55,7 @@ namespace nmc {
 // nomacs defines
 class DkBasicLoader;
 class DkMetaDataT;
+class DkImageHistogram;
 class DkZipContainer;
 class FileDownloader;
 
@@ -91,18 +94,20 @@ public:
 	virtual QSharedPointer<DkBasicLoader> getLoader();
 	virtual QSharedPointer<DkMetaDataT> getMetaData();
 	virtual QSharedPointer<DkThumbNailT> getThumb();
+	virtual QSharedPointer<DkImageHistogram> getHistogram();
 	virtual QSharedPointer<QByteArray> getFileBuffer();
 #ifdef WITH_QUAZIP
 	QSharedPointer<DkZipContainer> getZipData();
 #endif
-#ifdef WIN32
-	std::wstring getFileNameWStr() const;
-#endif
+	QString getSortKeyName() const;
+	qint64 getSortKeyDate(int sortMode) const;
 
 	bool exists();
 	bool setPageIdx(int skipIdx);
 
 	QSharedPointer<QByteArray> loadFileToBuffer(const QFileInfo fileInfo);
+	void releaseFileBuffer();
+	bool loadBuffer();
 	bool loadImage();
 	void setImage(const QImage& img);
 	void setImage(const QImage& img, const QFileInfo& fileInfo);
@@ -115,12 +120,17 @@ protected:
 	QSharedPointer<QByteArray> fileBuffer;
 	QSharedPointer<DkBasicLoader> loader;
 	QSharedPointer<DkThumbNailT> thumb;
+	QSharedPointer<DkImageHistogram> histogram;
 #ifdef WITH_QUAZIP	
 	QSharedPointer<DkZipContainer> zipData;
 #endif
-#ifdef WIN32
-	std::wstring fileNameStr;	// speeds up sorting of filenames on windows
-#endif
+	// sort keys and fileInfo are read by the sorting threads - setFileInfo might change them meanwhile
+	mutable QMutex sortKeyMutex;
+	QString sortKeyName;	// speeds up sorting of filenames
+	int sortKeyGeneration;	// is increased if the file info changes
+	mutable bool sortKeyDateValid;
+	mutable qint64 sortKeyCreated;
+	mutable qint64 sortKeyModified;
 
 	int loadState;
 	bool edited;
@@ -154,6 +164,7 @@ public:
 	void downloadFile(const QUrl& url);
 
 	bool loadImageThreaded(bool force = false);
+	bool loadFullResolution(bool threaded = true);
 	bool saveImageThreaded(const QFileInfo fileInfo, const QImage saveImg, int compression = -1);
 	bool saveImageThreaded(const QFileInfo fileInfo, int compression = -1);
 	void saveMetaDataThreaded();
@@ -161,6 +172,7 @@ public:
 
 	virtual QSharedPointer<DkBasicLoader> getLoader();
 	virtual QSharedPointer<DkThumbNailT> getThumb();
+	virtual QSharedPointer<DkImageHistogram> getHistogram();
 
 signals:
 	void fileLoadedSignal(bool loaded = true);
@@ -168,6 +180,7 @@ signals:
 	void showInfoSignal(QString msg, int time = 3000, int position = 0);
 	void errorDialogSignal(const QString& msg);
 	void thumbLoadedSignal(bool loaded = true);
+	void histogramLoadedSignal();
 
 public slots:
 	void checkForFileUpdates(); 
@@ -177,10 +190,13 @@ protected slots:
 	void imageLoaded();
 	void savingFinished();
 	void loadingFinished();
+	void fullResolutionLoaded();
 	void fileDownloaded();
+	void histogramLoaded();
 
 protected:
 	void fetchImage();
+	void computeHistogramThreaded();
 	
 	QSharedPointer<QByteArray> loadFileToBuffer(const QFileInfo fileInfo);
 	QSharedPointer<DkBasicLoader> loadImageIntern(const QFileInfo fileInfo, QSharedPointer<DkBasicLoader> loader, const QSharedPointer<QByteArray> fileBuffer);
@@ -189,8 +205,10 @@ protected:
 	
 	QFutureWatcher<QSharedPointer<QByteArray> > bufferWatcher;
 	QFutureWatcher<QSharedPointer<DkBasicLoader> > imageWatcher;
+	QFutureWatcher<QSharedPointer<DkBasicLoader> > fullResWatcher;
 	QFutureWatcher<QFileInfo> saveImageWatcher;
 	QFutureWatcher<bool> saveMetaDataWatcher;
+	QFutureWatcher<QSharedPointer<DkImageHistogram> > histogramWatcher;
 
 	QSharedPointer<FileDownloader> fileDownloader;
 
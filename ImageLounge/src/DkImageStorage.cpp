@@ -34,6 +34,10 @@
 #include <QThread>
 #include <QPixmap>
 #include <QPainter>
+#include <QtConcurrentRun>
+#include <QtConcurrentMap>
+#include <qmath.h>
+#include <float.h>
 #pragma warning(pop)		// no warnings from includes - end
 
 #if defined(WIN32) && !defined(SOCK_STREAM)
@@ -227,6 +231,10 @@ QImage DkImage::resizeImage(const QImage& img, const QSize& newSize, float facto
 		return QImage();
 	}
 
+	// linearization, filtering and gamma encoding in a single pass
+	if (correctGamma && DkResampler::isSupported(img, interpolation))
+		return DkResampler::resize(img, nSize, interpolation);
+
 	Qt::TransformationMode iplQt = Qt::FastTransformation;
 	switch(interpolation) {
 	case ipl_nearest:	
@@ -295,7 +303,7 @@ QImage DkImage::resizeImage(const QImage& img, const QSize& newSize, float facto
 	
 	if (correctGamma)
 		DkImage::gammaToLinear(qImg);
-	qImg.scaled(nSize, Qt::IgnoreAspectRatio, iplQt);
+	qImg = qImg.scaled(nSize, Qt::IgnoreAspectRatio, iplQt);
 	
 	if (correctGamma)
 		DkImage::linearToGamma(qImg);
@@ -395,23 +403,19 @@ void DkImage::mapGammaTable(QImage& img, const QVector<uchar>& gammaTable) {
 
 	//int channels = (img.hasAlphaChannel() || img.format() == QImage::Format_RGB32) ? 4 : 3;
 
+	// a complete table is checked once - each byte is a valid index then
+	if (gammaTable.size() <= UCHAR_MAX) {
+		qDebug() << "[DkImage] gamma table is incomplete: " << gammaTable.size();
+		return;
+	}
+
+	const uchar* gt = gammaTable.constData();
 	uchar* mPtr = img.bits();
 
 	for (int rIdx = 0; rIdx < img.height(); rIdx++) {
 
-		for (int cIdx = 0; cIdx < bpl; cIdx++, mPtr++) {
-
-			if (*mPtr < 0 || *mPtr > gammaTable.size()) {
-				qDebug() << "WRONG VALUE: " << *mPtr;
-				continue;
-			}
-			if ((int)gammaTable[*mPtr] < 0 || (int)gammaTable[*mPtr] > USHRT_MAX) {
-				qDebug() << "WRONG VALUE: " << *mPtr;
-				continue;
-			}
-
-			*mPtr = gammaTable[*mPtr];
-		}
+		for (int cIdx = 0; cIdx < bpl; cIdx++, mPtr++)
+			*mPtr = gt[*mPtr];
 		mPtr += pad;
 	}
 
@@ -786,26 +790,20 @@ void DkImage::mapGammaTable(cv::Mat& img, const QVector<unsigned short>& gammaTa
 
 	DkTimer dt;
 
-	for (int rIdx = 0; rIdx < img.rows; rIdx++) {
-
-		unsigned short* mPtr = img.ptr<unsigned short>(rIdx);
+	if (img.depth() != CV_16U || gammaTable.size() <= USHRT_MAX) {
+		qDebug() << "[DkImage] cannot map gamma table of size: " << gammaTable.size();
+		return;
+	}
 
-		for (int cIdx = 0; cIdx < img.cols; cIdx++) {
+	const unsigned short* gt = gammaTable.constData();
 
-			for (int channelIdx = 0; channelIdx < img.channels(); channelIdx++, mPtr++) {
+	for (int rIdx = 0; rIdx < img.rows; rIdx++) {
 
-				if (*mPtr < 0 || *mPtr > gammaTable.size()) {
-					qDebug() << "WRONG VALUE: " << *mPtr;
-					continue;
-				}
-				if ((int)gammaTable[*mPtr] < 0 || (int)gammaTable[*mPtr] > USHRT_MAX) {
-					qDebug() << "WRONG VALUE: " << *mPtr;
-					continue;
-				}
+		unsigned short* mPtr = img.ptr<unsigned short>(rIdx);
+		int len = img.cols*img.channels();
 
-				*mPtr = gammaTable[*mPtr];
-			}
-		}
+		for (int cIdx = 0; cIdx < len; cIdx++, mPtr++)
+			*mPtr = gt[*mPtr];
 	}
 
 	qDebug() << "gamma computation takes: " << dt.getTotal();
@@ -869,6 +867,32 @@ QImage DkImage::createThumb(const QImage& image) {
 	return thumb;
 };
 
+/**
+ * Returns the size a JPEG should be decoded with.
+ * libjpeg can decode with 1/2, 1/4 or 1/8 of the size in the DCT domain
+ * which is much faster than decoding the full image and resizing it.
+ * The smallest of these sizes that still covers minSize is returned.
+ * If it is passed to QImageReader::setScaledSize, Qt's JPEG handler
+ * chooses the matching scale_denom.
+ * @param size the JPEG's size.
+ * @param minSize the size the image is shown with (the aspect ratio is kept).
+ * @return QSize the decoding size or size if the JPEG should be decoded completely.
+ **/ 
+QSize DkImage::jpegScaledSize(const QSize& size, const QSize& minSize) {
+
+	if (size.isEmpty() || minSize.isEmpty())
+		return size;
+
+	double s = qMin((double)minSize.width()/size.width(), (double)minSize.height()/size.height());
+	int denom = 1;
+
+	while (denom < 8 && s*denom*2 <= 1.0)
+		denom *= 2;
+
+	// floor: Qt's handler computes the scale from the ratio - so we must not round up
+	return QSize(size.width()/denom, size.height()/denom);
+}
+
 QColor DkImage::getMeanColor(const QImage& img) {
 
 	// some speed-up params
@@ -921,6 +945,505 @@ QColor DkImage::getMeanColor(const QImage& img) {
 }
 
 
+// DkResampler --------------------------------------------------------------------
+QVector<float> DkResampler::linearTable;
+QVector<uchar> DkResampler::gammaTable;
+
+/**
+ * Returns true if the image can be resampled without conversion.
+ * Nearest neighbor is not gamma sensitive and thus left to the default path.
+ * @param img the image to resize
+ * @param interpolation the interpolation method (DkImage::ipl_*)
+ * @return bool true if resize() handles the image
+ **/ 
+bool DkResampler::isSupported(const QImage& img, int interpolation) {
+
+	if (interpolation <= DkImage::ipl_nearest || interpolation >= DkImage::ipl_end)
+		return false;
+
+	return img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32;
+}
+
+/**
+ * Resizes the image with gamma correction.
+ * Every source pixel is linearized, filtered and gamma encoded in one pass
+ * which replaces the four full image passes of the 16 bit round trip.
+ * The alpha channel is filtered without gamma correction.
+ * @param img a RGB32 or ARGB32 image
+ * @param newSize the new size
+ * @param interpolation the interpolation method (DkImage::ipl_*)
+ * @return QImage the resized image
+ **/ 
+QImage DkResampler::resize(const QImage& img, const QSize& newSize, int interpolation /* = DkImage::ipl_cubic */) {
+
+	if (!isSupported(img, interpolation) || newSize.width() < 1 || newSize.height() < 1)
+		return QImage();
+
+	DkTimer dt;
+
+	createTables();
+
+	QImage dstImg(newSize, img.format());
+
+	if (dstImg.isNull())	// out of memory
+		return dstImg;
+
+	// cv::resize only uses the area weights if the image gets smaller
+	// and switches to the faster area filter for linear 2x downsampling
+	KernelType type = kernel_cubic;
+	bool shrink = img.width() >= newSize.width() && img.height() >= newSize.height();
+
+	switch (interpolation) {
+	case DkImage::ipl_area:		type = shrink ? kernel_area : kernel_area_linear; break;
+	case DkImage::ipl_linear:	type = (img.width() == newSize.width()*2 && img.height() == newSize.height()*2) ? kernel_area : kernel_linear; break;
+	case DkImage::ipl_cubic:	type = kernel_cubic; break;
+#ifdef DISABLE_LANCZOS
+	case DkImage::ipl_lanczos:	type = kernel_cubic; break;
+#else
+	case DkImage::ipl_lanczos:	type = kernel_lanczos; break;
+#endif
+	}
+
+	Kernel kx = createKernel(img.width(), newSize.width(), type);
+	Kernel ky = createKernel(img.height(), newSize.height(), type);
+
+	// don't call scanLine() in the threads - it might detach the images
+	const uchar* src = img.bits();
+	uchar* dst = dstImg.bits();
+
+	// bands are small enough to keep the filtered rows in the cache
+	int numBands = qMax(QThread::idealThreadCount()*4, newSize.height()/32);
+	int bandRows = qMax((newSize.height() + numBands - 1) / numBands, 1);
+	QVector<Band> bands;
+
+	for (int row = 0; row < newSize.height(); row += bandRows) {
+		Band band;
+		band.src = src;
+		band.srcBpl = img.bytesPerLine();
+		band.srcWidth = img.width();
+		band.dst = dst;
+		band.dstBpl = dstImg.bytesPerLine();
+		band.dstWidth = newSize.width();
+		band.firstRow = row;
+		band.lastRow = qMin(row+bandRows, newSize.height());
+		band.kx = &kx;
+		band.ky = &ky;
+		bands.append(band);
+	}
+
+	QtConcurrent::blockingMap(bands, computeBand);
+
+	qDebug() << "[DkResampler]" << img.size() << "->" << newSize << "in" << dt.getTotal();
+
+	return dstImg;
+}
+
+/**
+ * Computes the weights of one axis like cv::resize does.
+ * Taps that fall outside the image are clamped to the border.
+ * @param srcSize the source size
+ * @param dstSize the destination size
+ * @param type the kernel type
+ * @return DkResampler::Kernel the weight table (dstSize*size entries)
+ **/ 
+DkResampler::Kernel DkResampler::createKernel(int srcSize, int dstSize, KernelType type) {
+
+	Kernel kernel;
+	double scale = (double)srcSize/dstSize;
+
+	if (type == kernel_area) {
+
+		// coverage of each source pixel (see computeResizeAreaTab)
+		kernel.size = qCeil(scale) + 1;
+		kernel.offsets.fill(0, dstSize*kernel.size);
+		kernel.weights.fill(0.0f, dstSize*kernel.size);
+
+		for (int dx = 0; dx < dstSize; dx++) {
+
+			double fsx1 = dx*scale;
+			double fsx2 = fsx1 + scale;
+			double cellWidth = qMin(scale, srcSize - fsx1);
+			int sx2 = qMin(qFloor(fsx2), srcSize-1);
+			int sx1 = qMin(qCeil(fsx1), sx2);
+			int idx = dx*kernel.size;
+			int last = idx+kernel.size;
+
+			if (sx1 - fsx1 > 1e-3 && idx < last) {
+				kernel.offsets[idx] = sx1-1;
+				kernel.weights[idx++] = (float)((sx1 - fsx1) / cellWidth);
+			}
+			for (int sx = sx1; sx < sx2 && idx < last; sx++) {
+				kernel.offsets[idx] = sx;
+				kernel.weights[idx++] = (float)(1.0 / cellWidth);
+			}
+			if (fsx2 - sx2 > 1e-3 && idx < last) {
+				kernel.offsets[idx] = sx2;
+				kernel.weights[idx++] = (float)(qMin(qMin(fsx2 - sx2, 1.0), cellWidth) / cellWidth);
+			}
+
+			// padded taps have zero weight
+			for (; idx < last; idx++)
+				kernel.offsets[idx] = sx2;
+		}
+
+		return kernel;
+	}
+
+	switch (type) {
+	case kernel_area_linear:
+	case kernel_linear:		kernel.size = 2; break;
+	case kernel_cubic:		kernel.size = 4; break;
+	default:				kernel.size = 8; break;
+	}
+
+	kernel.offsets.resize(dstSize*kernel.size);
+	kernel.weights.resize(dstSize*kernel.size);
+	int kCenter = kernel.size/2 - 1;
+	
+	for (int dx = 0; dx < dstSize; dx++) {
+
+		float fx;
+		int sx;
+
+		if (type == kernel_area_linear) {
+			sx = qFloor(dx*scale);
+			fx = (float)((dx+1) - (sx+1)*((double)dstSize/srcSize));
+			fx = fx <= 0 ? 0.0f : fx - qFloor(fx);
+		}
+		else {
+			fx = (float)((dx+0.5)*scale - 0.5);
+			sx = qFloor(fx);
+			fx -= sx;
+		}
+
+		// cubic and lanczos use border replication, linear kernels move the sample
+		if (type == kernel_linear || type == kernel_area_linear) {
+			if (sx < 0)
+				fx = 0, sx = 0;
+			if (sx >= srcSize-1)
+				fx = 0, sx = srcSize-1;
+		}
+
+		float* w = kernel.weights.data() + dx*kernel.size;
+
+		if (kernel.size == 2) {
+			w[0] = 1.0f - fx;
+			w[1] = fx;
+		}
+		else if (kernel.size == 4) {
+			const float A = -0.75f;
+			w[0] = ((A*(fx + 1) - 5*A)*(fx + 1) + 8*A)*(fx + 1) - 4*A;
+			w[1] = ((A + 2)*fx - (A + 3))*fx*fx + 1;
+			w[2] = ((A + 2)*(1 - fx) - (A + 3))*(1 - fx)*(1 - fx) + 1;
+			w[3] = 1.0f - w[0] - w[1] - w[2];
+		}
+		else if (fx < FLT_EPSILON) {
+			for (int k = 0; k < 8; k++)
+				w[k] = 0.0f;
+			w[3] = 1.0f;
+		}
+		else {
+			// lanczos4 using the sine of 45 degree steps
+			static const double s45 = 0.70710678118654752440084436210485;
+			static const double cs[][2] = {{1, 0}, {-s45, -s45}, {0, 1}, {s45, -s45}, {-1, 0}, {s45, s45}, {0, -1}, {-s45, s45}};
+			double y0 = -(fx+3)*M_PI*0.25;
+			double s0 = std::sin(y0), c0 = std::cos(y0);
+			float sum = 0.0f;
+
+			for (int k = 0; k < 8; k++) {
+				double y = -(fx+3-k)*M_PI*0.25;
+				w[k] = (float)((cs[k][0]*s0 + cs[k][1]*c0)/(y*y));
+				sum += w[k];
+			}
+
+			sum = 1.0f/sum;
+			for (int k = 0; k < 8; k++)
+				w[k] *= sum;
+		}
+
+		for (int k = 0; k < kernel.size; k++)
+			kernel.offsets[dx*kernel.size+k] = qMin(qMax(sx + k - kCenter, 0), srcSize-1);
+	}
+
+	return kernel;
+}
+
+/**
+ * Resamples the rows [firstRow lastRow) of the destination image.
+ * Source rows are linearized and filtered horizontally into a float buffer,
+ * the vertical filter then writes the gamma encoded result.
+ * All inner loops run over contiguous floats so that the compiler can vectorize them.
+ * @param band the band to compute
+ **/ 
+void DkResampler::computeBand(Band& band) {
+
+	const Kernel& kx = *band.kx;
+	const Kernel& ky = *band.ky;
+	const float* lin = linearTable.constData();
+	const uchar* gam = gammaTable.constData();
+
+	// source rows needed by this band
+	int firstSrc = ky.offsets[band.firstRow*ky.size];
+	int lastSrc = firstSrc;
+
+	for (int idx = band.firstRow*ky.size; idx < band.lastRow*ky.size; idx++) {
+		firstSrc = qMin(firstSrc, ky.offsets[idx]);
+		lastSrc = qMax(lastSrc, ky.offsets[idx]);
+	}
+
+	int dstLen = band.dstWidth*4;
+	QVector<float> srcRow(band.srcWidth*4);
+	QVector<float> rows((lastSrc-firstSrc+1)*dstLen);
+	QVector<float> acc(dstLen);
+
+	// horizontal pass
+	for (int sy = firstSrc; sy <= lastSrc; sy++) {
+
+		const uchar* sPtr = band.src + sy*band.srcBpl;
+		float* lPtr = srcRow.data();
+
+		for (int idx = 0; idx < band.srcWidth*4; idx += 4) {
+			lPtr[idx]   = lin[sPtr[idx]];
+			lPtr[idx+1] = lin[sPtr[idx+1]];
+			lPtr[idx+2] = lin[sPtr[idx+2]];
+			lPtr[idx+3] = sPtr[idx+3]*257.0f;	// alpha is not gamma corrected
+		}
+
+		float* rPtr = rows.data() + (sy-firstSrc)*dstLen;
+		const int* ofs = kx.offsets.constData();
+		const float* w = kx.weights.constData();
+
+		for (int dx = 0; dx < band.dstWidth; dx++, rPtr += 4) {
+
+			float v[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+			for (int k = 0; k < kx.size; k++, ofs++, w++) {
+				const float* p = lPtr + *ofs*4;
+				v[0] += *w*p[0];
+				v[1] += *w*p[1];
+				v[2] += *w*p[2];
+				v[3] += *w*p[3];
+			}
+
+			rPtr[0] = v[0];
+			rPtr[1] = v[1];
+			rPtr[2] = v[2];
+			rPtr[3] = v[3];
+		}
+	}
+
+	// vertical pass
+	for (int dy = band.firstRow; dy < band.lastRow; dy++) {
+
+		const int* ofs = ky.offsets.constData() + dy*ky.size;
+		const float* w = ky.weights.constData() + dy*ky.size;
+		float* aPtr = acc.data();
+
+		const float* rPtr = rows.constData() + (ofs[0]-firstSrc)*dstLen;
+		for (int idx = 0; idx < dstLen; idx++)
+			aPtr[idx] = w[0]*rPtr[idx];
+
+		for (int k = 1; k < ky.size; k++) {
+			
+			rPtr = rows.constData() + (ofs[k]-firstSrc)*dstLen;
+			for (int idx = 0; idx < dstLen; idx++)
+				aPtr[idx] += w[k]*rPtr[idx];
+		}
+
+		uchar* dPtr = band.dst + dy*band.dstBpl;
+
+		for (int idx = 0; idx < dstLen; idx += 4) {
+			dPtr[idx]   = gam[qBound(0, qRound(aPtr[idx]), USHRT_MAX)];
+			dPtr[idx+1] = gam[qBound(0, qRound(aPtr[idx+1]), USHRT_MAX)];
+			dPtr[idx+2] = gam[qBound(0, qRound(aPtr[idx+2]), USHRT_MAX)];
+			dPtr[idx+3] = (uchar)((qBound(0, qRound(aPtr[idx+3]), USHRT_MAX) + 128)/257);
+		}
+	}
+}
+
+/**
+ * Creates the lookup tables once.
+ * They are derived from the 16 bit tables which makes the
+ * results equal to the CV_16U round trip.
+ **/ 
+void DkResampler::createTables() {
+
+	static QMutex mutex;
+	QMutexLocker locker(&mutex);
+
+	if (!gammaTable.empty())
+		return;
+
+	QVector<unsigned short> g2l = DkImage::getGamma2LinearTable<unsigned short>();
+	QVector<unsigned short> l2g = DkImage::getLinear2GammaTable<unsigned short>();
+
+	QVector<float> lt(256);
+	for (int idx = 0; idx < lt.size(); idx++)
+		lt[idx] = g2l[idx*257];
+
+	QVector<uchar> gt(USHRT_MAX+1);
+	for (int idx = 0; idx < gt.size(); idx++)
+		gt[idx] = (uchar)qBound(0, qRound(l2g[idx]*255.0f/USHRT_MAX), 255);
+
+	linearTable = lt;
+	gammaTable = gt;	// assigned last: it marks the tables as ready
+}
+
+// DkImageHistogram --------------------------------------------------------------------
+DkImageHistogram::DkImageHistogram() {
+
+	memset(hist, 0, sizeof(hist));
+	maxValue = 0;
+	sampleStep = 1;
+	imgKey = 0;
+}
+
+/**
+ * Computes the histogram of an image.
+ * 8, 24 and 32 bit images are read directly, all other formats are converted.
+ * 8 bit images are counted by their values (not their color table).
+ * @param img the image
+ * @param sampleStep only every sampleStep-th row and column is counted if > 1
+ * @return QSharedPointer<DkImageHistogram> the histogram (empty if img is null)
+ **/ 
+QSharedPointer<DkImageHistogram> DkImageHistogram::compute(const QImage& img, int sampleStep /* = 1 */) {
+
+	QSharedPointer<DkImageHistogram> histogram(new DkImageHistogram());
+
+	if (img.isNull())
+		return histogram;
+
+	DkTimer dt;
+
+	QImage cImg = img;
+	if (img.depth() != 8 && img.depth() != 24 && img.depth() != 32)
+		cImg = img.convertToFormat(QImage::Format_ARGB32);
+
+	// bands start at sampled rows
+	sampleStep = qMax(sampleStep, 1);
+	int bandRows = 64*sampleStep;
+	QVector<Band> bands;
+
+	for (int row = 0; row < cImg.height(); row += bandRows) {
+		Band band;
+		band.img = &cImg;
+		band.firstRow = row;
+		band.lastRow = qMin(row+bandRows, cImg.height());
+		band.sampleStep = sampleStep;
+		bands.append(band);
+	}
+
+	QtConcurrent::blockingMap(bands, computeBand);
+
+	for (int bIdx = 0; bIdx < bands.size(); bIdx++) {
+		for (int cIdx = 0; cIdx < 3; cIdx++) {
+			for (int idx = 0; idx < 256; idx++)
+				histogram->hist[cIdx][idx] += bands[bIdx].hist[cIdx][idx];
+		}
+	}
+
+	for (int cIdx = 0; cIdx < 3; cIdx++) {
+		for (int idx = 0; idx < 256; idx++)
+			histogram->maxValue = qMax(histogram->maxValue, histogram->hist[cIdx][idx]);
+	}
+
+	histogram->sampleStep = sampleStep;
+	histogram->imgKey = img.cacheKey();
+
+	qDebug() << "[DkImageHistogram] computed (sample step: " << sampleStep << ") in " << dt.getTotal();
+
+	return histogram;
+}
+
+/**
+ * Counts the pixels of the rows [firstRow lastRow).
+ * @param band the band to compute
+ **/ 
+void DkImageHistogram::computeBand(Band& band) {
+
+	const QImage& img = *band.img;
+	const int step = band.sampleStep;
+
+	quint32 bins[3][256];
+	memset(bins, 0, sizeof(bins));
+
+	for (int rIdx = band.firstRow; rIdx < band.lastRow; rIdx += step) {
+
+		const uchar* ptr = img.constScanLine(rIdx);
+
+		// 32 bit images
+		if (img.depth() == 32) {
+
+			const QRgb* pixel = (const QRgb*)ptr;
+
+			for (int cIdx = 0; cIdx < img.width(); cIdx += step) {
+				bins[0][qRed(pixel[cIdx])]++;
+				bins[1][qGreen(pixel[cIdx])]++;
+				bins[2][qBlue(pixel[cIdx])]++;
+			}
+		}
+		// 24 bit images
+		else if (img.depth() == 24) {
+
+			for (int cIdx = 0; cIdx < img.width(); cIdx += step) {
+				const uchar* pixel = ptr + cIdx*3;
+				bins[0][pixel[0]]++;
+				bins[1][pixel[1]]++;
+				bins[2][pixel[2]]++;
+			}
+		}
+		// 8 bit images
+		else {
+
+			for (int cIdx = 0; cIdx < img.width(); cIdx += step)
+				bins[0][ptr[cIdx]]++;
+		}
+	}
+
+	// 8 bit values are counted in all channels
+	bool gray = img.depth() == 8;
+
+	for (int cIdx = 0; cIdx < 3; cIdx++) {
+		for (int idx = 0; idx < 256; idx++)
+			band.hist[cIdx][idx] = bins[gray ? 0 : cIdx][idx];
+	}
+}
+
+bool DkImageHistogram::isEmpty() const {
+
+	return maxValue == 0;
+}
+
+/**
+ * Returns true if the histogram is an approximation.
+ * @return bool true if not all pixels were counted
+ **/ 
+bool DkImageHistogram::isSampled() const {
+
+	return sampleStep > 1;
+}
+
+/**
+ * Returns true if the histogram belongs to img.
+ * Copies of an image share their cache key.
+ * @param img the image
+ * @return bool true if the histogram was computed from img
+ **/ 
+bool DkImageHistogram::isComputedFrom(const QImage& img) const {
+
+	return !img.isNull() && img.cacheKey() == imgKey;
+}
+
+long DkImageHistogram::getMaxValue() const {
+
+	return maxValue;
+}
+
+long DkImageHistogram::value(int channel, int bin) const {
+
+	return hist[channel][bin];
+}
+
 // DkImageStorage --------------------------------------------------------------------
 DkImageStorage::DkImageStorage(QImage img) {
 	this->img = img;
@@ -931,6 +1454,20 @@ DkImageStorage::DkImageStorage(QImage img) {
 
 	busy = false;
 	stop = true;
+
+	tileMemory = 0;
+	tileClock = 0;
+	tileGeneration = 0;
+	maxTileLevel = 0;
+}
+
+DkImageStorage::~DkImageStorage() {
+
+	// running tile computations must not access us anymore
+	clearTiles();
+
+	for (int idx = 0; idx < tileFutures.size(); idx++)
+		tileFutures[idx].waitForFinished();
 }
 
 void DkImageStorage::setImage(QImage img) {
@@ -938,6 +1475,13 @@ void DkImageStorage::setImage(QImage img) {
 	stop = true;
 	imgs.clear();	// is it save (if the thread is still working?)
 	this->img = img;
+
+	clearTiles();
+
+	// number of levels until the image fits into a single tile
+	maxTileLevel = 0;
+	for (QSize s = img.size(); s.width() > tile_size || s.height() > tile_size; s = (s+QSize(1,1))/2)
+		maxTileLevel++;
 }
 
 void DkImageStorage::antiAliasingChanged(bool antiAliasing) {
@@ -947,6 +1491,7 @@ void DkImageStorage::antiAliasingChanged(bool antiAliasing) {
 	if (!antiAliasing) {
 		stop = true;
 		imgs.clear();
+		clearTiles();
 	}
 
 	emit infoSignal((antiAliasing) ? tr("Anti Aliasing Enabled") : tr("Anti Aliasing Disabled"));
@@ -961,7 +1506,8 @@ QImage DkImageStorage::getImageConst() const {
 
 QImage DkImageStorage::getImage(float factor) {
 
-	if (factor >= 0.5f || img.isNull() || !DkSettings::display.antiAliasing)
+	// tiled images have no pyramid - see getTiles()
+	if (factor >= 0.5f || img.isNull() || !DkSettings::display.antiAliasing || isTiled())
 		return img;
 
 	// check if we have an image similar to that requested
@@ -990,52 +1536,58 @@ void DkImageStorage::computeImage() {
 
 	DkTimer dt;
 	busy = true;
-	QImage resizedImg = img;
-	
 
-	// down sample the image until it is twice times full HD
+	// all levels are computed from the full resolution image
 	QSize iSize = img.size();
-	while (iSize.width() > 2*1920 && iSize.height() > 2*1920)	// in general we need less than 200 ms for the whole downscaling if we start at 1500 x 1500
-		iSize *= 0.5;
-
-	// for extreme panorama images the Qt scaling crashes (if we have a width > 30000) so we simply 
-	if (qMax(iSize.width(), iSize.height()) < 20000)
-		resizedImg = resizedImg.scaled(iSize, Qt::KeepAspectRatio, Qt::FastTransformation);
+	QVector<QImage> levels;
+	QImage::Format format = img.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32;
+	levels.append(img.format() == format ? img : img.convertToFormat(format));
 
 	// it would be pretty strange if we needed more than 30 sub-images
 	for (int idx = 0; idx < 30; idx++) {
 
-		QSize s = resizedImg.size();
-		s *= 0.5;
+		QSize s = (levels.last().size() + QSize(1,1))/2;
 
 		if (s.width() < 32 || s.height() < 32)
 			break;
 
-		// // mapping here introduces bugs
-		//DkImage::gammaToLinear(resizedImg);
+		levels.append(QImage(s, format));
 
-#ifdef WITH_OPENCV
-		cv::Mat rImgCv = DkImage::qImage2Mat(resizedImg);
-		cv::Mat tmp;
-		cv::resize(rImgCv, tmp, cv::Size(s.width(), s.height()), 0, 0, CV_INTER_AREA);
-		resizedImg = DkImage::mat2QImage(tmp);
-#else
-		resizedImg = resizedImg.scaled(s, Qt::KeepAspectRatio, Qt::SmoothTransformation);
-#endif
+		if (levels.last().isNull())	// out of memory
+			break;
+	}
 
-		// // mapping here introduces bugs
-		//DkImage::linearToGamma(resizedImg);
-		
-		//resizedImg.setColorTable(img.colorTable());		// Not sure why we turned the color tables off
+	// levels within a band only depend on their own band
+	// so we can compute up to 5 levels per band in parallel
+	int numParallel = qMin(levels.size()-1, 5);
+	int bandRows = 4 << numParallel;
+	QVector<Band> bands;
+
+	for (int row = 0; row < img.height(); row += bandRows) {
+		Band band;
+		band.firstRow = row;
+		band.lastRow = qMin(row+bandRows, img.height());
+		band.levels = &levels;
+		bands.append(band);
+	}
 
-		// new image assigned?
-		if (stop)
-			break;
+	QtConcurrent::blockingMap(bands, computeBand);
 
-		mutex.lock();
-		imgs.push_front(resizedImg);
-		mutex.unlock();
+	// the small levels are computed directly
+	for (int idx = numParallel+1; idx < levels.size() && !stop; idx++)
+		DkImage::downsample2x2(levels[idx-1], levels[idx], 0, levels[idx].height());
+
+	// keep all levels that are smaller than twice times full HD
+	while (iSize.width() > 2*1920 && iSize.height() > 2*1920)
+		iSize *= 0.5;
+
+	mutex.lock();
+	for (int idx = 1; idx < levels.size() && !stop; idx++) {
+
+		if (levels[idx].width() <= iSize.width() || levels[idx].height() <= iSize.height())
+			imgs.push_front(levels[idx]);
 	}
+	mutex.unlock();
 
 	busy = false;
 
@@ -1049,4 +1601,393 @@ void DkImageStorage::computeImage() {
 
 }
 
+/**
+ * Computes a band of rows for all levels of the pyramid.
+ * Bands are aligned such that each level only needs the rows
+ * of its own band in the finer level.
+ **/ 
+void DkImageStorage::computeBand(Band& band) {
+
+	QVector<QImage>& levels = *band.levels;
+	int numParallel = qMin(levels.size()-1, 5);
+
+	for (int idx = 1; idx <= numParallel; idx++) {
+
+		int firstRow = band.firstRow >> idx;
+		int lastRow = qMin((band.lastRow + (1 << idx)-1) >> idx, levels[idx].height());
+
+		DkImage::downsample2x2(levels[idx-1], levels[idx], firstRow, lastRow);
+	}
+}
+
+/**
+ * Returns true if the image is too large for the pyramid.
+ * Tiled images should be drawn using getTiles().
+ * @return bool true if the image is tiled.
+ **/ 
+bool DkImageStorage::isTiled() const {
+
+	return (qint64)img.width()*img.height() > tile_min_pixels || 
+		img.width() > tile_max_side || img.height() > tile_max_side;
+}
+
+/**
+ * Returns the tiles needed to draw the visible part of a tiled image.
+ * Tiles which are not computed yet are scheduled (in parallel) and
+ * replaced by coarser tiles meanwhile (or not drawn at all).
+ * imageUpdated() is emitted if new tiles are available.
+ * @param visibleRect the visible part of the image (image coordinates).
+ * @param factor the current zoom factor.
+ * @return QVector<DkImageTile> the tiles to be drawn.
+ **/ 
+QVector<DkImageTile> DkImageStorage::getTiles(const QRect& visibleRect, float factor) {
+
+	QVector<DkImageTile> visibleTiles;
+	QRect vRect = visibleRect.intersected(img.rect());
+
+	if (vRect.isEmpty())
+		return visibleTiles;
+
+	// find the level which is just larger than the zoom factor
+	int level = 0;
+	if (DkSettings::display.antiAliasing) {
+		while (level < maxTileLevel && factor <= 1.0f/(2 << level))
+			level++;
+	}
+
+	// full resolution: draw the visible part only
+	if (level == 0) {
+		DkImageTile tile;
+		tile.rect = vRect;
+		tile.img = img;
+		tile.srcRect = vRect;
+		visibleTiles.append(tile);
+		return visibleTiles;
+	}
+
+	int extent = tile_size << level;	// tile size in image coordinates
+
+	QMutexLocker locker(&mutex);
+
+	for (int ty = vRect.top()/extent; ty <= vRect.bottom()/extent; ty++) {
+		for (int tx = vRect.left()/extent; tx <= vRect.right()/extent; tx++) {
+
+			DkImageTile tile;
+			tile.rect = tileRect(img.size(), level, tx, ty);
+
+			quint64 key = tileKey(level, tx, ty);
+			QHash<quint64, Tile>::iterator tIter = tiles.find(key);
+
+			if (tIter != tiles.end()) {
+				tIter.value().lastAccess = ++tileClock;
+				tile.img = tIter.value().img;
+				tile.srcRect = tile.img.rect();
+				visibleTiles.append(tile);
+				continue;
+			}
+
+			if (!pendingTiles.contains(key)) {
+
+				// forget about finished computations
+				for (int idx = tileFutures.size()-1; idx >= 0; idx--) {
+					if (tileFutures.at(idx).isFinished())
+						tileFutures.remove(idx);
+				}
+
+				pendingTiles.insert(key);
+				tileFutures.append(QtConcurrent::run(this, &DkImageStorage::computeTile, img, level, tx, ty, tileGeneration));
+			}
+
+			// try to find a coarser tile
+			for (int pLevel = level+1; pLevel <= maxTileLevel && tile.img.isNull(); pLevel++) {
+
+				int d = pLevel-level;
+				tIter = tiles.find(tileKey(pLevel, tx >> d, ty >> d));
+
+				if (tIter != tiles.end()) {
+					QRect pRect = tileRect(img.size(), pLevel, tx >> d, ty >> d);
+					tile.img = tIter.value().img;
+					tile.srcRect = QRect((tile.rect.x()-pRect.x()) >> pLevel, (tile.rect.y()-pRect.y()) >> pLevel, 
+						qMax(tile.rect.width() >> pLevel, 1), qMax(tile.rect.height() >> pLevel, 1));
+				}
+			}
+
+			// nothing found - scaling the full resolution would block the GUI, so we leave a gap until the tile arrives
+			if (!tile.img.isNull())
+				visibleTiles.append(tile);
+		}
+	}
+
+	return visibleTiles;
+}
+
+/**
+ * Halves an image by averaging 2x2 pixels.
+ * The result has a 32 bit format (RGB32 or ARGB32).
+ * Odd borders are averaged with themselves.
+ * @param img the image to be down sampled.
+ * @return QImage an image with half the size.
+ **/ 
+QImage DkImage::downsample2x2(const QImage& img) {
+
+	QImage::Format format = img.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32;
+	QImage src = (img.format() == format) ? img : img.convertToFormat(format);
+
+	QImage dst((src.width()+1)/2, (src.height()+1)/2, format);
+
+	if (!dst.isNull())
+		downsample2x2(src, dst, 0, dst.height());
+
+	return dst;
+}
+
+/**
+ * Halves the rows [firstRow lastRow[ of dst by averaging 2x2 pixels of src.
+ * Both images need a 32 bit format and dst must have half the size of src.
+ * Rows are independent - so different rows can be computed in parallel.
+ * @param src the image to be down sampled.
+ * @param dst the half-size image.
+ * @param firstRow the first row of dst.
+ * @param lastRow the row after the last row of dst.
+ **/ 
+void DkImage::downsample2x2(const QImage& src, QImage& dst, int firstRow, int lastRow) {
+
+	// scanLine() detaches which is not thread-safe - the caller owns dst anyway
+	uchar* dstBits = const_cast<uchar*>(dst.constBits());
+	int fullPairs = src.width()/2;
+
+	for (int y = firstRow; y < lastRow; y++) {
+
+		const quint32* r0 = (const quint32*)src.constScanLine(y*2);
+		const quint32* r1 = (const quint32*)src.constScanLine(qMin(y*2+1, src.height()-1));
+		quint32* d = (quint32*)(dstBits + y*dst.bytesPerLine());
+
+		// average two channels at once (no branches -> the compiler can vectorize this loop)
+		for (int x = 0; x < fullPairs; x++) {
+
+			quint32 p00 = r0[2*x], p01 = r0[2*x+1], p10 = r1[2*x], p11 = r1[2*x+1];
+
+			quint32 rb = (p00 & 0x00ff00ff) + (p01 & 0x00ff00ff) + (p10 & 0x00ff00ff) + (p11 & 0x00ff00ff) + 0x00020002;
+			quint32 ag = ((p00 >> 8) & 0x00ff00ff) + ((p01 >> 8) & 0x00ff00ff) + ((p10 >> 8) & 0x00ff00ff) + ((p11 >> 8) & 0x00ff00ff) + 0x00020002;
+
+			d[x] = ((rb >> 2) & 0x00ff00ff) | (((ag >> 2) & 0x00ff00ff) << 8);
+		}
+
+		// odd width: the last column is averaged with itself
+		if (fullPairs < dst.width()) {
+
+			quint32 p0 = r0[src.width()-1], p1 = r1[src.width()-1];
+			quint32 rb = 2*(p0 & 0x00ff00ff) + 2*(p1 & 0x00ff00ff) + 0x00020002;
+			quint32 ag = 2*((p0 >> 8) & 0x00ff00ff) + 2*((p1 >> 8) & 0x00ff00ff) + 0x00020002;
+
+			d[fullPairs] = ((rb >> 2) & 0x00ff00ff) | (((ag >> 2) & 0x00ff00ff) << 8);
+		}
+	}
+}
+
+quint64 DkImageStorage::tileKey(int level, int tx, int ty) {
+
+	return ((quint64)level << 56) | ((quint64)ty << 28) | (quint64)tx;
+}
+
+/**
+ * Returns the part of the image (full resolution coordinates) which is covered by a tile.
+ **/ 
+QRect DkImageStorage::tileRect(const QSize& imgSize, int level, int tx, int ty) const {
+
+	int extent = tile_size << level;
+	return QRect(tx*extent, ty*extent, extent, extent).intersected(QRect(QPoint(), imgSize));
+}
+
+/**
+ * Computes a tile and caches it.
+ * Tiles of the first level are computed from the image itself. Coarser tiles
+ * are composed of the four tiles of the next finer level. Missing children are
+ * scheduled as separate tasks and the last child to finish schedules its parent again.
+ **/ 
+void DkImageStorage::computeTile(QImage src, int level, int tx, int ty, int generation) {
+
+	quint64 key = tileKey(level, tx, ty);
+	QRect rect = tileRect(src.size(), level, tx, ty);
+	QImage canvas;
+
+	if (level == 1)
+		canvas = src.copy(rect);
+	else if (!composeTile(src, level, tx, ty, generation, canvas))
+		return;	// we are still pending - the children schedule us
+
+	insertTile(key, DkImage::downsample2x2(canvas), generation);
+
+	mutex.lock();
+	pendingTiles.remove(key);
+	bool current = generation == tileGeneration;
+
+	// am I the last child a parent waits for?
+	int px = tx >> 1, py = ty >> 1;
+	quint64 pKey = tileKey(level+1, px, py);
+
+	if (current && waitingTiles.contains(pKey)) {
+
+		bool siblingsDone = true;
+		for (int idx = 0; idx < 4 && siblingsDone; idx++)
+			siblingsDone = !pendingTiles.contains(tileKey(level, px*2 + (idx & 1), py*2 + (idx >> 1)));
+
+		if (siblingsDone) {
+			waitingTiles.remove(pKey);
+			tileFutures.append(QtConcurrent::run(this, &DkImageStorage::computeTile, src, level+1, px, py, generation));
+		}
+	}
+	mutex.unlock();
+
+	// tell my caller I did something
+	if (current)
+		emit imageUpdated();
+}
+
+/**
+ * Copies the four tiles of the next finer level into a canvas.
+ * Children which are not cached are scheduled and the tile is marked as waiting.
+ * @param canvas the composed children (twice the tile size).
+ * @return bool false if children are missing.
+ **/ 
+bool DkImageStorage::composeTile(const QImage& src, int level, int tx, int ty, int generation, QImage& canvas) {
+
+	int cLevel = level-1;
+	QImage children[4];
+	bool complete = true;
+
+	mutex.lock();
+
+	// a new image was assigned
+	if (generation != tileGeneration) {
+		mutex.unlock();
+		return false;
+	}
+
+	for (int idx = 0; idx < 4; idx++) {
+
+		int cx = tx*2 + (idx & 1);
+		int cy = ty*2 + (idx >> 1);
+
+		// tiles at the right/bottom border might have less children
+		if (tileRect(src.size(), cLevel, cx, cy).isEmpty())
+			continue;
+
+		quint64 cKey = tileKey(cLevel, cx, cy);
+		QHash<quint64, Tile>::iterator tIter = tiles.find(cKey);
+
+		if (tIter != tiles.end()) {
+			tIter.value().lastAccess = ++tileClock;
+			children[idx] = tIter.value().img;
+			continue;
+		}
+
+		complete = false;
+
+		if (!pendingTiles.contains(cKey)) {
+			pendingTiles.insert(cKey);
+			tileFutures.append(QtConcurrent::run(this, &DkImageStorage::computeTile, src, cLevel, cx, cy, generation));
+		}
+	}
+
+	if (!complete)
+		waitingTiles.insert(tileKey(level, tx, ty));
+
+	mutex.unlock();
+
+	if (!complete)
+		return false;
+
+	QRect rect = tileRect(src.size(), level, tx, ty);
+	canvas = QImage((rect.width() + (1 << cLevel)-1) >> cLevel, (rect.height() + (1 << cLevel)-1) >> cLevel, 
+		src.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+
+	for (int idx = 0; idx < 4; idx++) {
+
+		const QImage& child = children[idx];
+
+		if (child.isNull())
+			continue;
+
+		int cx = (idx & 1)*tile_size;
+		int cy = (idx >> 1)*tile_size;
+		int w = qMin(child.width(), canvas.width()-cx);
+
+		for (int y = 0; y < child.height() && cy+y < canvas.height(); y++)
+			memcpy(canvas.scanLine(cy+y) + cx*4, child.constScanLine(y), w*4);
+	}
+
+	return true;
+}
+
+void DkImageStorage::insertTile(quint64 key, const QImage& tile, int generation) {
+
+	QMutexLocker locker(&mutex);
+
+	// a new image was assigned
+	if (generation != tileGeneration || tile.isNull())
+		return;
+
+	// concurrent requests might have computed the same tile
+	if (tiles.contains(key)) {
+		tiles[key].lastAccess = ++tileClock;
+		return;
+	}
+
+	Tile t;
+	t.img = tile;
+	t.lastAccess = ++tileClock;
+	tiles.insert(key, t);
+	tileMemory += tile.byteCount();
+
+	if (tileMemory > tile_max_memory)
+		evictTiles(qRound64(tile_max_memory*0.8));
+}
+
+/**
+ * Drops the least recently used tiles.
+ * The mutex must be locked.
+ **/ 
+void DkImageStorage::evictTiles(qint64 maxBytes) {
+
+	QVector<QPair<quint32, int> > accesses;
+	accesses.reserve(tiles.size());
+
+	QHash<quint64, Tile>::const_iterator cIter = tiles.constBegin();
+	for (; cIter != tiles.constEnd(); cIter++)
+		accesses.append(qMakePair(cIter.value().lastAccess, cIter.value().img.byteCount()));
+
+	qSort(accesses);
+
+	// find the access time which splits the tiles (access times are unique)
+	qint64 bytes = tileMemory;
+	quint32 minAccess = 0;
+	for (int idx = 0; idx < accesses.size() && bytes > maxBytes; idx++) {
+		minAccess = accesses[idx].first;
+		bytes -= accesses[idx].second;
+	}
+
+	QHash<quint64, Tile>::iterator tIter = tiles.begin();
+	while (tIter != tiles.end()) {
+
+		if (tIter.value().lastAccess <= minAccess) {
+			tileMemory -= tIter.value().img.byteCount();
+			tIter = tiles.erase(tIter);
+		}
+		else
+			tIter++;
+	}
+}
+
+void DkImageStorage::clearTiles() {
+
+	QMutexLocker locker(&mutex);
+
+	tiles.clear();
+	pendingTiles.clear();
+	waitingTiles.clear();
+	tileMemory = 0;
+	tileGeneration++;
+}
+
 }
@@ -32,6 +32,11 @@
 #include <QMutex>
 #include <QVector>
 #include <QObject>
+#include <QHash>
+#include <QSet>
+#include <QRect>
+#include <QFuture>
+#include <QSharedPointer>
 
 // opencv
 #ifdef WITH_OPENCV
@@ -111,15 +116,118 @@ public:
 	static bool alphaChannelUsed(const QImage& img);
 	static QPixmap colorizePixmap(const QPixmap& icon, const QColor& col, float opacity = 1.0f);
 	static QImage createThumb(const QImage& img);
+	static QSize jpegScaledSize(const QSize& size, const QSize& minSize);
+	static QImage downsample2x2(const QImage& img);
+	static void downsample2x2(const QImage& src, QImage& dst, int firstRow, int lastRow);
 	static QColor getMeanColor(const QImage& img);
 	static uchar findHistPeak(const int* hist, float quantile = 0.005f);
 };
 
+/**
+ * Gamma correct resampling of 32 bit images.
+ * Linearization, the separable filter and the gamma encoding are fused
+ * into a single pass which is computed on row bands in parallel.
+ * Sampling positions and kernels follow cv::resize so that results
+ * match the 16 bit (CV_16U) path within one gray value.
+ **/ 
+class DllExport DkResampler {
+
+public:
+	static bool isSupported(const QImage& img, int interpolation);
+	static QImage resize(const QImage& img, const QSize& newSize, int interpolation = DkImage::ipl_cubic);
+
+protected:
+	enum KernelType {
+		kernel_area,
+		kernel_area_linear,		// cv::INTER_AREA if the image is enlarged
+		kernel_linear,
+		kernel_cubic,
+		kernel_lanczos,
+
+		kernel_end
+	};
+
+	// one weight table per axis
+	struct Kernel {
+		int size;				// taps per output pixel
+		QVector<int> offsets;	// source index of every tap (clamped to the border)
+		QVector<float> weights;
+	};
+
+	struct Band {
+		const uchar* src;
+		int srcBpl;
+		int srcWidth;
+		uchar* dst;
+		int dstBpl;
+		int dstWidth;
+		int firstRow;
+		int lastRow;
+		const Kernel* kx;
+		const Kernel* ky;
+	};
+
+	static Kernel createKernel(int srcSize, int dstSize, KernelType type);
+	static void computeBand(Band& band);
+	static void createTables();
+
+	static QVector<float> linearTable;	// 8 bit sRGB -> 16 bit linear
+	static QVector<uchar> gammaTable;	// 16 bit linear -> 8 bit sRGB
+};
+
+/**
+ * The RGB histogram of an image.
+ * Row bands are counted in parallel. A sample step > 1 only visits
+ * every n-th row and column which gives an instant approximation.
+ **/ 
+class DllExport DkImageHistogram {
+
+public:
+	DkImageHistogram();
+
+	static QSharedPointer<DkImageHistogram> compute(const QImage& img, int sampleStep = 1);
+
+	bool isEmpty() const;
+	bool isSampled() const;
+	bool isComputedFrom(const QImage& img) const;
+	long getMaxValue() const;
+	long value(int channel, int bin) const;
+
+protected:
+	long hist[3][256];	// r, g, b
+	long maxValue;
+	int sampleStep;
+	qint64 imgKey;
+
+	struct Band {
+		const QImage* img;
+		int firstRow;
+		int lastRow;
+		int sampleStep;
+		long hist[3][256];
+	};
+
+	static void computeBand(Band& band);
+};
+
+/**
+ * A part of the image which should be drawn.
+ * img is drawn from srcRect to rect (full resolution image coordinates).
+ **/ 
+class DllExport DkImageTile {
+
+public:
+	QRect rect;
+	QImage img;
+	QRect srcRect;
+};
+
 class DllExport DkImageStorage : public QObject {
 	Q_OBJECT
 
 public:
 	DkImageStorage(QImage img = QImage());
+	virtual ~DkImageStorage();
 
 	void setImage(QImage img);
 	QImage getImageConst() const;
@@ -128,6 +236,9 @@ public:
 		return !img.isNull();
 	}
 
+	bool isTiled() const;
+	QVector<DkImageTile> getTiles(const QRect& visibleRect, float factor);
+
 public slots:
 	void computeImage();
 	void antiAliasingChanged(bool antiAliasing);
@@ -144,6 +255,45 @@ protected:
 	QThread* computeThread;
 	bool busy;
 	bool stop;
+
+	// tiled pyramid (for very large images)
+	struct Tile {
+		QImage img;
+		quint32 lastAccess;
+	};
+
+	enum {
+		tile_size = 512,
+		tile_min_pixels = 64*1024*1024,		// images with more pixels are tiled
+		tile_max_side = 16384,				// or if one side is larger
+		tile_max_memory = 256*1024*1024,	// memory budget in bytes
+	};
+
+	QHash<quint64, Tile> tiles;
+	QSet<quint64> pendingTiles;
+	QSet<quint64> waitingTiles;		// pending tiles which wait for their children
+	QVector<QFuture<void> > tileFutures;
+	qint64 tileMemory;
+	quint32 tileClock;
+	int tileGeneration;
+	int maxTileLevel;
+
+	static quint64 tileKey(int level, int tx, int ty);
+	QRect tileRect(const QSize& imgSize, int level, int tx, int ty) const;
+	void computeTile(QImage src, int level, int tx, int ty, int generation);
+	bool composeTile(const QImage& src, int level, int tx, int ty, int generation, QImage& canvas);
+	void insertTile(quint64 key, const QImage& tile, int generation);
+	void evictTiles(qint64 maxBytes);
+	void clearTiles();
+
+	// pyramid
+	struct Band {
+		int firstRow;
+		int lastRow;
+		QVector<QImage>* levels;
+	};
+
+	static void computeBand(Band& band);
 };
 
 };
@@ -41,6 +41,10 @@
 #include <QPushButton>
 #include <QPainter>
 #include <QApplication>
+#include <QEventLoop>
+#include <QDebug>
+#include <QtConcurrentRun>
+#include <QtConcurrentMap>
 #pragma warning(pop)		// no warnings from includes - end
 
 namespace nmc {
@@ -60,22 +64,27 @@ bool DkImageManipulationWidget::prepareUndo;
 QPushButton* DkUndoRedo::buttonUndo;
 QPushButton* DkUndoRedo::buttonRedo;
 bool DkImageManipulationWidget::doARedraw;
-#ifdef WITH_OPENCV
-		cv::Mat DkImageManipulationWidget::imgMat;
-		cv::Mat DkImageManipulationWidget::origMat;
-		cv::Mat DkImageManipulationWidget::tempLUT;
-#endif
 
 /**
 * Image manipulation dialog with image manipulation tools and preview
  **/
 DkImageManipulationDialog::DkImageManipulationDialog(QWidget* parent, Qt::WindowFlags flags) : QDialog(parent, flags) {
 
+	img = 0;
+	previewPending = false;
+	previewId = 0;
+	runningPreviewId = 0;
+
+	connect(&previewWatcher, SIGNAL(finished()), this, SLOT(previewComputed()));
+
 	init();
 }
 
 DkImageManipulationDialog::~DkImageManipulationDialog() {
 
+	// the preview thread calls the tools
+	previewWatcher.blockSignals(true);
+	previewWatcher.waitForFinished();
 }
 
 /**
@@ -96,9 +105,6 @@ void DkImageManipulationDialog::init() {
 
 	DkImageManipulationWidget::clearHistoryVectors();
 	DkImageManipulationWidget::setEmptyManipulationType();
-#ifdef WITH_OPENCV
-	DkImageManipulationWidget::createMatLut();
-#endif
 }
 /**
 * reset dialog slider values
@@ -114,9 +120,6 @@ void DkImageManipulationDialog::resetValues() {
 
 	DkImageManipulationWidget::clearHistoryVectors();
 	DkImageManipulationWidget::setEmptyManipulationType();
-#ifdef WITH_OPENCV
-	DkImageManipulationWidget::createMatLut();
-#endif
 	DkImageManipulationWidget::setPrepareUndo(true);
 	DkUndoRedo::enableUndoButton(false);
 	DkUndoRedo::enableRedoButton(false);
@@ -218,13 +221,12 @@ void DkImageManipulationDialog::createImgPreview() {
 	if (imgPreview.format() == QImage::Format_Mono || imgPreview.format() == QImage::Format_MonoLSB || 
 		imgPreview.format() == QImage::Format_Indexed8 || imgPreview.isGrayscale()) emit isNotGrayscaleImg(false);
 
+	// previews that are computed for the old image are dropped
+	previewId++;
+	previewPending = false;
+
 #ifdef WITH_OPENCV
-	
-	cv::Mat imgMat = DkImage::qImage2Mat(imgPreview);
-	// imgMat.convertTo(imgMat, CV_32FC1, 1.0f/255.0f);  // for testing purposes
-	
-	DkImageManipulationWidget::setMatImg(imgMat);
-	DkImageManipulationWidget::setOrigMatImg(imgMat);
+	previewMat = DkImage::qImage2Mat(imgPreview);
 #endif
 
 }
@@ -239,6 +241,41 @@ void DkImageManipulationDialog::updateImg(QImage updatedImg) {
 	drawImgPreview();
 }
 
+/**
+* render the manipulation history on the preview image (in a background thread)
+* requests that come in while a preview is computed are collapsed - so the latest values win
+**/
+void DkImageManipulationDialog::updatePreview() {
+
+#ifdef WITH_OPENCV
+	if (previewWatcher.isRunning()) {
+		previewPending = true;
+		return;
+	}
+
+	previewPending = false;
+	runningPreviewId = previewId;
+	previewWatcher.setFuture(QtConcurrent::run(&nmc::DkImageManipulationDialog::computePreview, 
+		previewMat, DkImageManipulationWidget::createPipeline()));
+#endif
+}
+
+void DkImageManipulationDialog::previewComputed() {
+
+	if (runningPreviewId == previewId)
+		updateImg(previewWatcher.result());
+
+	if (previewPending)
+		updatePreview();
+}
+
+#ifdef WITH_OPENCV
+QImage DkImageManipulationDialog::computePreview(cv::Mat img, DkManipulationPipeline pipeline) {
+
+	return DkImage::mat2QImage(pipeline.apply(img));
+}
+#endif
+
 /**
 * draw preview image
  **/
@@ -272,8 +309,6 @@ DkImageManipulationWidget::DkImageManipulationWidget(QWidget *parent, DkImageMan
 	slidersReset = false;
 	this->doARedraw = true;
 
-	connect(this, SIGNAL(updateDialogImgSignal(QImage)), parent->parentWidget(), SLOT(updateImg(QImage)));
-
 	// create gradient for changing saturation slider background
 	hueGradientImg = QImage(181, 10, QImage::Format_ARGB32);
 	QLinearGradient hueGradient = QLinearGradient(hueGradientImg.rect().topLeft(), hueGradientImg.rect().topRight());
@@ -479,12 +514,6 @@ void DkImageManipulationWidget::prepareUndoRedoButtons() {
 
 #ifdef WITH_OPENCV
 
-// when the dialog is created create the lookuptable
-void DkImageManipulationWidget::createMatLut() {
-
-	tempLUT = createMatLut16();
-}
-
 /**
  * create initial 3 channels 16 bit lookup table with numbers from 0 .. 65535
  * @return 16 bit lut
@@ -636,35 +665,48 @@ cv::Mat DkImageManipulationWidget::manipulateImage(cv::Mat inImg){
 	if (historyToolsVec.size() > 0) {
 
 		QProgressDialog* progress = new QProgressDialog("Applying changes to image...", "Cancel", 0, 100, qApp->activeWindow());
-		int step = (int) (100 / historyToolsVec.size());
 		progress->setWindowModality(Qt::WindowModal);
 		progress->setValue(1);	// a strange behavior of the progress dialog: first setValue shows an empty dialog (setting to zero won't work)
 		progress->setValue(2);	// second setValue shows the progress bar with 2% (setting to zero won't work)
 		progress->setValue(0);	// finally set the progress to zero
 
+		// all manipulations are applied at once on parallel row bands
+		DkManipulationPipeline pipeline = createPipeline();
 		outImg = inImg.clone();
-		cv::Mat lut16 = createMatLut16();
-		unsigned int i;
-		for (i = 0; i < historyToolsVec.size(); i++) {
-
-			cv::Mat lut = lut16.clone();
-			lut = historyToolsVec[i]->compute(lut, historyDataVec[i].arg1, historyDataVec[i].arg2);
-			progress->setValue((int)(step*(i+0.5f)));
-			if (progress->wasCanceled()) break;
-			outImg = applyLutToImage(outImg, lut, historyDataVec[i].isHsv);
-			progress->setValue(step*(i+1)-1);
-			if (progress->wasCanceled()) break;
-		}
+
+		QFutureWatcher<void> watcher;
+		QEventLoop loop;
+		connect(&watcher, SIGNAL(finished()), &loop, SLOT(quit()));
+		connect(&watcher, SIGNAL(progressRangeChanged(int, int)), progress, SLOT(setRange(int, int)));
+		connect(&watcher, SIGNAL(progressValueChanged(int)), progress, SLOT(setValue(int)));
+		connect(progress, SIGNAL(canceled()), &watcher, SLOT(cancel()));
+		watcher.setFuture(pipeline.applyThreaded(outImg));
+		loop.exec();
 
 		progress->close(); 
 
-		if (historyToolsVec.size() != i) return nullImg;
+		if (watcher.isCanceled()) return nullImg;
 	}
 
 	return outImg;
 
 }
 
+/**
+ * create a pipeline of the current manipulation history
+ * @return the pipeline
+ **/
+DkManipulationPipeline DkImageManipulationWidget::createPipeline() {
+
+	DkManipulationPipeline pipeline;
+
+	for (unsigned int i = 0; i < historyToolsVec.size(); i++)
+		pipeline.append(historyToolsVec[i], historyDataVec[i]);
+	pipeline.compile();
+
+	return pipeline;
+}
+
 /**
  * change brightness or contrast of an image
  * @param input LUT
@@ -865,6 +907,181 @@ it under the terms of the one of three licenses as you choose:
 
 	return outLUT;
 }
+
+// DkManipulationPipeline --------------------------------------------------------------------
+void DkManipulationPipeline::append(DkImageManipulationWidget* tool, const historyData& data) {
+
+	Operation op;
+	op.tool = tool;
+	op.data = data;
+	operations.append(op);
+	stages.clear();
+}
+
+bool DkManipulationPipeline::isEmpty() const {
+
+	return operations.empty();
+}
+
+/**
+ * computes the lookup tables of all manipulations.
+ * call it from the GUI thread, the worker threads then just need the tables.
+ **/
+void DkManipulationPipeline::compile() {
+
+	if (!stages.empty() || operations.empty())
+		return;
+
+	cv::Mat lut16 = DkImageManipulationWidget::createMatLut16();
+
+	for (int idx = 0; idx < operations.size(); idx++) {
+
+		const Operation& op = operations[idx];
+		cv::Mat lut = op.tool->compute(lut16, op.data.arg1, op.data.arg2);
+		Stage stage = createStage(lut, op.data.isHsv);
+
+		// consecutive RGB manipulations are composed into a single table
+		if (!stage.isHsv && !stages.empty() && !stages.last().isHsv) {
+
+			Stage& last = stages.last();
+			for (int c = 0; c < 3; c++) {
+				for (int v = 0; v < 256; v++)
+					last.lut[c][v] = stage.lut[c][last.lut[c][v]];
+			}
+		}
+		else
+			stages.append(stage);
+	}
+}
+
+/**
+ * converts a 16 bit lookup table to an 8 bit table (the same mapping as applyLutToImage).
+ * @param lut16 the 16 bit lookup table
+ * @param isHsv if true, the first channel is the hue (0 .. 180)
+ * @return the 8 bit stage
+ **/
+DkManipulationPipeline::Stage DkManipulationPipeline::createStage(const cv::Mat& lut16, bool isHsv) {
+
+	Stage stage;
+	stage.isHsv = isHsv;
+
+	for (int c = 0; c < 3; c++) {
+
+		const unsigned short* ptrLut = lut16.ptr<unsigned short>(c);
+
+		for (int v = 0; v < 256; v++) {
+
+			if (isHsv && c == 0)
+				stage.lut[c][v] = (v <= 180) ? (unsigned char)cvRound(ptrLut[cvRound((v / 180.0f) * (lut16.cols-1))] / 65535.0f * 180.0f) : (unsigned char)v;
+			else
+				stage.lut[c][v] = (unsigned char)cvRound(ptrLut[cvRound((v / 255.0f) * (lut16.cols-1))] / 257.0f);
+		}
+	}
+
+	return stage;
+}
+
+void DkManipulationPipeline::mapStage(cv::Mat& img, const Stage& stage) {
+
+	int cn = img.channels();
+	int numLuts = (cn < 3) ? 1 : 3;
+
+	for (int row = 0; row < img.rows; row++) {
+
+		unsigned char* ptr = img.ptr<unsigned char>(row);
+
+		for (int col = 0; col < img.cols; col++, ptr += cn) {
+
+			for (int c = 0; c < numLuts; c++)
+				ptr[c] = stage.lut[c][ptr[c]];
+		}
+	}
+}
+
+void DkManipulationPipeline::computeBand(Band& band) {
+
+	cv::Mat img = band.img->rowRange(band.firstRow, band.lastRow);
+	const QVector<Stage>& stages = *band.stages;
+
+	for (int idx = 0; idx < stages.size(); idx++) {
+
+		const Stage& stage = stages[idx];
+
+		if (!stage.isHsv || img.channels() < 3) {
+			mapStage(img, stage);
+			continue;
+		}
+
+		cv::Mat hsvImg;
+		cvtColor(img, hsvImg, CV_RGB2HSV);
+		mapStage(hsvImg, stage);
+
+		if (img.channels() == 4) {
+			// cvtColor returns 3 channels - keep the alpha channel of the band
+			cv::Mat rgbImg;
+			cvtColor(hsvImg, rgbImg, CV_HSV2RGB);
+			int fromTo[] = {0,0, 1,1, 2,2};
+			cv::mixChannels(&rgbImg, 1, &img, 1, fromTo, 3);
+		}
+		else
+			cvtColor(hsvImg, img, CV_HSV2RGB);
+	}
+}
+
+void DkManipulationPipeline::createBands(cv::Mat& img) {
+
+	compile();
+
+	bands.clear();
+
+	if (img.depth() != CV_8U) {
+		qDebug() << "[DkManipulationPipeline] only 8 bit images are supported";
+		return;
+	}
+
+	int bandSize = 64;
+
+	for (int row = 0; row < img.rows; row += bandSize) {
+
+		Band band;
+		band.img = &img;
+		band.firstRow = row;
+		band.lastRow = qMin(row + bandSize, img.rows);
+		band.stages = &stages;
+		bands.append(band);
+	}
+}
+
+/**
+ * applies all manipulations to the image (in place).
+ * the future reports the progress in bands.
+ * @param img the 8 bit image - it must stay valid until the future is finished
+ * @return the future of the computation
+ **/
+QFuture<void> DkManipulationPipeline::applyThreaded(cv::Mat& img) {
+
+	createBands(img);
+	return QtConcurrent::map(bands, computeBand);
+}
+
+/**
+ * applies all manipulations to a copy of the image.
+ * the calling thread helps computing the bands, so it is save to call it from a worker thread.
+ * @param img the 8 bit image
+ * @return the manipulated image
+ **/
+cv::Mat DkManipulationPipeline::apply(const cv::Mat& img) {
+
+	cv::Mat outImg = img.clone();
+
+	if (isEmpty() || outImg.empty())
+		return outImg;
+
+	createBands(outImg);
+	QtConcurrent::blockingMap(bands, computeBand);
+
+	return outImg;
+}
 #endif
 
 // Brightness widget
@@ -938,10 +1155,6 @@ void DkBrightness::redrawImage() {
 	if (manipulationType != manipulationBrightness && manipulationType != manipulationContrast) {
 
 		resetSliderValues(manipulationBrightness);
-#ifdef WITH_OPENCV
-		imgMat = DkImage::qImage2Mat(manipDialog->getImgPreview());
-#endif
-
 		historyDataVec.push_back(currData);
 		historyToolsVec.push_back(this);
 		prepareUndoRedoButtons();
@@ -954,10 +1167,7 @@ void DkBrightness::redrawImage() {
 		historyToolsVec.back() = this;
 	}
 
-#ifdef WITH_OPENCV
-	cv::Mat manipulationLUT = compute(tempLUT, currData.arg1, currData.arg2);
-	emit updateDialogImgSignal(DkImage::mat2QImage(applyLutToImage(imgMat, manipulationLUT, currData.isHsv)));
-#endif
+	manipDialog->updatePreview();
 
 };
 
@@ -1032,10 +1242,6 @@ void DkContrast::redrawImage() {
 	if (manipulationType != manipulationBrightness && manipulationType != manipulationContrast) {
 
 		resetSliderValues(manipulationContrast);
-#ifdef WITH_OPENCV
-		imgMat = DkImage::qImage2Mat(manipDialog->getImgPreview());
-#endif
-
 		historyDataVec.push_back(currData);
 		historyToolsVec.push_back(this);
 		prepareUndoRedoButtons();
@@ -1048,10 +1254,7 @@ void DkContrast::redrawImage() {
 		historyToolsVec.back() = this;
 	}
 
-#ifdef WITH_OPENCV
-	cv::Mat manipulationLUT = compute(tempLUT, currData.arg1, currData.arg2);
-	emit updateDialogImgSignal(DkImage::mat2QImage(applyLutToImage(imgMat, manipulationLUT, currData.isHsv)));
-#endif
+	manipDialog->updatePreview();
 
 };
 
@@ -1126,10 +1329,6 @@ void DkSaturation::redrawImage() {
 	if (manipulationType != manipulationSaturation && manipulationType != manipulationHue) {
 
 		resetSliderValues(manipulationSaturation);
-#ifdef WITH_OPENCV
-		imgMat = DkImage::qImage2Mat(manipDialog->getImgPreview());
-#endif
-
 		historyDataVec.push_back(currData);
 		historyToolsVec.push_back(this);
 		prepareUndoRedoButtons();
@@ -1142,10 +1341,7 @@ void DkSaturation::redrawImage() {
 		historyToolsVec.back() = this;
 	}
 
-#ifdef WITH_OPENCV
-	cv::Mat manipulationLUT = compute(tempLUT, currData.arg1, currData.arg2);
-	emit updateDialogImgSignal(DkImage::mat2QImage(applyLutToImage(imgMat, manipulationLUT, currData.isHsv)));
-#endif
+	manipDialog->updatePreview();
 
 };
 
@@ -1231,10 +1427,6 @@ void DkHue::redrawImage() {
 	if (manipulationType != manipulationSaturation && manipulationType != manipulationHue) {
 
 		resetSliderValues(manipulationHue);
-#ifdef WITH_OPENCV
-		imgMat = DkImage::qImage2Mat(manipDialog->getImgPreview());
-#endif
-
 		historyDataVec.push_back(currData);
 		historyToolsVec.push_back(this);
 		prepareUndoRedoButtons();
@@ -1248,10 +1440,7 @@ void DkHue::redrawImage() {
 	}
 
 	setSaturationSliderColor(QColor(hueGradientImg.pixel(hue/2 + 90, 0)).name());
-#ifdef WITH_OPENCV
-	cv::Mat manipulationLUT = compute(tempLUT, currData.arg1, currData.arg2);
-	emit updateDialogImgSignal(DkImage::mat2QImage(applyLutToImage(imgMat, manipulationLUT, currData.isHsv)));
-#endif
+	manipDialog->updatePreview();
 
 };
 
@@ -1334,10 +1523,6 @@ void DkGamma::redrawImage() {
 	if (manipulationType != manipulationGamma) {
 
 		resetSliderValues(manipulationGamma);
-#ifdef WITH_OPENCV
-		imgMat = DkImage::qImage2Mat(manipDialog->getImgPreview());
-#endif
-
 		historyDataVec.push_back(currData);
 		historyToolsVec.push_back(this);
 		prepareUndoRedoButtons();
@@ -1350,10 +1535,7 @@ void DkGamma::redrawImage() {
 		historyToolsVec.back() = this;
 	}
 
-#ifdef WITH_OPENCV
-	cv::Mat manipulationLUT = compute(tempLUT, currData.arg1, currData.arg2);
-	emit updateDialogImgSignal(DkImage::mat2QImage(applyLutToImage(imgMat, manipulationLUT, currData.isHsv)));
-#endif
+	manipDialog->updatePreview();
 
 };
 
@@ -1447,10 +1629,6 @@ void DkExposure::redrawImage() {
 	if (manipulationType != manipulationExposure) {
 
 		resetSliderValues(manipulationExposure);
-#ifdef WITH_OPENCV
-		imgMat = DkImage::qImage2Mat(manipDialog->getImgPreview());
-#endif
-
 		historyDataVec.push_back(currData);
 		historyToolsVec.push_back(this);
 		prepareUndoRedoButtons();
@@ -1463,10 +1641,7 @@ void DkExposure::redrawImage() {
 		historyToolsVec.back() = this;
 	}
 
-#ifdef WITH_OPENCV
-	cv::Mat manipulationLUT = compute(tempLUT, currData.arg1, currData.arg2);
-	emit updateDialogImgSignal(DkImage::mat2QImage(applyLutToImage(imgMat, manipulationLUT, currData.isHsv)));
-#endif
+	manipDialog->updatePreview();
 
 };
 
@@ -1530,26 +1705,10 @@ void DkUndoRedo::undoPressed() {
 	historyDataVec.pop_back();
 	historyToolsVec.pop_back();
 
-#ifdef WITH_OPENCV
-	if (historyToolsVec.size() > 0) {
-
-		cv::Mat imgToDisplay = origMat.clone();
-		for (unsigned int i = 0; i < historyToolsVec.size(); i++) {
-
-			cv::Mat lut = historyToolsVec[i]->compute(tempLUT, historyDataVec[i].arg1, historyDataVec[i].arg2);
-			imgToDisplay = applyLutToImage(imgToDisplay, lut, historyDataVec[i].isHsv);
-		}
-
-		imgMat = imgToDisplay.clone();
-		emit updateDialogImgSignal(DkImage::mat2QImage(imgToDisplay));
-	}
-	else {
+	if (historyToolsVec.size() == 0)
 		buttonUndo->setEnabled(false);
-		imgMat = origMat.clone();
-		emit updateDialogImgSignal(DkImage::mat2QImage(imgMat));
-	}
-	
-#endif
+
+	manipDialog->updatePreview();
 
 	resetSliderValues(manipulationEmpty);
 	manipulationType = manipulationEmpty;
@@ -1568,23 +1727,12 @@ void DkUndoRedo::redoPressed() {
 		historyToolsVec.back()->setToolsValue(historyDataVec.back().arg1, historyDataVec.back().arg2);
 		doARedraw = true;
 		manipulationType = (char)manipulationTypeHist;
+		prepareUndo = true;
 	}
 
 	buttonUndo->setEnabled(true);
 
-#ifdef WITH_OPENCV
-	cv::Mat imgToDisplay = origMat.clone();
-	for (unsigned int i = 0; i < historyToolsVec.size(); i++) {
-
-		cv::Mat lut = historyToolsVec[i]->compute(tempLUT, historyDataVec[i].arg1, historyDataVec[i].arg2);
-		imgToDisplay = applyLutToImage(imgToDisplay, lut, historyDataVec[i].isHsv);
-	}
-
-	if(historyDataVec.size() != historyDataVecCopy.size()) imgMat = imgToDisplay.clone();
-	else prepareUndo = true;
-
-	emit updateDialogImgSignal(DkImage::mat2QImage(imgToDisplay));
-#endif
+	manipDialog->updatePreview();
 
 };
 
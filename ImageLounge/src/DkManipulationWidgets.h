@@ -30,6 +30,9 @@
 #pragma warning(push, 0)	// no warnings from includes - begin
 #include <QWidget>
 #include <QDialog>
+#include <QVector>
+#include <QFuture>
+#include <QFutureWatcher>
 #pragma warning(pop)		// no warnings from includes - end
 
 #ifdef WITH_OPENCV
@@ -62,6 +65,53 @@ struct historyData {
 	bool isHsv;
 };
 
+class DkImageManipulationWidget;
+
+#ifdef WITH_OPENCV
+/**
+ * Applies a manipulation history in a single pass over row bands.
+ * The 16 bit lookup tables of all manipulations are converted to 8 bit tables.
+ * Consecutive RGB manipulations are composed into one table, HSV manipulations
+ * convert the band to HSV and back. Bands are processed in parallel.
+ **/
+class DkManipulationPipeline {
+
+public:
+	void append(DkImageManipulationWidget* tool, const historyData& data);
+	bool isEmpty() const;
+	cv::Mat apply(const cv::Mat& img);
+	QFuture<void> applyThreaded(cv::Mat& img);
+	void compile();
+
+protected:
+	struct Operation {
+		DkImageManipulationWidget* tool;
+		historyData data;
+	};
+
+	struct Stage {
+		bool isHsv;
+		unsigned char lut[3][256];
+	};
+
+	struct Band {
+		cv::Mat* img;
+		int firstRow;
+		int lastRow;
+		const QVector<Stage>* stages;
+	};
+
+	QVector<Operation> operations;
+	QVector<Stage> stages;
+	QVector<Band> bands;
+
+	void createBands(cv::Mat& img);
+	static Stage createStage(const cv::Mat& lut16, bool isHsv);
+	static void mapStage(cv::Mat& img, const Stage& stage);
+	static void computeBand(Band& band);
+};
+#endif
+
 class DkImageManipulationWidget : public QWidget {
 
 	Q_OBJECT
@@ -83,14 +133,8 @@ class DkImageManipulationWidget : public QWidget {
 		static void clearHistoryVectors();
 
 #ifdef WITH_OPENCV
-		static void setMatImg(cv::Mat newImg) {
-			imgMat = newImg;
-		}
-		static void setOrigMatImg(cv::Mat newImg) {
-			origMat = newImg;
-		}
-		static void createMatLut();
 		static cv::Mat manipulateImage(cv::Mat inImg);
+		static DkManipulationPipeline createPipeline();
 
 		cv::Mat changeBrightnessAndContrast(cv::Mat inImgMat, float brightnessVal, float contrastVal);
 		cv::Mat changeSaturationAndHue(cv::Mat inImgMat, float saturationVal, float hueVal);
@@ -138,10 +182,6 @@ class DkImageManipulationWidget : public QWidget {
 		static bool prepareUndo;
 
 #ifdef WITH_OPENCV
-		static cv::Mat imgMat;
-		static cv::Mat tempLUT;
-		static cv::Mat origMat;
-
 		static cv::Mat applyLutToImage(cv::Mat inImg, cv::Mat tempLUT, bool isMatHsv);
 		static cv::Mat createMatLut16();
 #endif
@@ -174,9 +214,7 @@ class DkImageManipulationWidget : public QWidget {
 		void updateSliderVal(int val);
 		void updateDoubleSliderVal(double val);
 
-	signals:
-		void updateDialogImgSignal(QImage updatedImg);
-
+	friend class DkManipulationPipeline;
 };
 
 class DkBrightness : public DkImageManipulationWidget {
@@ -326,6 +364,7 @@ public:
 	};
 
 	void resetValues();
+	void updatePreview();
 	QImage getImgPreview() {return imgPreview;};
 
 	DkBrightness *getBrightnessWidget() { return brightnessWidget;};
@@ -337,10 +376,19 @@ public:
 
 protected slots:
 	void updateImg(QImage updatedImg);
+	void previewComputed();
 
 protected:
 	QImage *img;
 	QImage imgPreview;
+#ifdef WITH_OPENCV
+	cv::Mat previewMat;
+	static QImage computePreview(cv::Mat img, DkManipulationPipeline pipeline);
+#endif
+	QFutureWatcher<QImage> previewWatcher;
+	bool previewPending;
+	int previewId;
+	int runningPreviewId;
 	int dialogWidth;
 	int dialogHeight;
 	QRect previewImgRect;
@@ -37,21 +37,81 @@
 #include <QImage>
 #include <QDebug>
 #include <QBuffer>
+#include <QFile>
 #include <QVector2D>
 #include <QApplication>
+#include <QTime>
+#include <QVector>
+#include <QMutexLocker>
 #pragma warning(pop)		// no warnings from includes - end
 
 namespace nmc {
 
 // DkMetaDataT --------------------------------------------------------------------
-DkMetaDataT::DkMetaDataT() {
+DkMetaDataT::DkMetaDataT(const QFileInfo& fileInfo) {
 
+	file = fileInfo;
 	exifState = not_loaded;
+	cachedImg = false;
+	ownsIo = true;
 }
 
-void DkMetaDataT::readMetaData(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba) {
+void DkMetaDataT::readMetaData(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba, bool useCache) {
 
 	this->file = fileInfo;
+	cachedImg = false;
+	ownsIo = true;
+
+	// fresh stat: the file info passed might be outdated
+	// zip entries and downloaded images do not exist on disk - so they are never cached
+	QFileInfo cacheFile(file.isSymLink() ? file.symLinkTarget() : file.absoluteFilePath());
+	useCache &= cacheFile.exists();
+
+	if (useCache) {
+
+		QSharedPointer<Exiv2::Image> cImg = DkMetaDataCache::instance().find(cacheFile);
+
+		if (cImg) {
+			exifImg = cImg;
+			cachedImg = true;
+			cachedFile = cacheFile;
+			ownsIo = false;
+			exifState = loaded;
+			return;
+		}
+	}
+
+	QTime pt;
+	pt.start();
+
+	exifImg = loadImage(ba);
+
+	if (!exifImg) {
+		exifState = no_data;
+		return;
+	}
+	
+	//qDebug() << "[Exiv2] metadata loaded";
+	exifState = loaded;
+
+	if (useCache) {
+		DkMetaDataCache::instance().insert(cacheFile, exifImg, pt.elapsed());
+		cachedImg = true;
+		cachedFile = cacheFile;
+	}
+
+	//printMetaData();
+
+}
+
+/**
+ * Opens and parses the metadata of the current file.
+ * @param ba the file's buffer, if it is empty the file is read from disk.
+ * @return QSharedPointer<Exiv2::Image> the parsed image or a null pointer if the metadata could not be read.
+ **/ 
+QSharedPointer<Exiv2::Image> DkMetaDataT::loadImage(QSharedPointer<QByteArray> ba) const {
+
+	Exiv2::Image::AutoPtr img;
 
 	try {
 		if (!ba || ba->isEmpty()) {
@@ -60,53 +120,67 @@ void DkMetaDataT::readMetaData(const QFileInfo& fileInfo, QSharedPointer<QByteAr
 			// it was crashing here - if the thumbnail is fetched in the constructor of a label
 			// seems that the QFileInfo was corrupted?!
 			std::wstring filePath = (file.isSymLink()) ? file.symLinkTarget().toStdWString() : file.absoluteFilePath().toStdWString();
-			exifImg = Exiv2::ImageFactory::open(filePath);
+			img = Exiv2::ImageFactory::open(filePath);
 #else
 			std::wstring filePath = (file.isSymLink()) ? (wchar_t*)file.symLinkTarget().utf16() : (wchar_t*)file.absoluteFilePath().utf16();
-			exifImg = Exiv2::ImageFactory::open(filePath);
+			img = Exiv2::ImageFactory::open(filePath);
 #endif
 #else
 			std::string filePath = (file.isSymLink()) ? file.symLinkTarget().toStdString() : file.absoluteFilePath().toStdString();
-			exifImg = Exiv2::ImageFactory::open(filePath);
+			img = Exiv2::ImageFactory::open(filePath);
 #endif
 		}
 		else {
 			Exiv2::MemIo::AutoPtr exifBuffer(new Exiv2::MemIo((const byte*)ba->constData(), ba->size()));
-			exifImg = Exiv2::ImageFactory::open(exifBuffer);
+			img = Exiv2::ImageFactory::open(exifBuffer);
 		}
 	} 
 	catch (...) {
-		exifState = no_data;
 		qDebug() << "[Exiv2] could not open file for exif data";
-		return;
+		return QSharedPointer<Exiv2::Image>();
 	}
 
-	if (exifImg.get() == 0) {
-		exifState = no_data;
+	if (img.get() == 0) {
 		qDebug() << "[Exiv2] image could not be opened for exif data extraction";
-		return;
+		return QSharedPointer<Exiv2::Image>();
 	}
 
 	try {
-		exifImg->readMetadata();
+		img->readMetadata();
 
-		if (!exifImg->good()) {
+		if (!img->good()) {
 			qDebug() << "[Exiv2] metadata could not be read";
-			exifState = no_data;
-			return;
+			return QSharedPointer<Exiv2::Image>();
 		}
 
 	}catch (...) {
-		exifState = no_data;
 		qDebug() << "[Exiv2] could not read metadata (exception)";
-		return;
+		return QSharedPointer<Exiv2::Image>();
 	}
-	
-	//qDebug() << "[Exiv2] metadata loaded";
-	exifState = loaded;
 
-	//printMetaData();
+	return QSharedPointer<Exiv2::Image>(img.release());
+}
+
+/**
+ * Creates a private copy of cached metadata.
+ * Cached images are read by other threads - so we parse the file again before modifying it.
+ * @return bool false if the file could not be parsed.
+ **/ 
+bool DkMetaDataT::detach() {
+
+	if (!cachedImg)
+		return true;
 
+	QSharedPointer<Exiv2::Image> img = loadImage();
+
+	if (!img)
+		return false;
+
+	exifImg = img;
+	cachedImg = false;
+	ownsIo = true;
+
+	return true;
 }
 
 bool DkMetaDataT::saveMetaData(const QFileInfo& fileInfo, bool force) {
@@ -133,6 +207,8 @@ bool DkMetaDataT::saveMetaData(const QFileInfo& fileInfo, bool force) {
 	file.write(ba->data(), ba->size());
 	file.close();
 
+	DkMetaDataCache::instance().remove(fileInfo);
+
 	qDebug() << "[DkMetaDataT] I saved: " << ba->size() << " bytes";
 
 	return true;
@@ -191,7 +267,9 @@ bool DkMetaDataT::saveMetaData(QSharedPointer<QByteArray>& ba, bool force) {
 	} else
 		return false;
 
-	exifImg = exifImgN;
+	exifImg = QSharedPointer<Exiv2::Image>(exifImgN.release());
+	cachedImg = false;
+	ownsIo = true;
 	exifState = loaded;
 
 	return true;
@@ -246,24 +324,7 @@ int DkMetaDataT::getOrientation() const {
 			
 				Exiv2::Value::AutoPtr v = pos->getValue();
 
-				orientation = (int)pos->toFloat();
-
-				switch (orientation) {
-				case 6: orientation = 90;
-					break;
-				case 7: orientation = 90;
-					break;
-				case 3: orientation = 180;
-					break;
-				case 4: orientation = 180;
-					break;
-				case 8: orientation = -90;
-					break;
-				case 5: orientation = -90;
-					break;
-				default: orientation = 0;
-					break;
-				}	
+				orientation = orientationToDegree((int)pos->toFloat());
 			}
 		}
 	}
@@ -636,37 +697,59 @@ QImage DkMetaDataT::getPreviewImage(int minPreviewWidth) const {
 	if (exifData.empty())
 		return qImg;
 
-	try {
+	QByteArray ba;
+	int width = 0;
 
-		Exiv2::PreviewManager loader(*exifImg);
-		Exiv2::PreviewPropertiesList pList = loader.getPreviewProperties();
+	// the cache keeps the largest preview - otherwise a cache hit would parse the file again
+	if (!cachedImg || !DkMetaDataCache::instance().findPreview(cachedFile, ba, width)) {
 
-		int maxWidth = 0;
-		int mIdx = -1;
+		try {
 
-		// select the largest preview image
-		for (size_t idx = 0; idx < pList.size(); idx++) {
-			
-			if (pList[idx].width_ > (uint32_t)maxWidth && pList[idx].width_ > (uint32_t)minPreviewWidth) {
-				mIdx = (int)idx;
-				maxWidth = pList[idx].width_;
+			// the io of cached images might be gone (or used by another thread) - so we open the file again
+			QSharedPointer<Exiv2::Image> img = ownsIo ? exifImg : loadImage();
+
+			if (!ownsIo)
+				DkMetaDataCache::instance().addReparse();
+
+			if (!img)
+				return qImg;
+
+			Exiv2::PreviewManager loader(*img);
+			Exiv2::PreviewPropertiesList pList = loader.getPreviewProperties();
+
+			int mIdx = -1;
+
+			// select the largest preview image
+			for (size_t idx = 0; idx < pList.size(); idx++) {
+
+				if (pList[idx].width_ > (uint32_t)width) {
+					mIdx = (int)idx;
+					width = pList[idx].width_;
+				}
 			}
-		}
 
-		if (mIdx == -1)
+			// Get the selected preview image
+			if (mIdx != -1) {
+				Exiv2::PreviewImage preview = loader.getPreviewImage(pList[mIdx]);
+				ba = QByteArray((const char*)preview.pData(), preview.size());
+			}
+		}
+		catch (...) {
+			qDebug() << "Sorry, I could not load the thumb from the exif data...";
 			return qImg;
-		
-		// Get the selected preview image
-		Exiv2::PreviewImage preview = loader.getPreviewImage(pList[mIdx]);
+		}
 
-		QByteArray ba((const char*)preview.pData(), preview.size());
-		if (!qImg.loadFromData(ba))
-			return QImage();
-	}
-	catch (...) {
-		qDebug() << "Sorry, I could not load the thumb from the exif data...";
+		// files without preview are cached too
+		if (cachedImg)
+			DkMetaDataCache::instance().insertPreview(cachedFile, ba, width);
 	}
 
+	if (ba.isEmpty() || width <= minPreviewWidth)
+		return qImg;
+
+	if (!qImg.loadFromData(ba))
+		return QImage();
+
 	return qImg;
 }
 
@@ -864,7 +947,7 @@ QStringList DkMetaDataT::getQtValues() const {
 
 void DkMetaDataT::setThumbnail(QImage thumb) {
 
-	if (exifState == not_loaded || exifState == no_data) 
+	if (exifState == not_loaded || exifState == no_data || !detach()) 
 		return;
 
 	try {
@@ -974,6 +1057,9 @@ void DkMetaDataT::setOrientation(int o) {
 	if (o==-180) o=180;
 	if (o== 270) o=-90;
 
+	if (!detach())
+		return;
+
 	int orientation;
 
 	Exiv2::ExifData& exifData = exifImg->exifData();
@@ -1050,6 +1136,9 @@ void DkMetaDataT::setRating(int r) {
 	else if (r==1) {percentRating = 1; sRating = "1"; sRatingPercent = "1";}
 	else {r=0;}
 
+	if (!detach())
+		return;
+
 	Exiv2::ExifData &exifData = exifImg->exifData();		//Exif.Image.Rating  - short
 	Exiv2::XmpData &xmpData = exifImg->xmpData();			//Xmp.xmp.Rating - text
 
@@ -1111,7 +1200,7 @@ bool DkMetaDataT::updateImageMetaData(const QImage& img) {
 
 bool DkMetaDataT::setExifValue(QString key, QString taginfo) {
 
-	if (exifState == not_loaded || exifState == no_data)
+	if (exifState == not_loaded || exifState == no_data || !detach())
 		return false;
 
 	if (exifImg->checkMode(Exiv2::mdExif) != Exiv2::amReadWrite &&
@@ -1151,6 +1240,25 @@ bool DkMetaDataT::setExifValue(QString key, QString taginfo) {
 	return setExifSuccessfull;
 }
 
+/**
+ * Converts the EXIF orientation tag to degrees.
+ * Flipped images are treated as if they were just rotated.
+ * @param exifOrientation the value of Exif.Image.Orientation (1-8).
+ * @return int the orientation in degrees.
+ **/ 
+int DkMetaDataT::orientationToDegree(int exifOrientation) {
+
+	switch (exifOrientation) {
+	case 6: return 90;
+	case 7: return 90;
+	case 3: return 180;
+	case 4: return 180;
+	case 8: return -90;
+	case 5: return -90;
+	default: return 0;
+	}	
+}
+
 QString DkMetaDataT::exiv2ToQString(std::string exifString) {
 
 	QString info;
@@ -1208,6 +1316,583 @@ void DkMetaDataT::printMetaData() const {
 
 }
 
+// DkMetaDataCache --------------------------------------------------------------------
+DkMetaDataCache& DkMetaDataCache::instance() {
+
+	static DkMetaDataCache inst;
+	return inst;
+}
+
+DkMetaDataCache::DkMetaDataCache() {
+
+	usedBytes = 0;
+	accessClock = 0;
+
+	numHits = 0;
+	numMisses = 0;
+	numParsed = 0;
+	numReparsed = 0;
+	parseTime = 0;
+}
+
+DkMetaDataCache::~DkMetaDataCache() {
+
+	qDebug() << "[DkMetaDataCache]" << getStats();
+}
+
+/**
+ * Returns the parsed metadata of a file.
+ * @param file the file on disk (symlinks must be resolved).
+ * @return QSharedPointer<Exiv2::Image> the shared image or a null pointer if the file is not cached.
+ **/ 
+QSharedPointer<Exiv2::Image> DkMetaDataCache::find(const QFileInfo& file) {
+
+	QMutexLocker locker(&mutex);
+
+	QHash<QString, Entry>::iterator eIter = index.find(file.absoluteFilePath());
+
+	if (eIter != index.end()) {
+
+		Entry& e = eIter.value();
+
+		// the file changed since we have parsed it
+		if (e.modified != file.lastModified().toMSecsSinceEpoch() || e.fileSize != file.size()) {
+			usedBytes -= e.bytes;
+			index.erase(eIter);
+		}
+		else {
+			e.lastAccess = ++accessClock;
+			numHits++;
+			return e.img;
+		}
+	}
+
+	numMisses++;
+	return QSharedPointer<Exiv2::Image>();
+}
+
+/**
+ * Adds a parsed image to the cache.
+ * The image must not be modified afterwards since it is shared between threads.
+ * @param file the file on disk (symlinks must be resolved).
+ * @param img the parsed image.
+ * @param parseMs the time needed to parse the file.
+ **/ 
+void DkMetaDataCache::insert(const QFileInfo& file, QSharedPointer<Exiv2::Image> img, int parseMs) {
+
+	if (!img)
+		return;
+
+	Entry e;
+	e.img = img;
+	e.previewWidth = 0;
+	e.previewLoaded = false;
+	e.modified = file.lastModified().toMSecsSinceEpoch();
+	e.fileSize = file.size();
+	e.bytes = estimateBytes(*img);
+
+	QMutexLocker locker(&mutex);
+
+	e.lastAccess = ++accessClock;
+	parseTime += parseMs;
+	numParsed++;
+
+	QHash<QString, Entry>::iterator eIter = index.find(file.absoluteFilePath());
+	if (eIter != index.end())
+		usedBytes -= eIter.value().bytes;
+
+	index.insert(file.absoluteFilePath(), e);
+	usedBytes += e.bytes;
+
+	if (usedBytes > max_bytes)
+		evict(max_bytes*3/4);
+}
+
+/**
+ * Returns the preview of a cached file.
+ * @param file the file on disk (symlinks must be resolved).
+ * @param preview the encoded preview - it is empty if the file has no preview.
+ * @param width the preview width.
+ * @return bool false if the preview was not extracted yet.
+ **/ 
+bool DkMetaDataCache::findPreview(const QFileInfo& file, QByteArray& preview, int& width) {
+
+	QMutexLocker locker(&mutex);
+
+	QHash<QString, Entry>::const_iterator eIter = index.constFind(file.absoluteFilePath());
+
+	if (eIter == index.constEnd() || !eIter.value().previewLoaded)
+		return false;
+
+	preview = eIter.value().preview;
+	width = eIter.value().previewWidth;
+
+	return true;
+}
+
+/**
+ * Attaches the preview to a cached file.
+ * Nothing is done if the file was evicted meanwhile.
+ **/ 
+void DkMetaDataCache::insertPreview(const QFileInfo& file, const QByteArray& preview, int width) {
+
+	QMutexLocker locker(&mutex);
+
+	QHash<QString, Entry>::iterator eIter = index.find(file.absoluteFilePath());
+
+	if (eIter == index.end() || eIter.value().previewLoaded)
+		return;
+
+	Entry& e = eIter.value();
+	e.preview = preview;
+	e.previewWidth = width;
+	e.previewLoaded = true;
+	e.bytes += preview.size();
+	usedBytes += preview.size();
+
+	if (usedBytes > max_bytes)
+		evict(max_bytes*3/4);
+}
+
+/**
+ * Counts cache hits which had to parse the file again (e.g. to extract the preview).
+ **/ 
+void DkMetaDataCache::addReparse() {
+
+	QMutexLocker locker(&mutex);
+	numReparsed++;
+}
+
+void DkMetaDataCache::remove(const QFileInfo& file) {
+
+	QString filePath = file.isSymLink() ? QFileInfo(file.symLinkTarget()).absoluteFilePath() : file.absoluteFilePath();
+
+	QMutexLocker locker(&mutex);
+
+	QHash<QString, Entry>::iterator eIter = index.find(filePath);
+	if (eIter != index.end()) {
+		usedBytes -= eIter.value().bytes;
+		index.erase(eIter);
+	}
+}
+
+void DkMetaDataCache::clear() {
+
+	QMutexLocker locker(&mutex);
+
+	index.clear();
+	usedBytes = 0;
+}
+
+/**
+ * Removes the least recently used entries.
+ * The mutex must be locked by the caller.
+ * @param maxBytes the memory that may be used after evicting.
+ **/ 
+void DkMetaDataCache::evict(qint64 maxBytes) {
+
+	QVector<QPair<quint32, qint64> > accesses;
+	accesses.reserve(index.size());
+
+	QHash<QString, Entry>::const_iterator cIter = index.constBegin();
+	for (; cIter != index.constEnd(); cIter++)
+		accesses.append(qMakePair(cIter.value().lastAccess, cIter.value().bytes));
+
+	qSort(accesses);
+
+	// find the access time which splits the index (access times are unique)
+	qint64 bytes = usedBytes;
+	quint32 minAccess = 0;
+	for (int idx = 0; idx < accesses.size() && bytes > maxBytes; idx++) {
+		minAccess = accesses[idx].first;
+		bytes -= accesses[idx].second;
+	}
+
+	QHash<QString, Entry>::iterator eIter = index.begin();
+	while (eIter != index.end()) {
+
+		if (eIter.value().lastAccess <= minAccess) {
+			usedBytes -= eIter.value().bytes;
+			eIter = index.erase(eIter);
+		}
+		else
+			eIter++;
+	}
+}
+
+/**
+ * Estimates the memory needed by the parsed metadata.
+ * @param img the parsed image.
+ * @return qint64 the approximate size in bytes.
+ **/ 
+qint64 DkMetaDataCache::estimateBytes(Exiv2::Image& img) {
+
+	const qint64 datumOverhead = 64;	// key, type info and list node
+	qint64 bytes = sizeof(Exiv2::Image);
+
+	Exiv2::ExifData& exifData = img.exifData();
+	for (Exiv2::ExifData::const_iterator i = exifData.begin(); i != exifData.end(); ++i)
+		bytes += i->size() + datumOverhead;
+
+	Exiv2::IptcData& iptcData = img.iptcData();
+	for (Exiv2::IptcData::const_iterator i = iptcData.begin(); i != iptcData.end(); ++i)
+		bytes += i->size() + datumOverhead;
+
+	Exiv2::XmpData& xmpData = img.xmpData();
+	for (Exiv2::XmpData::const_iterator i = xmpData.begin(); i != xmpData.end(); ++i)
+		bytes += i->size() + datumOverhead;
+
+	bytes += img.xmpPacket().size();
+
+	return bytes;
+}
+
+QString DkMetaDataCache::getStats() {
+
+	QMutexLocker locker(&mutex);
+
+	QString stats = QString("%1 files (%2 MB), hits: %3 misses: %4")
+		.arg(index.size())
+		.arg(usedBytes/(1024.0*1024.0), 0, 'f', 1)
+		.arg(numHits)
+		.arg(numMisses);
+
+	// each hit saves one parse - unless the caller parsed the file anyway
+	if (numParsed)
+		stats += QString(", parse: %1 ms/file - saved ~%2 ms")
+			.arg((double)parseTime/numParsed, 0, 'f', 2)
+			.arg((double)parseTime/numParsed*qMax(numHits-numReparsed, 0), 0, 'f', 0);
+
+	return stats;
+}
+
+// DkExifHeader --------------------------------------------------------------------
+DkExifHeader::DkExifHeader() {
+
+	valid = false;
+	bigEndian = false;
+	tiffStart = 0;
+	bytesRead = 0;
+
+	orientation = -1;
+	thumbOffset = -1;
+	thumbLength = 0;
+}
+
+/**
+ * Reads the EXIF header of a JPEG or TIFF based file.
+ * @param fileInfo the file.
+ * @param ba the file's buffer, if it is empty the file is read from disk.
+ * @return bool true if the header could be parsed.
+ **/ 
+bool DkExifHeader::read(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba) {
+
+	this->file = fileInfo;
+	this->ba = ba;
+
+	QSharedPointer<QIODevice> device;
+
+	if (!openDevice(device))
+		return false;
+
+	QByteArray magic = readAt(*device, 0, 4);
+
+	if (magic.size() < 4)
+		return false;
+
+	if ((uchar)magic[0] == 0xFF && (uchar)magic[1] == 0xD8)
+		valid = readJpeg(*device);
+	else if (magic.startsWith("II") || magic.startsWith("MM"))
+		valid = readTiff(*device, 0);
+
+	return valid;
+}
+
+bool DkExifHeader::openDevice(QSharedPointer<QIODevice>& device) const {
+
+	if (ba && !ba->isEmpty()) {
+		QBuffer* buffer = new QBuffer();
+		buffer->setData(*ba);	// shallow copy
+		device = QSharedPointer<QIODevice>(buffer);
+	}
+	else
+		device = QSharedPointer<QIODevice>(new QFile(file.isSymLink() ? file.symLinkTarget() : file.absoluteFilePath()));
+
+	return device->open(QIODevice::ReadOnly);
+}
+
+/**
+ * Bounded read - nothing is read if the range exceeds the file.
+ **/ 
+QByteArray DkExifHeader::readAt(QIODevice& device, qint64 pos, int length) {
+
+	if (pos < 0 || length <= 0 || pos + length > device.size() || !device.seek(pos))
+		return QByteArray();
+
+	QByteArray data = device.read(length);
+	bytesRead += data.size();
+
+	return data;
+}
+
+/**
+ * Walks the JPEG segments until the frame header is found.
+ * Segments are skipped - so we just read their headers.
+ **/ 
+bool DkExifHeader::readJpeg(QIODevice& device) {
+
+	bool exif = false;
+	qint64 pos = 2;	// SOI
+
+	for (int idx = 0; idx < max_segments; idx++) {
+
+		QByteArray marker = readAt(device, pos, 4);
+
+		if (marker.size() < 4 || (uchar)marker[0] != 0xFF)
+			break;
+
+		uchar type = (uchar)marker[1];
+
+		// fill bytes & markers without payload
+		if (type == 0xFF) {
+			pos++;
+			continue;
+		}
+		else if (type == 0x01 || (type >= 0xD0 && type <= 0xD7)) {
+			pos += 2;
+			continue;
+		}
+		// start of scan or end of image - there are no more headers
+		else if (type == 0xDA || type == 0xD9)
+			break;
+
+		int length = (uchar)marker[2] << 8 | (uchar)marker[3];	// includes the length bytes
+
+		if (length < 2)
+			break;
+
+		if (type == 0xE1 && !exif) {
+
+			if (readAt(device, pos+4, 6) == QByteArray("Exif\0\0", 6))
+				exif = readTiff(device, pos+10);
+		}
+		// SOFn (DHT, JPG and DAC share the range)
+		else if (type >= 0xC0 && type <= 0xCF && type != 0xC4 && type != 0xC8 && type != 0xCC) {
+
+			QByteArray sof = readAt(device, pos+5, 4);	// skip the precision
+
+			if (sof.size() == 4)
+				size = QSize((uchar)sof[2] << 8 | (uchar)sof[3], (uchar)sof[0] << 8 | (uchar)sof[1]);
+			break;
+		}
+
+		pos += 2 + length;
+	}
+
+	return exif || size.isValid();
+}
+
+/**
+ * Reads the TIFF header and the IFDs we are interested in.
+ * @param tiffStart the offset of the TIFF header (all offsets in the IFDs are relative to it).
+ **/ 
+bool DkExifHeader::readTiff(QIODevice& device, qint64 tiffStart) {
+
+	this->tiffStart = tiffStart;
+	QByteArray header = readAt(device, tiffStart, 8);
+
+	if (header.size() < 8)
+		return false;
+
+	if (header.startsWith("II"))
+		bigEndian = false;
+	else if (header.startsWith("MM"))
+		bigEndian = true;
+	else
+		return false;
+
+	// 42 for TIFF - ORF and RW2 have their own magic numbers
+	quint16 magic = get16(header.constData()+2);
+	if (magic != 42 && magic != 0x4F52 && magic != 0x5352 && magic != 0x55)
+		return false;
+
+	qint64 next = readIfd(device, get32(header.constData()+4), ifd_0);
+
+	if (next > 0)
+		readIfd(device, next, ifd_1);
+
+	return true;
+}
+
+/**
+ * Reads the tags of an IFD.
+ * Values which do not fit into the entry are only read for DateTimeOriginal.
+ * @param offset the IFD's offset relative to the TIFF header.
+ * @param ifd the IFD type (ifd_0, ifd_1 or ifd_exif).
+ * @return qint64 the offset of the next IFD or 0.
+ **/ 
+qint64 DkExifHeader::readIfd(QIODevice& device, qint64 offset, int ifd) {
+
+	if (offset < 8)	// inside the TIFF header
+		return 0;
+
+	QByteArray countBytes = readAt(device, tiffStart + offset, 2);
+
+	if (countBytes.size() < 2)
+		return 0;
+
+	int numEntries = get16(countBytes.constData());
+
+	if (numEntries == 0 || numEntries > max_entries)
+		return 0;
+
+	// the entries and the offset of the next IFD
+	QByteArray entries = readAt(device, tiffStart + offset + 2, numEntries*12 + 4);
+
+	if (entries.size() < numEntries*12 + 4)
+		return 0;
+
+	quint32 width = 0;
+	quint32 height = 0;
+	quint32 subfileType = 0;
+	quint32 jpegOffset = 0;
+	quint32 jpegLength = 0;
+	quint32 exifOffset = 0;
+
+	for (int idx = 0; idx < numEntries; idx++) {
+
+		const char* entry = entries.constData() + idx*12;
+		quint16 tag = get16(entry);
+		quint16 type = get16(entry+2);
+		quint32 count = get32(entry+4);
+		quint32 value = (type == 3) ? get16(entry+8) : get32(entry+8);	// SHORTs are left aligned
+
+		switch (tag) {
+		case 0x00FE: subfileType = value;	break;
+		case 0x0100: width = value;			break;
+		case 0x0101: height = value;		break;
+		case 0x0112: 
+			if (ifd == ifd_0) 
+				orientation = value;
+			break;
+		case 0x0201: jpegOffset = value;	break;
+		case 0x0202: jpegLength = value;	break;
+		case 0x8769: 
+			if (ifd == ifd_0) 
+				exifOffset = value;
+			break;
+		case 0x9003:
+			if (ifd == ifd_exif && type == 2 && count >= 19) {
+				QByteArray date = readAt(device, tiffStart + value, 19);
+				dateOriginal = QDateTime::fromString(QString::fromLatin1(date), "yyyy:MM:dd hh:mm:ss");
+			}
+			break;
+		case 0xA002: 
+			if (ifd == ifd_exif) 
+				exifSize.setWidth(value);
+			break;
+		case 0xA003: 
+			if (ifd == ifd_exif) 
+				exifSize.setHeight(value);
+			break;
+		}
+	}
+
+	// reduced resolution images (e.g. NEF, DNG) do not tell us the image size
+	if (ifd == ifd_0 && subfileType == 0 && width && height)
+		ifdSize = QSize(width, height);
+
+	if (ifd == ifd_1 && jpegOffset && jpegLength && jpegLength <= (quint32)max_thumb_size && 
+		tiffStart + jpegOffset + jpegLength <= device.size()) {
+		thumbOffset = tiffStart + jpegOffset;
+		thumbLength = jpegLength;
+	}
+
+	if (exifOffset && exifOffset != offset)
+		readIfd(device, exifOffset, ifd_exif);
+
+	if (ifd == ifd_exif)
+		return 0;
+
+	quint32 next = get32(entries.constData() + numEntries*12);
+
+	return next != offset ? next : 0;
+}
+
+quint16 DkExifHeader::get16(const char* data) const {
+
+	const uchar* d = (const uchar*)data;
+	return bigEndian ? d[0] << 8 | d[1] : d[1] << 8 | d[0];
+}
+
+quint32 DkExifHeader::get32(const char* data) const {
+
+	const uchar* d = (const uchar*)data;
+	return bigEndian ? 
+		(quint32)d[0] << 24 | d[1] << 16 | d[2] << 8 | d[3] : 
+		(quint32)d[3] << 24 | d[2] << 16 | d[1] << 8 | d[0];
+}
+
+bool DkExifHeader::isValid() const {
+
+	return valid;
+}
+
+/**
+ * Returns the orientation in degrees (see DkMetaDataT::getOrientation).
+ * @return int the orientation or -1 if it is not specified.
+ **/ 
+int DkExifHeader::getOrientation() const {
+
+	if (orientation == -1)
+		return -1;
+
+	return DkMetaDataT::orientationToDegree(orientation);
+}
+
+/**
+ * Returns the image size.
+ * The JPEG frame header is preferred - for RAW files the EXIF size is returned.
+ * @return QSize the image size or an invalid size if it is unknown.
+ **/ 
+QSize DkExifHeader::getSize() const {
+
+	if (!size.isEmpty())
+		return size;
+	else if (!exifSize.isEmpty())
+		return exifSize;
+
+	return ifdSize;
+}
+
+QDateTime DkExifHeader::getDateTimeOriginal() const {
+
+	return dateOriginal;
+}
+
+bool DkExifHeader::hasThumbnail() const {
+
+	return thumbOffset > 0 && thumbLength > 0;
+}
+
+QImage DkExifHeader::getThumbnail() const {
+
+	QImage thumb;
+	QSharedPointer<QIODevice> device;
+
+	if (!hasThumbnail() || !openDevice(device) || !device->seek(thumbOffset))
+		return thumb;
+
+	thumb.loadFromData(device->read(thumbLength));
+
+	return thumb;
+}
+
+qint64 DkExifHeader::getBytesRead() const {
+
+	return bytesRead;
+}
+
 // DkMetaDataHelper --------------------------------------------------------------------
 
 void DkMetaDataHelper::init() {
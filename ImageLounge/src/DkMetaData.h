@@ -32,6 +32,10 @@
 #include <QFileInfo>
 #include <QStringList>
 #include <QMap>
+#include <QHash>
+#include <QMutex>
+#include <QDateTime>
+#include <QSize>
 
 #ifdef HAVE_EXIV2_HPP
 #include <exiv2/exiv2.hpp>
@@ -63,15 +67,16 @@ typedef unsigned char byte;
 class QFileInfo;
 class QVector2D;
 class QImage;
+class QIODevice;
 
 namespace nmc {
 
 class DllExport DkMetaDataT {
 
 public:
-	DkMetaDataT();
+	DkMetaDataT(const QFileInfo& fileInfo = QFileInfo());
 
-	void readMetaData(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba = QSharedPointer<QByteArray>());
+	void readMetaData(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba = QSharedPointer<QByteArray>(), bool useCache = true);
 	bool saveMetaData(const QFileInfo& fileInfo, bool force = false);
 	bool saveMetaData(QSharedPointer<QByteArray>& ba, bool force = false);
 
@@ -105,6 +110,7 @@ public:
 	void setThumbnail(QImage thumb);
 	void setQtValues(const QImage& cImg);
 	static QString exiv2ToQString(std::string exifString);
+	static int orientationToDegree(int exifOrientation);
 
 	bool hasMetaData() const;
 	bool isLoaded() const;
@@ -115,8 +121,14 @@ public:
 	void printMetaData() const; //only for debug
 
 protected:
-	Exiv2::Image::AutoPtr exifImg;
+	QSharedPointer<Exiv2::Image> loadImage(QSharedPointer<QByteArray> ba = QSharedPointer<QByteArray>()) const;
+	bool detach();
+
+	QSharedPointer<Exiv2::Image> exifImg;
+	bool cachedImg;		// exifImg is shared with DkMetaDataCache - never modify it
+	bool ownsIo;		// exifImg was parsed by us - so its io is valid
 	QFileInfo file;
+	QFileInfo cachedFile;	// the file (symlinks resolved) exifImg is cached for
 	QStringList qtKeys;
 	QStringList qtValues;
 
@@ -130,6 +142,124 @@ protected:
 	int exifState;
 };
 
+/**
+ * Process-wide cache of parsed metadata.
+ * Exiv2 parses are expensive (especially for RAW files) and the same file is
+ * read by the thumbnail threads, the loader and the save routines.
+ * Entries are keyed by the file path and validated with the modification date and
+ * the file size. Cached images are shared - DkMetaDataT detaches before writing.
+ **/ 
+class DllExport DkMetaDataCache {
+
+public:
+	static DkMetaDataCache& instance();
+	~DkMetaDataCache();
+
+	QSharedPointer<Exiv2::Image> find(const QFileInfo& file);
+	void insert(const QFileInfo& file, QSharedPointer<Exiv2::Image> img, int parseMs);
+	bool findPreview(const QFileInfo& file, QByteArray& preview, int& width);
+	void insertPreview(const QFileInfo& file, const QByteArray& preview, int width);
+	void addReparse();
+	void remove(const QFileInfo& file);
+	void clear();
+
+	QString getStats();
+
+protected:
+	DkMetaDataCache();
+	DkMetaDataCache(DkMetaDataCache const&);		// hide
+	void operator=(DkMetaDataCache const&);		// hide
+
+	struct Entry {
+		QSharedPointer<Exiv2::Image> img;
+		QByteArray preview;		// encoded preview (e.g. the JPEG embedded in RAW files)
+		int previewWidth;
+		bool previewLoaded;
+		qint64 modified;
+		qint64 fileSize;
+		qint64 bytes;
+		quint32 lastAccess;
+	};
+
+	void evict(qint64 maxBytes);
+	static qint64 estimateBytes(Exiv2::Image& img);
+
+	enum {
+		max_bytes = 64*1024*1024,
+	};
+
+	QHash<QString, Entry> index;
+	qint64 usedBytes;
+	quint32 accessClock;
+	QMutex mutex;
+
+	// stats
+	int numHits;
+	int numMisses;
+	int numParsed;
+	int numReparsed;	// hits which had to open the file anyway
+	qint64 parseTime;
+};
+
+/**
+ * Minimal EXIF reader for hot paths (e.g. thumbnails).
+ * It walks the TIFF structure of JPEGs (APP1) and TIFF based RAW files
+ * and extracts the orientation, the pixel dimensions, the original date and the
+ * location of the embedded thumbnail. Only the headers are read (a few KB).
+ * Use DkMetaDataT if you need anything else.
+ **/ 
+class DllExport DkExifHeader {
+
+public:
+	DkExifHeader();
+
+	bool read(const QFileInfo& fileInfo, QSharedPointer<QByteArray> ba = QSharedPointer<QByteArray>());
+
+	bool isValid() const;
+	int getOrientation() const;
+	QSize getSize() const;
+	QDateTime getDateTimeOriginal() const;
+	bool hasThumbnail() const;
+	QImage getThumbnail() const;
+	qint64 getBytesRead() const;
+
+protected:
+	bool openDevice(QSharedPointer<QIODevice>& device) const;
+	QByteArray readAt(QIODevice& device, qint64 pos, int length);
+	bool readJpeg(QIODevice& device);
+	bool readTiff(QIODevice& device, qint64 tiffStart);
+	qint64 readIfd(QIODevice& device, qint64 offset, int ifd);
+	quint16 get16(const char* data) const;
+	quint32 get32(const char* data) const;
+
+	enum {
+		ifd_0,
+		ifd_1,
+		ifd_exif,
+	};
+
+	enum {
+		max_entries = 512,
+		max_segments = 64,
+		max_thumb_size = 4*1024*1024,
+	};
+
+	QFileInfo file;
+	QSharedPointer<QByteArray> ba;
+	bool valid;
+	bool bigEndian;
+	qint64 tiffStart;
+	qint64 bytesRead;
+
+	int orientation;
+	QSize size;			// SOF of JPEGs
+	QSize exifSize;		// Exif.Photo.PixelXDimension
+	QSize ifdSize;		// full resolution image of TIFFs
+	QDateTime dateOriginal;
+	qint64 thumbOffset;
+	int thumbLength;
+};
+
 class DllExport DkMetaDataHelper {
 
 public:
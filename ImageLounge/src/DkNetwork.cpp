@@ -67,6 +67,14 @@ DkClientManager::DkClientManager(QString title, QObject* parent) : QThread(paren
 	this->currentTitle = title;
 	qRegisterMetaType<QList<quint16> >("QList<quint16>");
 	qRegisterMetaType<QList<DkPeer*> >("QList<DkPeer*>");
+
+#ifdef DK_DEBUG
+	// show the sync message rates
+	QTimer* statsTimer = new QTimer(this);
+	connect(statsTimer, SIGNAL(timeout()), this, SLOT(updateSyncStats()));
+	statsTimer->start(1000);
+	syncStatsTime.start();
+#endif
 }
 
 DkClientManager::~DkClientManager() {
@@ -90,6 +98,36 @@ void DkClientManager::connectionReadyForUse(quint16 peerServerPort, QString titl
 
 }
 
+/**
+ * Collects the message counts of all connections and sends them to the debug overlay.
+ **/
+void DkClientManager::updateSyncStats() {
+
+	DkSyncStats stats;
+
+	foreach (DkPeer* peer, peerList.getPeerList()) {
+		if (peer && peer->connection)
+			stats.add(peer->connection->takeSyncStats());
+	}
+
+	double sec = qMax(syncStatsTime.restart(), 1) / 1000.0;
+
+	if (stats.sent == 0 && stats.received == 0)
+		return;
+
+	QString msg = QString("sync sent: %1/s (%2 coalesced)\nreceived: %3/s (%4 dropped)")
+		.arg(qRound(stats.sent / sec))
+		.arg(stats.coalesced)
+		.arg(qRound(stats.received / sec))
+		.arg(stats.dropped);
+
+	if (stats.latencyCount > 0)
+		msg += QString("\nlatency: %1 ms").arg(stats.latencySum / (double)stats.latencyCount, 0, 'f', 1);
+
+	qDebug() << msg;
+	emit sendSyncStatsSignal(msg, 1500);
+}
+
 void DkClientManager::disconnected() {
 
 	if (DkConnection *connection = qobject_cast<DkConnection *>(sender())) {		
@@ -236,10 +274,17 @@ void DkClientManager::sendGoodByeToAll() {
 // DkLocalClientManager --------------------------------------------------------------------
 
 DkLocalClientManager::DkLocalClientManager(QString title, QObject* parent ) : DkClientManager(title, parent) {
+	numProbes = 0;
+	numPeersFound = 0;
+
 	server = new DkLocalTcpServer(this);
 	connect(server, SIGNAL(serverReiceivedNewConnection(int)), this, SLOT(newConnection(int)));
+
+	searchTimer = new QTimer(this);
+	searchTimer->setSingleShot(true);
+	connect(searchTimer, SIGNAL(timeout()), this, SLOT(searchTimeout()));
+
 	searchForOtherClients();
-	//QFuture<void> future = QtConcurrent::run(this, &DkLocalClientManager::searchForOtherClients);
 }
 
 QList<DkPeer*> DkLocalClientManager::getPeerList() {
@@ -258,23 +303,86 @@ void DkLocalClientManager::synchronizeWithServerPort(quint16 port) {
 	synchronizeWith(peer->peerId);
 }
 
+/**
+ * Looks for other instances on the local ports.
+ * All ports are probed at once (non-blocking), connections that are
+ * not established within the deadline are dropped.
+ **/
 void DkLocalClientManager::searchForOtherClients() {
-		
+
+	searchTime.start();
+	numProbes = 0;
+	numPeersFound = 0;
+
 	for (int i = server->startPort; i <= server->endPort; i++) {
 		if (i == server->serverPort())
 			continue;
 		//qDebug() << "search For other clients on port:" << i;
 		DkConnection* connection = createConnection();
-		connection->connectToHost(QHostAddress::LocalHost, (qint16)i);
-		
+		connect(connection, SIGNAL(connected()), this, SLOT(probeConnected()));
+		connect(connection, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(probeFailed()));
+		probes.append(connection);
+		numProbes++;
 
-		if (connection->waitForConnected(20)) {
-			//qDebug() << "Connected to " << i ;
-			connection->sendGreetingMessage(currentTitle);
-		} else
-			delete connection;
+		connection->connectToHost(QHostAddress::LocalHost, (quint16)i);
 	}
+
+	// local connections are either accepted or refused within a few ms
+	if (probes.empty())
+		searchFinished();
+	else
+		searchTimer->start(500);
+}
+
+void DkLocalClientManager::probeConnected() {
+
+	DkConnection* connection = qobject_cast<DkConnection*>(sender());
 	
+	if (!connection || !probes.contains(connection))
+		return;
+
+	//qDebug() << "Connected to " << connection->peerPort();
+	numPeersFound++;
+	connection->sendGreetingMessage(currentTitle);
+	removeProbe(connection);
+}
+
+void DkLocalClientManager::probeFailed() {
+
+	DkConnection* connection = qobject_cast<DkConnection*>(sender());
+
+	if (!connection || !probes.contains(connection))
+		return;
+
+	removeProbe(connection);
+	connection->deleteLater();	// we are called from the connection
+}
+
+void DkLocalClientManager::searchTimeout() {
+
+	foreach (DkConnection* connection, probes) {
+		connection->abort();
+		connection->deleteLater();
+	}
+	probes.clear();
+
+	searchFinished();
+}
+
+void DkLocalClientManager::removeProbe(DkConnection* connection) {
+
+	disconnect(connection, SIGNAL(connected()), this, SLOT(probeConnected()));
+	disconnect(connection, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(probeFailed()));
+	probes.removeAll(connection);
+
+	if (probes.empty() && searchTimer->isActive())
+		searchFinished();
+}
+
+void DkLocalClientManager::searchFinished() {
+
+	searchTimer->stop();
+	qDebug() << "[DkLocalClientManager] found" << numPeersFound << "of" << numProbes << "ports in" << searchTime.elapsed() << "ms";
 }
 
 void DkLocalClientManager::run() {
@@ -1756,6 +1864,7 @@ void DkManagerThread::connectClient() {
 	connect(parent, SIGNAL(sendPositionSignal(QRect, bool)), clientManager, SLOT(sendPosition(QRect, bool)));
 	connect(parent, SIGNAL(synchronizeRemoteControl(quint16)), clientManager, SLOT(synchronizeWith(quint16)));
 	connect(parent, SIGNAL(synchronizeWithServerPortSignal(quint16)), clientManager, SLOT(synchronizeWithServerPort(quint16)));
+	connect(clientManager, SIGNAL(sendSyncStatsSignal(QString, int)), this, SLOT(showSyncStats(QString, int)));
 
 	connect(parent, SIGNAL(sendTitleSignal(QString)), clientManager, SLOT(sendTitle(QString)));
 	connect(vp, SIGNAL(sendNewFileSignal(qint16, QString)), clientManager, SLOT(sendNewFile(qint16, QString)));
@@ -1791,6 +1900,12 @@ void DkManagerThread::run() {
 	qDebug() << "quitting in da thread...";
 }
 
+void DkManagerThread::showSyncStats(QString msg, int time) {
+
+	if (parent)
+		parent->viewport()->getController()->setInfo(msg, time, DkControlWidget::top_left_label);
+}
+
 void DkManagerThread::quit() {
 	
 	qDebug() << "quitting thread...";
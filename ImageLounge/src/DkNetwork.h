@@ -40,6 +40,7 @@
 #include <QThread>
 #include <QMutex>
 #include <QSharedPointer>
+#include <QTime>
 #pragma warning(pop)		// no warnings from includes - end
 
 #include "DkConnection.h"
@@ -105,6 +106,7 @@ class DkClientManager : public QThread {
 		void sendGoodByeMessage();
 		void synchronizedPeersListChanged(QList<quint16> newList);
 		void updateConnectionSignal(QList<DkPeer*> peers);
+		void sendSyncStatsSignal(QString msg, int time);
 		
 		void receivedQuit();
 
@@ -132,6 +134,7 @@ class DkClientManager : public QThread {
 		virtual void connectionReceivedGoodBye(DkConnection* connection);
 		void connectionShowStatusMessage(DkConnection* connection, QString msg);
 		void disconnected();
+		void updateSyncStats();
 
 	protected:
 		void removeConnection(DkConnection* connection);
@@ -142,6 +145,7 @@ class DkClientManager : public QThread {
 		QString currentTitle;
 		quint16 newPeerId;
 		QList<DkConnection*> startUpConnections;
+		QTime syncStatsTime;
 
 };
 
@@ -168,12 +172,23 @@ class DkLocalClientManager : public DkClientManager {
 		void connectionSynchronized(QList<quint16> synchronizedPeersOfOtherClient, DkConnection* connection);
 		virtual void connectionStopSynchronized(DkConnection* connection);
 		void connectionReceivedQuit(); 
+		void probeConnected();
+		void probeFailed();
+		void searchTimeout();
 
 	private:
 		DkLocalConnection* createConnection();
 		void searchForOtherClients();
+		void removeProbe(DkConnection* connection);
+		void searchFinished();
 
 		DkLocalTcpServer* server;
+
+		QList<DkConnection*> probes;	// pending connections of the current search
+		QTimer* searchTimer;
+		QTime searchTime;
+		int numProbes;
+		int numPeersFound;
 };
 
 
@@ -412,6 +427,7 @@ public slots:
 	};
 
 	void quit();
+	void showSyncStats(QString msg, int time);
 
 protected:
 	virtual void createClient(QString title) = 0;
@@ -1520,11 +1520,7 @@ void DkNoMacs::enableNoImageActions(bool enable) {
 	toolsActions[menu_tools_thumbs]->setEnabled(enable);
 	
 	panelActions[menu_panel_info]->setEnabled(enable);
-#ifdef WITH_OPENCV
 	panelActions[menu_panel_histogram]->setEnabled(enable);
-#else
-	panelActions[menu_panel_histogram]->setEnabled(false);
-#endif
 	panelActions[menu_panel_scroller]->setEnabled(enable);
 	panelActions[menu_panel_comment]->setEnabled(enable);
 	panelActions[menu_panel_preview]->setEnabled(enable);
@@ -1805,7 +1801,7 @@ void DkNoMacs::flipImageHorizontal() {
 	if (!vp)
 		return;
 
-	QImage img = vp->getImage();
+	QImage img = vp->getFullResolutionImage();
 	img = img.mirrored(true, false);
 
 	if (img.isNull())
@@ -1821,7 +1817,7 @@ void DkNoMacs::flipImageVertical() {
 	if (!vp)
 		return;
 
-	QImage img = vp->getImage();
+	QImage img = vp->getFullResolutionImage();
 	img = img.mirrored(false, true);
 
 	if (img.isNull())
@@ -1838,7 +1834,7 @@ void DkNoMacs::invertImage() {
 	if (!vp)
 		return;
 
-	QImage img = vp->getImage();
+	QImage img = vp->getFullResolutionImage();
 	img.invertPixels();
 
 	if (img.isNull())
@@ -1855,7 +1851,7 @@ void DkNoMacs::convert2gray() {
 	if (!vp)
 		return;
 
-	QImage img = vp->getImage();
+	QImage img = vp->getFullResolutionImage();
 
 	QVector<QRgb> table(256);
 	for(int i=0;i<256;++i)
@@ -1876,7 +1872,7 @@ void DkNoMacs::normalizeImage() {
 	if (!vp)
 		return;
 
-	QImage img = vp->getImage();
+	QImage img = vp->getFullResolutionImage();
 	
 	bool normalized = DkImage::normImage(img);
 
@@ -1893,7 +1889,7 @@ void DkNoMacs::autoAdjustImage() {
 	if (!vp)
 		return;
 
-	QImage img = vp->getImage();
+	QImage img = vp->getFullResolutionImage();
 
 	bool normalized = DkImage::autoAdjustImage(img);
 
@@ -1906,7 +1902,7 @@ void DkNoMacs::autoAdjustImage() {
 void DkNoMacs::unsharpMask() {
 #ifdef WITH_OPENCV
 	DkUnsharpDialog* unsharpDialog = new DkUnsharpDialog(this);
-	unsharpDialog->setImage(viewport()->getImage());
+	unsharpDialog->setImage(viewport()->getFullResolutionImage());
 	int answer = unsharpDialog->exec();
 	if (answer == QDialog::Accepted) {
 		QImage editedImage = unsharpDialog->getImage();
@@ -2614,13 +2610,13 @@ void DkNoMacs::saveFileAs(bool silent) {
 		applyPluginChanges(true, true);
 
 	if (getTabWidget()->getCurrentImageLoader())
-		getTabWidget()->getCurrentImageLoader()->saveUserFileAs(getTabWidget()->getViewPort()->getImage(), silent);
+		getTabWidget()->getCurrentImageLoader()->saveUserFileAs(getTabWidget()->getViewPort()->getFullResolutionImage(), silent);
 }
 
 void DkNoMacs::saveFileWeb() {
 
 	if (getTabWidget()->getCurrentImageLoader())
-		getTabWidget()->getCurrentImageLoader()->saveFileWeb(getTabWidget()->getViewPort()->getImage());
+		getTabWidget()->getCurrentImageLoader()->saveFileWeb(getTabWidget()->getViewPort()->getFullResolutionImage());
 }
 
 void DkNoMacs::resizeImage() {
@@ -2647,7 +2643,7 @@ void DkNoMacs::resizeImage() {
 	qDebug() << "resize image: " << viewport()->getImage().size();
 
 
-	resizeDialog->setImage(viewport()->getImage());
+	resizeDialog->setImage(viewport()->getFullResolutionImage());
 
 	if (!resizeDialog->exec())
 		return;
@@ -2749,7 +2745,7 @@ void DkNoMacs::openImgManipulationDialog() {
 	else 
 		imgManipulationDialog->resetValues();
 
-	QImage tmpImg = viewport()->getImage();
+	QImage tmpImg = viewport()->getFullResolutionImage();
 	imgManipulationDialog->setImage(&tmpImg);
 
 	bool ok = imgManipulationDialog->exec() != 0;
@@ -2758,7 +2754,7 @@ void DkNoMacs::openImgManipulationDialog() {
 
 #ifdef WITH_OPENCV
 
-		QImage mImg = DkImage::mat2QImage(DkImageManipulationWidget::manipulateImage(DkImage::qImage2Mat(viewport()->getImage())));
+		QImage mImg = DkImage::mat2QImage(DkImageManipulationWidget::manipulateImage(DkImage::qImage2Mat(viewport()->getFullResolutionImage())));
 
 		if (!mImg.isNull())
 			viewport()->setEditedImage(mImg);
@@ -2772,7 +2768,7 @@ void DkNoMacs::setWallpaper() {
 
 	// based on code from: http://qtwiki.org/Set_windows_background_using_QT
 
-	QImage img = viewport()->getImage();
+	QImage img = viewport()->getFullResolutionImage();
 
 	QImage dImg = img;
 
@@ -2810,7 +2806,7 @@ void DkNoMacs::printDialog() {
 		res = imgC->getMetaData()->getResolution();
 
 	//QPrintPreviewDialog* previewDialog = new QPrintPreviewDialog();
-	QImage img = viewport()->getImage();
+	QImage img = viewport()->getFullResolutionImage();
 	if (!printPreviewDialog)
 		printPreviewDialog = new DkPrintPreviewDialog(img, (float)res.x(), 0, this);
 	else
@@ -3761,7 +3757,7 @@ void DkNoMacs::runLoadedPlugin() {
    }
    else if (cPlugin->interfaceType() == DkPluginInterface::interface_basic) {
 
-	    QImage tmpImg = viewport()->getImage();
+	    QImage tmpImg = viewport()->getFullResolutionImage();
 		QImage result = cPlugin->runPlugin(key, tmpImg);
 		if(!result.isNull()) 
 			viewport()->setEditedImage(result);
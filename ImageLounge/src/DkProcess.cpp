@@ -29,11 +29,17 @@
 #include "DkUtils.h"
 #include "DkImageContainer.h"
 #include "DkImageStorage.h"
+#include "DkSettings.h"
 
 #pragma warning(push, 0)	// no warnings from includes - begin
 #include <QFuture>
 #include <QFutureWatcher>
 #include <QtConcurrentMap>
+#include <QtConcurrentRun>
+#include <QThreadPool>
+#include <QThread>
+#include <QTime>
+#include <QSettings>
 #include <QWidget>
 #pragma warning(pop)		// no warnings from includes - end
 
@@ -237,6 +243,8 @@ DkBatchProcess::DkBatchProcess(const QFileInfo& fileInfoIn, const QFileInfo& fil
 	compression = -1;
 	failure = 0;
 	isProcessed = false;
+	deleteOriginal = false;
+	processingTime = 0;
 
 	mode = DkBatchConfig::mode_skip_existing;
 }
@@ -256,6 +264,29 @@ void DkBatchProcess::setDeleteOriginal(bool deleteOriginal) {
 	this->deleteOriginal = deleteOriginal;
 }
 
+void DkBatchProcess::setCompression(int compression) {
+
+	this->compression = compression;
+}
+
+void DkBatchProcess::addProcessingTime(int ms) {
+
+	processingTime += ms;
+}
+
+/**
+ * Returns the memory (MB) of the buffered file and the decoded image.
+ **/ 
+float DkBatchProcess::getMemoryUsage() const {
+
+	return imgC ? imgC->getMemoryUsage() : 0.0f;
+}
+
+int DkBatchProcess::getProcessingTime() const {
+
+	return processingTime;
+}
+
 QFileInfo DkBatchProcess::inputFile() const {
 
 	return fileInfoIn;
@@ -278,31 +309,49 @@ bool DkBatchProcess::wasProcessed() const {
 
 bool DkBatchProcess::compute() {
 
+	QTime dt;
+	dt.start();
+
+	if (prepare() && read() && decode() && process())
+		write();
+
+	addProcessingTime(dt.elapsed());
+
+	return failure == 0;
+}
+
+/**
+ * Checks the item and does all work which does not need the image.
+ * Renaming and copying is done here.
+ * @return bool true if the image needs to be loaded.
+ **/ 
+bool DkBatchProcess::prepare() {
+
 	isProcessed = true;
 
 	// check errors
 	if (fileInfoOut.exists() && mode == DkBatchConfig::mode_skip_existing) {
 		logStrings.append(QObject::tr("%1 already exists -> skipping (check 'overwrite' if you want to overwrite the file)").arg(fileInfoOut.absoluteFilePath()));
 		failure++;
-		return failure == 0;
+		return false;
 	}
 	else if (!fileInfoIn.exists()) {
 		logStrings.append(QObject::tr("Error: input file does not exist"));
 		logStrings.append(QObject::tr("Input: %1").arg(fileInfoIn.absoluteFilePath()));
 		failure++;
-		return failure == 0;
+		return false;
 	}
 	else if (fileInfoIn == fileInfoOut && processFunctions.empty()) {
 		logStrings.append(QObject::tr("Skipping: nothing to do here."));
 		failure++;
-		return failure == 0;
+		return false;
 	}
 	
 	// do the work
 	if (processFunctions.empty() && fileInfoIn.absolutePath() == fileInfoOut.absolutePath() && fileInfoIn.suffix() == fileInfoOut.suffix()) {	// rename?
 		if (!renameFile())
 			failure++;
-		return failure == 0;
+		return false;
 	}
 	else if (processFunctions.empty() && fileInfoIn.suffix() == fileInfoOut.suffix()) {	// copy?
 		if (!copyFile())
@@ -310,31 +359,54 @@ bool DkBatchProcess::compute() {
 		else
 			deleteOriginalFile();
 
-		return failure == 0;
+		return false;
 	}
 
-	process();
-
-	return failure == 0;
+	return true;
 }
 
-QStringList DkBatchProcess::getLog() const {
+/**
+ * Reads the file into memory (I/O bound).
+ **/ 
+bool DkBatchProcess::read() {
 
-	return logStrings;
-}
+	logStrings.append(QObject::tr("processing %1").arg(fileInfoIn.absoluteFilePath()));
 
-bool DkBatchProcess::process() {
+	imgC = QSharedPointer<DkImageContainer>(new DkImageContainer(fileInfoIn));
+	imgC->loadBuffer();
 
-	logStrings.append(QObject::tr("processing %1").arg(fileInfoIn.absoluteFilePath()));
+	return true;
+}
+
+/**
+ * Decodes the buffered file (CPU bound).
+ **/ 
+bool DkBatchProcess::decode() {
 
-	QSharedPointer<DkImageContainer> imgC(new DkImageContainer(fileInfoIn));
+	if (!imgC)
+		return false;
 
 	if (!imgC->loadImage() || imgC->image().isNull()) {
 		logStrings.append(QObject::tr("Error while loading..."));
 		failure++;
+		imgC.clear();
 		return false;
 	}
 
+	// the metadata is parsed - so we do not need to keep the buffer
+	imgC->releaseFileBuffer();
+
+	return true;
+}
+
+/**
+ * Runs the process chain.
+ **/ 
+bool DkBatchProcess::process() {
+
+	if (!imgC)
+		return false;
+
 	for (QSharedPointer<DkAbstractBatch> batch : processFunctions) {
 
 		if (!batch) {
@@ -348,6 +420,17 @@ bool DkBatchProcess::process() {
 		}
 	}
 
+	return true;
+}
+
+/**
+ * Encodes and writes the image.
+ **/ 
+void DkBatchProcess::write() {
+
+	if (!imgC)
+		return;
+
 	deleteExisting();
 
 	if (imgC->saveImage(fileInfoOut, compression))
@@ -357,9 +440,23 @@ bool DkBatchProcess::process() {
 		failure++;
 	}
 
+	imgC.clear();
 	deleteOriginalFile();
+}
 
-	return true;
+/**
+ * Drops an item which is in the pipeline.
+ **/ 
+void DkBatchProcess::cancel() {
+
+	imgC.clear();
+	logStrings.append(QObject::tr("Canceled."));
+	failure++;
+}
+
+QStringList DkBatchProcess::getLog() const {
+
+	return logStrings;
 }
 
 bool DkBatchProcess::renameFile() {
@@ -442,6 +539,12 @@ bool DkBatchProcess::deleteOriginalFile() {
 	return true;
 }
 
+// DkBatchStageRunner --------------------------------------------------------------------
+void DkBatchStageRunner::run() {
+
+	batch->runStage(stage);
+}
+
 // DkBatchConfig --------------------------------------------------------------------
 DkBatchConfig::DkBatchConfig(const QStringList& fileList, const QString& outputDir, const QString& fileNamePattern) {
 
@@ -479,12 +582,100 @@ bool DkBatchConfig::isOk() const {
 	return true;
 }
 
+/**
+ * Loads a batch configuration from an ini file (used by the command line).
+ * [Batch]
+ * files = list of files, wildcards (e.g. /img/*.jpg) are resolved
+ * outputDir, pattern (e.g. <c:0>_small.<old>), compression (-1 default),
+ * overwrite (bool), deleteOriginal (bool)
+ * [Resize]
+ * mode = percent | longSide | shortSide | width | height
+ * value = percent or pixel, property = both | decreaseOnly | increaseOnly, gamma (bool)
+ * [Transform]
+ * angle (-90, 90, 180), flipHorizontal (bool), flipVertical (bool)
+ * @param settingsPath the path to the ini file.
+ * @return bool true if the file could be read.
+ **/ 
+bool DkBatchConfig::load(const QString& settingsPath) {
+
+	if (!QFileInfo(settingsPath).exists())
+		return false;
+
+	QSettings settings(settingsPath, QSettings::IniFormat);
+
+	settings.beginGroup("Batch");
+
+	fileList.clear();
+	QStringList files = settings.value("files", QStringList()).toStringList();
+
+	for (QString cFile : files) {
+
+		QFileInfo fileInfo(cFile);
+
+		if (cFile.contains("*") || cFile.contains("?")) {
+			QDir dir = fileInfo.absoluteDir();
+			QStringList names = dir.entryList(QStringList(fileInfo.fileName()), QDir::Files, QDir::Name);
+
+			for (QString name : names)
+				fileList.append(dir.absoluteFilePath(name));
+		}
+		else
+			fileList.append(fileInfo.absoluteFilePath());
+	}
+
+	outputDirPath = settings.value("outputDir", outputDirPath).toString();
+	fileNamePattern = settings.value("pattern", "<c:0>.<old>").toString();
+	compression = settings.value("compression", compression).toInt();
+	mode = settings.value("overwrite", false).toBool() ? mode_overwrite : mode_skip_existing;
+	deleteOriginal = settings.value("deleteOriginal", false).toBool();
+	settings.endGroup();
+
+	processFunctions.clear();
+
+	settings.beginGroup("Resize");
+	QStringList resizeModes;
+	resizeModes << "percent" << "longSide" << "shortSide" << "width" << "height";
+	QStringList resizeProperties;
+	resizeProperties << "both" << "decreaseOnly" << "increaseOnly";
+
+	int resizeMode = qMax(resizeModes.indexOf(settings.value("mode", "percent").toString()), 0);
+	int resizeProperty = qMax(resizeProperties.indexOf(settings.value("property", "both").toString()), 0);
+	float resizeValue = settings.value("value", 100.0f).toFloat();
+	bool correctGamma = settings.value("gamma", false).toBool();
+	settings.endGroup();
+
+	if (resizeMode == DkResizeBatch::mode_default)
+		resizeValue /= 100.0f;
+
+	QSharedPointer<DkResizeBatch> resizeBatch(new DkResizeBatch());
+	resizeBatch->setProperties(resizeValue, resizeMode, resizeProperty, DkImage::ipl_area, correctGamma);
+
+	if (resizeBatch->isActive())
+		processFunctions.append(resizeBatch);
+
+	settings.beginGroup("Transform");
+	int angle = settings.value("angle", 0).toInt();
+	bool flipHorizontal = settings.value("flipHorizontal", false).toBool();
+	bool flipVertical = settings.value("flipVertical", false).toBool();
+	settings.endGroup();
+
+	QSharedPointer<DkBatchTransform> transformBatch(new DkBatchTransform());
+	transformBatch->setProperties(angle, flipHorizontal, flipVertical);
+
+	if (transformBatch->isActive())
+		processFunctions.append(transformBatch);
+
+	return true;
+}
+
 // DkBatchProcessing --------------------------------------------------------------------
 DkBatchProcessing::DkBatchProcessing(const DkBatchConfig& config, QWidget* parent /*= 0*/) : QObject(parent) {
 
 	this->batchConfig = config;
 
-	connect(&batchWatcher, SIGNAL(progressValueChanged(int)), this, SIGNAL(progressValueChanged(int)));
+	items = 0;
+	numItems = 0;
+
 	connect(&batchWatcher, SIGNAL(finished()), this, SIGNAL(finished()));
 }
 
@@ -504,6 +695,7 @@ void DkBatchProcessing::init() {
 		DkBatchProcess cProcess(cFileInfo, newFileInfo);
 		cProcess.setMode(batchConfig.getMode());
 		cProcess.setDeleteOriginal(batchConfig.getDeleteOriginal());
+		cProcess.setCompression(batchConfig.getCompression());
 		cProcess.setProcessChain(batchConfig.getProcessFunctions());
 
 		batchItems.push_back(cProcess);
@@ -519,13 +711,187 @@ void DkBatchProcessing::compute() {
 	if (batchWatcher.isRunning())
 		batchWatcher.waitForFinished();
 
-	QFuture<void> future = QtConcurrent::map(batchItems, &nmc::DkBatchProcessing::computeItem);
+	QFuture<void> future = QtConcurrent::run(this, &nmc::DkBatchProcessing::runPipeline);
 	batchWatcher.setFuture(future);
 }
 
-bool DkBatchProcessing::computeItem(DkBatchProcess& item) {
+/**
+ * Runs the batch as a pipeline: read -> decode/process -> encode/write.
+ * Each stage has its own workers, so I/O and CPU bound stages overlap.
+ * Decoding and processing share one worker per core - a decoded image is
+ * processed by the thread that decoded it and never waits in a queue.
+ * The stages are connected by bounded queues which limit the memory of the
+ * images in flight (back-pressure).
+ **/ 
+void DkBatchProcessing::runPipeline() {
+
+	QTime dt;
+	dt.start();
+
+	int numCores = qMax(QThread::idealThreadCount(), 1);
+
+	// encoding is CPU bound too - so the writers take some cores from the compute stage
+	int numWriters = qBound(1, numCores/4, 2);
+
+	stages[stage_read].name = tr("read");
+	stages[stage_read].numThreads = 2;
+	stages[stage_compute].name = tr("decode/process");
+	stages[stage_compute].numThreads = qMax(numCores-numWriters, 1);
+	stages[stage_write].name = tr("encode/write");
+	stages[stage_write].numThreads = numWriters;
 
-	return item.compute();
+	// the queues get a quarter of the memory budget (file buffers) and half of it (decoded images)
+	// the remaining quarter is left for the images which are being decoded or encoded
+	float memBudget = getMemoryBudget();
+	queues[stage_read].reset(stages[stage_compute].numThreads*2, memBudget*0.25f);
+	queues[stage_compute].reset(stages[stage_write].numThreads*2, memBudget*0.5f);
+
+	items = batchItems.data();
+	numItems = batchItems.size();
+	readIdx.fetchAndStoreRelaxed(0);
+	numDone.fetchAndStoreRelaxed(0);
+	canceled.fetchAndStoreRelaxed(0);
+
+	// we need our own pool - workers block on the queues and the global pool is used by the loaders
+	QThreadPool pool;
+	int numThreads = 0;
+
+	for (int sIdx = 0; sIdx < stage_end; sIdx++) {
+		stages[sIdx].numActive.fetchAndStoreRelaxed(stages[sIdx].numThreads);
+		stages[sIdx].numItems.fetchAndStoreRelaxed(0);
+		stages[sIdx].busyTime.fetchAndStoreRelaxed(0);
+		numThreads += stages[sIdx].numThreads;
+	}
+
+	pool.setMaxThreadCount(numThreads);
+
+	for (int sIdx = 0; sIdx < stage_end; sIdx++) {
+		for (int tIdx = 0; tIdx < stages[sIdx].numThreads; tIdx++)
+			pool.start(new DkBatchStageRunner(this, sIdx));
+	}
+
+	pool.waitForDone();
+	items = 0;
+
+	// report
+	double wallTime = qMax(dt.elapsed(), 1);
+	pipelineReport.clear();
+	pipelineReport << tr("%1 images in %2 s (%3 images/s)")
+		.arg(numItems)
+		.arg(wallTime/1000.0, 0, 'f', 2)
+		.arg(numItems/wallTime*1000.0, 0, 'f', 2);
+
+	for (int sIdx = 0; sIdx < stage_end; sIdx++) {
+
+		Stage& s = stages[sIdx];
+		int sItems = s.numItems.fetchAndAddRelaxed(0);
+		int busyTime = s.busyTime.fetchAndAddRelaxed(0);
+
+		pipelineReport << tr("%1 (%2 threads): %3 images, %4 images/s, %5 ms/image, %6% busy")
+			.arg(s.name)
+			.arg(s.numThreads)
+			.arg(sItems)
+			.arg(sItems/wallTime*1000.0, 0, 'f', 2)
+			.arg(sItems ? (double)busyTime/sItems : 0.0, 0, 'f', 1)
+			.arg(busyTime/(wallTime*s.numThreads)*100.0, 0, 'f', 0);
+	}
+
+	for (QString line : pipelineReport)
+		qDebug() << "[Batch]" << line;
+}
+
+/**
+ * Worker loop of a pipeline stage.
+ * The last worker of a stage closes its output queue, so the next stage
+ * stops as soon as it processed the remaining items.
+ * @param stage the stage.
+ **/ 
+void DkBatchProcessing::runStage(int stage) {
+
+	int idx = -1;
+
+	while (nextItem(stage, idx)) {
+
+		DkBatchProcess& item = items[idx];
+		bool forward = false;
+
+		if (!isCanceled()) {
+			QTime dt;
+			dt.start();
+
+			forward = computeStage(item, stage);
+
+			int ms = dt.elapsed();
+			item.addProcessingTime(ms);
+			stages[stage].busyTime.fetchAndAddRelaxed(ms);
+			stages[stage].numItems.ref();
+		}
+		else
+			item.cancel();
+
+		// the next stage takes over
+		if (forward && queues[stage].push(idx, item.getMemoryUsage()))
+			continue;
+		else if (forward)
+			item.cancel();	// the queue was closed
+
+		emit progressValueChanged(numDone.fetchAndAddRelaxed(1)+1);
+	}
+
+	if (!stages[stage].numActive.deref() && stage < stage_write)
+		queues[stage].close();
+}
+
+bool DkBatchProcessing::nextItem(int stage, int& idx) {
+
+	if (stage == stage_read) {
+
+		if (isCanceled())
+			return false;
+
+		idx = readIdx.fetchAndAddRelaxed(1);
+		return idx < numItems;
+	}
+
+	return queues[stage-1].pop(idx);
+}
+
+/**
+ * Computes a stage of a batch item.
+ * @return bool true if the item needs the next stage.
+ **/ 
+bool DkBatchProcessing::computeStage(DkBatchProcess& item, int stage) {
+
+	switch (stage) {
+	case stage_read:	return item.prepare() && item.read();
+	case stage_compute:	return item.decode() && item.process();
+	case stage_write:	item.write();
+	}
+
+	return false;
+}
+
+/**
+ * Returns the memory (MB) the images in the pipeline may use.
+ * This is the cache memory if it is set, otherwise a quarter of the free memory.
+ **/ 
+float DkBatchProcessing::getMemoryBudget() const {
+
+	float memBudget = DkSettings::resources.cacheMemory;
+
+	if (memBudget <= 0)
+		memBudget = (float)DkMemory::getFreeMemory()*0.25f;
+
+	// we cannot determine the free memory on all systems
+	if (memBudget <= 0)
+		memBudget = 512;
+
+	return memBudget;
+}
+
+bool DkBatchProcessing::isCanceled() {
+
+	return canceled.testAndSetAcquire(1, 1);
 }
 
 QStringList DkBatchProcessing::getLog() const {
@@ -538,9 +904,16 @@ QStringList DkBatchProcessing::getLog() const {
 		log << "";	// add empty line between images
 	}
 
+	log << getPipelineReport();
+
 	return log;
 }
 
+QStringList DkBatchProcessing::getPipelineReport() const {
+
+	return pipelineReport;
+}
+
 int DkBatchProcessing::getNumFailures() const {
 
 	int numFailures = 0;
@@ -621,9 +994,16 @@ bool DkBatchProcessing::isComputing() const {
 	return batchWatcher.isRunning();
 }
 
+/**
+ * Cancels the pipeline.
+ * No more files are read and the items in the queues are dropped.
+ **/ 
 void DkBatchProcessing::cancel() {
 
-	batchWatcher.cancel();
+	canceled.fetchAndStoreRelease(1);
+
+	for (int qIdx = 0; qIdx < stage_end-1; qIdx++)
+		queues[qIdx].close();
 }
 
 }
\ No newline at end of file
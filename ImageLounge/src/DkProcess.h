@@ -34,6 +34,11 @@
 #include <QDir>
 #include <QStringList>
 #include <QUrl>
+#include <QRunnable>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QAtomicInt>
 #pragma warning(pop)		// no warnings from includes - end
 
 // Qt defines
@@ -131,12 +136,25 @@ public:
 	void setProcessChain(const QVector<QSharedPointer<DkAbstractBatch> > processes);
 	void setMode(int mode);
 	void setDeleteOriginal(bool deleteOriginal);
+	void setCompression(int compression);
 	bool compute();	// do the work
+
+	// pipeline stages - each returns true if the next stage is needed
+	bool prepare();
+	bool read();
+	bool decode();
+	bool process();
+	void write();
+	void cancel();
+
 	QStringList getLog() const;
 	bool hasFailed() const;
 	bool wasProcessed() const;
 	QFileInfo inputFile() const;
 	QFileInfo outputFile() const;
+	void addProcessingTime(int ms);
+	int getProcessingTime() const;
+	float getMemoryUsage() const;
 
 protected:
 	QFileInfo fileInfoIn;
@@ -146,11 +164,12 @@ protected:
 	int compression;
 	int failure;
 	bool isProcessed;
+	int processingTime;	// ms
 
 	QVector<QSharedPointer<DkAbstractBatch> > processFunctions;
 	QStringList logStrings;
+	QSharedPointer<DkImageContainer> imgC;
 
-	bool process();
 	bool deleteExisting();
 	bool deleteOriginalFile();
 	bool copyFile();
@@ -164,6 +183,7 @@ public:
 	DkBatchConfig(const QStringList& fileList, const QString& outputDir, const QString& fileNamePattern);
 
 	bool isOk() const;
+	bool load(const QString& settingsPath);
 
 	void setFileList(const QStringList& fileList) { this->fileList = fileList; };
 	void setOutputDir(const QString& outputDir) {this->outputDirPath = outputDir; };
@@ -201,6 +221,117 @@ protected:
 	QVector<QSharedPointer<DkAbstractBatch> > processFunctions;
 };
 
+/**
+ * Bounded queue that connects two pipeline stages.
+ * push blocks if the queue is full (back-pressure) and pop blocks if it is empty.
+ * If the queue is closed, push fails and pop returns the remaining items.
+ **/ 
+template <typename T>
+class DkBoundedQueue {
+
+public:
+	DkBoundedQueue() {
+		capacity = 1;
+		maxMemory = 0;
+		memory = 0;
+		closed = false;
+	};
+
+	/**
+	 * Clears the queue.
+	 * @param capacity the maximal number of items.
+	 * @param maxMemory the maximal memory (MB) of all queued items, 0 = unlimited.
+	 **/ 
+	void reset(int capacity, float maxMemory = 0) {
+		QMutexLocker locker(&mutex);
+		queue.clear();
+		memQueue.clear();
+		this->capacity = qMax(capacity, 1);
+		this->maxMemory = maxMemory;
+		memory = 0;
+		closed = false;
+	};
+
+	/**
+	 * Adds an item and blocks while the queue is full.
+	 * An item is always accepted by an empty queue - even if it exceeds the memory budget.
+	 * @param mem the memory (MB) of the item.
+	 **/ 
+	bool push(const T& item, float mem = 0) {
+		QMutexLocker locker(&mutex);
+
+		while (isFull(mem) && !closed)
+			notFull.wait(&mutex);
+
+		if (closed)
+			return false;
+
+		queue.enqueue(item);
+		memQueue.enqueue(mem);
+		memory += mem;
+		notEmpty.wakeOne();
+		return true;
+	};
+
+	bool pop(T& item) {
+		QMutexLocker locker(&mutex);
+
+		while (queue.isEmpty() && !closed)
+			notEmpty.wait(&mutex);
+
+		if (queue.isEmpty())
+			return false;
+
+		item = queue.dequeue();
+		memory -= memQueue.dequeue();
+		notFull.wakeAll();	// items differ in size - every waiting producer might fit now
+		return true;
+	};
+
+	void close() {
+		QMutexLocker locker(&mutex);
+		closed = true;
+		notEmpty.wakeAll();
+		notFull.wakeAll();
+	};
+
+protected:
+	QQueue<T> queue;
+	QQueue<float> memQueue;
+	int capacity;
+	float maxMemory;
+	float memory;
+	bool closed;
+	QMutex mutex;
+	QWaitCondition notEmpty;
+	QWaitCondition notFull;
+
+	bool isFull(float mem) const {
+
+		if (queue.size() >= capacity)
+			return true;
+
+		return maxMemory > 0 && !queue.isEmpty() && memory + mem > maxMemory;
+	};
+};
+
+class DkBatchProcessing;
+
+class DkBatchStageRunner : public QRunnable {
+
+public:
+	DkBatchStageRunner(DkBatchProcessing* batch, int stage) {
+		this->batch = batch;
+		this->stage = stage;
+	};
+
+	void run();
+
+protected:
+	DkBatchProcessing* batch;
+	int stage;
+};
+
 class DkBatchProcessing : public QObject {
 	Q_OBJECT
 
@@ -214,12 +345,20 @@ public:
 		batch_item_end
 	};
 
+	enum {
+		stage_read,
+		stage_compute,	// decode & process
+		stage_write,
+
+		stage_end
+	};
+
 	DkBatchProcessing(const DkBatchConfig& config = DkBatchConfig(), QWidget* parent = 0);
 
 	void compute();
-	static bool computeItem(DkBatchProcess& item);
 	
 	QStringList getLog() const;
+	QStringList getPipelineReport() const;
 	int getNumFailures() const;
 	int getNumItems() const;
 	int getNumProcessed() const;
@@ -232,6 +371,7 @@ public:
 	// getter, setter
 	void setBatchConfig(const DkBatchConfig& config) { this->batchConfig = config; };
 	DkBatchConfig getBatchConfig() const { return batchConfig; };
+	QVector<DkBatchProcess> getBatchItems() const { return batchItems; };
 
 public slots:
 	// user interaction
@@ -242,14 +382,40 @@ signals:
 	void finished();
 
 protected:
+	friend class DkBatchStageRunner;
+
 	DkBatchConfig batchConfig;
 	QVector<DkBatchProcess> batchItems;
 	QList<int> resList;
 	
 	// threading
 	QFutureWatcher<void> batchWatcher;
+
+	// pipeline
+	struct Stage {
+		QString name;
+		int numThreads;
+		QAtomicInt numActive;
+		QAtomicInt numItems;
+		QAtomicInt busyTime;	// ms
+	};
+
+	Stage stages[stage_end];
+	DkBoundedQueue<int> queues[stage_end-1];	// output of each stage
+	DkBatchProcess* items;
+	int numItems;
+	QAtomicInt readIdx;
+	QAtomicInt numDone;
+	QAtomicInt canceled;
+	QStringList pipelineReport;
 	
 	void init();
+	void runPipeline();
+	void runStage(int stage);
+	bool nextItem(int stage, int& idx);
+	bool computeStage(DkBatchProcess& item, int stage);
+	float getMemoryBudget() const;
+	bool isCanceled();
 };
 
 }
\ No newline at end of file
@@ -437,6 +437,9 @@ void DkSettings::load() {
 	resources_p.filterDuplicats = settings.value("filterDuplicates", resources_p.filterDuplicats).toBool();
 	resources_p.preferredExtension = settings.value("preferredExtension", resources_p.preferredExtension).toString();	
 	resources_p.gammaCorrection = settings.value("gammaCorrection", resources_p.gammaCorrection).toBool();
+	resources_p.thumbCacheSize = settings.value("thumbCacheSize", resources_p.thumbCacheSize).toFloat();
+	resources_p.screenResolutionFirst = settings.value("screenResolutionFirst", resources_p.screenResolutionFirst).toBool();
+	resources_p.mapFileBuffers = settings.value("mapFileBuffers", resources_p.mapFileBuffers).toBool();
 
 	if (sync_p.switchModifier) {
 		global_p.altMod = Qt::ControlModifier;
@@ -686,6 +689,12 @@ void DkSettings::save(bool force) {
 		settings.setValue("preferredExtension", resources_p.preferredExtension);
 	if (!force && resources_p.gammaCorrection != resources_d.gammaCorrection)
 		settings.setValue("gammaCorrection", resources_p.gammaCorrection);
+	if (!force && resources_p.thumbCacheSize != resources_d.thumbCacheSize)
+		settings.setValue("thumbCacheSize", resources_p.thumbCacheSize);
+	if (!force && resources_p.screenResolutionFirst != resources_d.screenResolutionFirst)
+		settings.setValue("screenResolutionFirst", resources_p.screenResolutionFirst);
+	if (!force && resources_p.mapFileBuffers != resources_d.mapFileBuffers)
+		settings.setValue("mapFileBuffers", resources_p.mapFileBuffers);
 	settings.endGroup();
 
 	// keep loaded settings in mind
@@ -810,8 +819,9 @@ void DkSettings::setToDefaultSettings() {
 	resources_p.loadRawThumb = raw_thumb_always;
 	resources_p.filterDuplicats = false;
 	resources_p.preferredExtension = "*.jpg";
-	resources_p.numThumbsLoading = 0;
-	resources_p.maxThumbsLoading = 5;
+	resources_p.thumbCacheSize = 256;	// MB
+	resources_p.screenResolutionFirst = true;
+	resources_p.mapFileBuffers = false;	// mapped files crash (SIGBUS) if they are truncated or a share drops and are locked on Windows
 	resources_p.gammaCorrection = true;
 	resources_p.waitForLastImg = true;
 
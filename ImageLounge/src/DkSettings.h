@@ -260,8 +260,9 @@ public:
 		bool filterDuplicats;
 		int loadRawThumb;
 		QString preferredExtension;
-		int numThumbsLoading;
-		int maxThumbsLoading;
+		float thumbCacheSize;
+		bool screenResolutionFirst;
+		bool mapFileBuffers;
 		bool gammaCorrection;
 	};
 
@@ -40,6 +40,14 @@
 #include <QtConcurrentRun>
 #include <QTimer>
 #include <QBuffer>
+#include <QDir>
+#include <QDataStream>
+#include <QDateTime>
+#include <QCoreApplication>
+#include <QDesktopServices>
+#if QT_VERSION >= 0x050000
+#include <QStandardPaths>
+#endif
 #pragma warning(pop)		// no warnings from includes - end
 
 namespace nmc {
@@ -68,6 +76,15 @@ DkThumbNail::~DkThumbNail() {}
  **/ 
 void DkThumbNail::compute(int forceLoad) {
 	
+	if (forceLoad == do_not_force && rescale) {
+		QImage cThumb = DkThumbCache::instance().find(file, maxThumbSize);
+
+		if (!cThumb.isNull()) {
+			this->img = cThumb;
+			return;
+		}
+	}
+
 	// we do this that complicated to be thread-safe
 	// if we use member vars in the thread and the object gets deleted during thread execution we crash...
 	this->img = computeIntern(file, QSharedPointer<QByteArray>(), forceLoad, maxThumbSize, minThumbSize, rescale);
@@ -110,27 +127,34 @@ QImage DkThumbNail::computeIntern(const QFileInfo file, const QSharedPointer<QBy
 
 	// see if we can read the thumbnail from the exif data
 	QImage thumb;
-	DkMetaDataT metaData;
+	DkMetaDataT metaData(file);
+	DkExifHeader exifHeader;
+	int orientation = -1;
 
 	QSharedPointer<QByteArray> baZip = QSharedPointer<QByteArray>();
 #ifdef WITH_QUAZIP
 	if (file.dir().path().contains(DkZipContainer::zipMarker())) 
 		baZip = DkZipContainer::extractImage(DkZipContainer::decodeZipFile(file), DkZipContainer::decodeImageFile(file));
 #endif
-	try {
-		if (baZip && !baZip->isEmpty())	
-			metaData.readMetaData(file, baZip);
-		else if (!ba || ba->isEmpty())
-			metaData.readMetaData(file);
-		else
-			metaData.readMetaData(file, ba);
+	QSharedPointer<QByteArray> baFile = (baZip && !baZip->isEmpty()) ? baZip : ba;
 
-		// read the full image if we want to create new thumbnails
-		if (forceLoad != force_save_thumb)
-			thumb = metaData.getThumbnail();
+	// the header is sufficient for the thumbnail and its orientation - exiv2 is just needed if we write thumbnails
+	if (forceLoad != force_save_thumb && exifHeader.read(file, baFile)) {
+		thumb = exifHeader.getThumbnail();
+		orientation = exifHeader.getOrientation();
 	}
-	catch(...) {
-		// do nothing - we'll load the full file
+	else {
+		try {
+			metaData.readMetaData(file, baFile);
+
+			// read the full image if we want to create new thumbnails
+			if (forceLoad != force_save_thumb)
+				thumb = metaData.getThumbnail();
+		}
+		catch(...) {
+			// do nothing - we'll load the full file
+		}
+		orientation = metaData.getOrientation();
 	}
 	removeBlackBorder(thumb);
 
@@ -138,8 +162,6 @@ QImage DkThumbNail::computeIntern(const QFileInfo file, const QSharedPointer<QBy
 		return QImage();
 
 	bool exifThumb = !thumb.isNull();
-
-	int orientation = metaData.getOrientation();
 	int imgW = thumb.width();
 	int imgH = thumb.height();
 	int tS = minThumbSize;
@@ -147,15 +169,14 @@ QImage DkThumbNail::computeIntern(const QFileInfo file, const QSharedPointer<QBy
 	// as found at: http://olliwang.com/2010/01/30/creating-thumbnail-images-in-qt/
 	QString filePath = (file.isSymLink()) ? file.symLinkTarget() : file.absoluteFilePath();
 	QImageReader* imageReader = 0;
+	QBuffer buffer;		// must live as long as the reader
 	
 	if (!ba || ba->isEmpty())
 		imageReader = new QImageReader(filePath);
 	else {
-		QBuffer buffer;
-		buffer.setData(ba->data());
+		buffer.setData(*ba);
 		buffer.open(QIODevice::ReadOnly);
 		imageReader = new QImageReader(&buffer, QFileInfo(filePath).suffix().toStdString().c_str());
-		buffer.close();
 	}
 
 	if (thumb.isNull() || thumb.width() < tS && thumb.height() < tS) {
@@ -190,13 +211,22 @@ QImage DkThumbNail::computeIntern(const QFileInfo file, const QSharedPointer<QBy
 		}
 
 		QSize initialSize = imageReader->size();
+		QSize scaledSize(imgW, imgH);
+
+		// libjpeg decodes 1/2, 1/4 or 1/8 of the size in the DCT domain - we do the rest with a proper filter
+		if (rescale && imgW > 0 && imgH > 0 && imageReader->format() == "jpeg")
+			scaledSize = DkImage::jpegScaledSize(initialSize, scaledSize);
 
-		imageReader->setScaledSize(QSize(imgW, imgH));
+		imageReader->setScaledSize(scaledSize);
 		thumb = imageReader->read();
 
+		if (!thumb.isNull() && scaledSize != QSize(imgW, imgH))
+			thumb = thumb.scaled(QSize(imgW, imgH), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
 		// try to read the image
 		if (thumb.isNull()) {
 			DkBasicLoader loader;
+			loader.setRawPreviewMode(true);	// thumbnails never need the full RAW resolution
 			
 			if (baZip && !baZip->isEmpty())	{
 				if (loader.loadGeneral(file, baZip, true, true))
@@ -260,6 +290,9 @@ QImage DkThumbNail::computeIntern(const QFileInfo file, const QSharedPointer<QBy
 				sThumb = sThumb.transformed(rotationMatrix);
 			}
 
+			if (!metaData.isLoaded())
+				metaData.readMetaData(file, baFile);
+
 			metaData.setThumbnail(sThumb);
 
 			if (!ba || ba->isEmpty())
@@ -275,6 +308,12 @@ QImage DkThumbNail::computeIntern(const QFileInfo file, const QSharedPointer<QBy
 	}
 
 
+	// keep the thumbnail for the next time the folder is opened (zipped files are not cached - they have no valid modified date)
+	if (!thumb.isNull() && rescale && forceLoad != force_exif_thumb && (!baZip || baZip->isEmpty())) {
+		DkThumbCache::instance().insert(file, maxThumbSize, thumb);
+		DkThumbCache::instance().addDecodeTime(dt.getTotalTime());
+	}
+
 	if (!thumb.isNull())
 		qDebug() << "[thumb] " << file.fileName() << "(" << thumb.width() << " x " << thumb.height() << ") loaded in: " << dt.getTotal() << ((exifThumb) ? " from EXIV" : " from File");
 
@@ -362,10 +401,8 @@ DkThumbNailT::DkThumbNailT(QFileInfo file, QImage img) : DkThumbNail(file, img)
 
 DkThumbNailT::~DkThumbNailT() {
 
-	if (fetching && DkSettings::resources.numThumbsLoading > 0)
-		DkSettings::resources.numThumbsLoading--;
-	thumbWatcher.blockSignals(true);
-	thumbWatcher.cancel();
+	if (fetching)
+		DkThumbScheduler::instance().remove(this);
 }
 
 void DkThumbNailT::fetchColor() {
@@ -402,7 +439,13 @@ void DkThumbNailT::colorLoaded() {
 	qDebug() << "mean color: " << meanColor;
 }
 
-bool DkThumbNailT::fetchThumb(int forceLoad /* = false */,  QSharedPointer<QByteArray> ba) {
+bool DkThumbNailT::fetchThumb(int forceLoad /* = false */,  QSharedPointer<QByteArray> ba, float priority /* = 0.0f */) {
+
+	// already queued? the request might be more urgent now
+	if (fetching && DkThumbScheduler::instance().isPending(this)) {
+		DkThumbScheduler::instance().schedule(this, this->forceLoad, ba, priority);
+		return false;
+	}
 
 	if (forceLoad == force_full_thumb || forceLoad == force_save_thumb || forceLoad == save_thumb)
 		img = QImage();
@@ -410,44 +453,701 @@ bool DkThumbNailT::fetchThumb(int forceLoad /* = false */,  QSharedPointer<QByte
 	if (!img.isNull() || !imgExists || fetching)
 		return false;
 
-	// we have to do our own bool here
-	// watcher.isRunning() returns false if the thread is waiting in the pool
+	// no rescale if we load from exif - memory should not be an issue here
+	if (forceLoad == DkThumbNailT::force_exif_thumb)
+		rescale = false;
+
 	fetching = true;
 	this->forceLoad = forceLoad;
 
-	connect(&thumbWatcher, SIGNAL(finished()), this, SLOT(thumbLoaded()));
-	thumbWatcher.setFuture(QtConcurrent::run(this, 
-		&nmc::DkThumbNailT::computeCall, forceLoad, ba));
-	
-	DkSettings::resources.numThumbsLoading++;
+	DkThumbScheduler::instance().schedule(this, forceLoad, ba, priority);
 
 	return true;
 }
 
-
-QImage DkThumbNailT::computeCall(int forceLoad, QSharedPointer<QByteArray> ba) {
-
-	// no rescale if we load from exif - memory should not be an issue here
-	if (forceLoad == DkThumbNailT::force_exif_thumb)
-		rescale = false;
-
-	return DkThumbNail::computeIntern(file, ba, forceLoad, maxThumbSize, minThumbSize, rescale);
-}
-
-void DkThumbNailT::thumbLoaded() {
+void DkThumbNailT::thumbLoaded(const QImage& thumb) {
 	
-	QFuture<QImage> future = thumbWatcher.future();
-
-	img = future.result();
+	img = thumb;
 	
 	if (img.isNull() && forceLoad != force_exif_thumb)
 		imgExists = false;
 
 	fetching = false;
-	DkSettings::resources.numThumbsLoading--;
 	emit thumbLoadedSignal(!img.isNull());
 }
 
+void DkThumbNailT::thumbCanceled() {
+
+	// the thumbnail can be requested again
+	fetching = false;
+}
+
+// DkThumbScheduler --------------------------------------------------------------------
+DkThumbScheduler& DkThumbScheduler::instance() {
+
+	static DkThumbScheduler inst;
+	return inst;
+}
+
+DkThumbScheduler::DkThumbScheduler() {
+
+	numRequests = 0;
+	numLoaded = 0;
+	numCanceled = 0;
+	totalLatency = 0;
+	maxLatency = 0;
+}
+
+DkThumbScheduler::~DkThumbScheduler() {
+
+	// the workers do not touch the thumbnails - we just drop their results
+	QList<QFutureWatcher<QImage>*> watchers = runningJobs.keys();
+	for (int idx = 0; idx < watchers.size(); idx++)
+		watchers[idx]->blockSignals(true);
+}
+
+/**
+ * Queues a thumbnail request.
+ * If the thumbnail is queued already, its priority is updated.
+ * @param thumb the thumbnail to be loaded.
+ * @param forceLoad the loading flag (e.g. exiv only)
+ * @param ba the file buffer (can be empty)
+ * @param priority lower values are loaded first (e.g. the distance to the visible area).
+ **/ 
+void DkThumbScheduler::schedule(DkThumbNailT* thumb, int forceLoad, QSharedPointer<QByteArray> ba, float priority) {
+
+	if (!thumb)
+		return;
+
+	if (pendingJobs.contains(thumb)) {
+		pendingJobs[thumb].priority = priority;
+		return;
+	}
+
+	DkThumbJob job;
+	job.thumb = thumb;
+	job.file = thumb->getFile();
+	job.ba = ba;
+	job.forceLoad = forceLoad;
+	job.maxThumbSize = thumb->getMaxThumbSize();
+	job.minThumbSize = thumb->getMinThumbSize();
+	job.rescale = thumb->rescale;
+	job.priority = priority;
+	job.order = numRequests++;
+	job.requested.start();
+
+	pendingJobs.insert(thumb, job);
+	startJobs();
+}
+
+/**
+ * Cancels a thumbnail request.
+ * Pending requests are removed. Running requests cannot be stopped,
+ * so their result is still delivered (the thumbnail is decoded anyway).
+ * @param thumb the thumbnail.
+ **/ 
+void DkThumbScheduler::cancel(DkThumbNailT* thumb) {
+
+	if (pendingJobs.remove(thumb)) {
+		thumb->thumbCanceled();
+		numCanceled++;
+	}
+}
+
+/**
+ * Removes all requests of a thumbnail that is deleted.
+ * The results of running requests are dropped.
+ * @param thumb the thumbnail.
+ **/ 
+void DkThumbScheduler::remove(DkThumbNailT* thumb) {
+
+	if (pendingJobs.remove(thumb))
+		numCanceled++;
+
+	QHash<QFutureWatcher<QImage>*, DkThumbJob>::iterator jobIter = runningJobs.begin();
+	for (; jobIter != runningJobs.end(); jobIter++) {
+		if (jobIter->thumb == thumb)
+			jobIter->thumb = 0;
+	}
+}
+
+bool DkThumbScheduler::isPending(DkThumbNailT* thumb) const {
+
+	return pendingJobs.contains(thumb);
+}
+
+int DkThumbScheduler::maxWorkers() const {
+
+	return qMax(1, QThread::idealThreadCount()-1);
+}
+
+void DkThumbScheduler::startJobs() {
+
+	while (runningJobs.size() < maxWorkers() && !pendingJobs.empty()) {
+
+		// find the most urgent request - the queue is short, a linear search is fine
+		QHash<DkThumbNailT*, DkThumbJob>::iterator nextJob = pendingJobs.begin();
+		QHash<DkThumbNailT*, DkThumbJob>::iterator jobIter = pendingJobs.begin();
+
+		for (; jobIter != pendingJobs.end(); jobIter++) {
+
+			if (jobIter->priority < nextJob->priority || 
+				(jobIter->priority == nextJob->priority && jobIter->order < nextJob->order))
+				nextJob = jobIter;
+		}
+
+		DkThumbJob job = nextJob.value();
+		pendingJobs.erase(nextJob);
+
+		QFutureWatcher<QImage>* watcher = new QFutureWatcher<QImage>(this);
+		connect(watcher, SIGNAL(finished()), this, SLOT(jobFinished()));
+		runningJobs.insert(watcher, job);
+		watcher->setFuture(QtConcurrent::run(&nmc::DkThumbScheduler::computeThumb, job));
+	}
+}
+
+QImage DkThumbScheduler::computeThumb(DkThumbJob job) {
+
+	// the thumbnail store is checked before we decode anything - it is decoded here too (not in the GUI thread)
+	if (job.forceLoad == DkThumbNail::do_not_force && job.rescale) {
+		QImage cThumb = DkThumbCache::instance().find(job.file, job.maxThumbSize);
+
+		if (!cThumb.isNull())
+			return cThumb;
+	}
+
+	return DkThumbNail::computeIntern(job.file, job.ba, job.forceLoad, job.maxThumbSize, job.minThumbSize, job.rescale);
+}
+
+void DkThumbScheduler::jobFinished() {
+
+	QFutureWatcher<QImage>* watcher = static_cast<QFutureWatcher<QImage>*>(sender());
+
+	if (!watcher || !runningJobs.contains(watcher))
+		return;
+
+	DkThumbJob job = runningJobs.take(watcher);
+	QImage thumb = watcher->result();
+	watcher->deleteLater();
+
+	// latency = time in the queue + decoding
+	int latency = job.requested.elapsed();
+	numLoaded++;
+	totalLatency += latency;
+	maxLatency = qMax(maxLatency, latency);
+
+	qDebug() << "[DkThumbScheduler]" << job.file.fileName() << "requested" << latency << "ms ago -" << pendingJobs.size() << "pending";
+
+	startJobs();
+
+	// the thumbnail was deleted meanwhile
+	if (job.thumb)
+		job.thumb->thumbLoaded(thumb);
+
+	if (pendingJobs.empty() && runningJobs.empty())
+		qDebug() << "[DkThumbScheduler]" << getStats();
+}
+
+QString DkThumbScheduler::getStats() const {
+
+	double meanLatency = numLoaded ? totalLatency/numLoaded : 0.0;
+
+	return QString("%1 thumbnails loaded, %2 canceled - latency: %3 ms mean, %4 ms max (%5 workers)")
+		.arg(numLoaded).arg(numCanceled).arg(qRound(meanLatency)).arg(maxLatency).arg(maxWorkers());
+}
+
+// DkThumbCache --------------------------------------------------------------------
+DkThumbCache& DkThumbCache::instance() {
+
+	static DkThumbCache inst;
+	return inst;
+}
+
+DkThumbCache::DkThumbCache() {
+
+	packMap = 0;
+	mappedSize = 0;
+	usedBytes = 0;
+	deadBytes = 0;
+	accessClock = 0;
+	numDirty = 0;
+
+	numHits = 0;
+	numMisses = 0;
+	hitTime = 0;
+	decodeTime = 0;
+
+	// resolve the folder once - the cache might be saved after the application object is gone
+	cachePath = cacheDir();
+
+	load();
+}
+
+DkThumbCache::~DkThumbCache() {
+
+	save();
+	unmapPack();
+	packFile.close();
+
+	qDebug() << "[DkThumbCache]" << getStats();
+}
+
+/**
+ * Returns the directory where the thumbnail pack is stored.
+ * Portable versions keep the pack next to the executable.
+ * @return QString the cache directory.
+ **/ 
+QString DkThumbCache::cacheDir() const {
+
+	if (DkSettings::isPortable())
+		return QCoreApplication::applicationDirPath() + "/thumbs";
+
+#if QT_VERSION >= 0x050000
+	return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/thumbs";
+#else
+	return QDesktopServices::storageLocation(QDesktopServices::CacheLocation) + "/thumbs";
+#endif
+}
+
+void DkThumbCache::load() {
+
+	QDir dir(cachePath);
+
+	if (!dir.exists() && !dir.mkpath(dir.absolutePath())) {
+		qDebug() << "[DkThumbCache] could not create: " << dir.absolutePath();
+		return;
+	}
+
+	DkTimer dt;
+	packFile.setFileName(dir.absoluteFilePath("thumbs.pack"));
+
+	if (!packFile.open(QIODevice::ReadWrite)) {
+		qDebug() << "[DkThumbCache] could not open: " << packFile.fileName();
+		return;
+	}
+
+	QFile indexFile(dir.absoluteFilePath("thumbs.idx"));
+
+	// the pack is useless without its index (e.g. the index was deleted)
+	if (!indexFile.open(QIODevice::ReadOnly)) {
+		packFile.resize(0);
+		return;
+	}
+
+	QDataStream ds(&indexFile);
+	quint32 magic, version;
+	ds >> magic >> version;
+
+	// unknown format? -> start from scratch
+	if (magic != 0x6e6d5463 || version != 1) {
+		packFile.resize(0);
+		return;
+	}
+
+	qint64 packSize = packFile.size();
+	qint32 numEntries;
+	ds >> accessClock >> numEntries;
+
+	for (int idx = 0; idx < numEntries && ds.status() == QDataStream::Ok; idx++) {
+
+		QString filePath;
+		Entry e;
+		qint32 length, thumbSize;
+		ds >> filePath >> e.offset >> length >> e.modified >> e.fileSize >> thumbSize >> e.lastAccess;
+		e.length = length;
+		e.thumbSize = thumbSize;
+
+		// the pack was not written completely (e.g. crash)
+		if (e.offset + e.length > packSize)
+			continue;
+
+		index.insert(filePath, e);
+		usedBytes += e.length;
+	}
+
+	deadBytes = packSize - usedBytes;
+
+	qDebug() << "[DkThumbCache]" << index.size() << "thumbnails indexed in" << dt.getTotal();
+}
+
+/**
+ * Writes the index to disk.
+ * The pack itself is written whenever a thumbnail is inserted.
+ **/ 
+void DkThumbCache::save() {
+
+	QMutexLocker locker(&mutex);
+
+	if (!numDirty || !packFile.isOpen())
+		return;
+
+	DkTimer dt;
+	packFile.flush();
+
+	QFile indexFile(QDir(cachePath).absoluteFilePath("thumbs.idx"));
+
+	if (!indexFile.open(QIODevice::WriteOnly)) {
+		qDebug() << "[DkThumbCache] could not write the index: " << indexFile.fileName();
+		return;
+	}
+
+	QDataStream ds(&indexFile);
+	ds << (quint32)0x6e6d5463 << (quint32)1;
+	ds << accessClock << (qint32)index.size();
+
+	QMultiHash<QString, Entry>::const_iterator eIter = index.constBegin();
+	for (; eIter != index.constEnd(); eIter++) {
+		const Entry& e = eIter.value();
+		ds << eIter.key() << e.offset << (qint32)e.length << e.modified << e.fileSize << (qint32)e.thumbSize << e.lastAccess;
+	}
+
+	numDirty = 0;
+
+	qDebug() << "[DkThumbCache] index with" << index.size() << "thumbnails saved in" << dt.getTotal();
+}
+
+/**
+ * Returns the cached thumbnail of a file.
+ * @param file the image file
+ * @param thumbSize the (maximal) thumbnail size requested
+ * @return QImage the thumbnail or a null image if the thumbnail is not cached or outdated
+ **/ 
+QImage DkThumbCache::find(const QFileInfo& file, int thumbSize) {
+
+	if (!DkSettings::resources.thumbCacheSize)
+		return QImage();
+
+	DkTimer dt;
+	QByteArray ba;
+	QString filePath = file.absoluteFilePath();
+	qint64 modified = file.lastModified().toMSecsSinceEpoch();
+
+	mutex.lock();
+
+	QMultiHash<QString, Entry>::iterator eIter = index.find(filePath);
+	for (; eIter != index.end() && eIter.key() == filePath; eIter++) {
+
+		Entry& e = eIter.value();
+
+		if (e.thumbSize != thumbSize)
+			continue;
+
+		// the file changed since we have cached it
+		if (e.modified != modified || e.fileSize != file.size()) {
+			deadBytes += e.length;
+			usedBytes -= e.length;
+			index.erase(eIter);
+			numDirty++;
+			break;
+		}
+
+		if (e.offset + e.length > mappedSize)
+			mapPack();
+
+		if (packMap && e.offset + e.length <= mappedSize) {
+			ba = QByteArray((const char*)packMap + e.offset, e.length);	// deep copy - the pack might get remapped
+			e.lastAccess = ++accessClock;
+			numDirty++;		// the access order is saved too
+		}
+		break;
+	}
+
+	mutex.unlock();
+
+	QImage thumb;
+	if (!ba.isEmpty())
+		thumb.loadFromData(ba);
+
+	mutex.lock();
+	if (!thumb.isNull()) {
+		numHits++;
+		hitTime += dt.getTotalTime();
+	}
+	else
+		numMisses++;
+	mutex.unlock();
+
+	return thumb;
+}
+
+/**
+ * Appends a thumbnail to the pack.
+ * @param file the image file
+ * @param thumbSize the (maximal) thumbnail size requested
+ * @param thumb the thumbnail
+ **/ 
+void DkThumbCache::insert(const QFileInfo& file, int thumbSize, const QImage& thumb) {
+
+	if (!DkSettings::resources.thumbCacheSize || DkSettings::app.privateMode || thumb.isNull() || !file.exists())
+		return;
+
+	QByteArray ba;
+	QBuffer buffer(&ba);
+	buffer.open(QIODevice::WriteOnly);
+	thumb.save(&buffer, DkImage::alphaChannelUsed(thumb) ? "PNG" : "JPG", 90);
+	buffer.close();
+
+	if (ba.isEmpty())
+		return;
+
+	QMutexLocker locker(&mutex);
+
+	if (!packFile.isOpen())
+		return;
+
+	QString filePath = file.absoluteFilePath();
+
+	// remove old versions of the thumbnail
+	QMultiHash<QString, Entry>::iterator eIter = index.find(filePath);
+	while (eIter != index.end() && eIter.key() == filePath) {
+
+		if (eIter.value().thumbSize == thumbSize) {
+			deadBytes += eIter.value().length;
+			usedBytes -= eIter.value().length;
+			eIter = index.erase(eIter);
+		}
+		else
+			eIter++;
+	}
+
+	Entry e;
+	e.offset = packFile.size();
+	e.length = ba.size();
+	e.modified = file.lastModified().toMSecsSinceEpoch();
+	e.fileSize = file.size();
+	e.thumbSize = thumbSize;
+	e.lastAccess = ++accessClock;
+
+	if (!packFile.seek(e.offset) || packFile.write(ba) != ba.size()) {
+		qDebug() << "[DkThumbCache] could not write to: " << packFile.fileName();
+		return;
+	}
+
+	index.insert(filePath, e);
+	usedBytes += e.length;
+	numDirty++;
+
+	qint64 maxBytes = (qint64)(DkSettings::resources.thumbCacheSize*1024.0f*1024.0f);
+
+	if (usedBytes > maxBytes)
+		evict(qRound64(maxBytes*0.8));
+	if (deadBytes > maxBytes*0.5 && deadBytes > usedBytes)
+		compact();
+
+	// write the index from time to time - we would lose all thumbnails if nomacs crashes otherwise
+	if (numDirty > 500) {
+		locker.unlock();
+		save();
+	}
+}
+
+/**
+ * Removes all thumbnails of a file (e.g. if the file was changed).
+ * @param file the image file
+ **/ 
+void DkThumbCache::remove(const QFileInfo& file) {
+
+	QMutexLocker locker(&mutex);
+
+	QString filePath = file.absoluteFilePath();
+	QMultiHash<QString, Entry>::iterator eIter = index.find(filePath);
+
+	while (eIter != index.end() && eIter.key() == filePath) {
+		deadBytes += eIter.value().length;
+		usedBytes -= eIter.value().length;
+		eIter = index.erase(eIter);
+		numDirty++;
+	}
+}
+
+/**
+ * Removes all thumbnails.
+ **/ 
+void DkThumbCache::clear() {
+
+	QMutexLocker locker(&mutex);
+
+	unmapPack();
+	index.clear();
+	packFile.resize(0);
+	usedBytes = 0;
+	deadBytes = 0;
+	numDirty++;
+}
+
+/**
+ * Drops the least recently used thumbnails.
+ * @param maxBytes the number of bytes the pack may use after eviction.
+ **/ 
+void DkThumbCache::evict(qint64 maxBytes) {
+
+	DkTimer dt;
+	QVector<QPair<quint32, int> > accesses;
+	accesses.reserve(index.size());
+
+	QMultiHash<QString, Entry>::const_iterator cIter = index.constBegin();
+	for (; cIter != index.constEnd(); cIter++)
+		accesses.append(qMakePair(cIter.value().lastAccess, cIter.value().length));
+
+	qSort(accesses);
+
+	// find the access time which splits the index (access times are unique)
+	qint64 bytes = usedBytes;
+	quint32 minAccess = 0;
+	for (int idx = 0; idx < accesses.size() && bytes > maxBytes; idx++) {
+		minAccess = accesses[idx].first;
+		bytes -= accesses[idx].second;
+	}
+
+	QMultiHash<QString, Entry>::iterator eIter = index.begin();
+	while (eIter != index.end()) {
+
+		if (eIter.value().lastAccess <= minAccess) {
+			deadBytes += eIter.value().length;
+			usedBytes -= eIter.value().length;
+			eIter = index.erase(eIter);
+		}
+		else
+			eIter++;
+	}
+
+	numDirty++;
+	qDebug() << "[DkThumbCache] evicted thumbnails in" << dt.getTotal() << "-" << usedBytes/(1024*1024) << "MB in use";
+}
+
+/**
+ * Rewrites the pack without evicted thumbnails.
+ **/ 
+void DkThumbCache::compact() {
+
+	DkTimer dt;
+
+	if (!mapPack())
+		return;
+
+	QString packName = packFile.fileName();
+	QFile newPack(packName + ".tmp");
+
+	if (!newPack.open(QIODevice::WriteOnly))
+		return;
+
+	// the offsets are just applied if the new pack replaced the old one
+	QVector<qint64> newOffsets;
+	newOffsets.reserve(index.size());
+	bool written = true;
+
+	QMultiHash<QString, Entry>::const_iterator cIter = index.constBegin();
+	for (; cIter != index.constEnd() && written; cIter++) {
+
+		const Entry& e = cIter.value();
+		newOffsets.append(newPack.pos());
+		written = newPack.write((const char*)packMap + e.offset, e.length) == e.length;
+	}
+	newPack.close();
+
+	unmapPack();
+	packFile.close();
+
+	// keep the old pack until the new one is in place
+	QFile::remove(packName + ".old");
+	bool replaced = written && QFile::rename(packName, packName + ".old");
+
+	if (replaced && !newPack.rename(packName)) {
+
+		// we lost the pack - start from scratch
+		if (!QFile::rename(packName + ".old", packName)) {
+			index.clear();
+			usedBytes = 0;
+			deadBytes = 0;
+			numDirty++;
+		}
+		replaced = false;
+	}
+
+	if (replaced) {
+		QFile::remove(packName + ".old");
+
+		QMultiHash<QString, Entry>::iterator eIter = index.begin();
+		for (int idx = 0; eIter != index.end(); eIter++, idx++)
+			eIter.value().offset = newOffsets[idx];
+
+		deadBytes = 0;
+		numDirty++;
+		qDebug() << "[DkThumbCache] pack compacted in" << dt.getTotal();
+	}
+	else {
+		qDebug() << "[DkThumbCache] could not replace: " << packName;
+		newPack.remove();
+	}
+
+	if (!packFile.open(QIODevice::ReadWrite)) {
+		qDebug() << "[DkThumbCache] could not reopen: " << packFile.fileName();
+		index.clear();
+		usedBytes = 0;
+		deadBytes = 0;
+		numDirty++;
+	}
+}
+
+bool DkThumbCache::mapPack() {
+
+	unmapPack();
+	packFile.flush();
+
+	qint64 packSize = packFile.size();
+
+	if (packSize <= 0)
+		return false;
+
+	packMap = packFile.map(0, packSize);
+	mappedSize = packMap ? packSize : 0;
+
+	return packMap != 0;
+}
+
+void DkThumbCache::unmapPack() {
+
+	if (packMap)
+		packFile.unmap(packMap);
+
+	packMap = 0;
+	mappedSize = 0;
+}
+
+/**
+ * Adds the time needed to decode a thumbnail (cache miss).
+ * @param sec the decoding time in seconds
+ **/ 
+void DkThumbCache::addDecodeTime(double sec) {
+
+	QMutexLocker locker(&mutex);
+	decodeTime += sec;
+}
+
+/**
+ * Returns the cache statistics.
+ * The mean loading times of cached (warm) and decoded (cold) thumbnails
+ * allow for comparing both paths.
+ * @return QString a human readable string.
+ **/ 
+QString DkThumbCache::getStats() {
+
+	QMutexLocker locker(&mutex);
+
+	QString stats = QString("%1 thumbnails (%2 MB), hits: %3 misses: %4")
+		.arg(index.size())
+		.arg(usedBytes/(1024.0*1024.0), 0, 'f', 1)
+		.arg(numHits)
+		.arg(numMisses);
+
+	if (numHits)
+		stats += QString(", warm: %1 ms/thumb").arg(hitTime/numHits*1000.0, 0, 'f', 2);
+	if (numMisses)
+		stats += QString(", cold: %1 ms/thumb").arg(decodeTime/numMisses*1000.0, 0, 'f', 2);
+
+	return stats;
+}
+
 /**
  * Default constructor of the thumbnail loader.
  * Note: currently the init calls the getFilteredFileList which might be slow.
@@ -34,6 +34,10 @@
 #include <QDir>
 #include <QThread>
 #include <QImage>
+#include <QMutex>
+#include <QMultiHash>
+#include <QFile>
+#include <QTime>
 #pragma warning(pop)		// no warnings from includes - end
 
 #ifndef DllExport
@@ -87,7 +91,7 @@ public:
 	 **/ 
 	virtual void setImage(const QImage img);
 
-	void removeBlackBorder(QImage& img);
+	static void removeBlackBorder(QImage& img);
 
 	/**
 	 * Returns the thumbnail.
@@ -171,7 +175,9 @@ public:
 	};
 
 protected:
-	QImage computeIntern(QFileInfo file, QSharedPointer<QByteArray> ba, int forceLoad, int maxThumbSize, int minThumbSize, bool rescale);
+	friend class DkThumbScheduler;
+
+	static QImage computeIntern(QFileInfo file, QSharedPointer<QByteArray> ba, int forceLoad, int maxThumbSize, int minThumbSize, bool rescale);
 	QColor computeColorIntern();
 
 	QImage img;
@@ -192,7 +198,7 @@ public:
 	DkThumbNailT(QFileInfo file = QFileInfo(), QImage img = QImage());
 	~DkThumbNailT();
 
-	bool fetchThumb(int forceLoad = do_not_force, QSharedPointer<QByteArray> ba = QSharedPointer<QByteArray>());
+	bool fetchThumb(int forceLoad = do_not_force, QSharedPointer<QByteArray> ba = QSharedPointer<QByteArray>(), float priority = 0.0f);
 	void fetchColor();
 
 	/**
@@ -201,7 +207,7 @@ public:
 	 **/ 
 	int hasImage() const {
 		
-		if (thumbWatcher.isRunning())
+		if (fetching)
 			return loading;
 		else
 			return DkThumbNail::hasImage();
@@ -217,20 +223,135 @@ signals:
 	void colorUpdated();
 
 protected slots:
-	void thumbLoaded();
 	void colorLoaded();
 
 protected:
-	QImage computeCall(int forceLoad, QSharedPointer<QByteArray> ba);
+	friend class DkThumbScheduler;
+
+	void thumbLoaded(const QImage& thumb);
+	void thumbCanceled();
 	QColor computeColorCall();
 
-	QFutureWatcher<QImage> thumbWatcher;
 	QFutureWatcher<QColor> colorWatcher;
 	bool fetching;
 	bool fetchingColor;
 	int forceLoad;
 };
 
+/**
+ * Schedules thumbnail loading.
+ * Requests are queued by priority (e.g. the distance to the visible area,
+ * 0 is most urgent) and decoded by a bounded number of workers. One core
+ * is left for loading the current image. Pending requests are canceled
+ * if their thumbnails are not needed anymore.
+ **/ 
+class DllExport DkThumbScheduler : public QObject {
+	Q_OBJECT
+
+public:
+	static DkThumbScheduler& instance();
+	~DkThumbScheduler();
+
+	void schedule(DkThumbNailT* thumb, int forceLoad, QSharedPointer<QByteArray> ba, float priority);
+	void cancel(DkThumbNailT* thumb);
+	void remove(DkThumbNailT* thumb);
+	bool isPending(DkThumbNailT* thumb) const;
+	int maxWorkers() const;
+	QString getStats() const;
+
+protected slots:
+	void jobFinished();
+
+protected:
+	DkThumbScheduler();
+
+	struct DkThumbJob {
+		DkThumbNailT* thumb;
+		QFileInfo file;
+		QSharedPointer<QByteArray> ba;
+		int forceLoad;
+		int maxThumbSize;
+		int minThumbSize;
+		bool rescale;
+		float priority;
+		quint64 order;
+		QTime requested;
+	};
+
+	void startJobs();
+	static QImage computeThumb(DkThumbJob job);
+
+	QHash<DkThumbNailT*, DkThumbJob> pendingJobs;
+	QHash<QFutureWatcher<QImage>*, DkThumbJob> runningJobs;
+	quint64 numRequests;
+	int numLoaded;
+	int numCanceled;
+	double totalLatency;	// ms
+	int maxLatency;			// ms
+};
+
+/**
+ * Persistent thumbnail store.
+ * Thumbnails are appended (encoded) to a pack file which is memory mapped
+ * for reading. The index maps a file's absolute path, last modified date,
+ * file size and the thumbnail size to the thumbnail's position in the pack.
+ * If the pack exceeds DkSettings::resources.thumbCacheSize, the least
+ * recently used thumbnails are evicted.
+ **/ 
+class DllExport DkThumbCache {
+
+public:
+	static DkThumbCache& instance();
+	~DkThumbCache();
+
+	QImage find(const QFileInfo& file, int thumbSize);
+	void insert(const QFileInfo& file, int thumbSize, const QImage& thumb);
+	void remove(const QFileInfo& file);
+	void clear();
+	void save();
+
+	void addDecodeTime(double sec);
+	QString getStats();
+
+protected:
+	DkThumbCache();
+	DkThumbCache(DkThumbCache const&);		// hide
+	void operator=(DkThumbCache const&);	// hide
+
+	struct Entry {
+		qint64 offset;
+		int length;
+		qint64 modified;
+		qint64 fileSize;
+		int thumbSize;
+		quint32 lastAccess;
+	};
+
+	void load();
+	bool mapPack();
+	void unmapPack();
+	void evict(qint64 maxBytes);
+	void compact();
+	QString cacheDir() const;
+
+	QMultiHash<QString, Entry> index;
+	QString cachePath;
+	QFile packFile;
+	uchar* packMap;
+	qint64 mappedSize;
+	qint64 usedBytes;
+	qint64 deadBytes;
+	quint32 accessClock;
+	int numDirty;
+	QMutex mutex;
+
+	// stats
+	int numHits;
+	int numMisses;
+	double hitTime;
+	double decodeTime;
+};
+
 /**
  * This class provides a method for reading thumbnails.
  * If the a thumbnail is provided in the metadata,
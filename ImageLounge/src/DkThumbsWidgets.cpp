@@ -52,6 +52,8 @@
 #include <QMessageBox>
 #include <QInputDialog>
 #include <QMimeData>
+#include <QSet>
+#include <QGraphicsView>
 #pragma warning(pop)		// no warnings from includes - end
 
 namespace nmc {
@@ -334,8 +336,8 @@ void DkFilePreview::drawThumbs(QPainter* painter) {
 		else if (orientation == Qt::Horizontal && imgWorldRect.left() > width() || orientation == Qt::Vertical && imgWorldRect.top() > height())
 			break;
 
-		if (thumb->hasImage() == DkThumbNail::not_loaded && 
-			DkSettings::resources.numThumbsLoading < DkSettings::resources.maxThumbsLoading) {
+		// the thumbnail scheduler limits the number of thumbnails loaded in parallel
+		if (thumb->hasImage() == DkThumbNail::not_loaded) {
 				thumb->fetchThumb();
 				connect(thumb.data(), SIGNAL(thumbLoadedSignal()), this, SLOT(update()));
 		}
@@ -1038,11 +1040,35 @@ void DkThumbLabel::setVisible(bool visible) {
 	text.setVisible(visible);
 }
 
+/**
+ * Returns the vertical distance to the visible area.
+ * @param visibleRect the visible area (scene coordinates)
+ * @return float 0 if the label is visible
+ **/ 
+float DkThumbLabel::visibleDistance(const QRectF& visibleRect) const {
+
+	QRectF r = sceneBoundingRect();
+
+	if (r.bottom() < visibleRect.top())
+		return (float)(visibleRect.top() - r.bottom());
+	else if (r.top() > visibleRect.bottom())
+		return (float)(r.top() - visibleRect.bottom());
+
+	return 0.0f;
+}
+
 void DkThumbLabel::paint(QPainter* painter, const QStyleOptionGraphicsItem* option, QWidget* widget) {
 	
-	if (!fetchingThumb && thumb->hasImage() == DkThumbNail::not_loaded && 
-		DkSettings::resources.numThumbsLoading < DkSettings::resources.maxThumbsLoading*2) {
-			thumb->fetchThumb();
+	if (!fetchingThumb && thumb->hasImage() == DkThumbNail::not_loaded) {
+
+			// labels are painted if they are visible - but the view decides which one is the most urgent
+			float dist = 0.0f;
+			if (scene() && !scene()->views().empty()) {
+				QGraphicsView* view = scene()->views().first();
+				dist = visibleDistance(view->mapToScene(view->viewport()->rect()).boundingRect());
+			}
+
+			thumb->fetchThumb(DkThumbNail::do_not_force, QSharedPointer<QByteArray>(), dist);
 			fetchingThumb = true;
 	}
 	else if (!thumbInitialized && (thumb->hasImage() == DkThumbNail::loaded || thumb->hasImage() == DkThumbNail::exists_not)) {
@@ -1542,6 +1568,7 @@ DkThumbsView::DkThumbsView(DkThumbScene* scene, QWidget* parent /* = 0 */) : QGr
 	setObjectName("DkThumbsView");
 	this->scene = scene;
 	connect(scene, SIGNAL(thumbLoadedSignal()), this, SLOT(fetchThumbs()));
+	connect(verticalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(fetchThumbs()));
 
 	//setDragMode(QGraphicsView::RubberBandDrag);
 
@@ -1769,29 +1796,22 @@ void DkThumbsView::dropEvent(QDropEvent *event) {
 	qDebug() << "drop event...";
 }
 
+/**
+ * Requests the thumbnails of the visible area and one page above and below.
+ * Thumbnails are prioritized by their distance to the visible area.
+ * Requests of thumbnails that were scrolled out of this area are canceled.
+ **/ 
 void DkThumbsView::fetchThumbs() {
 
-	int maxThreads = DkSettings::resources.maxThumbsLoading*2;
-
-	// don't do anything if it is loading anyway
-	if (DkSettings::resources.numThumbsLoading/* > maxThreads*/) {
-		//qDebug() << "rejected because num thumbs loading: " << 
-		return;
-	}
-
-	qDebug() << "currently loading: " << DkSettings::resources.numThumbsLoading << " thumbs";
+	QRectF visibleRect = mapToScene(viewport()->rect()).boundingRect();
+	QRectF prefetchRect = visibleRect.adjusted(0, -visibleRect.height(), 0, visibleRect.height());
 
-	//bool firstReached = false;
-
-	QList<QGraphicsItem*> items = scene->items(mapToScene(viewport()->rect()).boundingRect(), Qt::IntersectsItemShape);
-
-	//qDebug() << mapToScene(viewport()->rect()).boundingRect() << " number of items: " << items.size();
+	QList<QGraphicsItem*> items = scene->items(prefetchRect, Qt::IntersectsItemShape);
+	QVector<QSharedPointer<DkThumbNailT> > cRequestedThumbs;
+	QSet<DkThumbNailT*> requested;
 
 	for (int idx = 0; idx < items.size(); idx++) {
 
-		if (!maxThreads)
-			break;
-
 		DkThumbLabel* th = dynamic_cast<DkThumbLabel*>(items.at(idx));
 
 		if (!th) {
@@ -1799,14 +1819,24 @@ void DkThumbsView::fetchThumbs() {
 			continue;
 		}
 
-		if (th->pixmap().isNull()) {
-			th->update();
-			maxThreads--;
-		}
-		//else if (!thumbLabels.at(idx)->pixmap().isNull())
-		//	firstReached = true;
+		QSharedPointer<DkThumbNailT> thumb = th->getThumb();
+
+		if (!thumb || (thumb->hasImage() != DkThumbNail::not_loaded && thumb->hasImage() != DkThumbNail::loading))
+			continue;
+
+		thumb->fetchThumb(DkThumbNail::do_not_force, QSharedPointer<QByteArray>(), th->visibleDistance(visibleRect));
+		cRequestedThumbs.append(thumb);
+		requested.insert(thumb.data());
+	}
+
+	// cancel thumbnails that are not needed anymore
+	for (int idx = 0; idx < requestedThumbs.size(); idx++) {
+
+		if (!requested.contains(requestedThumbs.at(idx).data()))
+			DkThumbScheduler::instance().cancel(requestedThumbs.at(idx).data());
 	}
 
+	requestedThumbs = cRequestedThumbs;
 }
 
 // DkThumbScrollWidget --------------------------------------------------------------------
@@ -189,6 +189,7 @@ public:
 	void updateSize();
 	void setVisible(bool visible);
 	QPixmap pixmap() const;
+	float visibleDistance(const QRectF& visibleRect) const;
 
 public slots:
 	void updateLabel();
@@ -294,6 +295,7 @@ protected:
 	DkThumbScene* scene;
 	QPointF mousePos;
 	int lastShiftIdx;
+	QVector<QSharedPointer<DkThumbNailT> > requestedThumbs;
 
 };
 
@@ -226,6 +226,52 @@ QString DkUtils::getLongestNumber(const QString& str, int startIdx) {
 	return str.mid(startIdx, idx-startIdx);
 }
 
+/**
+ * Computes a collation key for natural sorting.
+ * Comparing two keys with operator< results in the same order as
+ * naturalCompare (case insensitive): a1.png < a2.png < a10.png.
+ * Digit runs are encoded by their length (leading zeros removed) and their
+ * digits so that numbers are compared by value. The case folded string is
+ * appended to break ties (e.g. img01.png vs img1.png).
+ * Computing the key once per file is much faster than calling naturalCompare
+ * for every comparison if large folders are sorted.
+ * @param str the string (e.g. a file name).
+ * @return QString the sort key.
+ **/ 
+QString DkUtils::naturalSortKey(const QString& str) {
+
+	QString folded = str.toCaseFolded();
+	QString key;
+	key.reserve(folded.size()*2 + 4);
+
+	for (int idx = 0; idx < folded.size(); ) {
+
+		if (!folded[idx].isDigit()) {
+			key.append(folded[idx]);
+			idx++;
+			continue;
+		}
+
+		int last = idx;
+		while (last < folded.size() && folded[last].isDigit())
+			last++;
+
+		// remove leading zeros (but keep one digit)
+		while (idx < last-1 && folded[idx].digitValue() == 0)
+			idx++;
+
+		key.append(QChar('0'));						// digits are still sorted before letters
+		key.append(QChar((ushort)(last-idx)));		// longer numbers are larger
+		for (; idx < last; idx++)
+			key.append(QChar('0' + folded[idx].digitValue()));
+	}
+
+	key.append(QChar((ushort)0));
+	key.append(folded);
+
+	return key;
+}
+
 bool DkUtils::compDateCreated(const QFileInfo& lhf, const QFileInfo& rhf) {
 
 	return lhf.created() < rhf.created();
@@ -135,6 +135,8 @@ public:
 
 	static QString getLongestNumber(const QString& str, int startIdx = 0);
 
+	static QString naturalSortKey(const QString& str);
+
 	static void addLanguages(QComboBox* langCombo, QStringList& languages);
 
 
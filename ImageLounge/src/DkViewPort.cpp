@@ -460,7 +460,7 @@ void DkControlWidget::showHistogram(bool visible) {
 
 	if (visible && !histogram->isVisible()) {
 		histogram->show();
-		if(!viewport->getImage().isNull()) histogram->drawHistogram(viewport->getImage());
+		if(!viewport->getImage().isNull()) histogram->drawHistogram(viewport->getImage(), imgC);
 		else  histogram->clearHistogram();
 	}
 	else if (!visible && histogram->isVisible()) {
@@ -951,7 +951,19 @@ void DkViewPort::setImage(QImage newImg) {
 	//qDebug() << "new image (viewport) loaded,  size: " << newImg.size() << "channel: " << imgQt.format();
 	//qDebug() << "keep zoom is always: " << (DkSettings::display.keepZoom == DkSettings::zoom_always_keep);
 
-	if (!DkSettings::slideShow.moveSpeed && (DkSettings::display.keepZoom == DkSettings::zoom_never_keep || 
+	// the full resolution replaces a RAW preview -> keep the view
+	bool replacesPreview = !rawPreviewSize.isEmpty() && loader && loader->file() == rawPreviewFile &&
+		oldImgRect.size().toSize() == rawPreviewSize && newImg.width() > rawPreviewSize.width();
+	rawPreviewSize = QSize();
+
+	if (replacesPreview) {
+		updateImageMatrix();
+
+		// show the new image exactly where the preview was
+		float s = (float)oldImgRect.width()/newImg.width();
+		worldMatrix = imgMatrix.inverted() * QTransform::fromScale(s, s) * oldImgMatrix * oldWorldMatrix;
+	}
+	else if (!DkSettings::slideShow.moveSpeed && (DkSettings::display.keepZoom == DkSettings::zoom_never_keep || 
 		(DkSettings::display.keepZoom == DkSettings::zoom_keep_same_size && oldImgRect != imgRect)) ||
 		 oldImgRect.isEmpty())
 		worldMatrix.reset();
@@ -995,7 +1007,7 @@ void DkViewPort::setImage(QImage newImg) {
 	update();
 
 	// draw a histogram from the image -> does nothing if the histogram is invisible
-	if (controller->getHistogram()) controller->getHistogram()->drawHistogram(newImg);
+	if (controller->getHistogram()) controller->getHistogram()->drawHistogram(newImg, loader->getCurrentImage());
 	if (DkSettings::sync.syncMode == DkSettings::sync_mode_remote_display)
 		tcpSendImage(true);
 
@@ -1114,10 +1126,43 @@ void DkViewPort::zoom(float factor, QPointF center) {
 
 	tcpSynchronize();
 
+	// previews (RAW or JPEG) are smaller - so we need the full resolution if we zoom past 100% of the preview
+	if (worldMatrix.m11()*imgMatrix.m11() > 1.0f)
+		loadFullResolution();
+
 	emit zoomSignal((float)(worldMatrix.m11()*imgMatrix.m11()*100));
 	
 }
 
+void DkViewPort::loadFullResolution(bool threaded) {
+
+	if (!loader || !loader->getCurrentImage() || (threaded && !rawPreviewSize.isEmpty()))
+		return;
+
+	// set before loading - if not threaded, setImage is called before loadFullResolution returns
+	rawPreviewSize = imgStorage.getImage().size();
+	rawPreviewFile = loader->file();
+
+	if (!loader->getCurrentImage()->loadFullResolution(threaded))
+		rawPreviewSize = QSize();
+}
+
+/**
+ * Returns the image in full resolution.
+ * If a preview is displayed, the full resolution is loaded first (blocking).
+ * Use it if the image is edited, saved or exported - getImage() returns the image displayed.
+ * @return QImage the full resolution image.
+ **/ 
+QImage DkViewPort::getFullResolutionImage() {
+
+	if (!movie && loader && loader->getCurrentImage() && 
+		loader->getCurrentImage()->getLoadState() == DkImageContainer::loaded &&
+		loader->getCurrentImage()->getLoader()->isPreview())
+		loadFullResolution(false);
+
+	return getImage();
+}
+
 void DkViewPort::zoomTo(float zoomLevel, const QPoint&) {
 
 	worldMatrix.reset();
@@ -1610,7 +1655,7 @@ void DkViewPort::mouseMoveEvent(QMouseEvent *event) {
 			if (loader->file().exists() && !loader->isEdited())
 				mimeData->setUrls(urls);
 			else if (!getImage().isNull())
-				mimeData->setImageData(getImage());
+				mimeData->setImageData(getFullResolutionImage());
 
 			QDrag* drag = new QDrag(this);
 			drag->setMimeData(mimeData);
@@ -1831,7 +1876,7 @@ void DkViewPort::copyImage() {
 	if (loader->file().exists() && !loader->isEdited())
 		mimeData->setUrls(urls);
 	else if (!getImage().isNull())
-		mimeData->setImageData(getImage());
+		mimeData->setImageData(getFullResolutionImage());
 
 	mimeData->setText(loader->file().absoluteFilePath());
 
@@ -1851,7 +1896,7 @@ void DkViewPort::copyImageBuffer() {
 	QMimeData* mimeData = new QMimeData;
 
 	if (!getImage().isNull())
-		mimeData->setImageData(getImage());
+		mimeData->setImageData(getFullResolutionImage());
 
 	QClipboard* clipboard = QApplication::clipboard();
 	clipboard->setMimeData(mimeData);
@@ -2315,6 +2360,16 @@ void DkViewPort::cropImage(DkRotatingRect rect, const QColor& bgCol) {
 		return;
 	}
 
+	// the rect is relative to the image displayed - scale it if that was a preview
+	QSize displayedSize = getImage().size();
+	QImage srcImg = getFullResolutionImage();
+
+	if (!displayedSize.isEmpty() && srcImg.width() != displayedSize.width()) {
+		double s = (double)srcImg.width()/displayedSize.width();
+		tForm = QTransform::fromScale(1.0/s, 1.0/s) * tForm * QTransform::fromScale(s, s);
+		cImgSize *= s;
+	}
+
 	qDebug() << cImgSize;
 
 	double angle = DkMath::normAngleRad(rect.getAngle(), 0, CV_PI*0.5);
@@ -2331,7 +2386,7 @@ void DkViewPort::cropImage(DkRotatingRect rect, const QColor& bgCol) {
 	if (minD > FLT_EPSILON)
 		painter.setRenderHints(QPainter::SmoothPixmapTransform | QPainter::Antialiasing);
 	
-	painter.drawImage(QRect(QPoint(), getImage().size()), getImage(), QRect(QPoint(), getImage().size()));
+	painter.drawImage(QRect(QPoint(), srcImg.size()), srcImg, QRect(QPoint(), srcImg.size()));
 	painter.end();
 
 	QSharedPointer<DkImageContainerT> imgC = loader->getCurrentImage();
@@ -2496,7 +2551,10 @@ void DkViewPortFrameless::draw(QPainter *painter, float) {
 			painter->drawRect(imgViewRect);
 		}
 
-		painter->drawImage(imgViewRect, imgQt, QRect(QPoint(), imgQt.size()));
+		if (imgStorage.isTiled())
+			drawTiles(painter);
+		else
+			painter->drawImage(imgViewRect, imgQt, QRect(QPoint(), imgQt.size()));
 	}
 	else {
 		painter->drawPixmap(imgViewRect, movie->currentPixmap(), movie->frameRect());
@@ -3066,7 +3124,7 @@ void DkViewPortContrast::drawImageHistogram() {
 
 	if (controller->getHistogram() && controller->getHistogram()->isVisible()) {
 		if(drawFalseColorImg) controller->getHistogram()->drawHistogram(falseColorImg);
-		else controller->getHistogram()->drawHistogram(imgStorage.getImage());
+		else controller->getHistogram()->drawHistogram(imgStorage.getImage(), loader ? loader->getCurrentImage() : QSharedPointer<DkImageContainerT>());
 	}
 
 }
@@ -374,6 +374,7 @@ public:
 	virtual ~DkViewPort();
 
 	virtual void release();
+	QImage getFullResolutionImage();
 	
 	void zoom(float factor = 0.5, QPointF center = QPointF(-1,-1));
 
@@ -506,6 +507,9 @@ protected:
 	QTransform oldWorldMatrix;
 	QTransform oldImgMatrix;
 
+	QSize rawPreviewSize;		// size of the RAW preview which is replaced
+	QFileInfo rawPreviewFile;
+
 	QTimer* skipImageTimer;
 	QTimer* repeatZoomTimer;
 	
@@ -545,6 +549,7 @@ protected:
 	virtual void drawBackground(QPainter *painter);
 	virtual void updateImageMatrix();
 	void showZoom();
+	void loadFullResolution(bool threaded = true);
 	//QPoint newCenter(QSize s);	// for frameless
 	void toggleLena();
 	void getPixelInfo(const QPoint& pos);
@@ -278,6 +278,7 @@ void DkFolderScrollBar::animateOpacityDown() {
 
 // DkThumbsSaver --------------------------------------------------------------------
 DkThumbsSaver::DkThumbsSaver(QWidget* parent) : DkWidget(parent) {
+	pd = 0;
 	stop = false;
 	cLoadIdx = 0;
 	numSaved = 0;
@@ -310,17 +311,15 @@ void DkThumbsSaver::processDir(QVector<QSharedPointer<DkImageContainerT> > image
 
 void DkThumbsSaver::thumbLoaded(bool) {
 
+	// thumbnail widgets might request the same thumbnail again - we count it once
+	if (sender())
+		disconnect(sender(), SIGNAL(thumbLoadedSignal(bool)), this, SLOT(thumbLoaded(bool)));
+
 	numSaved++;
 	emit numFilesSignal(numSaved);
 
-	if (numSaved == images.size() || stop) {
-		if (pd) {
-			pd->close();
-			pd->deleteLater();
-			pd = 0;
-		}
-		stop = true;
-	}
+	if (numSaved == images.size() || stop)
+		closeProgress();
 	else
 		loadNext();
 }
@@ -330,18 +329,39 @@ void DkThumbsSaver::loadNext() {
 	if (stop)
 		return;
 
-	int missing = DkSettings::resources.maxThumbsLoading-DkSettings::resources.numThumbsLoading;
-	int numLoading = cLoadIdx+missing;
+	// the thumbnail scheduler decodes the thumbnails - we keep its workers busy without flooding its queue
+	int numLoading = numSaved + 2*DkThumbScheduler::instance().maxWorkers();
 	int force = (forceSave) ? DkThumbNail::force_save_thumb : DkThumbNail::save_thumb;
 
-	qDebug() << "missing: " << missing << " num loading: " << numLoading;
-	qDebug() << "loading bounds: " << cLoadIdx << " - " << numLoading;
-
 	for (int idx = cLoadIdx; idx < images.size() && idx < numLoading; idx++) {
+		
 		cLoadIdx++;
-		connect(images.at(idx)->getThumb().data(), SIGNAL(thumbLoadedSignal(bool)), this, SLOT(thumbLoaded(bool)));
-		images.at(idx)->getThumb()->fetchThumb(force);
+		QSharedPointer<DkThumbNailT> thumb = images.at(idx)->getThumb();
+		connect(thumb.data(), SIGNAL(thumbLoadedSignal(bool)), this, SLOT(thumbLoaded(bool)), Qt::UniqueConnection);
+		thumb->fetchThumb(force);
+
+		// nothing was scheduled (e.g. the file does not exist) - so there will be no signal
+		if (thumb->hasImage() != DkThumbNailT::loading) {
+			disconnect(thumb.data(), SIGNAL(thumbLoadedSignal(bool)), this, SLOT(thumbLoaded(bool)));
+			numSaved++;
+			numLoading++;
+		}
 	}
+
+	emit numFilesSignal(numSaved);
+
+	if (numSaved == images.size())
+		closeProgress();
+}
+
+void DkThumbsSaver::closeProgress() {
+
+	if (pd) {
+		pd->close();
+		pd->deleteLater();
+		pd = 0;
+	}
+	stop = true;
 }
 
 void DkThumbsSaver::stopProgress() {
@@ -2312,152 +2332,66 @@ void DkHistogram::paintEvent(QPaintEvent*) {
 }
 
 /**
- * Goes through the image and counts pixels values. They are used to create the image histogram.
+ * Draws the image histogram.
+ * If the image belongs to imgC, the container's cached histogram is used.
+ * Otherwise (e.g. false color images) the histogram is computed directly.
  * @param currently displayed image
+ * @param imgC the image container of the displayed image (if any)
  **/ 
-void DkHistogram::drawHistogram(QImage imgQt) {
-
-	if (!isVisible() || imgQt.isNull()) {
-		setPainted(false);
-		return;
-	}
+void DkHistogram::drawHistogram(QImage imgQt, QSharedPointer<DkImageContainerT> imgC) {
 
-	DkTimer dt;
+	if (imgC && imgC->getLoader()->image().cacheKey() != imgQt.cacheKey())
+		imgC.clear();
 
-#ifdef WITH_OPENCV
+	if (this->imgC && this->imgC != imgC)
+		disconnect(this->imgC.data(), SIGNAL(histogramLoadedSignal()), this, SLOT(histogramLoaded()));
 
+	this->imgC = imgC;
 
-	long histValues[3][256];
-
-	for (int idx = 0; idx < 256; idx++) {
-		histValues[0][idx] = 0;
-		histValues[1][idx] = 0;
-		histValues[2][idx] = 0;
+	if (!isVisible() || imgQt.isNull()) {
+		setPainted(false);
+		return;
 	}
-	
-
-	// 8 bit images
-	if (imgQt.depth() == 8) {
-
-		qDebug() << "8 bit histogram -------------------";
 
-		for (int rIdx = 0; rIdx < imgQt.height(); rIdx++) {
-
-			const unsigned char* pixel = imgQt.constScanLine(rIdx);
-
-			for (int cIdx = 0; cIdx < imgQt.width(); cIdx++, pixel++) {
-
-				histValues[0][*pixel]++;
-				histValues[1][*pixel]++;
-				histValues[2][*pixel]++;
-			}
-		}
+	if (imgC) {
+		// a sampled histogram is shown until the container computed all pixels
+		connect(imgC.data(), SIGNAL(histogramLoadedSignal()), this, SLOT(histogramLoaded()), Qt::UniqueConnection);
+		drawHistogram(imgC->getHistogram());
 	}
-	// 24 bit images
-	else if (imgQt.depth() == 24) {
-		
-		qDebug() << "24 bit histogram -------------------";
-
-		// TODO: not tested!!
-		for (int rIdx = 0; rIdx < imgQt.height(); rIdx++) {
+	else
+		drawHistogram(DkImageHistogram::compute(imgQt));
+}
 
-			const unsigned char* pixel = imgQt.constScanLine(rIdx);
+void DkHistogram::histogramLoaded() {
 
-			for (int cIdx = 0; cIdx < imgQt.width(); cIdx++) {
+	if (imgC && isVisible())
+		drawHistogram(imgC->getHistogram());
+}
 
-				// If I understood the api correctly, the first bits are 0 if we have 24bpp & < 8 bits per channel
-				histValues[0][*pixel]++; pixel++;
-				histValues[1][*pixel]++; pixel++;
-				histValues[2][*pixel]++; pixel++;
-			}
-		}
-	}
-	// 32 bit images
-	else if (imgQt.depth() == 32) {
-		
-		for (int rIdx = 0; rIdx < imgQt.height(); rIdx++) {
-		
-			const QRgb* pixel = (QRgb*)(imgQt.constScanLine(rIdx));
-	
-			for (int cIdx = 0; cIdx < imgQt.width(); cIdx++, pixel++) {
+/**
+ * Renders the (cached) histogram bins.
+ * @param histogram the histogram
+ **/ 
+void DkHistogram::drawHistogram(QSharedPointer<DkImageHistogram> histogram) {
 
-				histValues[0][qRed(*pixel)]++;
-				histValues[1][qGreen(*pixel)]++;
-				histValues[2][qBlue(*pixel)]++;
-			}
-		}
+	if (!histogram || histogram->isEmpty()) {
+		setPainted(false);
+		update();
+		return;
 	}
 
-	int maxHistValue = 0;
+	long histValues[3][256];
 
 	for (int idx = 0; idx < 256; idx++) {
-		
-		if (histValues[0][idx] > maxHistValue)
-			maxHistValue = histValues[0][idx];
-		if (histValues[1][idx] > maxHistValue)
-			maxHistValue = histValues[1][idx];
-		if (histValues[2][idx] > maxHistValue)
-			maxHistValue = histValues[2][idx];
+		histValues[0][idx] = histogram->value(0, idx);
+		histValues[1][idx] = histogram->value(1, idx);
+		histValues[2][idx] = histogram->value(2, idx);
 	}
 
-	//Mat imgMat = DkImage::qImage2Mat(imgQt);
-	//
-	//vector<Mat> imgChannels;
-	//split(imgMat, imgChannels);
-
-	//int noChannels = (imgChannels.size() < 3) ? 1 : 3;
-
-	//// Set the number of bins
-	//int histSize = 256;
-	//// Set the ranges for B,G,R
-	//float range[] = { 0, 256 } ;
-	//const float* histRange = { range };
-
-	//MatND hist;
-	//// note: long == int if compiled with a 32bit compiler
-	//long histValues[3][256];
-	//long maxHistValue = 0;
-
-	//for (int i = 0; i < noChannels; i++) {
-
-	//	calcHist( &imgChannels[(noChannels - 1) - i], 1, 0, Mat(), hist, 1, &histSize, &histRange, true, false); // careful! channels are rotated: B,G,R
-	//	
-	//	for (int j = 0; j < 256; j++) histValues[i][j] = hist.at<float>(j);
-	//	hist.setTo(0);
-	//}
-
-	//if (noChannels == 1) {
-
-	//	for (int i = 0; i < 256; i++) {
-	//		histValues[2][i] = histValues[1][i] = histValues[0][i];
-	//		
-	//		if(histValues[0][i] > maxHistValue) maxHistValue = histValues[0][i];
-	//	}
-	//}
-	//else {
-
-	//	for (int i = 0; i < 256; i++) {
-	//		long maxRGB = (histValues[0][i] > histValues[1][i]) ? 
-	//			((histValues[0][i] > histValues[2][i]) ? histValues[0][i] : histValues[2][i]) :  
-	//			((histValues[1][i] > histValues[2][i]) ? histValues[1][i] : histValues[2][i]);
-
-	//		if(maxRGB > maxHistValue) maxHistValue = maxRGB;
-	//	}
-	//}
-	//qDebug() << "computing the histogram took me: " << dt.getTotal();
-
-	setMaxHistogramValue(maxHistValue);
+	setMaxHistogramValue(histogram->getMaxValue());
 	updateHistogramValues(histValues);
 	setPainted(true);
 
-#else
-
-	setPainted(false);
-
-#endif
-	
-	qDebug() << "drawing the histogram took me: " << dt.getTotal();
-
 	update();
 }
 
@@ -2466,6 +2400,7 @@ void DkHistogram::drawHistogram(QImage imgQt) {
  **/ 
 void DkHistogram::clearHistogram() {
 
+	imgC.clear();
 	setPainted(false);
 	update();
 }
@@ -62,6 +62,7 @@ namespace nmc {
 
 // nomacs defines
 class DkCropToolBar;
+class DkImageHistogram;
 
 class DkGradientLabel : public DkLabel {
 	Q_OBJECT
@@ -353,6 +354,7 @@ public slots:
 	void loadNext();
 
 protected:
+	void closeProgress();
 
 	QFileInfo currentDir;
 	QProgressDialog* pd;
@@ -724,12 +726,16 @@ class DkHistogram : public DkWidget {
 public:
 	DkHistogram(QWidget *parent);
 	~DkHistogram();
-	void drawHistogram(QImage img);
+	void drawHistogram(QImage img, QSharedPointer<DkImageContainerT> imgC = QSharedPointer<DkImageContainerT>());
+	void drawHistogram(QSharedPointer<DkImageHistogram> histogram);
 	void clearHistogram();
 	void setMaxHistogramValue(long maxValue);
 	void updateHistogramValues(long histValues[][256]);
 	void setPainted(bool isPainted);
 
+public slots:
+	void histogramLoaded();
+
 protected:
 	virtual void mousePressEvent(QMouseEvent *event);
 	virtual void mouseMoveEvent(QMouseEvent *event);
@@ -738,6 +744,7 @@ protected:
 
 private:
 	QWidget* parent;
+	QSharedPointer<DkImageContainerT> imgC;
 	long hist[3][256];
 	long maxValue;
 	bool isPainted;
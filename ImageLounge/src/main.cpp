@@ -53,6 +53,10 @@
 
 #include "DkNoMacs.h"
 #include "DkSettings.h"
+#include "DkProcess.h"
+#include "DkBasicLoader.h"
+#include "DkThumbs.h"
+#include "DkMetaData.h"
 
 #include <iostream>
 #include <cassert>
@@ -88,6 +92,75 @@ void createPluginsPath() {
 
 }
 
+#ifdef WIN32
+QStringList argumentList(int argc, wchar_t *argv[]) {
+
+	QStringList args;
+	for (int idx = 0; idx < argc; idx++)
+		args.append(QString::fromWCharArray(argv[idx]));
+
+	return args;
+}
+#else
+QStringList argumentList(int argc, char *argv[]) {
+
+	QStringList args;
+	for (int idx = 0; idx < argc; idx++)
+		args.append(QString::fromLocal8Bit(argv[idx]));
+
+	return args;
+}
+#endif
+
+/**
+ * Runs a batch without creating any widgets (nomacs --batch <config.ini>).
+ * One line is printed per file: status, time [ms], input and output (tab separated).
+ * Lines starting with # summarize the run.
+ * @return int 0 if all files were processed, 1 if any file failed and 2 if the config is invalid.
+ **/ 
+int runBatch(int argc, char *argv[], const QString& configPath) {
+
+	QCoreApplication a(argc, argv);
+	nmc::DkSettings::initFileFilters();
+	nmc::DkSettings::load();
+	nmc::DkFormatRegistry::instance();	// see main()
+	nmc::DkTiffIndex::instance();
+	nmc::DkThumbCache::instance();
+	nmc::DkMetaDataCache::instance();
+
+	QTextStream out(stdout);
+
+	nmc::DkBatchConfig config;
+	if (!config.load(configPath) || !config.isOk()) {
+		std::cerr << "could not load a valid batch config from: " << configPath.toStdString() << std::endl;
+		return 2;
+	}
+
+	nmc::DkBatchProcessing batch(config);
+	QObject::connect(&batch, SIGNAL(finished()), &a, SLOT(quit()));
+	batch.compute();
+	a.exec();
+
+	QVector<nmc::DkBatchProcess> items = batch.getBatchItems();
+
+	for (const nmc::DkBatchProcess& item : items) {
+
+		QString status = !item.wasProcessed() ? "SKIPPED" : (item.hasFailed() ? "FAIL" : "OK");
+		out << status << "\t" << item.getProcessingTime() << "\t" 
+			<< item.inputFile().absoluteFilePath() << "\t" << item.outputFile().absoluteFilePath() << "\n";
+	}
+
+	for (QString line : batch.getPipelineReport())
+		out << "# " << line << "\n";
+
+	out << "# " << batch.getNumFailures() << " of " << batch.getNumItems() << " failed\n";
+	out.flush();
+
+	nmc::DkThumbCache::instance().save();
+
+	return batch.getNumFailures() ? 1 : 0;
+}
+
 #ifdef WIN32
 int main(int argc, wchar_t *argv[]) {
 #else
@@ -112,6 +185,12 @@ int main(int argc, char *argv[]) {
 	QCoreApplication::setOrganizationDomain("http://www.nomacs.org");
 	QCoreApplication::setApplicationName("Image Lounge");
 	
+	// headless batch processing - no widgets, translations or plugins are loaded
+	QStringList cmdArgs = argumentList(argc, argv);
+	int batchIdx = cmdArgs.indexOf("--batch");
+	if (batchIdx != -1 && batchIdx+1 < cmdArgs.size())
+		return runBatch(argc, (char**)argv, cmdArgs[batchIdx+1]);
+
 	//qDebug() << "settings: " << settings.fileName();
 
 	// NOTE: raster option destroys the frameless view on mac
@@ -130,6 +209,13 @@ int main(int argc, char *argv[]) {
 	
 	nmc::DkSettings::load();
 
+	// singletons used by the loader threads are created here
+	// (function-local statics are not initialized thread-safe by older compilers)
+	nmc::DkFormatRegistry::instance();
+	nmc::DkTiffIndex::instance();
+	nmc::DkThumbCache::instance();
+	nmc::DkMetaDataCache::instance();
+
 	int mode = settings.value("AppSettings/appMode", nmc::DkSettings::app.appMode).toInt();
 	nmc::DkSettings::app.currentAppMode = mode;
 
@@ -215,5 +301,8 @@ int main(int argc, char *argv[]) {
 	int rVal = a.exec();
 	delete w;	// we need delete so that settings are saved (from destructors)
 
+	// do not wait for the static destructor - the application object is still alive here
+	nmc::DkThumbCache::instance().save();
+
 	return rVal;
 }